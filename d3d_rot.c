@@ -8,43 +8,134 @@
 
  gcc -g -O2 -Wall -Wextra -o d3d_rot d3d_rot.c -ld3d11 -ld3dcompiler -ldxgi -luuid -D_WIN32_WINNT=0x0601
 
+ * Software rasterizer, headless (default on other systems than Windows):
+
+ gcc -g -O2 -Wall -Wextra -o d3d_rot d3d_rot.c -lm -lpthread -DHAVE_SOFT
+
+ * Shaders compiled at build time, embedded in the binary (Windows):
+
+ fxc /nologo /T vs_5_0 /E main_vs /Vn shader_main_vs /Fh shader_main_vs.h shader_3.hlsl
+ fxc /nologo /T ps_5_0 /E main_ps /Vn shader_main_ps /Fh shader_main_ps.h shader_3.hlsl
+ fxc /nologo /T vs_5_0 /E main_rect_vs /Vn shader_main_rect_vs /Fh shader_main_rect_vs.h shader_3.hlsl
+ fxc /nologo /T vs_5_0 /E main_vs16 /Vn shader_main_vs16 /Fh shader_main_vs16.h shader_3.hlsl
+
+ and add -DHAVE_SHADER_BLOBS to the gcc command above
+
+ * Frame timing, per stage (any of the builds above), see prof_json_dump():
+
+ -DHAVE_PROF
+
+ * Retained scene recorded in parallel with deferred contexts (Windows):
+
+ -DHAVE_DEFERRED
+
+ * Offscreen benchmark (software rasterizer), see bench_main():
+
+ ./d3d_rot --bench --triangles 1000,10000 --threads 1,4 --rotation all
+
  */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 
-#ifndef WIN32_LEAN_AND_MEAN
-# define WIN32_LEAN_AND_MEAN
+#if !defined _WIN32 && !defined HAVE_SOFT
+# define HAVE_SOFT
 #endif
 
-#include <windows.h>
+#ifdef _WIN32
 
-#if defined _WIN32_WINNT && _WIN32_WINNT >= 0x0A00
-# define HAVE_WIN10
-#endif
+# ifndef WIN32_LEAN_AND_MEAN
+#  define WIN32_LEAN_AND_MEAN
+# endif
 
-#define _DEBUG
+# include <windows.h>
 
-/* C API for d3d11 */
-#define COBJMACROS
+# if defined _WIN32_WINNT && _WIN32_WINNT >= 0x0A00
+#  define HAVE_WIN10
+# endif
+
+# ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#  define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+# endif
 
-#ifdef HAVE_WIN10
-# include <dxgi1_3.h>
 #else
-# include <dxgi.h>
+
+# include <time.h>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+
+typedef float FLOAT;
+typedef unsigned char BYTE;
+typedef short SHORT;
+typedef unsigned short USHORT;
+typedef unsigned int UINT;
+
+#endif
+
+#ifdef HAVE_SOFT
+# include <pthread.h>
+# include <sched.h>
+# include <stdatomic.h>
+#endif
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+# include <immintrin.h>
+# define HAVE_SIMD_X86
+#elif defined __GNUC__ && defined __aarch64__
+# include <arm_neon.h>
+# define HAVE_SIMD_NEON
+#endif
+
+/* debug informations in debug builds only: build with -DNDEBUG for none */
+#if !defined NDEBUG && !defined _DEBUG
+# define _DEBUG
 #endif
-#include <d3d11.h>
-#include <d3dcompiler.h>
 
-/* comment for no debug informations */
-#define _DEBUG
+#ifndef HAVE_SOFT
+
+/* C API for d3d11 */
+# define COBJMACROS
+
+# ifdef HAVE_WIN10
+#  include <dxgi1_3.h>
+# else
+#  include <dxgi.h>
+# endif
+# include <d3d11.h>
+# include <d3dcompiler.h>
+
+#endif
 
+/*
+ * debug informations are trace events, kept in memory and exported
+ * with trace_flush(), see the Trace section
+ */
 #ifdef _DEBUG
 # define FCT \
-do { printf(" * %s\n", __FUNCTION__); fflush(stdout); } while (0)
+trace_event(__FUNCTION__, TRACE_TYPE_INSTANT, 0, 0)
+# define TRACE(name, a, b) \
+trace_event(name, TRACE_TYPE_INSTANT, a, b)
+# define TRACE_BEGIN(name, a, b) \
+trace_event(name, TRACE_TYPE_BEGIN, a, b)
+# define TRACE_END(name) \
+trace_event(name, TRACE_TYPE_END, 0, 0)
+# define TRACE_THREAD() \
+trace_thread_start()
 #else
 # define FCT \
 do { } while (0)
+# define TRACE(name, a, b) \
+do { } while (0)
+# define TRACE_BEGIN(name, a, b) \
+do { } while (0)
+# define TRACE_END(name) \
+do { } while (0)
+# define TRACE_THREAD() \
+do { } while (0)
 #endif
 
 #define XF(w,x) ((float)(2 * (x) - (w)) / (float)(w))
@@ -52,13 +143,23 @@ do { } while (0)
 
 typedef struct Window Window;
 typedef struct D3d D3d;
+typedef struct Scene Scene;
+typedef struct Pace Pace;
+typedef struct Render Render;
 
 struct Window
 {
+#ifndef HAVE_SOFT
     HINSTANCE instance;
     RECT rect;
     HWND win;
+#else
+    int width; /* size of the offscreen target */
+    int height;
+#endif
     D3d *d3d;
+    Pace *pace;
+    Render *render; /* render thread, NULL if rendering in the window thread */
     int rotation; /* rotation (clockwise): 0, 1, 2 3 */
     unsigned int fullscreen: 1;
 };
@@ -67,29 +168,11 @@ void window_fullscreen_set(Window *win, unsigned int fullscreen);
 
 void window_rotation_set(Window *win, int rotation);
 
-struct D3d
-{
-    /* DXGI */
-#ifdef HAVE_WIN10
-    IDXGIFactory2 *dxgi_factory;
-    IDXGISwapChain1 *dxgi_swapchain;
-#else
-    IDXGIFactory *dxgi_factory;
-    IDXGISwapChain *dxgi_swapchain;
-#endif
-    /* D3D11 */
-    ID3D11Device *d3d_device;
-    ID3D11DeviceContext *d3d_device_ctx;
-    ID3D11RenderTargetView *d3d_render_target_view;
-    ID3D11InputLayout *d3d_input_layout;
-    ID3D11VertexShader *d3d_vertex_shader;
-    ID3D11Buffer *d3d_const_buffer;
-    ID3D11RasterizerState *d3d_rasterizer_state;
-    ID3D11PixelShader *d3d_pixel_shader;
-    D3D11_VIEWPORT viewport;
-    unsigned int vsync : 1;
-};
-
+/*
+ * vertex: position in pixels, converted to NDC by main_vs with the
+ * viewport size of the constant buffer, so that a size change does not
+ * modify the vertices
+ */
 typedef struct
 {
     FLOAT x;
@@ -100,1343 +183,13230 @@ typedef struct
     BYTE a;
 } Vertex;
 
+/*
+ * compact vertex: position in pixels, as 16 bits integers (R16G16_SINT),
+ * converted to NDC by main_vs16 with the viewport size of the constant
+ * buffer. 8 bytes instead of 12, and no float conversion on the CPU.
+ */
+typedef struct
+{
+    SHORT x;
+    SHORT y;
+    BYTE r;
+    BYTE g;
+    BYTE b;
+    BYTE a;
+} Vertex16;
+
+typedef enum
+{
+    VERTEX_FORMAT_FLOAT, /* Vertex, pixels */
+    VERTEX_FORMAT_SINT16, /* Vertex16, pixels */
+    VERTEX_FORMAT_LAST
+} Vertex_Format;
+
+/* returns 0 if the position is out of the 16 bits range, and clamped */
+int vertex16_pack(Vertex16 *v, int x, int y,
+                  unsigned char r,
+                  unsigned char g,
+                  unsigned char b,
+                  unsigned char a);
+
+void vertex16_unpack(const Vertex16 *v, int *x, int *y,
+                     unsigned char *r,
+                     unsigned char *g,
+                     unsigned char *b,
+                     unsigned char *a);
+
+void vertex16_decode(const Vertex16 *v, Vertex *out);
+
+/*
+ * what main_vs and main_vs16 do before the rotation, w and h being the
+ * viewport size: same result as XF() / YF() for integer pixels
+ */
+void vertex_ndc(float x, float y, int w, int h, float *nx, float *ny);
+
 typedef struct
 {
     float rotation[2][4];
+    float viewport[4]; /* width and height, in pixels, then unused */
 } Const_Buffer;
 
-D3d *d3d_init(Window *win, int vsync);
-
-void d3d_shutdown(D3d *d3d);
+/*
+ * damage tracking: the boxes, in scene pixels, of the primitives
+ * before and after a modification are accumulated in at most
+ * DAMAGE_RECTS_MAX disjoint rectangles, merged when it wastes few
+ * pixels. Above DAMAGE_FULL_PERCENT of the target, everything is
+ * redrawn. The back buffer is the frame before the previous one (2
+ * buffers, flip model), so the damage of the previous frame is redrawn
+ * too.
+ */
 
-void d3d_resize(D3d *d3d, int rot, UINT width, UINT height);
+#define DAMAGE_RECTS_MAX 8
+#define DAMAGE_FULL_PERCENT 50
+#define DAMAGE_MERGE_SLACK (32 * 32) /* pixels, drawn for nothing to save a rectangle */
 
-void d3d_render(D3d *d3d);
+typedef struct
+{
+    int x0; /* inclusive */
+    int y0;
+    int x1; /* exclusive */
+    int y1;
+} Damage_Rect;
 
-/************************* Window *************************/
+typedef struct
+{
+    Damage_Rect rects[DAMAGE_RECTS_MAX];
+    unsigned int count;
+    unsigned int full : 1; /* rects are not used */
+} Damage_Region;
 
-LRESULT CALLBACK
-_window_procedure(HWND   window,
-                  UINT   message,
-                  WPARAM window_param,
-                  LPARAM data_param)
+typedef struct
 {
-  switch (message)
-    {
-    case WM_CLOSE:
-        PostQuitMessage(0);
-        return 0;
-    case WM_KEYUP:
-        if (window_param == 'Q')
-        {
-            PostQuitMessage(0);
-        }
-        if (window_param == 'F')
-        {
-            Window *win;
+    Damage_Region current; /* since the last frame */
+    Damage_Region previous; /* of the last frame */
+    int w;
+    int h;
+    /* statistics */
+    unsigned int frames;
+    unsigned int full_frames;
+    unsigned long long pixels; /* redrawn */
+} Damage;
 
-#ifdef _DEBUG
-            printf("fullscreen\n");
-            fflush(stdout);
-#endif
-            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
-            window_fullscreen_set(win, !win->fullscreen);
-        }
-        if (window_param == 'R')
-        {
-            RECT r;
-            Window *win;
+void damage_init(Damage *d);
 
-#ifdef _DEBUG
-            printf("rotation\n");
-            fflush(stdout);
-#endif
-            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
-            window_rotation_set(win, (win->rotation + 1) % 4);
-        }
-        if (window_param == 'D')
-        {
-            RECT r;
-            Window* win;
+void damage_size_set(Damage *d, int w, int h);
 
-#ifdef _DEBUG
-            printf("draw texture\n");
-            fflush(stdout);
-#endif
-            win = (Window*)GetWindowLongPtr(window, GWLP_USERDATA);
-        }
-        if (window_param == 'U')
-        {
-            RECT r;
-            Window* win;
+void damage_full(Damage *d);
 
-#ifdef _DEBUG
-            printf("update d3d\n");
-            fflush(stdout);
-#endif
-            win = (Window*)GetWindowLongPtr(window, GWLP_USERDATA);
-            GetClientRect(window, &r);
-            d3d_resize(win->d3d,
-                win->rotation,
-                r.right - r.left, r.bottom - r.top);
-            d3d_render(win->d3d);
-        }
-        return 0;
-    case WM_ERASEBKGND:
-        /* no need to erase back */
-        return 1;
-    /* GDI notifications */
-    case WM_CREATE:
-#ifdef _DEBUG
-        printf(" * WM_CREATE\n");
-        fflush(stdout);
-#endif
-        return 0;
-    case WM_SIZE:
-    {
-        Window * win;
+void damage_add(Damage *d, const Damage_Rect *r);
 
-#ifdef _DEBUG
-        printf(" * WM_SIZE : %u %u\n", (UINT)LOWORD(data_param), (UINT)HIWORD(data_param));
-        fflush(stdout);
-#endif
+void damage_region_add(Damage_Region *g, const Damage_Rect *r, int w, int h);
 
-        win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
-        d3d_resize(win->d3d,
-                   win->rotation,
-                   (UINT)LOWORD(data_param), (UINT)HIWORD(data_param));
+void damage_frame(Damage *d, Damage_Region *redraw, Damage_Region *present);
 
-        return 0;
-    }
-    case WM_PAINT:
-    {
-#ifdef _DEBUG
-        printf(" * WM_PAINT\n");
-        fflush(stdout);
-#endif
+int damage_rect_intersect(const Damage_Rect *a, const Damage_Rect *b);
 
-        if (GetUpdateRect(window, NULL, FALSE))
-        {
-            PAINTSTRUCT ps;
-            Window *win;
+int damage_rect_map(const Damage_Rect *r, const float m[2][4],
+                    int w, int h, Damage_Rect *out);
 
-            BeginPaint(window, &ps);
+int damage_rect_unmap(const Damage_Rect *t, const float m[2][4],
+                      int w, int h, Damage_Rect *out);
 
-            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
-            d3d_render(win->d3d);
+typedef enum
+{
+    PRIM_TRIANGLE,
+    PRIM_RECTANGLE
+} Prim_Type;
 
-            EndPaint(window, &ps);
-        }
+/*
+ * topology of indices: triangle list, or triangle strips separated by
+ * INDEX_CUT, the strip cut value of R32_UINT, truncated to 0xffff, the
+ * one of R16_UINT, by index16_convert(). A quad, 0 1 3 1 2 3 in a
+ * list, is the strip 0 1 3 2: with its cut, 5 indices instead of 6, a
+ * triangle 4 instead of 3.
+ */
 
-        return 0;
-      }
-    default:
-      return DefWindowProc(window, message, window_param, data_param);
-    }
-}
+#define INDEX_CUT 0xffffffffU
 
-Window *window_new(int x, int y, int w, int h)
+typedef enum
 {
-    WNDCLASS wc;
-    RECT r;
-    Window *win;
+    TOPOLOGY_LIST,
+    TOPOLOGY_STRIP,
+    TOPOLOGY_AUTO /* scene only: the one with fewer indices */
+} Topology;
 
-    win = (Window *)calloc(1, sizeof(Window));
-    if (!win)
-        return NULL;
+typedef struct
+{
+    Prim_Type type;
+    int p[6]; /* triangle: x1 y1 x2 y2 x3 y3, rectangle: x y w h */
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+    unsigned char a;
+    unsigned int first_vertex;
+    unsigned int first_index;
+    unsigned int index_count;
+    unsigned int dirty : 1;
+    unsigned int placed : 1; /* has been set, its old box is damaged when modified */
+} Prim;
 
-    win->instance = GetModuleHandle(NULL);
-    if (!win->instance)
-        goto free_win;
+typedef struct
+{
+    unsigned int first; /* first vertex */
+    unsigned int count; /* number of vertices */
+} Scene_Range;
 
-    memset (&wc, 0, sizeof (WNDCLASS));
-    wc.style = CS_HREDRAW | CS_VREDRAW;
-    wc.lpfnWndProc = _window_procedure;
-    wc.cbClsExtra = 0;
-    wc.cbWndExtra = 0;
-    wc.hInstance = win->instance;
-    wc.hIcon = LoadIcon (NULL, IDI_APPLICATION);
-    wc.hCursor = LoadCursor (NULL, IDC_ARROW);
-    wc.hbrBackground = NULL;
-    wc.lpszMenuName =  NULL;
-    wc.lpszClassName = "D3D";
+/*
+ * uniform grid over the boxes of the primitives, in scene pixels, for
+ * the visibility queries. A box is stored in each cell it covers, the
+ * cells being hashed so that the scene is not bounded; one over more
+ * than GRID_CELLS_MAX cells is kept in a list tested by every query.
+ * Updated in place when a primitive moves: the cells are only changed
+ * if its box covers other ones.
+ */
 
-    if(!RegisterClass(&wc))
-        goto free_library;
+#define GRID_CELL_BITS 6 /* cells of 64x64 pixels */
+#define GRID_CELLS_MAX 16U
+#define GRID_NONE 0xffffffffU
+#define GRID_LARGE 0xfffffffeU
 
-    r.left = 0;
-    r.top = 0;
-    r.right = w;
-    r.bottom = h;
-    if (!AdjustWindowRectEx(&r,
-                            WS_OVERLAPPEDWINDOW | WS_SIZEBOX,
-                            FALSE,
-                            0U))
-        goto unregister_class;
+typedef struct
+{
+    int cx;
+    int cy;
+    unsigned int id;
+    unsigned int next; /* in the bucket, or in the free list */
+    unsigned int prev; /* in the bucket, GRID_NONE for the first one */
+    unsigned int id_next; /* next cell of the same primitive */
+} Grid_Entry;
 
-    printf("window new : %d %d %ld %ld", w, h, r.right - r.left, r.bottom - r.top);
-    fflush(stdout);
+typedef struct
+{
+    unsigned int *buckets; /* first entry, GRID_NONE if empty */
+    unsigned int buckets_count; /* power of 2 */
+    Grid_Entry *entries;
+    unsigned int entries_count;
+    unsigned int entries_size;
+    unsigned int entries_used; /* in the buckets */
+    unsigned int entries_free; /* first removed entry, reused first */
+    Damage_Rect *boxes; /* per primitive */
+    unsigned int boxes_size;
+    unsigned int *cells; /* per primitive: first entry, GRID_NONE or GRID_LARGE */
+    unsigned int cells_size;
+    unsigned int ids_count;
+    unsigned int *large; /* ids of the primitives over too many cells */
+    unsigned int large_count;
+    unsigned int large_size;
+    unsigned long long *marks; /* one bit per primitive, cleared after a query */
+    unsigned int marks_size;
+} Grid;
+
+void grid_init(Grid *g);
+
+void grid_free(Grid *g);
+
+/* insert or move the box of id, ids are dense. Returns 0 if no memory */
+int grid_set(Grid *g, unsigned int id, const Damage_Rect *box);
+
+/* ids of the boxes intersecting r, in increasing order, ids has room for all */
+unsigned int grid_query(Grid *g, const Damage_Rect *r, unsigned int *ids);
 
-    win->win = CreateWindowEx(0U,
-                              "D3D", "Test",
-                              WS_OVERLAPPEDWINDOW | WS_SIZEBOX,
-                              x, y,
-                              r.right - r.left,
-                              r.bottom - r.top,
-                              NULL,
-                              NULL, win->instance, NULL);
-    if (!win->win)
-        goto unregister_class;
+/*
+ * retained scene: primitives are added once, their vertices and
+ * indices are kept in arrays mirrored in GPU buffers, and only the
+ * vertices of the modified primitives are regenerated and uploaded.
+ */
+struct Scene
+{
+    Prim *prims;
+    unsigned int prims_count;
+    unsigned int prims_size;
+    unsigned int rects_count;
+    void *vertices; /* Vertex or Vertex16, see format */
+    unsigned int vertices_count;
+    unsigned int vertices_size;
+    unsigned int vertex_size; /* in bytes */
+    Vertex_Format format;
+    unsigned int *indices; /* in topology */
+    unsigned int indices_count;
+    unsigned int indices_size;
+    unsigned int indices_clean; /* indices before that one are uploaded */
+    Topology topology; /* of the indices, list or strip */
+    Topology topology_set; /* asked for, TOPOLOGY_AUTO by default */
+    unsigned int *dirty; /* ids of the modified primitives */
+    unsigned int dirty_count;
+    unsigned int dirty_size;
+    Scene_Range *ranges; /* merged vertex ranges to upload */
+    unsigned int ranges_count;
+    unsigned int ranges_size;
+    int w;
+    int h;
+    Damage damage;
+    Grid grid; /* boxes of the placed primitives */
+    unsigned int *visible; /* ids drawn by the frame, in scene order */
+    unsigned int visible_count;
+    unsigned int visible_size;
+    Damage_Rect visible_rect; /* of the last query, in scene pixels */
+    unsigned long long *coverage; /* occlusion mask, one bit per block */
+    unsigned int coverage_size;
+    unsigned int occluded_count; /* dropped by the last occlusion pass */
+    unsigned int dirty_all : 1;
+    unsigned int cull : 1; /* visible from the grid, set by default */
+    unsigned int occlusion : 1; /* covered ones dropped, set by default */
+    unsigned int grid_failed : 1; /* no memory: all are visible */
+    unsigned int visible_clean : 1; /* no primitive set since the query */
+};
 
-    return win;
+Scene *scene_new(void);
 
-  unregister_class:
-    UnregisterClass("D2D", win->instance);
-  free_library:
-    FreeLibrary(win->instance);
-  free_win:
-    free(win);
+void scene_free(Scene *s);
 
-    return NULL;
+int scene_triangle_add(Scene *s,
+                       int x1, int y1,
+                       int x2, int y2,
+                       int x3, int y3,
+                       unsigned char r,
+                       unsigned char g,
+                       unsigned char b,
+                       unsigned char a);
+
+int scene_rectangle_add(Scene *s,
+                        int x, int y,
+                        int w, int h,
+                        unsigned char r,
+                        unsigned char g,
+                        unsigned char b,
+                        unsigned char a);
+
+void scene_triangle_set(Scene *s, int id,
+                        int x1, int y1,
+                        int x2, int y2,
+                        int x3, int y3,
+                        unsigned char r,
+                        unsigned char g,
+                        unsigned char b,
+                        unsigned char a);
+
+void scene_rectangle_set(Scene *s, int id,
+                         int x, int y,
+                         int w, int h,
+                         unsigned char r,
+                         unsigned char g,
+                         unsigned char b,
+                         unsigned char a);
+
+void scene_size_set(Scene *s, int w, int h);
+
+int scene_vertex_format_set(Scene *s, Vertex_Format format);
+
+/* all the indices are rebuilt if the topology changes */
+int scene_topology_set(Scene *s, Topology topology);
+
+void scene_prim_box(const Prim *p, Damage_Rect *r);
+
+void scene_cull_set(Scene *s, int cull);
+
+void scene_occlusion_set(Scene *s, int occlusion);
+
+/* the visible primitives with the rotation m, in visible */
+void scene_visible_update(Scene *s, const float m[2][4]);
+
+/*
+ * returns 0 if the ranges can not be allocated: the dirty primitives are
+ * kept, scene_clean() must not be called and the next frame retries
+ */
+int scene_update(Scene *s);
+
+void scene_clean(Scene *s);
+
+/*
+ * shared index buffer: the indices of INDEX_QUADS_MAX quads (0 1 3 1 2
+ * 3, the vertices being upper left, upper right, bottom right, bottom
+ * left), then of INDEX_TRIANGLES_MAX triangles (0 1 2), in 16 bits.
+ * Built once and immutable, the primitives use it with a base vertex.
+ * The largest index is below 0xffff, the strip cut value of R16_UINT.
+ */
+
+#define INDEX16_VERTICES_MAX 0xffffU
+#define INDEX_QUADS_MAX (INDEX16_VERTICES_MAX / 4U)
+#define INDEX_TRIANGLES_MAX (INDEX16_VERTICES_MAX / 3U)
+#define INDEX_QUADS_FIRST 0U
+#define INDEX_TRIANGLES_FIRST (INDEX_QUADS_MAX * 6U)
+#define INDEX_SHARED_COUNT (INDEX_TRIANGLES_FIRST + INDEX_TRIANGLES_MAX * 3U)
+
+typedef struct
+{
+    unsigned int index_count;
+    unsigned int first_index; /* in the shared index buffer */
+    unsigned int base_vertex;
+} Index_Draw;
+
+/* indices has INDEX_SHARED_COUNT elements */
+void index_shared_fill(USHORT *indices);
+
+/* 32 bits indices below INDEX16_VERTICES_MAX, or INDEX_CUT, to 16 bits */
+void index16_convert(const unsigned int *in, unsigned int count, USHORT *out);
+
+/* the triangles drawn from indices, in order, the degenerate ones skipped */
+typedef struct
+{
+    Topology topology;
+    const unsigned int *indices;
+    unsigned int count;
+    unsigned int pos; /* next index */
+    unsigned int strip; /* first index of the current strip */
+} Index_Iter;
+
+void index_iter_init(Index_Iter *it, Topology topology,
+                     const unsigned int *indices, unsigned int count);
+
+/* returns 0 once all the triangles are read */
+int index_iter_next(Index_Iter *it, unsigned int tri[3]);
+
+/*
+ * triangle list to strips: 2 consecutive triangles a b d, b c d (a quad)
+ * give the strip a b d c, any other triangle a strip of its own. out has
+ * room for 4 * count / 3 indices. Returns the number of indices written.
+ */
+unsigned int index_strip_convert(const unsigned int *list, unsigned int count,
+                                 unsigned int *out);
+
+/* list or strips, whichever has fewer indices, written in out */
+Topology index_topology_convert(const unsigned int *list, unsigned int count,
+                                unsigned int *out, unsigned int *out_count);
+
+/*
+ * first draw of count primitives of the same type, with consecutive
+ * vertices from base_vertex: returns the number of primitives it
+ * draws, at most INDEX_QUADS_MAX or INDEX_TRIANGLES_MAX.
+ */
+unsigned int index_draw_get(Prim_Type type,
+                            unsigned int base_vertex,
+                            unsigned int count,
+                            Index_Draw *d);
+
+/*
+ * instanced rectangles: a unit quad shared by all the rectangles and
+ * one 20 bytes record per rectangle, expanded by main_rect_vs
+ */
+
+typedef struct
+{
+    FLOAT x; /* upper left corner, in pixels */
+    FLOAT y;
+    FLOAT w; /* size, in pixels */
+    FLOAT h;
+    BYTE r;
+    BYTE g;
+    BYTE b;
+    BYTE a;
+} Rect_Instance;
+
+void rect_instance_set(Rect_Instance *ri,
+                       int x, int y,
+                       int rw, int rh,
+                       unsigned char r,
+                       unsigned char g,
+                       unsigned char b,
+                       unsigned char a);
+
+unsigned int scene_rect_instances_build(const Scene *s, Rect_Instance *ri);
+
+/*
+ * immediate mode batcher: the primitives of a frame are appended to a
+ * single vertex ring buffer, with no-overwrite appends and a discard
+ * when the ring wraps. The indices are the ones of the shared index
+ * buffer and nothing but the vertices is written. Consecutive appends
+ * are drawn with one draw call, split at the 16 bits limit: a draw
+ * started by a triangle has 3 vertices per triangle and ends at the
+ * next rectangle, in a draw started by a rectangle a triangle is a quad
+ * repeating its last vertex. The backend provides the map/unmap/draw
+ * functions.
+ */
+
+#define BATCH_VERTICES 65536U
+
+typedef struct
+{
+    void *(*map)(void *data, int discard);
+    void (*unmap)(void *data);
+    void (*draw)(void *data,
+                 unsigned int index_count,
+                 unsigned int first_index,
+                 unsigned int base_vertex);
+} Batch_Ops;
+
+typedef struct
+{
+    const Batch_Ops *ops;
+    void *data;
+    Vertex *vertices; /* mapped vertex ring, NULL when unmapped */
+    unsigned int vertices_size;
+    unsigned int vertex_pos; /* next free vertex */
+    unsigned int draw_base_vertex; /* first vertex of the pending draw */
+    Prim_Type draw_type; /* of the pending draw, quads if PRIM_RECTANGLE */
+    unsigned int draws; /* draw calls issued since batch_begin() */
+    unsigned int wraps; /* ring wraps since batch_begin() */
+    unsigned int discard : 1; /* next map must discard */
+} Batch;
+
+void batch_init(Batch *bt, const Batch_Ops *ops, void *data,
+                unsigned int vertices_size);
+
+void batch_begin(Batch *bt);
+
+int batch_triangle(Batch *bt,
+                   int x1, int y1,
+                   int x2, int y2,
+                   int x3, int y3,
+                   unsigned char r,
+                   unsigned char g,
+                   unsigned char b,
+                   unsigned char a);
+
+int batch_rectangle(Batch *bt,
+                    int x, int y,
+                    int w, int h,
+                    unsigned char r,
+                    unsigned char g,
+                    unsigned char b,
+                    unsigned char a);
+
+void batch_flush(Batch *bt);
+
+/*
+ * shader cache: compiled shaders are stored in one file, keyed by a
+ * hash of the source, the entry point, the target and the compilation
+ * flags. The backend provides the compiler.
+ */
+
+/* returns the bytecode, allocated with mem_malloc(), or NULL */
+typedef void *(*Shader_Compile)(void *data,
+                                const char *src, size_t src_size,
+                                const char *entry, const char *target,
+                                unsigned int flags, size_t *size);
+
+typedef struct
+{
+    unsigned long long key;
+    void *blob;
+    size_t size;
+} Shader_Cache_Entry;
+
+typedef struct
+{
+    char *file;
+    const unsigned char *map; /* mapped file, NULL if missing or invalid */
+    size_t map_size;
+    unsigned int count; /* number of shaders in the mapped file */
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+    Shader_Cache_Entry *added; /* compiled since shader_cache_open() */
+    unsigned int added_count;
+    unsigned int added_size;
+    char *src_file; /* last source read */
+    char *src;
+    size_t src_size;
+    unsigned int compiles;
+} Shader_Cache;
+
+unsigned long long shader_key(const void *src, size_t src_size,
+                              const char *entry, const char *target,
+                              unsigned int flags);
+
+Shader_Cache *shader_cache_open(const char *file);
+
+int shader_cache_close(Shader_Cache *c);
+
+const void *shader_cache_find(const Shader_Cache *c,
+                              unsigned long long key, size_t *size);
+
+int shader_cache_add(Shader_Cache *c,
+                     unsigned long long key, void *blob, size_t size);
+
+const void *shader_get(Shader_Cache *c, const char *file,
+                       const char *entry, const char *target,
+                       unsigned int flags,
+                       Shader_Compile compile, void *data,
+                       size_t *size);
+
+/*
+ * task graph: tasks whose dependencies are done run concurrently on a
+ * few threads, the calling thread included. A task whose dependency
+ * has failed is skipped. Times are recorded to find the critical path.
+ * The threads are created and joined by each task_graph_run(): it is
+ * for one-shot graphs, like the startup, not for each frame.
+ */
+
+#define TASKS_MAX 32
+
+typedef enum
+{
+    TASK_WAITING,
+    TASK_RUNNING,
+    TASK_DONE,
+    TASK_FAILED,
+    TASK_SKIPPED
+} Task_State;
+
+typedef struct
+{
+    const char *name;
+    int (*func)(void *data); /* returns 0 on failure */
+    void *data;
+    unsigned int deps; /* bit i set: task i must be done before */
+    unsigned int main_thread : 1; /* run by the calling thread only */
+    /* set by task_graph_run() */
+    Task_State state;
+    int thread;
+    unsigned long long start; /* ns, since the start of the graph */
+    unsigned long long end;
+} Task;
+
+void task_set(Task *t, const char *name,
+              int (*func)(void *data), void *data,
+              unsigned int deps, int main_thread);
+
+int task_graph_run(Task *tasks, unsigned int count, int threads);
+
+void task_graph_print(const Task *tasks, unsigned int count);
+
+/*
+ * deferred resize: the size and rotation requests (WM_SIZE, rotation
+ * key) are only recorded, the last one wins. The renderer applies them
+ * once, at the start of the next frame: the buffers are reallocated
+ * only if the size has changed, the rotation constants are updated
+ * only if the rotation has changed.
+ */
+
+typedef enum
+{
+    RESIZE_NONE = 0,
+    RESIZE_BUFFERS = 1 << 0,
+    RESIZE_ROTATION = 1 << 1
+} Resize_Change;
+
+typedef struct
+{
+    UINT width; /* applied */
+    UINT height;
+    int rot;
+    UINT pending_width; /* requested */
+    UINT pending_height;
+    int pending_rot;
+    unsigned int requests; /* since the start */
+    unsigned int reallocs; /* buffers reallocated */
+    unsigned int rotations; /* rotation constants updated */
+} Resize;
+
+void resize_init(Resize *rs);
+
+void resize_request(Resize *rs, int rot, UINT width, UINT height);
+
+unsigned int resize_pending(const Resize *rs);
+
+void resize_done(Resize *rs, unsigned int changes);
+
+/*
+ * pipeline state elision: the state bound to the device context is
+ * shadowed, a bind call is issued only if it changes the state.
+ * Objects are compared by address: the context keeps a reference on
+ * the bound objects, so a new object can not have the address of a
+ * bound one.
+ */
+
+typedef enum
+{
+    STATE_TOPOLOGY,
+    STATE_INPUT_LAYOUT,
+    STATE_VERTEX_BUFFER_0,
+    STATE_VERTEX_BUFFER_1,
+    STATE_INDEX_BUFFER,
+    STATE_VS,
+    STATE_VS_CONSTANT_BUFFER,
+    STATE_RASTERIZER,
+    STATE_PS,
+    STATE_LAST
+} State_Slot;
+
+typedef struct
+{
+    const void *objects[STATE_LAST];
+    unsigned long long params[STATE_LAST]; /* topology, stride, format... */
+    unsigned int valid; /* bit per slot, set when the shadow is known */
+    unsigned int issued; /* calls of the current frame */
+    unsigned int elided;
+    unsigned int last_issued; /* calls of the previous frame */
+    unsigned int last_elided;
+} State_Cache;
+
+void state_cache_reset(State_Cache *sc);
+
+int state_cache_set(State_Cache *sc, State_Slot slot,
+                    const void *object, unsigned long long param);
+
+void state_cache_frame(State_Cache *sc);
+
+/*
+ * frame pacing: decides when a frame is rendered. The clock is a
+ * callback, so that the pacing can be driven by a simulated time.
+ */
+
+typedef enum
+{
+    PACE_ON_DEMAND, /* a frame when invalidated, otherwise wait for events */
+    PACE_FIXED, /* a frame at a fixed rate, sleeping until its deadline */
+    PACE_PRESENT, /* a frame as soon as possible, Present() blocks (vsync) */
+    PACE_LAST
+} Pace_Mode;
+
+/* no frame until pace_invalidate() */
+#define PACE_WAIT_EVENT 0xffffffffffffffffULL
+
+typedef unsigned long long (*Pace_Clock)(void *data);
+
+struct Pace
+{
+    Pace_Mode mode;
+    Pace_Clock clock; /* in nanoseconds */
+    void *clock_data;
+    unsigned long long period; /* fixed rate */
+    unsigned long long deadline; /* of the next frame, fixed rate */
+    unsigned long long begin; /* of the current frame */
+    unsigned long long last; /* beginning of the previous frame */
+    /* statistics */
+    unsigned int frames;
+    unsigned int missed; /* deadlines missed by more than a period */
+    long long slack_min; /* time left before the deadline, at the end of a frame */
+    long long slack_sum;
+    unsigned long long interval_min; /* between the beginnings of 2 frames */
+    unsigned long long interval_max;
+    unsigned int dirty : 1;
+};
+
+void pace_init(Pace *pc, Pace_Mode mode, int hz,
+               Pace_Clock clock, void *clock_data);
+
+void pace_mode_set(Pace *pc, Pace_Mode mode);
+
+void pace_invalidate(Pace *pc);
+
+unsigned long long pace_wait(const Pace *pc);
+
+int pace_frame_begin(Pace *pc);
+
+void pace_frame_end(Pace *pc);
+
+/*
+ * commands of the window thread, executed by the render thread. They
+ * go through a single producer / single consumer ring without lock:
+ * only the producer writes head, only the consumer writes tail.
+ */
+
+typedef enum
+{
+    CMD_RESIZE, /* rotation, width, height */
+    CMD_ROTATION, /* rotation, same size */
+    CMD_RENDER_MODE, /* next render mode */
+    CMD_PACE_MODE, /* next pacing mode */
+    CMD_VERTEX_FORMAT, /* next vertex format of the scene */
+    CMD_INVALIDATE,
+    CMD_TRIANGLE, /* x1, y1, x2, y2, x3, y3, r, g, b, a */
+    CMD_RECTANGLE, /* x, y, w, h, r, g, b, a */
+    CMD_QUIT
+} Cmd_Type;
+
+typedef struct
+{
+    Cmd_Type type;
+    int args[10];
+} Cmd;
+
+#define CMD_QUEUE_SIZE 256 /* power of 2 */
+
+typedef struct
+{
+    /* producer, tail is read again only when the ring looks full */
+    unsigned int head;
+    unsigned int tail_cache;
+    char pad1[64 - 2 * sizeof(unsigned int)];
+    /* consumer, head is read again only when the ring looks empty */
+    unsigned int tail;
+    unsigned int head_cache;
+    char pad2[64 - 2 * sizeof(unsigned int)];
+    Cmd cmds[CMD_QUEUE_SIZE];
+} Cmd_Queue;
+
+void cmd_queue_init(Cmd_Queue *q);
+
+int cmd_queue_push(Cmd_Queue *q, const Cmd *c);
+
+int cmd_queue_pop(Cmd_Queue *q, Cmd *c);
+
+/*
+ * parallel recording: the scene is split in chunks of consecutive
+ * primitives. Each chunk is recorded in its own command list, by any
+ * thread and in any order, then the lists are replayed in chunk order,
+ * so the result is the one of a serial recording.
+ */
+
+#define CHUNKS_MAX 32
+
+typedef struct
+{
+    unsigned int first; /* first primitive */
+    unsigned int count;
+} Chunk;
+
+unsigned int chunks_split(Chunk *chunks, unsigned int max,
+                          unsigned int count, unsigned int threads,
+                          unsigned int min_size);
+
+/*
+ * heap allocations of each frame: mem_frame_mark() is called once per
+ * frame, at its start. In the steady state (same scene size, no
+ * resize), last must be 0
+ */
+typedef struct
+{
+    unsigned long long mark;
+    unsigned long long last; /* during the previous frame */
+    unsigned int frames;
+    unsigned int frames_allocating;
+} Mem_Frame;
+
+void mem_frame_mark(Mem_Frame *f);
+
+/*
+ * frame arena: bump allocations, all released at once by arena_reset().
+ * A frame larger than the block gets more blocks, merged in one block
+ * by the next reset, half as large again, so that frames slowly growing
+ * (tile bins of moving primitives) do not allocate each time a new
+ * largest frame is seen.
+ */
+
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct Arena_Block Arena_Block;
+
+typedef struct
+{
+    Arena_Block *blocks; /* the first one is the current one */
+    size_t used; /* in the current block */
+    size_t block_size;
+    size_t bytes; /* allocated since the last reset */
+    size_t peak;
+} Arena;
+
+void arena_init(Arena *a, size_t block_size);
+
+void *arena_alloc(Arena *a, size_t size);
+
+void arena_reset(Arena *a);
+
+void arena_free(Arena *a);
+
+typedef enum
+{
+    RENDER_RETAINED, /* scene buffers, uploaded when modified */
+    RENDER_IMMEDIATE, /* scene appended each frame to the ring buffers */
+    RENDER_INSTANCED, /* immediate, with instanced rectangles */
+    RENDER_LAST
+} Render_Mode;
+
+#ifndef HAVE_SOFT
+
+#ifdef HAVE_DEFERRED
+# define D3D_RECORD_THREADS 4
+# define D3D_RECORD_CHUNKS 8 /* one deferred context each */
+# define D3D_RECORD_MIN 256 /* primitives per chunk, at least */
+
+typedef struct D3d_Record_Pool D3d_Record_Pool;
+#endif
+
+struct D3d
+{
+    /* DXGI */
+#ifdef HAVE_WIN10
+    IDXGIFactory2 *dxgi_factory;
+    IDXGISwapChain1 *dxgi_swapchain;
+#else
+    IDXGIFactory *dxgi_factory;
+    IDXGISwapChain *dxgi_swapchain;
+#endif
+    /* D3D11 */
+    ID3D11Device *d3d_device;
+    ID3D11DeviceContext *d3d_device_ctx;
+#ifdef HAVE_WIN10
+    ID3D11DeviceContext1 *d3d_device_ctx1; /* ClearView(), for the damaged rects */
+#endif
+    ID3D11RenderTargetView *d3d_render_target_view;
+    ID3D11InputLayout *d3d_input_layout;
+    ID3D11VertexShader *d3d_vertex_shader;
+    ID3D11InputLayout *d3d_input16_layout; /* compact vertices */
+    ID3D11VertexShader *d3d_vertex16_shader;
+    ID3D11Buffer *d3d_const_buffer;
+    ID3D11RasterizerState *d3d_rasterizer_state;
+    ID3D11RasterizerState *d3d_rasterizer_scissor_state; /* damaged rects */
+    ID3D11PixelShader *d3d_pixel_shader;
+    /* retained scene, its geometry lives in the two buffers below */
+    ID3D11Buffer *d3d_scene_vertex_buffer;
+    ID3D11Buffer *d3d_scene_index_buffer;
+    UINT scene_vertices_bytes; /* capacity of the vertex buffer, any format */
+    UINT scene_indices_size; /* capacity of the index buffer, in indices */
+    DXGI_FORMAT scene_index_format; /* R16_UINT while the vertices fit */
+    Scene *scene;
+    /* quad and triangle indices, R16_UINT, shared by all the primitives */
+    ID3D11Buffer *d3d_shared_index_buffer;
+    /* immediate mode, the primitives go through the ring buffer below */
+    ID3D11Buffer *d3d_batch_vertex_buffer;
+    Batch batch;
+    /* instanced rectangles */
+    ID3D11InputLayout *d3d_rect_input_layout;
+    ID3D11VertexShader *d3d_rect_vertex_shader;
+    ID3D11Buffer *d3d_rect_vertex_buffer; /* unit quad */
+    ID3D11Buffer *d3d_rect_instance_buffer;
+    UINT rect_instances_size; /* capacity of the instance buffer */
+    Render_Mode mode;
+    D3D11_VIEWPORT viewport;
+    Resize resize;
+    State_Cache state;
+#ifdef HAVE_DEFERRED
+    /* retained scene, recorded in parallel */
+    ID3D11DeviceContext *d3d_deferred_ctx[D3D_RECORD_CHUNKS];
+    ID3D11CommandList *d3d_command_list[D3D_RECORD_CHUNKS];
+    D3d_Record_Pool *record_pool; /* workers, alive until d3d_shutdown() */
+#endif
+    /* scratch data of a frame, released when the next one starts */
+    Arena frame;
+    Mem_Frame allocs;
+    unsigned int vsync : 1;
+};
+
+#else
+
+typedef struct Soft_Pool Soft_Pool;
+typedef struct Soft_Triangle Soft_Triangle;
+
+/*
+ * software backend: the scene is rasterized in a B8G8R8A8 framebuffer
+ * in memory
+ */
+struct D3d
+{
+    unsigned int *framebuffer; /* B8G8R8A8, 0xAARRGGBB on little endian */
+    int width;
+    int height;
+    float rotation[2][4]; /* same content as Const_Buffer */
+    Scene *scene;
+    Render_Mode mode;
+    /* tiled rendering, used with more than one thread */
+    Soft_Pool *pool;
+    Soft_Triangle *triangles; /* transformed triangles of the frame */
+    unsigned int *bins; /* triangle ids, grouped by tile */
+    unsigned int *bin_offsets; /* start of each tile in bins */
+    /* triangles recorded in parallel, one command buffer per chunk */
+    Chunk chunks[CHUNKS_MAX];
+    unsigned int chunk_bases[CHUNKS_MAX]; /* first triangle of a chunk */
+    unsigned int chunk_counts[CHUNKS_MAX]; /* recorded triangles */
+    unsigned int chunk_vertex_bases[CHUNKS_MAX]; /* first vertex of a chunk */
+    unsigned int chunks_count;
+    /* vertices of the chunks, transformed by xform_batch() */
+    int *vertex_x;
+    int *vertex_y;
+    float *vertex_nx;
+    float *vertex_ny;
+    unsigned int clear_color;
+    /* rotate pass: unrotated frame, rotated with image_rotate() */
+    unsigned int *unrotated;
+    size_t unrotated_size;
+    int rot;
+    int pass_rot; /* rotation done by image_rotate() during the pass, else 0 */
+    Resize resize;
+    /* scratch data of a frame, released when the next one starts */
+    Arena frame;
+    Mem_Frame allocs;
+    unsigned int rotate_pass : 1;
+    unsigned int damage : 1; /* only the damaged rects are redrawn */
+    unsigned int vsync : 1;
+};
+
+#endif
+
+void *mem_malloc(size_t size);
+
+void *mem_calloc(size_t nmemb, size_t size);
+
+void *mem_realloc(void *ptr, size_t size);
+
+unsigned long long mem_allocs_get(void);
+
+unsigned long long time_now(void);
+
+void time_sleep(unsigned long long ns);
+
+/*
+ * frame timing: with HAVE_PROF, PROF_BEGIN() / PROF_END() measure a
+ * stage of a frame, otherwise they expand to nothing
+ */
+
+typedef enum
+{
+    PROF_FRAME,
+    PROF_GEOMETRY,
+    PROF_UPLOAD,
+    PROF_CLEAR,
+    PROF_STATE,
+    PROF_DRAW,
+    PROF_ROTATE,
+    PROF_PRESENT,
+    PROF_RESIZE_MAP,
+    PROF_RESIZE_BUFFERS,
+    PROF_RESIZE_RTV,
+    PROF_LAST
+} Prof_Phase;
+
+#ifdef HAVE_PROF
+# define PROF_BEGIN(phase) \
+unsigned long long prof_start_##phase = time_now()
+# define PROF_END(phase) \
+prof_sample(PROF_##phase, time_now() - prof_start_##phase)
+#else
+# define PROF_BEGIN(phase) \
+do { } while (0)
+# define PROF_END(phase) \
+do { } while (0)
+#endif
+
+typedef enum
+{
+    TRACE_TYPE_BEGIN = 'B',
+    TRACE_TYPE_END = 'E',
+    TRACE_TYPE_INSTANT = 'i'
+} Trace_Type;
+
+/* name must be a static string, it is not copied */
+void trace_event(const char *name, Trace_Type type, int a, int b);
+
+/* allocates the ring of the calling thread, instead of its first event */
+void trace_thread_start(void);
+
+int trace_open(const char *file);
+
+void trace_flush(void);
+
+void trace_close(void);
+
+#ifdef HAVE_PROF
+void prof_sample(Prof_Phase phase, unsigned long long ns);
+
+void prof_aggregate(void);
+
+unsigned long long prof_percentile(Prof_Phase phase, double p);
+
+void prof_json_dump(FILE *f);
+
+void prof_reset(void);
+#endif
+
+void rotation_matrix_set(float m[2][4], int rot);
+
+/* chooses the SIMD variants, once, before any thread is started */
+void simd_init(void);
+
+void xform_batch(const int *x, const int *y,
+                 float *ox, float *oy,
+                 unsigned int n,
+                 int w, int h,
+                 const float m[2][4]);
+
+void image_rotate(unsigned int *dst, int dst_stride,
+                  const unsigned int *src, int src_stride,
+                  int w, int h, int rot);
+
+D3d *d3d_init(Window *win, int vsync);
+
+void d3d_shutdown(D3d *d3d);
+
+void d3d_resize(D3d *d3d, int rot, UINT width, UINT height);
+
+void d3d_render(D3d *d3d);
+
+#ifdef HAVE_SOFT
+int d3d_framebuffer_save(const D3d *d3d, const char *file);
+
+int d3d_threads_set(D3d *d3d, int threads);
+
+void d3d_rotate_pass_set(D3d *d3d, int on);
+
+void d3d_damage_set(D3d *d3d, int on);
+#endif
+
+#ifndef HAVE_SOFT
+
+/************************* Window *************************/
+
+struct Render
+{
+    Cmd_Queue queue;
+    Window *win;
+    HANDLE event; /* set when a command is pushed */
+    HANDLE timer;
+    HANDLE thread;
+};
+
+/* the thread owning the device: the render thread, or the window one */
+static void cmd_execute(Window *win, const Cmd *c)
+{
+    D3d *d3d = win->d3d;
+    const int *a = c->args;
+
+    switch (c->type)
+    {
+        case CMD_RESIZE:
+            d3d_resize(d3d, a[0], (UINT)a[1], (UINT)a[2]);
+            pace_invalidate(win->pace);
+            break;
+        case CMD_ROTATION:
+            d3d_resize(d3d, a[0],
+                       d3d->resize.pending_width,
+                       d3d->resize.pending_height);
+            pace_invalidate(win->pace);
+            break;
+        case CMD_RENDER_MODE:
+            d3d->mode = (d3d->mode + 1) % RENDER_LAST;
+            pace_invalidate(win->pace);
+            break;
+        case CMD_PACE_MODE:
+            pace_mode_set(win->pace, (win->pace->mode + 1) % PACE_LAST);
+            /* present bound: Present() waits for the vertical blank */
+            d3d->vsync = win->pace->mode == PACE_PRESENT;
+            TRACE("pacing mode", win->pace->mode, 0);
+            break;
+        case CMD_VERTEX_FORMAT:
+            scene_vertex_format_set(d3d->scene,
+                                    (d3d->scene->format + 1) % VERTEX_FORMAT_LAST);
+            TRACE("vertex format", d3d->scene->format,
+                  (int)d3d->scene->vertex_size);
+            pace_invalidate(win->pace);
+            break;
+        case CMD_INVALIDATE:
+            pace_invalidate(win->pace);
+            break;
+        case CMD_TRIANGLE:
+            scene_triangle_add(d3d->scene, a[0], a[1], a[2], a[3], a[4], a[5],
+                               a[6], a[7], a[8], a[9]);
+            pace_invalidate(win->pace);
+            break;
+        case CMD_RECTANGLE:
+            scene_rectangle_add(d3d->scene, a[0], a[1], a[2], a[3],
+                                a[4], a[5], a[6], a[7]);
+            pace_invalidate(win->pace);
+            break;
+        default:
+            break;
+    }
+}
+
+/* posted to the render thread if any, executed now otherwise */
+static void window_cmd(Window *win, const Cmd *c)
+{
+    if (!win->render)
+    {
+        cmd_execute(win, c);
+        return;
+    }
+
+    /* full only if the render thread is stuck for a long time */
+    while (!cmd_queue_push(&win->render->queue, c))
+        SwitchToThread();
+    SetEvent(win->render->event);
+}
+
+static void window_cmd_post(Window *win, Cmd_Type type, int a0, int a1, int a2)
+{
+    Cmd c;
+
+    memset(&c, 0, sizeof(Cmd));
+    c.type = type;
+    c.args[0] = a0;
+    c.args[1] = a1;
+    c.args[2] = a2;
+    window_cmd(win, &c);
+}
+
+LRESULT CALLBACK
+_window_procedure(HWND   window,
+                  UINT   message,
+                  WPARAM window_param,
+                  LPARAM data_param)
+{
+  switch (message)
+    {
+    case WM_CLOSE:
+        PostQuitMessage(0);
+        return 0;
+    case WM_KEYUP:
+        if (window_param == 'Q')
+        {
+            PostQuitMessage(0);
+        }
+        if (window_param == 'F')
+        {
+            Window *win;
+
+            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
+            window_fullscreen_set(win, !win->fullscreen);
+        }
+        if (window_param == 'R')
+        {
+            Window *win;
+
+            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
+            window_rotation_set(win, (win->rotation + 1) % 4);
+        }
+        if (window_param == 'I')
+        {
+            Window *win;
+
+            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
+            window_cmd_post(win, CMD_RENDER_MODE, 0, 0, 0);
+        }
+        if (window_param == 'U')
+        {
+            RECT r;
+            Window* win;
+
+            win = (Window*)GetWindowLongPtr(window, GWLP_USERDATA);
+            GetClientRect(window, &r);
+            window_cmd_post(win, CMD_RESIZE, win->rotation,
+                            r.right - r.left, r.bottom - r.top);
+        }
+        if (window_param == 'P')
+        {
+            Window *win;
+
+            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
+            window_cmd_post(win, CMD_PACE_MODE, 0, 0, 0);
+        }
+        if (window_param == 'V')
+        {
+            Window *win;
+
+            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
+            window_cmd_post(win, CMD_VERTEX_FORMAT, 0, 0, 0);
+        }
+        return 0;
+    case WM_ERASEBKGND:
+        /* no need to erase back */
+        return 1;
+    /* GDI notifications */
+    case WM_CREATE:
+        TRACE("WM_CREATE", 0, 0);
+        return 0;
+    case WM_SIZE:
+    {
+        Window * win;
+
+        TRACE("WM_SIZE", LOWORD(data_param), HIWORD(data_param));
+
+        win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
+        window_cmd_post(win, CMD_RESIZE, win->rotation,
+                        LOWORD(data_param), HIWORD(data_param));
+
+        return 0;
+    }
+    case WM_PAINT:
+    {
+        TRACE("WM_PAINT", 0, 0);
+
+        if (GetUpdateRect(window, NULL, FALSE))
+        {
+            PAINTSTRUCT ps;
+            Window *win;
+
+            BeginPaint(window, &ps);
+
+            /*
+             * without render thread, rendered here, and not only in the
+             * message loop, as the modal loop of a resize by the user
+             * does not return to it
+             */
+            win = (Window *)GetWindowLongPtr(window, GWLP_USERDATA);
+            window_cmd_post(win, CMD_INVALIDATE, 0, 0, 0);
+            if (!win->render && pace_frame_begin(win->pace))
+            {
+                d3d_render(win->d3d);
+                pace_frame_end(win->pace);
+            }
+
+            EndPaint(window, &ps);
+        }
+
+        return 0;
+      }
+    default:
+      return DefWindowProc(window, message, window_param, data_param);
+    }
+}
+
+Window *window_new(int x, int y, int w, int h)
+{
+    WNDCLASS wc;
+    RECT r;
+    Window *win;
+
+    win = (Window *)mem_calloc(1, sizeof(Window));
+    if (!win)
+        return NULL;
+
+    win->instance = GetModuleHandle(NULL);
+    if (!win->instance)
+        goto free_win;
+
+    memset (&wc, 0, sizeof (WNDCLASS));
+    wc.style = CS_HREDRAW | CS_VREDRAW;
+    wc.lpfnWndProc = _window_procedure;
+    wc.cbClsExtra = 0;
+    wc.cbWndExtra = 0;
+    wc.hInstance = win->instance;
+    wc.hIcon = LoadIcon (NULL, IDI_APPLICATION);
+    wc.hCursor = LoadCursor (NULL, IDC_ARROW);
+    wc.hbrBackground = NULL;
+    wc.lpszMenuName =  NULL;
+    wc.lpszClassName = "D3D";
+
+    if(!RegisterClass(&wc))
+        goto free_library;
+
+    r.left = 0;
+    r.top = 0;
+    r.right = w;
+    r.bottom = h;
+    if (!AdjustWindowRectEx(&r,
+                            WS_OVERLAPPEDWINDOW | WS_SIZEBOX,
+                            FALSE,
+                            0U))
+        goto unregister_class;
+
+    win->win = CreateWindowEx(0U,
+                              "D3D", "Test",
+                              WS_OVERLAPPEDWINDOW | WS_SIZEBOX,
+                              x, y,
+                              r.right - r.left,
+                              r.bottom - r.top,
+                              NULL,
+                              NULL, win->instance, NULL);
+    if (!win->win)
+        goto unregister_class;
+
+    return win;
+
+  unregister_class:
+    UnregisterClass("D2D", win->instance);
+  free_library:
+    FreeLibrary(win->instance);
+  free_win:
+    free(win);
+
+    return NULL;
+}
+
+void window_del(Window *win)
+{
+    if (!win)
+        return;
+
+    DestroyWindow(win->win);
+    UnregisterClass("D2D", win->instance);
+    FreeLibrary(win->instance);
+    free(win);
+}
+
+void window_show(Window *win)
+{
+    ShowWindow(win->win, SW_SHOWNORMAL);
+}
+
+void window_fullscreen_set(Window *win, unsigned int on)
+{
+    HWND prev;
+    DWORD style;
+    DWORD exstyle;
+    UINT flags;
+    int x;
+    int y;
+    int w;
+    int h;
+
+    on =  !!on;
+    if ((win->fullscreen && on) ||
+        (!win->fullscreen && !on))
+        return;
+
+    if (on)
+    {
+        MONITORINFO mi;
+        HMONITOR monitor;
+
+        if (!GetWindowRect(win->win, &win->rect))
+        {
+            printf("GetWindowRect() failed\n");
+            return;
+        }
+
+        monitor = MonitorFromWindow(win->win, MONITOR_DEFAULTTONEAREST);
+        mi.cbSize = sizeof(MONITORINFO);
+        if (!GetMonitorInfo(monitor, &mi))
+            return;
+
+        style = WS_VISIBLE | WS_POPUP;
+        exstyle = WS_EX_TOPMOST;
+        prev = HWND_TOPMOST;
+        x = 0;
+        y = 0;
+        w = mi.rcMonitor.right - mi.rcMonitor.left;
+        h = mi.rcMonitor.bottom - mi.rcMonitor.top;
+        flags = SWP_NOCOPYBITS | SWP_SHOWWINDOW;
+    }
+    else
+    {
+
+        style = WS_OVERLAPPEDWINDOW | WS_SIZEBOX;
+        exstyle = 0U;
+        prev = HWND_NOTOPMOST;
+        x = win->rect.left;
+        y = win->rect.top;
+        w = win->rect.right - win->rect.left;
+        h = win->rect.bottom - win->rect.top;
+        flags = SWP_NOCOPYBITS | SWP_SHOWWINDOW;
+    }
+
+    SetLastError(0);
+    if (!SetWindowLongPtr(win->win, GWL_STYLE, style) &&
+        (GetLastError() != 0))
+    {
+        printf("SetWindowLongPtr() failed\n");
+        return;
+    }
+    SetLastError(0);
+    if (!SetWindowLongPtr(win->win, GWL_EXSTYLE, exstyle) &&
+        (GetLastError() != 0))
+    {
+        printf("SetWindowLongPtr() failed\n");
+        return;
+    }
+    if (!SetWindowPos(win->win, prev, x, y, w, h, flags))
+    {
+        printf("SetWindowPos() failed\n");
+        return;
+    }
+
+    win->fullscreen = on;
+}
+
+void window_rotation_set(Window *win, int rotation)
+{
+    int rdiff;
+
+    if (win->rotation == rotation)
+        return;
+
+    rdiff = win->rotation - rotation;
+    if (rdiff < 0) rdiff = -rdiff;
+
+    if (rdiff != 2)
+    {
+        RECT r;
+        RECT r2;
+        int x;
+        int y;
+
+        win->rotation = rotation;
+
+        if (!GetWindowRect(win->win, &r))
+        {
+            printf("GetClient failed\n");
+            return;
+        }
+
+        x = r.left;
+        y = r.top;
+
+        if (!GetClientRect(win->win, &r))
+        {
+            printf("GetClient failed\n");
+            return;
+        }
+
+        r2.left = 0;
+        r2.top = 0;
+        r2.right = r.bottom - r.top;
+        r2.bottom = r.right - r.left;
+        if (!AdjustWindowRectEx(&r2,
+                                WS_OVERLAPPEDWINDOW | WS_SIZEBOX,
+                                FALSE,
+                                0U))
+        {
+            printf("AdjustWindowRectEx failed\n");
+            return;
+        }
+
+        if (!MoveWindow(win->win,
+                        x, y,
+                        r2.right - r2.left, r2.bottom - r2.top,
+                        TRUE))
+        {
+            printf("MoveWindow() failed\n");
+            return;
+        }
+    }
+    else
+    {
+        /* same size, no WM_SIZE: only the rotation changes */
+        win->rotation = rotation;
+        window_cmd_post(win, CMD_ROTATION, rotation, 0, 0);
+    }
+}
+
+#endif
+
+/************************** Memory **************************/
+
+/* heap allocations go through these, so that they can be counted */
+
+static unsigned long long mem_allocs = 0;
+
+void *mem_malloc(size_t size)
+{
+    __atomic_add_fetch(&mem_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void *mem_calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&mem_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(nmemb, size);
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&mem_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+/* number of allocations since the start of the program */
+unsigned long long mem_allocs_get(void)
+{
+    return __atomic_load_n(&mem_allocs, __ATOMIC_RELAXED);
+}
+
+void mem_frame_mark(Mem_Frame *f)
+{
+    unsigned long long now = mem_allocs_get();
+
+    if (f->mark)
+    {
+        f->last = now - f->mark;
+        f->frames++;
+        if (f->last)
+            f->frames_allocating++;
+        TRACE("allocs", (int)f->last, (int)f->frames_allocating);
+    }
+    f->mark = now ? now : 1;
+}
+
+/*************************** Arena ***************************/
+
+struct Arena_Block
+{
+    Arena_Block *next;
+    unsigned char *data; /* aligned on ARENA_ALIGN */
+    size_t size;
+};
+
+static size_t arena_round(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static Arena_Block *arena_block_new(size_t size)
+{
+    Arena_Block *b;
+    size_t header;
+
+    header = arena_round(sizeof(Arena_Block));
+    b = (Arena_Block *)mem_malloc(header + size + ARENA_ALIGN);
+    if (!b)
+        return NULL;
+
+    b->next = NULL;
+    b->data = (unsigned char *)arena_round((size_t)b + header);
+    b->size = size;
+
+    return b;
+}
+
+void arena_init(Arena *a, size_t block_size)
+{
+    memset(a, 0, sizeof(Arena));
+    a->block_size = arena_round(block_size ? block_size : ARENA_BLOCK_SIZE);
+}
+
+void *arena_alloc(Arena *a, size_t size)
+{
+    void *ptr;
+
+    size = arena_round(size ? size : 1);
+    if (!a->blocks || (a->used + size > a->blocks->size))
+    {
+        Arena_Block *b;
+
+        b = arena_block_new((size > a->block_size) ? size : a->block_size);
+        if (!b)
+            return NULL;
+
+        b->next = a->blocks;
+        a->blocks = b;
+        a->used = 0;
+    }
+
+    ptr = a->blocks->data + a->used;
+    a->used += size;
+    a->bytes += size;
+
+    return ptr;
+}
+
+/* the blocks of a frame are replaced by one, with room for half more */
+void arena_reset(Arena *a)
+{
+    if (a->bytes > a->peak)
+        a->peak = a->bytes;
+    a->bytes = 0;
+    a->used = 0;
+
+    if (a->blocks && a->blocks->next)
+    {
+        Arena_Block *b;
+        size_t size = 0;
+
+        for (b = a->blocks; b; b = b->next)
+            size += b->size;
+
+        b = arena_block_new(arena_round(size + size / 2));
+        arena_free(a);
+        a->blocks = b;
+    }
+}
+
+void arena_free(Arena *a)
+{
+    Arena_Block *b = a->blocks;
+
+    while (b)
+    {
+        Arena_Block *next = b->next;
+
+        free(b);
+        b = next;
+    }
+
+    a->blocks = NULL;
+    a->used = 0;
+}
+
+/* frame boundary: the scratch data of the previous frame is released */
+static void d3d_frame_start(D3d *d3d)
+{
+    mem_frame_mark(&d3d->allocs);
+    arena_reset(&d3d->frame);
+}
+
+/*************************** Time ***************************/
+
+/* monotonic time, in nanoseconds */
+unsigned long long time_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+
+    return (unsigned long long)(count.QuadPart / freq.QuadPart) * 1000000000ULL +
+           (unsigned long long)(count.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void time_sleep(unsigned long long ns)
+{
+#ifdef _WIN32
+    Sleep((DWORD)((ns + 999999ULL) / 1000000ULL));
+#else
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ns / 1000000000ULL);
+    ts.tv_nsec = (long)(ns % 1000000000ULL);
+    while (nanosleep(&ts, &ts) == -1)
+        ;
+#endif
+}
+
+#ifdef HAVE_PROF
+
+/************************* Profiling *************************/
+
+/*
+ * each stage has a ring of samples, written lock-free from any
+ * thread, and a histogram, filled from the ring by prof_aggregate().
+ * A slot is 0 when empty, so a sample is stored as ns + 1 and the
+ * aggregation stops at a slot whose sample is not written yet.
+ */
+
+#define PROF_RING_SIZE 1024 /* power of 2 */
+
+/* log-linear buckets: 16 per power of 2, that is 6% of precision */
+#define PROF_SUB_BITS 4
+#define PROF_SUB_COUNT (1 << PROF_SUB_BITS)
+#define PROF_BUCKETS ((64 - PROF_SUB_BITS + 1) << PROF_SUB_BITS)
+
+typedef struct
+{
+    unsigned long long samples[PROF_RING_SIZE];
+    unsigned long long head; /* next slot to write */
+    unsigned long long tail; /* next slot to aggregate */
+} Prof_Ring;
+
+typedef struct
+{
+    unsigned int buckets[PROF_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long lost; /* overwritten before aggregation */
+} Prof_Histo;
+
+static const char *prof_names[PROF_LAST] =
+{
+    "frame",
+    "geometry",
+    "upload",
+    "clear",
+    "state",
+    "draw",
+    "rotate",
+    "present",
+    "resize_map",
+    "resize_buffers",
+    "resize_rtv"
+};
+
+static Prof_Ring prof_rings[PROF_LAST];
+static Prof_Histo prof_histos[PROF_LAST];
+
+static unsigned int prof_bucket(unsigned long long v)
+{
+    int e;
+
+    if (v < PROF_SUB_COUNT)
+        return (unsigned int)v;
+
+    e = 63 - __builtin_clzll(v);
+
+    return ((e - PROF_SUB_BITS + 1) << PROF_SUB_BITS) +
+           (unsigned int)((v >> (e - PROF_SUB_BITS)) & (PROF_SUB_COUNT - 1));
+}
+
+/* largest value of the bucket */
+static unsigned long long prof_bucket_value(unsigned int b)
+{
+    unsigned int e;
+
+    if (b < PROF_SUB_COUNT)
+        return b;
+
+    e = (b >> PROF_SUB_BITS) + PROF_SUB_BITS - 1;
+
+    return (((unsigned long long)(PROF_SUB_COUNT + (b & (PROF_SUB_COUNT - 1))) + 1)
+            << (e - PROF_SUB_BITS)) - 1;
+}
+
+void prof_sample(Prof_Phase phase, unsigned long long ns)
+{
+    Prof_Ring *r = prof_rings + phase;
+    unsigned long long i;
+
+    i = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(r->samples + (i & (PROF_RING_SIZE - 1)), ns + 1,
+                     __ATOMIC_RELEASE);
+}
+
+/* not thread safe: only one thread aggregates */
+void prof_aggregate(void)
+{
+    int i;
+
+    for (i = 0; i < PROF_LAST; i++)
+    {
+        Prof_Ring *r = prof_rings + i;
+        Prof_Histo *h = prof_histos + i;
+        unsigned long long head;
+
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head - r->tail > PROF_RING_SIZE)
+        {
+            h->lost += head - r->tail - PROF_RING_SIZE;
+            r->tail = head - PROF_RING_SIZE;
+        }
+
+        while (r->tail < head)
+        {
+            unsigned long long v;
+
+            v = __atomic_exchange_n(r->samples + (r->tail & (PROF_RING_SIZE - 1)),
+                                    0, __ATOMIC_ACQUIRE);
+            if (v == 0)
+                break;
+
+            v--;
+            h->buckets[prof_bucket(v)]++;
+            h->count++;
+            h->sum += v;
+            if (v > h->max)
+                h->max = v;
+            r->tail++;
+        }
+    }
+}
+
+/* p in [0, 1], result in nanoseconds, from the aggregated samples */
+unsigned long long prof_percentile(Prof_Phase phase, double p)
+{
+    const Prof_Histo *h = prof_histos + phase;
+    unsigned long long rank;
+    unsigned long long n;
+    unsigned int b;
+
+    if (h->count == 0)
+        return 0;
+
+    rank = (unsigned long long)ceil(p * (double)h->count);
+    if (rank < 1)
+        rank = 1;
+
+    n = 0;
+    for (b = 0; b < PROF_BUCKETS; b++)
+    {
+        n += h->buckets[b];
+        if (n >= rank)
+        {
+            unsigned long long v = prof_bucket_value(b);
+
+            return (v < h->max) ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+void prof_json_dump(FILE *f)
+{
+    int first;
+    int i;
+
+    prof_aggregate();
+
+    first = 1;
+    fprintf(f, "{\n");
+    for (i = 0; i < PROF_LAST; i++)
+    {
+        const Prof_Histo *h = prof_histos + i;
+
+        if (h->count == 0)
+            continue;
+
+        fprintf(f,
+                "%s  \"%s\": { \"count\": %llu, \"lost\": %llu, "
+                "\"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+                "\"p99_ns\": %llu, \"max_ns\": %llu }",
+                first ? "" : ",\n",
+                prof_names[i], h->count, h->lost,
+                h->sum / h->count,
+                prof_percentile(i, 0.50),
+                prof_percentile(i, 0.90),
+                prof_percentile(i, 0.99),
+                h->max);
+        first = 0;
+    }
+    fprintf(f, "\n}\n");
+    fflush(f);
+}
+
+void prof_reset(void)
+{
+    prof_aggregate();
+    memset(prof_histos, 0, sizeof(prof_histos));
+}
+
+#endif
+
+/************************** Trace **************************/
+
+/*
+ * each thread writes fixed size events in its own ring, without lock
+ * nor system call. trace_flush(), called by one thread only, moves
+ * them to the file opened with trace_open(), in the Chrome trace event
+ * format (chrome://tracing or https://ui.perfetto.dev). When a ring is
+ * full, the events are dropped and counted. Rings live until the end
+ * of the program, as a thread can still write in its ring after
+ * trace_close().
+ */
+
+#define TRACE_EVENTS 4096 /* per thread, power of 2 */
+
+typedef struct
+{
+    unsigned long long ts;
+    const char *name;
+    int a;
+    int b;
+    Trace_Type type;
+} Trace_Event;
+
+typedef struct Trace_Buffer Trace_Buffer;
+
+struct Trace_Buffer
+{
+    Trace_Event events[TRACE_EVENTS];
+    unsigned long long head; /* written by the owner thread */
+    unsigned long long tail; /* written by the flushing thread */
+    unsigned long long dropped;
+    unsigned int tid;
+    Trace_Buffer *next;
+};
+
+static Trace_Buffer *trace_buffers = NULL; /* rings of all the threads */
+static unsigned int trace_tids = 0;
+static __thread Trace_Buffer *trace_local = NULL;
+static FILE *trace_file = NULL;
+static unsigned long long trace_start = 0;
+static unsigned long long trace_written = 0;
+
+static Trace_Buffer *trace_buffer_new(void)
+{
+    Trace_Buffer *tb;
+
+    tb = (Trace_Buffer *)mem_calloc(1, sizeof(Trace_Buffer));
+    if (!tb)
+        return NULL;
+
+    tb->tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+    tb->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace_buffers, &tb->next, tb, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    trace_local = tb;
+
+    return tb;
+}
+
+void trace_thread_start(void)
+{
+    if (!trace_local)
+        trace_buffer_new();
+}
+
+void trace_event(const char *name, Trace_Type type, int a, int b)
+{
+    Trace_Buffer *tb;
+    Trace_Event *ev;
+    unsigned long long head;
+
+    tb = trace_local;
+    if (!tb)
+    {
+        tb = trace_buffer_new();
+        if (!tb)
+            return;
+    }
+
+    head = tb->head;
+    if (head - __atomic_load_n(&tb->tail, __ATOMIC_ACQUIRE) >= TRACE_EVENTS)
+    {
+        __atomic_add_fetch(&tb->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ev = tb->events + (head & (TRACE_EVENTS - 1));
+    ev->ts = time_now();
+    ev->name = name;
+    ev->a = a;
+    ev->b = b;
+    ev->type = type;
+
+    __atomic_store_n(&tb->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_open(const char *file)
+{
+    trace_close();
+
+    trace_file = fopen(file, "wb");
+    if (!trace_file)
+        return 0;
+
+    trace_start = time_now();
+    trace_written = 0;
+    fprintf(trace_file, "{\"traceEvents\":[\n");
+
+    return 1;
+}
+
+/* without opened file, the events are discarded */
+void trace_flush(void)
+{
+    Trace_Buffer *tb;
+
+    tb = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+    for (; tb; tb = tb->next)
+    {
+        unsigned long long head;
+        unsigned long long tail;
+
+        head = __atomic_load_n(&tb->head, __ATOMIC_ACQUIRE);
+        tail = tb->tail;
+        if (trace_file)
+        {
+            for (; tail < head; tail++)
+            {
+                const Trace_Event *ev;
+
+                ev = tb->events + (tail & (TRACE_EVENTS - 1));
+                fprintf(trace_file,
+                        "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                        "\"pid\":1,\"tid\":%u%s",
+                        trace_written ? ",\n" : "",
+                        ev->name, (char)ev->type,
+                        (double)(long long)(ev->ts - trace_start) / 1000.0,
+                        tb->tid,
+                        (ev->type == TRACE_TYPE_INSTANT) ? ",\"s\":\"t\"" : "");
+                if (ev->type != TRACE_TYPE_END)
+                    fprintf(trace_file, ",\"args\":{\"a\":%d,\"b\":%d}",
+                            ev->a, ev->b);
+                fprintf(trace_file, "}");
+                trace_written++;
+            }
+        }
+        __atomic_store_n(&tb->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+void trace_close(void)
+{
+    Trace_Buffer *tb;
+    unsigned long long dropped;
+
+    if (!trace_file)
+        return;
+
+    trace_flush();
+
+    dropped = 0;
+    tb = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE);
+    for (; tb; tb = tb->next)
+        dropped += __atomic_load_n(&tb->dropped, __ATOMIC_RELAXED);
+
+    fprintf(trace_file, "\n],\"otherData\":{\"dropped\":\"%llu\"}}\n",
+            dropped);
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+/************************* Rotation *************************/
+
+/* 2x3 matrix applied by main_vs, rotation (clockwise): 0, 1, 2 3 */
+void rotation_matrix_set(float m[2][4], int rot)
+{
+    switch (rot)
+    {
+        case 0:
+            m[0][0] = 1.0f;
+            m[0][1] = 0.0f;
+            m[0][2] = 0.0f;
+            m[1][0] = 0.0f;
+            m[1][1] = 1.0f;
+            m[1][2] = 0.0f;
+            break;
+        case 1:
+            m[0][0] = 0.0f;
+            m[0][1] = -1.0f;
+            m[0][2] = 2.0f;
+            m[1][0] = 1.0f;
+            m[1][1] = 0.0f;
+            m[1][2] = 0.0f;
+            break;
+        case 2:
+            m[0][0] = -1.0f;
+            m[0][1] = 0.0f;
+            m[0][2] = 0.0f;
+            m[1][0] = 0.0f;
+            m[1][1] = -1.0f;
+            m[1][2] = 0.0f;
+            break;
+        case 3:
+            m[0][0] = 0.0f;
+            m[0][1] = 1.0f;
+            m[0][2] = 0.0f;
+            m[1][0] = -1.0f;
+            m[1][1] = 0.0f;
+            m[1][2] = 2.0f;
+            break;
+    }
+}
+
+/************************ Transform ************************/
+
+/*
+ * batch transform of SoA pixel coordinates to NDC, same operations as
+ * XF() and YF(), followed by the 2x3 affine of main_vs if m is not
+ * NULL. The SIMD variants do the same IEEE operations in the same
+ * order (no reciprocal, no FMA), so they give the same results as the
+ * scalar one. The variant is chosen by simd_init().
+ */
+
+typedef void (*Xform_Func)(const int *x, const int *y,
+                           float *ox, float *oy,
+                           unsigned int n,
+                           int w, int h,
+                           const float m[2][4]);
+
+static void xform_batch_c(const int *x, const int *y,
+                          float *ox, float *oy,
+                          unsigned int n,
+                          int w, int h,
+                          const float m[2][4])
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+    {
+        float fx = XF(w, x[i]);
+        float fy = YF(h, y[i]);
+
+        if (m)
+        {
+            ox[i] = m[0][0] * fx + m[0][1] * fy + m[0][2];
+            oy[i] = m[1][0] * fx + m[1][1] * fy + m[1][2];
+        }
+        else
+        {
+            ox[i] = fx;
+            oy[i] = fy;
+        }
+    }
+}
+
+#ifdef HAVE_SIMD_X86
+
+__attribute__((target("sse2")))
+static void xform_batch_sse2(const int *x, const int *y,
+                             float *ox, float *oy,
+                             unsigned int n,
+                             int w, int h,
+                             const float m[2][4])
+{
+    __m128i vw = _mm_set1_epi32(w);
+    __m128i vh = _mm_set1_epi32(h);
+    __m128 fw = _mm_set1_ps((float)w);
+    __m128 fh = _mm_set1_ps((float)h);
+    unsigned int i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m128i xi = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i yi = _mm_loadu_si128((const __m128i *)(y + i));
+        __m128 fx;
+        __m128 fy;
+
+        /* (2 * x - w) / w and (h - 2 * y) / h */
+        fx = _mm_div_ps(_mm_cvtepi32_ps(_mm_sub_epi32(_mm_add_epi32(xi, xi), vw)), fw);
+        fy = _mm_div_ps(_mm_cvtepi32_ps(_mm_sub_epi32(vh, _mm_add_epi32(yi, yi))), fh);
+
+        if (m)
+        {
+            __m128 rx;
+            __m128 ry;
+
+            rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0][0]), fx),
+                                       _mm_mul_ps(_mm_set1_ps(m[0][1]), fy)),
+                            _mm_set1_ps(m[0][2]));
+            ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[1][0]), fx),
+                                       _mm_mul_ps(_mm_set1_ps(m[1][1]), fy)),
+                            _mm_set1_ps(m[1][2]));
+            fx = rx;
+            fy = ry;
+        }
+
+        _mm_storeu_ps(ox + i, fx);
+        _mm_storeu_ps(oy + i, fy);
+    }
+
+    xform_batch_c(x + i, y + i, ox + i, oy + i, n - i, w, h, m);
+}
+
+__attribute__((target("avx2")))
+static void xform_batch_avx2(const int *x, const int *y,
+                             float *ox, float *oy,
+                             unsigned int n,
+                             int w, int h,
+                             const float m[2][4])
+{
+    __m256i vw = _mm256_set1_epi32(w);
+    __m256i vh = _mm256_set1_epi32(h);
+    __m256 fw = _mm256_set1_ps((float)w);
+    __m256 fh = _mm256_set1_ps((float)h);
+    unsigned int i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+        __m256i xi = _mm256_loadu_si256((const __m256i *)(x + i));
+        __m256i yi = _mm256_loadu_si256((const __m256i *)(y + i));
+        __m256 fx;
+        __m256 fy;
+
+        fx = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_add_epi32(xi, xi), vw)), fw);
+        fy = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(vh, _mm256_add_epi32(yi, yi))), fh);
+
+        if (m)
+        {
+            __m256 rx;
+            __m256 ry;
+
+            rx = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[0][0]), fx),
+                                             _mm256_mul_ps(_mm256_set1_ps(m[0][1]), fy)),
+                               _mm256_set1_ps(m[0][2]));
+            ry = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[1][0]), fx),
+                                             _mm256_mul_ps(_mm256_set1_ps(m[1][1]), fy)),
+                               _mm256_set1_ps(m[1][2]));
+            fx = rx;
+            fy = ry;
+        }
+
+        _mm256_storeu_ps(ox + i, fx);
+        _mm256_storeu_ps(oy + i, fy);
+    }
+
+    xform_batch_sse2(x + i, y + i, ox + i, oy + i, n - i, w, h, m);
+}
+
+#endif
+
+#ifdef HAVE_SIMD_NEON
+
+static void xform_batch_neon(const int *x, const int *y,
+                             float *ox, float *oy,
+                             unsigned int n,
+                             int w, int h,
+                             const float m[2][4])
+{
+    int32x4_t vw = vdupq_n_s32(w);
+    int32x4_t vh = vdupq_n_s32(h);
+    float32x4_t fw = vdupq_n_f32((float)w);
+    float32x4_t fh = vdupq_n_f32((float)h);
+    unsigned int i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        int32x4_t xi = vld1q_s32(x + i);
+        int32x4_t yi = vld1q_s32(y + i);
+        float32x4_t fx;
+        float32x4_t fy;
+
+        fx = vdivq_f32(vcvtq_f32_s32(vsubq_s32(vaddq_s32(xi, xi), vw)), fw);
+        fy = vdivq_f32(vcvtq_f32_s32(vsubq_s32(vh, vaddq_s32(yi, yi))), fh);
+
+        if (m)
+        {
+            float32x4_t rx;
+            float32x4_t ry;
+
+            /* vmulq/vaddq, not vmlaq, to avoid fused operations */
+            rx = vaddq_f32(vaddq_f32(vmulq_n_f32(fx, m[0][0]),
+                                     vmulq_n_f32(fy, m[0][1])),
+                           vdupq_n_f32(m[0][2]));
+            ry = vaddq_f32(vaddq_f32(vmulq_n_f32(fx, m[1][0]),
+                                     vmulq_n_f32(fy, m[1][1])),
+                           vdupq_n_f32(m[1][2]));
+            fx = rx;
+            fy = ry;
+        }
+
+        vst1q_f32(ox + i, fx);
+        vst1q_f32(oy + i, fy);
+    }
+
+    xform_batch_c(x + i, y + i, ox + i, oy + i, n - i, w, h, m);
+}
+
+#endif
+
+/* the variants usable on this CPU, the best one last */
+static unsigned int xform_variants_get(Xform_Func *funcs, const char **names)
+{
+    unsigned int count = 0;
+
+    funcs[count] = xform_batch_c;
+    names[count++] = "c";
+#if defined HAVE_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        funcs[count] = xform_batch_sse2;
+        names[count++] = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        funcs[count] = xform_batch_avx2;
+        names[count++] = "avx2";
+    }
+#elif defined HAVE_SIMD_NEON
+    funcs[count] = xform_batch_neon;
+    names[count++] = "neon";
+#endif
+
+    return count;
+}
+
+#define XFORM_VARIANTS_MAX 4
+
+static Xform_Func xform_batch_func = xform_batch_c;
+
+#if defined HAVE_SIMD_X86
+/* the 4x4 tiles of image_rotate(), SSE2 being optional on 32 bits x86 */
+static int image_rotate_sse2 = 0;
+#endif
+
+void simd_init(void)
+{
+    Xform_Func funcs[XFORM_VARIANTS_MAX];
+    const char *names[XFORM_VARIANTS_MAX];
+    unsigned int count;
+
+    count = xform_variants_get(funcs, names);
+    xform_batch_func = funcs[count - 1];
+#if defined HAVE_SIMD_X86
+    image_rotate_sse2 = __builtin_cpu_supports("sse2");
+#endif
+}
+
+void xform_batch(const int *x, const int *y,
+                 float *ox, float *oy,
+                 unsigned int n,
+                 int w, int h,
+                 const float m[2][4])
+{
+    xform_batch_func(x, y, ox, oy, n, w, h, m);
+}
+
+/************************** Image **************************/
+
+/*
+ * quarter turn rotations (clockwise) of B8G8R8A8 images, w and h being
+ * the size of the source and strides in pixels. The image is processed
+ * in square blocks so that both the source rows and the destination
+ * rows stay in cache, and 4x4 pixel tiles are transposed in SIMD
+ * registers. The borders are done pixel per pixel.
+ */
+
+#define IMAGE_ROTATE_BLOCK 64
+
+static void image_rotate_pixels(unsigned int *dst, int dst_stride,
+                                const unsigned int *src, int src_stride,
+                                int w, int h, int rot,
+                                int x0, int y0, int x1, int y1)
+{
+    int x;
+    int y;
+
+    for (y = y0; y < y1; y++)
+    {
+        const unsigned int *s = src + (size_t)y * src_stride;
+
+        for (x = x0; x < x1; x++)
+        {
+            switch (rot)
+            {
+                case 1:
+                    dst[(size_t)x * dst_stride + (h - 1 - y)] = s[x];
+                    break;
+                case 2:
+                    dst[(size_t)(h - 1 - y) * dst_stride + (w - 1 - x)] = s[x];
+                    break;
+                case 3:
+                    dst[(size_t)(w - 1 - x) * dst_stride + y] = s[x];
+                    break;
+                default:
+                    dst[(size_t)y * dst_stride + x] = s[x];
+                    break;
+            }
+        }
+    }
+}
+
+#if defined HAVE_SIMD_X86
+
+/* 4x4 tile at (x, y), rot is 1 or 3 */
+__attribute__((target("sse2")))
+static void image_rotate_tile(unsigned int *dst, int dst_stride,
+                              const unsigned int *src, int src_stride,
+                              int w, int h, int rot, int x, int y)
+{
+    const unsigned int *s = src + (size_t)y * src_stride + x;
+    __m128i r0, r1, r2, r3;
+    __m128i t0, t1, t2, t3;
+    __m128i c[4];
+    unsigned int *d;
+    int step;
+    int j;
+
+    r0 = _mm_loadu_si128((const __m128i *)(s));
+    r1 = _mm_loadu_si128((const __m128i *)(s + src_stride));
+    r2 = _mm_loadu_si128((const __m128i *)(s + 2 * src_stride));
+    r3 = _mm_loadu_si128((const __m128i *)(s + 3 * src_stride));
+
+    if (rot == 1)
+    {
+        /* bottom row first: column j of the tile, read upward */
+        t0 = r0;
+        r0 = r3;
+        r3 = t0;
+        t0 = r1;
+        r1 = r2;
+        r2 = t0;
+    }
+
+    t0 = _mm_unpacklo_epi32(r0, r1);
+    t1 = _mm_unpacklo_epi32(r2, r3);
+    t2 = _mm_unpackhi_epi32(r0, r1);
+    t3 = _mm_unpackhi_epi32(r2, r3);
+    c[0] = _mm_unpacklo_epi64(t0, t1);
+    c[1] = _mm_unpackhi_epi64(t0, t1);
+    c[2] = _mm_unpacklo_epi64(t2, t3);
+    c[3] = _mm_unpackhi_epi64(t2, t3);
+
+    if (rot == 1)
+    {
+        d = dst + (size_t)x * dst_stride + (h - 4 - y);
+        step = dst_stride;
+    }
+    else
+    {
+        d = dst + (size_t)(w - 1 - x) * dst_stride + y;
+        step = -dst_stride;
+    }
+
+    for (j = 0; j < 4; j++, d += step)
+        _mm_storeu_si128((__m128i *)d, c[j]);
+}
+
+/* 4 pixels of the row y, at x */
+__attribute__((target("sse2")))
+static void image_rotate_180_4(unsigned int *dst, int dst_stride,
+                               const unsigned int *src, int src_stride,
+                               int w, int h, int x, int y)
+{
+    __m128i r;
+
+    r = _mm_loadu_si128((const __m128i *)(src + (size_t)y * src_stride + x));
+    r = _mm_shuffle_epi32(r, _MM_SHUFFLE(0, 1, 2, 3));
+    _mm_storeu_si128((__m128i *)(dst + (size_t)(h - 1 - y) * dst_stride + (w - 4 - x)), r);
+}
+
+#elif defined HAVE_SIMD_NEON
+
+static void image_rotate_tile(unsigned int *dst, int dst_stride,
+                              const unsigned int *src, int src_stride,
+                              int w, int h, int rot, int x, int y)
+{
+    const unsigned int *s = src + (size_t)y * src_stride + x;
+    uint32x4_t r0, r1, r2, r3;
+    uint32x4x2_t t01, t23;
+    uint32x4_t c[4];
+    unsigned int *d;
+    int step;
+    int j;
+
+    r0 = vld1q_u32(s);
+    r1 = vld1q_u32(s + src_stride);
+    r2 = vld1q_u32(s + 2 * src_stride);
+    r3 = vld1q_u32(s + 3 * src_stride);
+
+    if (rot == 1)
+    {
+        t01 = vtrnq_u32(r3, r2);
+        t23 = vtrnq_u32(r1, r0);
+    }
+    else
+    {
+        t01 = vtrnq_u32(r0, r1);
+        t23 = vtrnq_u32(r2, r3);
+    }
+
+    c[0] = vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0]));
+    c[1] = vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1]));
+    c[2] = vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0]));
+    c[3] = vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1]));
+
+    if (rot == 1)
+    {
+        d = dst + (size_t)x * dst_stride + (h - 4 - y);
+        step = dst_stride;
+    }
+    else
+    {
+        d = dst + (size_t)(w - 1 - x) * dst_stride + y;
+        step = -dst_stride;
+    }
+
+    for (j = 0; j < 4; j++, d += step)
+        vst1q_u32(d, c[j]);
+}
+
+static void image_rotate_180_4(unsigned int *dst, int dst_stride,
+                               const unsigned int *src, int src_stride,
+                               int w, int h, int x, int y)
+{
+    uint32x4_t r;
+
+    r = vld1q_u32(src + (size_t)y * src_stride + x);
+    r = vrev64q_u32(r);
+    r = vcombine_u32(vget_high_u32(r), vget_low_u32(r));
+    vst1q_u32(dst + (size_t)(h - 1 - y) * dst_stride + (w - 4 - x), r);
+}
+
+#else
+
+static void image_rotate_tile(unsigned int *dst, int dst_stride,
+                              const unsigned int *src, int src_stride,
+                              int w, int h, int rot, int x, int y)
+{
+    image_rotate_pixels(dst, dst_stride, src, src_stride, w, h, rot,
+                        x, y, x + 4, y + 4);
+}
+
+static void image_rotate_180_4(unsigned int *dst, int dst_stride,
+                               const unsigned int *src, int src_stride,
+                               int w, int h, int x, int y)
+{
+    image_rotate_pixels(dst, dst_stride, src, src_stride, w, h, 2,
+                        x, y, x + 4, y + 1);
+}
+
+#endif
+
+void image_rotate(unsigned int *dst, int dst_stride,
+                  const unsigned int *src, int src_stride,
+                  int w, int h, int rot)
+{
+    int bx;
+    int by;
+    int x;
+    int y;
+
+    rot &= 3;
+
+    if (rot == 0)
+    {
+        for (y = 0; y < h; y++)
+            memcpy(dst + (size_t)y * dst_stride,
+                   src + (size_t)y * src_stride,
+                   w * sizeof(unsigned int));
+        return;
+    }
+
+#if defined HAVE_SIMD_X86
+    if (!image_rotate_sse2)
+    {
+        image_rotate_pixels(dst, dst_stride, src, src_stride,
+                            w, h, rot, 0, 0, w, h);
+        return;
+    }
+#endif
+
+    if (rot == 2)
+    {
+        /* rows stay rows, no need of blocks */
+        for (y = 0; y < h; y++)
+        {
+            for (x = 0; x + 4 <= w; x += 4)
+                image_rotate_180_4(dst, dst_stride, src, src_stride,
+                                   w, h, x, y);
+            image_rotate_pixels(dst, dst_stride, src, src_stride,
+                                w, h, rot, x, y, w, y + 1);
+        }
+        return;
+    }
+
+    for (by = 0; by < h; by += IMAGE_ROTATE_BLOCK)
+    {
+        int ey = (by + IMAGE_ROTATE_BLOCK < h) ? by + IMAGE_ROTATE_BLOCK : h;
+        int ey4 = by + ((ey - by) & ~3);
+
+        for (bx = 0; bx < w; bx += IMAGE_ROTATE_BLOCK)
+        {
+            int ex = (bx + IMAGE_ROTATE_BLOCK < w) ? bx + IMAGE_ROTATE_BLOCK : w;
+            int ex4 = bx + ((ex - bx) & ~3);
+
+            for (y = by; y < ey4; y += 4)
+                for (x = bx; x < ex4; x += 4)
+                    image_rotate_tile(dst, dst_stride, src, src_stride,
+                                      w, h, rot, x, y);
+
+            /* right and bottom borders of the block */
+            image_rotate_pixels(dst, dst_stride, src, src_stride,
+                                w, h, rot, ex4, by, ex, ey4);
+            image_rotate_pixels(dst, dst_stride, src, src_stride,
+                                w, h, rot, bx, ey4, ex, ey);
+        }
+    }
+}
+
+/*************************** Damage ***************************/
+
+void damage_init(Damage *d)
+{
+    memset(d, 0, sizeof(Damage));
+    d->w = 1;
+    d->h = 1;
+    d->current.full = 1;
+    d->previous.full = 1;
+}
+
+/* the content of the buffers is lost */
+void damage_size_set(Damage *d, int w, int h)
+{
+    if ((d->w == w) && (d->h == h))
+        return;
+
+    d->w = w;
+    d->h = h;
+    damage_full(d);
+}
+
+/* the previous frame becomes full when this one is rolled */
+void damage_full(Damage *d)
+{
+    d->current.full = 1;
+    d->current.count = 0;
+}
+
+static long long damage_area(const Damage_Rect *r)
+{
+    return (long long)(r->x1 - r->x0) * (long long)(r->y1 - r->y0);
+}
+
+int damage_rect_intersect(const Damage_Rect *a, const Damage_Rect *b)
+{
+    return (a->x0 < b->x1) && (b->x0 < a->x1) &&
+           (a->y0 < b->y1) && (b->y0 < a->y1);
+}
+
+/* rects are kept disjoint: overlapping ones are always merged */
+void damage_region_add(Damage_Region *g, const Damage_Rect *rect, int w, int h)
+{
+    Damage_Rect r;
+    long long area;
+    unsigned int i;
+
+    if (g->full)
+        return;
+
+    r = *rect;
+    if (r.x0 < 0) r.x0 = 0;
+    if (r.y0 < 0) r.y0 = 0;
+    if (r.x1 > w) r.x1 = w;
+    if (r.y1 > h) r.y1 = h;
+    if ((r.x0 >= r.x1) || (r.y0 >= r.y1))
+        return;
+
+    /* merged rects may now overlap others: until none is merged */
+    for (;;)
+    {
+        long long best_waste;
+        int best;
+
+        best = -1;
+        best_waste = 0;
+        for (i = 0; i < g->count; i++)
+        {
+            const Damage_Rect *e = g->rects + i;
+            Damage_Rect u;
+            long long waste;
+
+            u.x0 = r.x0 < e->x0 ? r.x0 : e->x0;
+            u.y0 = r.y0 < e->y0 ? r.y0 : e->y0;
+            u.x1 = r.x1 > e->x1 ? r.x1 : e->x1;
+            u.y1 = r.y1 > e->y1 ? r.y1 : e->y1;
+            waste = damage_area(&u) - damage_area(&r) - damage_area(e);
+
+            if (damage_rect_intersect(&r, e) || (waste <= DAMAGE_MERGE_SLACK))
+            {
+                best = (int)i;
+                break;
+            }
+
+            /* no room left: the cheapest merge */
+            if ((g->count == DAMAGE_RECTS_MAX) &&
+                ((best < 0) || (waste < best_waste)))
+            {
+                best = (int)i;
+                best_waste = waste;
+            }
+        }
+
+        if (best < 0)
+            break;
+
+        if (g->rects[best].x0 < r.x0) r.x0 = g->rects[best].x0;
+        if (g->rects[best].y0 < r.y0) r.y0 = g->rects[best].y0;
+        if (g->rects[best].x1 > r.x1) r.x1 = g->rects[best].x1;
+        if (g->rects[best].y1 > r.y1) r.y1 = g->rects[best].y1;
+        g->rects[best] = g->rects[--g->count];
+    }
+
+    g->rects[g->count++] = r;
+
+    area = 0;
+    for (i = 0; i < g->count; i++)
+        area += damage_area(g->rects + i);
+    if (area * 100 > (long long)w * h * DAMAGE_FULL_PERCENT)
+    {
+        g->full = 1;
+        g->count = 0;
+    }
+}
+
+void damage_add(Damage *d, const Damage_Rect *r)
+{
+    damage_region_add(&d->current, r, d->w, d->h);
+}
+
+/*
+ * start of a frame: redraw is what must be drawn in the back buffer,
+ * present what has changed since the previous frame. Nothing to draw
+ * if both are empty.
+ */
+void damage_frame(Damage *d, Damage_Region *redraw, Damage_Region *present)
+{
+    unsigned int i;
+
+    *present = d->current;
+    *redraw = d->current;
+    if (d->previous.full)
+    {
+        redraw->full = 1;
+        redraw->count = 0;
+    }
+    for (i = 0; i < d->previous.count; i++)
+        damage_region_add(redraw, d->previous.rects + i, d->w, d->h);
+
+    d->frames++;
+    if (redraw->full)
+    {
+        d->full_frames++;
+        d->pixels += (unsigned long long)d->w * d->h;
+    }
+    for (i = 0; i < redraw->count; i++)
+        d->pixels += (unsigned long long)damage_area(redraw->rects + i);
+
+    d->previous = d->current;
+    d->current.count = 0;
+    d->current.full = 0;
+}
+
+/*
+ * from scene pixels to target pixels, through main_vs: the box of the
+ * transformed corners, with one more pixel around it for the rounding.
+ * Returns 0 if the result is outside of the target.
+ */
+int damage_rect_map(const Damage_Rect *r, const float m[2][4],
+                    int w, int h, Damage_Rect *out)
+{
+    float minx, miny, maxx, maxy;
+    int i;
+
+    minx = miny = 1e30f;
+    maxx = maxy = -1e30f;
+    for (i = 0; i < 4; i++)
+    {
+        float x;
+        float y;
+        float tx;
+        float ty;
+
+        vertex_ndc((float)((i & 1) ? r->x1 : r->x0),
+                   (float)((i & 2) ? r->y1 : r->y0),
+                   w, h, &x, &y);
+        tx = m[0][0] * x + m[0][1] * y + m[0][2];
+        ty = m[1][0] * x + m[1][1] * y + m[1][2];
+        tx = (tx + 1.0f) * 0.5f * (float)w;
+        ty = (1.0f - ty) * 0.5f * (float)h;
+        if (tx < minx) minx = tx;
+        if (tx > maxx) maxx = tx;
+        if (ty < miny) miny = ty;
+        if (ty > maxy) maxy = ty;
+    }
+
+    out->x0 = (int)floorf(minx) - 1;
+    out->y0 = (int)floorf(miny) - 1;
+    out->x1 = (int)ceilf(maxx) + 1;
+    out->y1 = (int)ceilf(maxy) + 1;
+    if (out->x0 < 0) out->x0 = 0;
+    if (out->y0 < 0) out->y0 = 0;
+    if (out->x1 > w) out->x1 = w;
+    if (out->y1 > h) out->y1 = h;
+
+    return (out->x0 < out->x1) && (out->y0 < out->y1);
+}
+
+/*
+ * from target pixels back to scene pixels, m being a rotation: the box
+ * of the corners, one more pixel around it, not clamped to the scene.
+ * Returns 0 if m can not be inverted.
+ */
+int damage_rect_unmap(const Damage_Rect *t, const float m[2][4],
+                      int w, int h, Damage_Rect *out)
+{
+    float minx, miny, maxx, maxy;
+    float det;
+    int i;
+
+    det = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+    if (det == 0.0f)
+        return 0;
+
+    minx = miny = 1e30f;
+    maxx = maxy = -1e30f;
+    for (i = 0; i < 4; i++)
+    {
+        float tx;
+        float ty;
+        float x;
+        float y;
+
+        tx = (float)((i & 1) ? t->x1 : t->x0) * 2.0f / (float)w - 1.0f - m[0][2];
+        ty = 1.0f - (float)((i & 2) ? t->y1 : t->y0) * 2.0f / (float)h - m[1][2];
+        x = (m[1][1] * tx - m[0][1] * ty) / det;
+        y = (m[0][0] * ty - m[1][0] * tx) / det;
+        x = (x + 1.0f) * 0.5f * (float)w;
+        y = (1.0f - y) * 0.5f * (float)h;
+        if (x < minx) minx = x;
+        if (x > maxx) maxx = x;
+        if (y < miny) miny = y;
+        if (y > maxy) maxy = y;
+    }
+
+    out->x0 = (int)floorf(minx) - 1;
+    out->y0 = (int)floorf(miny) - 1;
+    out->x1 = (int)ceilf(maxx) + 1;
+    out->y1 = (int)ceilf(maxy) + 1;
+
+    return 1;
+}
+
+/*************************** Vertex ***************************/
+
+static SHORT vertex16_clamp(int v, int *ok)
+{
+    if (v < -32768)
+    {
+        *ok = 0;
+        return -32768;
+    }
+    if (v > 32767)
+    {
+        *ok = 0;
+        return 32767;
+    }
+
+    return (SHORT)v;
+}
+
+int vertex16_pack(Vertex16 *v, int x, int y,
+                  unsigned char r,
+                  unsigned char g,
+                  unsigned char b,
+                  unsigned char a)
+{
+    int ok = 1;
+
+    v->x = vertex16_clamp(x, &ok);
+    v->y = vertex16_clamp(y, &ok);
+    v->r = r;
+    v->g = g;
+    v->b = b;
+    v->a = a;
+
+    return ok;
+}
+
+void vertex16_unpack(const Vertex16 *v, int *x, int *y,
+                     unsigned char *r,
+                     unsigned char *g,
+                     unsigned char *b,
+                     unsigned char *a)
+{
+    *x = v->x;
+    *y = v->y;
+    *r = v->r;
+    *g = v->g;
+    *b = v->b;
+    *a = v->a;
+}
+
+void vertex16_decode(const Vertex16 *v, Vertex *out)
+{
+    out->x = (float)v->x;
+    out->y = (float)v->y;
+    out->r = v->r;
+    out->g = v->g;
+    out->b = v->b;
+    out->a = v->a;
+}
+
+/* 2 * x - w is exact for integer pixels, then the same division as XF() */
+void vertex_ndc(float x, float y, int w, int h, float *nx, float *ny)
+{
+    *nx = (2.0f * x - (float)w) / (float)w;
+    *ny = ((float)h - 2.0f * y) / (float)h;
+}
+
+/************************** Index **************************/
+
+void index_shared_fill(USHORT *indices)
+{
+    USHORT *q = indices + INDEX_QUADS_FIRST;
+    USHORT *t = indices + INDEX_TRIANGLES_FIRST;
+    unsigned int i;
+
+    for (i = 0; i < INDEX_QUADS_MAX; i++)
+    {
+        unsigned int base = 4U * i;
+
+        q[0] = (USHORT)(base + 0U);
+        q[1] = (USHORT)(base + 1U);
+        q[2] = (USHORT)(base + 3U);
+        q[3] = (USHORT)(base + 1U);
+        q[4] = (USHORT)(base + 2U);
+        q[5] = (USHORT)(base + 3U);
+        q += 6;
+    }
+
+    for (i = 0; i < 3U * INDEX_TRIANGLES_MAX; i++)
+        t[i] = (USHORT)i;
+}
+
+void index16_convert(const unsigned int *in, unsigned int count, USHORT *out)
+{
+    unsigned int i;
+
+    /* INDEX_CUT becomes 0xffff */
+    for (i = 0; i < count; i++)
+        out[i] = (USHORT)in[i];
+}
+
+unsigned int index_draw_get(Prim_Type type,
+                            unsigned int base_vertex,
+                            unsigned int count,
+                            Index_Draw *d)
+{
+    unsigned int max;
+
+    max = (type == PRIM_RECTANGLE) ? INDEX_QUADS_MAX : INDEX_TRIANGLES_MAX;
+    if (count > max)
+        count = max;
+
+    if (type == PRIM_RECTANGLE)
+    {
+        d->index_count = 6U * count;
+        d->first_index = INDEX_QUADS_FIRST;
+    }
+    else
+    {
+        d->index_count = 3U * count;
+        d->first_index = INDEX_TRIANGLES_FIRST;
+    }
+    d->base_vertex = base_vertex;
+
+    return count;
+}
+
+void index_iter_init(Index_Iter *it, Topology topology,
+                     const unsigned int *indices, unsigned int count)
+{
+    it->topology = topology;
+    it->indices = indices;
+    it->count = count;
+    it->pos = 0;
+    it->strip = 0;
+}
+
+int index_iter_next(Index_Iter *it, unsigned int tri[3])
+{
+    const unsigned int *idx = it->indices;
+
+    while (1)
+    {
+        if (it->topology == TOPOLOGY_LIST)
+        {
+            if (it->pos + 3 > it->count)
+                return 0;
+
+            tri[0] = idx[it->pos + 0];
+            tri[1] = idx[it->pos + 1];
+            tri[2] = idx[it->pos + 2];
+            it->pos += 3;
+        }
+        else
+        {
+            unsigned int k;
+
+            if (it->pos >= it->count)
+                return 0;
+
+            if (idx[it->pos] == INDEX_CUT)
+            {
+                it->strip = ++it->pos;
+                continue;
+            }
+
+            k = it->pos - it->strip;
+            it->pos++;
+            if (k < 2)
+                continue;
+
+            /* odd triangles have their first 2 vertices swapped, as D3D */
+            tri[0] = idx[it->strip + k - ((k & 1) ? 1 : 2)];
+            tri[1] = idx[it->strip + k - ((k & 1) ? 2 : 1)];
+            tri[2] = idx[it->strip + k];
+        }
+
+        if ((tri[0] != tri[1]) && (tri[1] != tri[2]) && (tri[0] != tri[2]))
+            return 1;
+    }
+}
+
+unsigned int index_strip_convert(const unsigned int *list, unsigned int count,
+                                 unsigned int *out)
+{
+    unsigned int i;
+    unsigned int n;
+
+    i = 0;
+    n = 0;
+    while (i + 3 <= count)
+    {
+        if (n > 0)
+            out[n++] = INDEX_CUT;
+
+        out[n++] = list[i + 0];
+        out[n++] = list[i + 1];
+        out[n++] = list[i + 2];
+
+        /* a b d then b c d: one more index */
+        if ((i + 6 <= count) &&
+            (list[i + 3] == list[i + 1]) &&
+            (list[i + 5] == list[i + 2]))
+        {
+            out[n++] = list[i + 4];
+            i += 6;
+        }
+        else
+            i += 3;
+    }
+
+    return n;
+}
+
+Topology index_topology_convert(const unsigned int *list, unsigned int count,
+                                unsigned int *out, unsigned int *out_count)
+{
+    unsigned int n;
+
+    n = index_strip_convert(list, count, out);
+    if (n < count)
+    {
+        *out_count = n;
+        return TOPOLOGY_STRIP;
+    }
+
+    memcpy(out, list, count * sizeof(unsigned int));
+    *out_count = count;
+
+    return TOPOLOGY_LIST;
+}
+
+/************************** Grid **************************/
+
+static int array_grow(void **data, unsigned int *size,
+                      unsigned int needed, size_t elt_size)
+{
+    void *tmp;
+    unsigned int s;
+
+    if (needed <= *size)
+        return 1;
+
+    s = *size ? *size : 16U;
+    while (s < needed)
+        s *= 2U;
+
+    tmp = mem_realloc(*data, s * elt_size);
+    if (!tmp)
+        return 0;
+
+    *data = tmp;
+    *size = s;
+
+    return 1;
+}
+
+static int scene_id_cmp(const void *a, const void *b)
+{
+    unsigned int ia = *(const unsigned int *)a;
+    unsigned int ib = *(const unsigned int *)b;
+
+    return (ia > ib) - (ia < ib);
+}
+
+void grid_init(Grid *g)
+{
+    memset(g, 0, sizeof(Grid));
+    g->entries_free = GRID_NONE;
+}
+
+void grid_free(Grid *g)
+{
+    free(g->marks);
+    free(g->large);
+    free(g->cells);
+    free(g->boxes);
+    free(g->entries);
+    free(g->buckets);
+    grid_init(g);
+}
+
+/* cell of a pixel, rounded down for the negative ones */
+static int grid_cell(int v)
+{
+    return (v >= 0) ? (v >> GRID_CELL_BITS) : -((-v - 1) >> GRID_CELL_BITS) - 1;
+}
+
+static unsigned int grid_hash(const Grid *g, int cx, int cy)
+{
+    unsigned int k;
+
+    k = (unsigned int)cx * 0x9e3779b1U ^ (unsigned int)cy * 0x85ebca77U;
+    k ^= k >> 15;
+
+    return k & (g->buckets_count - 1);
+}
+
+/* cells of a box, inclusive. Returns their number */
+static unsigned long long grid_cells_get(const Damage_Rect *box,
+                                   int *cx0, int *cy0, int *cx1, int *cy1)
+{
+    *cx0 = grid_cell(box->x0);
+    *cy0 = grid_cell(box->y0);
+    *cx1 = grid_cell(box->x1 - 1);
+    *cy1 = grid_cell(box->y1 - 1);
+
+    return (unsigned long long)(*cx1 - *cx0 + 1) *
+           (unsigned long long)(*cy1 - *cy0 + 1);
+}
+
+/* twice as many buckets, all the entries are linked again */
+static int grid_rehash(Grid *g, unsigned int needed)
+{
+    unsigned int *buckets;
+    unsigned int count;
+    unsigned int id;
+    unsigned int i;
+
+    count = g->buckets_count ? g->buckets_count : 256U;
+    while (count < needed)
+        count *= 2U;
+    if (count == g->buckets_count)
+        return 1;
+
+    buckets = (unsigned int *)mem_malloc(count * sizeof(unsigned int));
+    if (!buckets)
+        return 0;
+
+    free(g->buckets);
+    g->buckets = buckets;
+    g->buckets_count = count;
+    for (i = 0; i < count; i++)
+        buckets[i] = GRID_NONE;
+
+    for (id = 0; id < g->ids_count; id++)
+    {
+        unsigned int e;
+
+        if (g->cells[id] == GRID_LARGE)
+            continue;
+
+        for (e = g->cells[id]; e != GRID_NONE; e = g->entries[e].id_next)
+        {
+            Grid_Entry *entry = g->entries + e;
+            unsigned int b = grid_hash(g, entry->cx, entry->cy);
+
+            entry->next = buckets[b];
+            entry->prev = GRID_NONE;
+            if (buckets[b] != GRID_NONE)
+                g->entries[buckets[b]].prev = e;
+            buckets[b] = e;
+        }
+    }
+
+    return 1;
+}
+
+/* the cells of id are removed from the buckets, or from the large list */
+static void grid_remove(Grid *g, unsigned int id)
+{
+    unsigned int e;
+    unsigned int i;
+
+    if (g->cells[id] == GRID_LARGE)
+    {
+        for (i = 0; i < g->large_count; i++)
+        {
+            if (g->large[i] == id)
+            {
+                g->large[i] = g->large[--g->large_count];
+                break;
+            }
+        }
+        g->cells[id] = GRID_NONE;
+        return;
+    }
+
+    e = g->cells[id];
+    while (e != GRID_NONE)
+    {
+        Grid_Entry *entry = g->entries + e;
+        unsigned int next;
+
+        /* all the boxes of a cell are in the same chain, it can be long */
+        if (entry->prev != GRID_NONE)
+            g->entries[entry->prev].next = entry->next;
+        else
+            g->buckets[grid_hash(g, entry->cx, entry->cy)] = entry->next;
+        if (entry->next != GRID_NONE)
+            g->entries[entry->next].prev = entry->prev;
+
+        next = entry->id_next;
+        entry->next = g->entries_free;
+        g->entries_free = e;
+        g->entries_used--;
+        e = next;
+    }
+    g->cells[id] = GRID_NONE;
+}
+
+static int grid_insert(Grid *g, unsigned int id, const Damage_Rect *box)
+{
+    unsigned long long cells;
+    unsigned int count;
+    unsigned int needed;
+    int cx0, cy0, cx1, cy1;
+    int cx, cy;
+
+    cells = grid_cells_get(box, &cx0, &cy0, &cx1, &cy1);
+    if (cells > GRID_CELLS_MAX)
+    {
+        if (!array_grow((void **)&g->large, &g->large_size,
+                        g->large_count + 1, sizeof(unsigned int)))
+            return 0;
+        g->large[g->large_count++] = id;
+        g->cells[id] = GRID_LARGE;
+        return 1;
+    }
+
+    /* the removed entries are reused before the array grows */
+    count = (unsigned int)cells;
+    needed = g->entries_used + count;
+    if (!grid_rehash(g, needed) ||
+        !array_grow((void **)&g->entries, &g->entries_size,
+                    g->entries_count + count, sizeof(Grid_Entry)))
+        return 0;
+
+    for (cy = cy0; cy <= cy1; cy++)
+    {
+        for (cx = cx0; cx <= cx1; cx++)
+        {
+            Grid_Entry *entry;
+            unsigned int e;
+            unsigned int b;
+
+            if (g->entries_free != GRID_NONE)
+            {
+                e = g->entries_free;
+                g->entries_free = g->entries[e].next;
+            }
+            else
+                e = g->entries_count++;
+
+            b = grid_hash(g, cx, cy);
+            entry = g->entries + e;
+            entry->cx = cx;
+            entry->cy = cy;
+            entry->id = id;
+            entry->next = g->buckets[b];
+            entry->prev = GRID_NONE;
+            entry->id_next = g->cells[id];
+            if (g->buckets[b] != GRID_NONE)
+                g->entries[g->buckets[b]].prev = e;
+            g->buckets[b] = e;
+            g->cells[id] = e;
+            g->entries_used++;
+        }
+    }
+
+    return 1;
+}
+
+int grid_set(Grid *g, unsigned int id, const Damage_Rect *box)
+{
+    if (id >= g->ids_count)
+    {
+        unsigned int count = id + 1;
+        unsigned int i;
+
+        if (!array_grow((void **)&g->boxes, &g->boxes_size,
+                        count, sizeof(Damage_Rect)) ||
+            !array_grow((void **)&g->cells, &g->cells_size,
+                        count, sizeof(unsigned int)) ||
+            !array_grow((void **)&g->marks, &g->marks_size,
+                        (count + 63U) / 64U, sizeof(unsigned long long)))
+            return 0;
+
+        for (i = g->ids_count; i < count; i++)
+        {
+            memset(g->boxes + i, 0, sizeof(Damage_Rect));
+            g->cells[i] = GRID_NONE;
+        }
+        for (i = (g->ids_count + 63U) / 64U; i < (count + 63U) / 64U; i++)
+            g->marks[i] = 0;
+        g->ids_count = count;
+    }
+
+    if (g->cells[id] != GRID_NONE)
+    {
+        const Damage_Rect *old = g->boxes + id;
+        int ox0, oy0, ox1, oy1;
+        int cx0, cy0, cx1, cy1;
+
+        /* same cells: only the box changes */
+        grid_cells_get(old, &ox0, &oy0, &ox1, &oy1);
+        grid_cells_get(box, &cx0, &cy0, &cx1, &cy1);
+        if ((ox0 == cx0) && (oy0 == cy0) && (ox1 == cx1) && (oy1 == cy1))
+        {
+            g->boxes[id] = *box;
+            return 1;
+        }
+        grid_remove(g, id);
+    }
+
+    g->boxes[id] = *box;
+
+    return grid_insert(g, id, box);
+}
+
+static int grid_mark(Grid *g, unsigned int id)
+{
+    unsigned long long bit = 1ULL << (id & 63U);
+
+    if (g->marks[id / 64U] & bit)
+        return 0;
+
+    g->marks[id / 64U] |= bit;
+    return 1;
+}
+
+/*
+ * the ids are collected when first seen in a cell, then sorted, or read
+ * back from the marks if there are many. The marks are cleared for the
+ * next query. A query over more cells than primitives tests all boxes.
+ */
+unsigned int grid_query(Grid *g, const Damage_Rect *r, unsigned int *ids)
+{
+    unsigned int count;
+    unsigned int i;
+    int cx0, cy0, cx1, cy1;
+    int cx, cy;
+
+    count = 0;
+    if ((r->x0 >= r->x1) || (r->y0 >= r->y1) || (g->ids_count == 0))
+        return 0;
+
+    if ((grid_cells_get(r, &cx0, &cy0, &cx1, &cy1) > g->ids_count) ||
+        !g->buckets_count)
+    {
+        for (i = 0; i < g->ids_count; i++)
+        {
+            if ((g->cells[i] != GRID_NONE) &&
+                damage_rect_intersect(g->boxes + i, r))
+                ids[count++] = i;
+        }
+        return count;
+    }
+
+    for (cy = cy0; cy <= cy1; cy++)
+    {
+        for (cx = cx0; cx <= cx1; cx++)
+        {
+            unsigned int e;
+
+            for (e = g->buckets[grid_hash(g, cx, cy)];
+                 e != GRID_NONE;
+                 e = g->entries[e].next)
+            {
+                const Grid_Entry *entry = g->entries + e;
+
+                if ((entry->cx == cx) && (entry->cy == cy) &&
+                    damage_rect_intersect(g->boxes + entry->id, r) &&
+                    grid_mark(g, entry->id))
+                    ids[count++] = entry->id;
+            }
+        }
+    }
+
+    for (i = 0; i < g->large_count; i++)
+    {
+        if (damage_rect_intersect(g->boxes + g->large[i], r) &&
+            grid_mark(g, g->large[i]))
+            ids[count++] = g->large[i];
+    }
+
+    if (count > g->ids_count / 64U)
+    {
+        unsigned int words = (g->ids_count + 63U) / 64U;
+
+        count = 0;
+        for (i = 0; i < words; i++)
+        {
+            unsigned long long m = g->marks[i];
+
+            g->marks[i] = 0;
+            while (m)
+            {
+                ids[count++] = i * 64U + (unsigned int)__builtin_ctzll(m);
+                m &= m - 1;
+            }
+        }
+        return count;
+    }
+
+    for (i = 0; i < count; i++)
+        g->marks[ids[i] / 64U] = 0;
+    qsort(ids, count, sizeof(unsigned int), scene_id_cmp);
+
+    return count;
+}
+
+/************************** Scene **************************/
+
+Scene *scene_new(void)
+{
+    Scene *s;
+
+    s = (Scene *)mem_calloc(1, sizeof(Scene));
+    if (!s)
+        return NULL;
+
+    s->w = 1;
+    s->h = 1;
+    s->format = VERTEX_FORMAT_FLOAT;
+    s->vertex_size = sizeof(Vertex);
+    s->topology = TOPOLOGY_LIST;
+    s->topology_set = TOPOLOGY_AUTO;
+    s->cull = 1;
+    s->occlusion = 1;
+    damage_init(&s->damage);
+    grid_init(&s->grid);
+
+    return s;
+}
+
+void scene_free(Scene *s)
+{
+    if (!s)
+        return;
+
+    grid_free(&s->grid);
+    free(s->coverage);
+    free(s->visible);
+    free(s->ranges);
+    free(s->dirty);
+    free(s->indices);
+    free(s->vertices);
+    free(s->prims);
+    free(s);
+}
+
+static void scene_prim_dirty(Scene *s, unsigned int id)
+{
+    Prim *p;
+
+    p = s->prims + id;
+    if (p->dirty || s->dirty_all)
+        return;
+
+    if (!array_grow((void **)&s->dirty, &s->dirty_size,
+                    s->dirty_count + 1, sizeof(unsigned int)))
+    {
+        /* no memory to track it: everything is regenerated */
+        s->dirty_all = 1;
+        return;
+    }
+
+    p->dirty = 1;
+    s->dirty[s->dirty_count++] = id;
+}
+
+/* bounding box, in pixels */
+void scene_prim_box(const Prim *p, Damage_Rect *r)
+{
+    int i;
+
+    if (p->type == PRIM_RECTANGLE)
+    {
+        r->x0 = p->p[2] < 0 ? p->p[0] + p->p[2] : p->p[0];
+        r->y0 = p->p[3] < 0 ? p->p[1] + p->p[3] : p->p[1];
+        r->x1 = (p->p[2] < 0 ? p->p[0] : p->p[0] + p->p[2]) + 1;
+        r->y1 = (p->p[3] < 0 ? p->p[1] : p->p[1] + p->p[3]) + 1;
+        return;
+    }
+
+    r->x0 = r->x1 = p->p[0];
+    r->y0 = r->y1 = p->p[1];
+    for (i = 1; i < 3; i++)
+    {
+        if (p->p[2 * i] < r->x0) r->x0 = p->p[2 * i];
+        if (p->p[2 * i] > r->x1) r->x1 = p->p[2 * i];
+        if (p->p[2 * i + 1] < r->y0) r->y0 = p->p[2 * i + 1];
+        if (p->p[2 * i + 1] > r->y1) r->y1 = p->p[2 * i + 1];
+    }
+    r->x1++;
+    r->y1++;
+}
+
+/* before and after a modification, the old box is skipped on the first set */
+static void scene_prim_damage(Scene *s, Prim *p)
+{
+    Damage_Rect r;
+
+    if (!p->placed)
+        return;
+
+    scene_prim_box(p, &r);
+    damage_add(&s->damage, &r);
+}
+
+/* after a modification, the box of the primitive is moved in the grid */
+static void scene_prim_grid_set(Scene *s, unsigned int id)
+{
+    Damage_Rect r;
+
+    s->visible_clean = 0;
+    if (s->grid_failed)
+        return;
+
+    scene_prim_box(s->prims + id, &r);
+    if (!grid_set(&s->grid, id, &r))
+    {
+        /* no memory to track it: everything is drawn */
+        s->grid_failed = 1;
+        grid_free(&s->grid);
+    }
+}
+
+#define SCENE_PRIM_INDICES_MAX 6U
+
+/*
+ * the indices of a primitive in topology, written in out. In strips,
+ * the cut is part of the primitive, so that the indices of consecutive
+ * primitives are drawn at once.
+ */
+static unsigned int scene_prim_indices(const Prim *p, Topology topology,
+                                       unsigned int *out)
+{
+    static const unsigned int quad[6] = { 0, 1, 3, 1, 2, 3 };
+    unsigned int list[6];
+    unsigned int count;
+    unsigned int i;
+
+    count = (p->type == PRIM_RECTANGLE) ? 6U : 3U;
+    for (i = 0; i < count; i++)
+        list[i] = p->first_vertex + ((p->type == PRIM_RECTANGLE) ? quad[i] : i);
+
+    if (topology == TOPOLOGY_LIST)
+    {
+        memcpy(out, list, count * sizeof(unsigned int));
+        return count;
+    }
+
+    count = index_strip_convert(list, count, out);
+    out[count++] = INDEX_CUT;
+
+    return count;
+}
+
+/*
+ * the topology with fewer indices, or the one asked for. Changing it
+ * rebuilds all the indices, so it is only done when the other one
+ * saves more than 1/16 of them.
+ */
+static void scene_topology_update(Scene *s)
+{
+    Topology topology;
+    unsigned int rects;
+    unsigned int triangles;
+    unsigned int count;
+    unsigned int i;
+
+    topology = s->topology_set;
+    rects = s->rects_count;
+    triangles = s->prims_count - s->rects_count;
+    if (topology == TOPOLOGY_AUTO)
+    {
+        unsigned int list = 3U * triangles + 6U * rects;
+        unsigned int strip = 4U * triangles + 5U * rects;
+
+        topology = s->topology;
+        if ((topology == TOPOLOGY_LIST) && (strip + strip / 16U < list))
+            topology = TOPOLOGY_STRIP;
+        else if ((topology == TOPOLOGY_STRIP) && (list + list / 16U < strip))
+            topology = TOPOLOGY_LIST;
+    }
+
+    if (topology == s->topology)
+        return;
+
+    count = (topology == TOPOLOGY_LIST) ?
+        3U * triangles + 6U * rects : 4U * triangles + 5U * rects;
+    if (!array_grow((void **)&s->indices, &s->indices_size,
+                    count, sizeof(unsigned int)))
+        return;
+
+    s->topology = topology;
+    s->indices_count = 0;
+    for (i = 0; i < s->prims_count; i++)
+    {
+        Prim *p = s->prims + i;
+
+        p->first_index = s->indices_count;
+        p->index_count = scene_prim_indices(p, topology,
+                                            s->indices + s->indices_count);
+        s->indices_count += p->index_count;
+    }
+
+    /* everything is uploaded again */
+    s->indices_clean = 0;
+}
+
+int scene_topology_set(Scene *s, Topology topology)
+{
+    s->topology_set = topology;
+    scene_topology_update(s);
+
+    return (topology == TOPOLOGY_AUTO) || (s->topology == topology);
+}
+
+static int scene_prim_add(Scene *s, Prim_Type type,
+                          unsigned int vertex_count)
+{
+    Prim *p;
+
+    if (!array_grow((void **)&s->prims, &s->prims_size,
+                    s->prims_count + 1, sizeof(Prim)) ||
+        !array_grow((void **)&s->visible, &s->visible_size,
+                    s->prims_count + 1, sizeof(unsigned int)) ||
+        !array_grow((void **)&s->vertices, &s->vertices_size,
+                    s->vertices_count + vertex_count, s->vertex_size) ||
+        !array_grow((void **)&s->indices, &s->indices_size,
+                    s->indices_count + SCENE_PRIM_INDICES_MAX,
+                    sizeof(unsigned int)))
+        return -1;
+
+    p = s->prims + s->prims_count;
+    memset(p, 0, sizeof(Prim));
+    p->type = type;
+    p->first_vertex = s->vertices_count;
+    p->first_index = s->indices_count;
+
+    /* indices only change with the topology */
+    p->index_count = scene_prim_indices(p, s->topology,
+                                        s->indices + s->indices_count);
+
+    s->vertices_count += vertex_count;
+    s->indices_count += p->index_count;
+    if (type == PRIM_RECTANGLE)
+        s->rects_count++;
+
+    return (int)s->prims_count++;
+}
+
+int scene_triangle_add(Scene *s,
+                       int x1, int y1,
+                       int x2, int y2,
+                       int x3, int y3,
+                       unsigned char r,
+                       unsigned char g,
+                       unsigned char b,
+                       unsigned char a)
+{
+    int id;
+
+    id = scene_prim_add(s, PRIM_TRIANGLE, 3U);
+    if (id < 0)
+        return -1;
+
+    scene_triangle_set(s, id, x1, y1, x2, y2, x3, y3, r, g, b, a);
+
+    return id;
+}
+
+int scene_rectangle_add(Scene *s,
+                        int x, int y,
+                        int w, int h,
+                        unsigned char r,
+                        unsigned char g,
+                        unsigned char b,
+                        unsigned char a)
+{
+    /* triangle upper left, then triangle bottom right */
+    int id;
+
+    id = scene_prim_add(s, PRIM_RECTANGLE, 4U);
+    if (id < 0)
+        return -1;
+
+    scene_rectangle_set(s, id, x, y, w, h, r, g, b, a);
+
+    return id;
+}
+
+void scene_triangle_set(Scene *s, int id,
+                        int x1, int y1,
+                        int x2, int y2,
+                        int x3, int y3,
+                        unsigned char r,
+                        unsigned char g,
+                        unsigned char b,
+                        unsigned char a)
+{
+    Prim *p;
+
+    if ((id < 0) || ((unsigned int)id >= s->prims_count))
+        return;
+
+    p = s->prims + id;
+    if (p->type != PRIM_TRIANGLE)
+        return;
+
+    scene_prim_damage(s, p);
+    p->p[0] = x1;
+    p->p[1] = y1;
+    p->p[2] = x2;
+    p->p[3] = y2;
+    p->p[4] = x3;
+    p->p[5] = y3;
+    p->r = r;
+    p->g = g;
+    p->b = b;
+    p->a = a;
+    p->placed = 1;
+    scene_prim_damage(s, p);
+    scene_prim_dirty(s, id);
+    scene_prim_grid_set(s, id);
+}
+
+void scene_rectangle_set(Scene *s, int id,
+                         int x, int y,
+                         int w, int h,
+                         unsigned char r,
+                         unsigned char g,
+                         unsigned char b,
+                         unsigned char a)
+{
+    Prim *p;
+
+    if ((id < 0) || ((unsigned int)id >= s->prims_count))
+        return;
+
+    p = s->prims + id;
+    if (p->type != PRIM_RECTANGLE)
+        return;
+
+    scene_prim_damage(s, p);
+    p->p[0] = x;
+    p->p[1] = y;
+    p->p[2] = w;
+    p->p[3] = h;
+    p->r = r;
+    p->g = g;
+    p->b = b;
+    p->a = a;
+    p->placed = 1;
+    scene_prim_damage(s, p);
+    scene_prim_dirty(s, id);
+    scene_prim_grid_set(s, id);
+}
+
+void scene_size_set(Scene *s, int w, int h)
+{
+    if ((s->w == w) && (s->h == h))
+        return;
+
+    /* the vertices are in pixels: only the damage depends on the size */
+    s->w = w;
+    s->h = h;
+    damage_size_set(&s->damage, w, h);
+}
+
+void scene_cull_set(Scene *s, int cull)
+{
+    s->cull = !!cull;
+    s->visible_clean = 0;
+}
+
+void scene_occlusion_set(Scene *s, int occlusion)
+{
+    s->occlusion = !!occlusion;
+    s->visible_clean = 0;
+}
+
+/*
+ * occlusion: the visible primitives are walked front to back, that is
+ * from the last one, over a mask of blocks of 8x8 scene pixels covering
+ * the target. A rectangle of alpha 255 sets the blocks strictly inside
+ * it, so that no sample on its edges is in them, and a primitive whose
+ * box in the target only touches set blocks is dropped. Triangles and
+ * translucent rectangles never occlude.
+ */
+
+#define OCCLUSION_BLOCK_BITS 3
+#define OCCLUSION_BLOCK_SIZE (1 << OCCLUSION_BLOCK_BITS)
+
+/* block of a pixel, rounded down for the negative ones */
+static int scene_block(int v)
+{
+    return (v >= 0) ? (v >> OCCLUSION_BLOCK_BITS) :
+        -((-v - 1) >> OCCLUSION_BLOCK_BITS) - 1;
+}
+
+/* bits lo to hi of a word of the mask */
+static unsigned long long scene_coverage_bits(int lo, int hi)
+{
+    unsigned long long m = ~0ULL << lo;
+
+    if (hi < 63)
+        m &= (2ULL << hi) - 1ULL;
+
+    return m;
+}
+
+/* 1 if all the blocks are set, or if set is 1, sets them */
+static int scene_coverage_span(unsigned long long *coverage, unsigned int stride,
+                               int bx0, int by0, int bx1, int by1, int set)
+{
+    int by;
+
+    for (by = by0; by <= by1; by++)
+    {
+        unsigned long long *row = coverage + (size_t)by * stride;
+        int w;
+
+        for (w = bx0 >> 6; w <= (bx1 >> 6); w++)
+        {
+            unsigned long long m;
+
+            m = scene_coverage_bits((w == (bx0 >> 6)) ? (bx0 & 63) : 0,
+                                    (w == (bx1 >> 6)) ? (bx1 & 63) : 63);
+            if (set)
+                row[w] |= m;
+            else if ((row[w] & m) != m)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* r is the target in scene pixels, the order of visible is kept */
+static void scene_occlusion_cull(Scene *s, const Damage_Rect *r)
+{
+    unsigned int stride;
+    unsigned int count;
+    unsigned int k;
+    unsigned int i;
+    int bw;
+    int bh;
+
+    s->occluded_count = 0;
+    bw = scene_block(r->x1 - r->x0 - 1) + 1;
+    bh = scene_block(r->y1 - r->y0 - 1) + 1;
+    if ((bw <= 0) || (bh <= 0))
+        return;
+
+    /* nothing is dropped without memory for the mask */
+    stride = ((unsigned int)bw + 63U) / 64U;
+    if (!array_grow((void **)&s->coverage, &s->coverage_size,
+                    stride * (unsigned int)bh, sizeof(unsigned long long)))
+        return;
+    memset(s->coverage, 0, stride * (size_t)bh * sizeof(unsigned long long));
+
+    count = s->visible_count;
+    k = count;
+    for (i = count; i-- > 0;)
+    {
+        unsigned int id = s->visible[i];
+        const Prim *p = s->prims + id;
+        Damage_Rect box;
+        int x0, y0, x1, y1;
+
+        /* only the part in the target can be seen */
+        scene_prim_box(p, &box);
+        x0 = (box.x0 > r->x0) ? box.x0 : r->x0;
+        y0 = (box.y0 > r->y0) ? box.y0 : r->y0;
+        x1 = (box.x1 < r->x1) ? box.x1 : r->x1;
+        y1 = (box.y1 < r->y1) ? box.y1 : r->y1;
+        if ((x0 < x1) && (y0 < y1) &&
+            scene_coverage_span(s->coverage, stride,
+                                scene_block(x0 - r->x0), scene_block(y0 - r->y0),
+                                scene_block(x1 - 1 - r->x0),
+                                scene_block(y1 - 1 - r->y0), 0))
+        {
+            s->occluded_count++;
+            continue;
+        }
+
+        /* k > i: the kept ones are written over the ones already read */
+        s->visible[--k] = id;
+
+        if ((p->type != PRIM_RECTANGLE) || (p->a != 255))
+            continue;
+
+        /*
+         * the rectangle is box.x0 to box.x1 - 1: blocks starting after
+         * box.x0, ending before box.x1 - 1
+         */
+        x0 = scene_block(box.x0 - r->x0 + OCCLUSION_BLOCK_SIZE);
+        y0 = scene_block(box.y0 - r->y0 + OCCLUSION_BLOCK_SIZE);
+        x1 = scene_block(box.x1 - 1 - r->x0) - 1;
+        y1 = scene_block(box.y1 - 1 - r->y0) - 1;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 >= bw) x1 = bw - 1;
+        if (y1 >= bh) y1 = bh - 1;
+        if ((x0 <= x1) && (y0 <= y1))
+            scene_coverage_span(s->coverage, stride, x0, y0, x1, y1, 1);
+    }
+
+    memmove(s->visible, s->visible + k, (count - k) * sizeof(unsigned int));
+    s->visible_count = count - k;
+}
+
+/*
+ * the primitives whose box intersects the target, mapped back in scene
+ * pixels through the rotation: with rotations 1 and 3, the target does
+ * not cover the same part of the scene. Those fully covered by opaque
+ * rectangles over them are then dropped. The result is kept while no
+ * primitive is set and the target is the same.
+ */
+void scene_visible_update(Scene *s, const float m[2][4])
+{
+    Damage_Rect t;
+    Damage_Rect r;
+    unsigned int i;
+
+    t.x0 = 0;
+    t.y0 = 0;
+    t.x1 = s->w;
+    t.y1 = s->h;
+    if (!damage_rect_unmap(&t, m, s->w, s->h, &r))
+    {
+        for (i = 0; i < s->prims_count; i++)
+            s->visible[i] = i;
+        s->visible_count = s->prims_count;
+        s->occluded_count = 0;
+        s->visible_clean = 0;
+        return;
+    }
+
+    if (s->visible_clean &&
+        (r.x0 == s->visible_rect.x0) && (r.y0 == s->visible_rect.y0) &&
+        (r.x1 == s->visible_rect.x1) && (r.y1 == s->visible_rect.y1))
+        return;
+
+    if (s->cull && !s->grid_failed)
+        s->visible_count = grid_query(&s->grid, &r, s->visible);
+    else
+    {
+        for (i = 0; i < s->prims_count; i++)
+            s->visible[i] = i;
+        s->visible_count = s->prims_count;
+    }
+
+    s->occluded_count = 0;
+    if (s->occlusion)
+        scene_occlusion_cull(s, &r);
+
+    s->visible_rect = r;
+    s->visible_clean = 1;
+}
+
+/* all the vertices are regenerated in the new format */
+int scene_vertex_format_set(Scene *s, Vertex_Format format)
+{
+    size_t size;
+
+    if (s->format == format)
+        return 1;
+
+    size = (format == VERTEX_FORMAT_SINT16) ? sizeof(Vertex16) : sizeof(Vertex);
+    if (s->vertices_size)
+    {
+        void *tmp;
+
+        tmp = mem_realloc(s->vertices, s->vertices_size * size);
+        if (!tmp)
+            return 0;
+        s->vertices = tmp;
+    }
+
+    s->format = format;
+    s->vertex_size = (unsigned int)size;
+    s->dirty_all = 1;
+
+    return 1;
+}
+
+/* positions of the vertices of a primitive, in pixels */
+static unsigned int scene_prim_points_get(const Prim *p, int *x, int *y)
+{
+    if (p->type == PRIM_TRIANGLE)
+    {
+        x[0] = p->p[0];
+        y[0] = p->p[1];
+        x[1] = p->p[2];
+        y[1] = p->p[3];
+        x[2] = p->p[4];
+        y[2] = p->p[5];
+        return 3U;
+    }
+
+    /* upper left, upper right, bottom right, bottom left */
+    x[0] = p->p[0];
+    y[0] = p->p[1];
+    x[1] = p->p[0] + p->p[2];
+    y[1] = p->p[1];
+    x[2] = p->p[0] + p->p[2];
+    y[2] = p->p[1] + p->p[3];
+    x[3] = p->p[0];
+    y[3] = p->p[1] + p->p[3];
+    return 4U;
+}
+
+static void scene_prim_vertices_set(Scene *s, const Prim *p)
+{
+    Vertex *v;
+    int x[4];
+    int y[4];
+    unsigned int count;
+    unsigned int i;
+
+    count = scene_prim_points_get(p, x, y);
+    if (s->format == VERTEX_FORMAT_SINT16)
+    {
+        Vertex16 *v16 = (Vertex16 *)s->vertices + p->first_vertex;
+
+        for (i = 0; i < count; i++)
+            vertex16_pack(v16 + i, x[i], y[i], p->r, p->g, p->b, p->a);
+        return;
+    }
+
+    v = (Vertex *)s->vertices + p->first_vertex;
+    for (i = 0; i < count; i++)
+    {
+        v[i].x = (float)x[i];
+        v[i].y = (float)y[i];
+        v[i].r = p->r;
+        v[i].g = p->g;
+        v[i].b = p->b;
+        v[i].a = p->a;
+    }
+}
+
+/* regenerate all the vertices */
+static void scene_vertices_set(Scene *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->prims_count; i++)
+        scene_prim_vertices_set(s, s->prims + i);
+}
+
+static unsigned int scene_prim_vertex_count(const Prim *p)
+{
+    return (p->type == PRIM_TRIANGLE) ? 3U : 4U;
+}
+
+/*
+ * above 1 modified primitive in SCENE_DIRTY_FULL, sorting them and
+ * uploading their ranges one by one is slower than one full update
+ */
+#define SCENE_DIRTY_FULL 4U
+
+/*
+ * regenerate the vertices of the modified primitives and compute the
+ * vertex ranges to upload. The cost is in the number of modified
+ * primitives, except when everything is dirty (format change, or too
+ * many modified primitives).
+ */
+int scene_update(Scene *s)
+{
+    unsigned int i;
+
+    s->ranges_count = 0;
+
+    scene_topology_update(s);
+
+    if (!s->dirty_all && (s->dirty_count == 0))
+        return 1;
+
+    if (s->dirty_count > s->prims_count / SCENE_DIRTY_FULL)
+        s->dirty_all = 1;
+
+    /* one range per dirty primitive at most */
+    if (!array_grow((void **)&s->ranges, &s->ranges_size,
+                    s->dirty_all ? 1U : s->dirty_count,
+                    sizeof(Scene_Range)))
+    {
+        if (!s->ranges_size)
+            return 0;
+        s->dirty_all = 1;
+    }
+
+    if (s->dirty_all)
+    {
+        scene_vertices_set(s);
+
+        if (s->vertices_count > 0)
+        {
+            s->ranges[0].first = 0;
+            s->ranges[0].count = s->vertices_count;
+            s->ranges_count = 1;
+        }
+        return 1;
+    }
+
+    /* adjacent primitives have adjacent vertices: sort to merge them */
+    qsort(s->dirty, s->dirty_count, sizeof(unsigned int), scene_id_cmp);
+
+    for (i = 0; i < s->dirty_count; i++)
+    {
+        const Prim *p;
+        Scene_Range *last;
+
+        p = s->prims + s->dirty[i];
+        scene_prim_vertices_set(s, p);
+
+        last = s->ranges_count ? s->ranges + s->ranges_count - 1 : NULL;
+        if (last && (last->first + last->count == p->first_vertex))
+            last->count += scene_prim_vertex_count(p);
+        else
+        {
+            s->ranges[s->ranges_count].first = p->first_vertex;
+            s->ranges[s->ranges_count].count = scene_prim_vertex_count(p);
+            s->ranges_count++;
+        }
+    }
+
+    return 1;
+}
+
+/* call once the ranges and the new indices have been uploaded */
+void scene_clean(Scene *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->dirty_count; i++)
+        s->prims[s->dirty[i]].dirty = 0;
+
+    s->dirty_count = 0;
+    s->ranges_count = 0;
+    s->indices_clean = s->indices_count;
+    s->dirty_all = 0;
+}
+
+void rect_instance_set(Rect_Instance *ri,
+                       int x, int y,
+                       int rw, int rh,
+                       unsigned char r,
+                       unsigned char g,
+                       unsigned char b,
+                       unsigned char a)
+{
+    ri->x = (float)x;
+    ri->y = (float)y;
+    ri->w = (float)rw;
+    ri->h = (float)rh;
+    ri->r = r;
+    ri->g = g;
+    ri->b = b;
+    ri->a = a;
+}
+
+/* fill ri with the visible rectangles of the scene, in scene order */
+unsigned int scene_rect_instances_build(const Scene *s, Rect_Instance *ri)
+{
+    unsigned int count;
+    unsigned int i;
+
+    count = 0;
+    for (i = 0; i < s->visible_count; i++)
+    {
+        const Prim *p = s->prims + s->visible[i];
+
+        if (p->type != PRIM_RECTANGLE)
+            continue;
+
+        rect_instance_set(ri + count,
+                          p->p[0], p->p[1], p->p[2], p->p[3],
+                          p->r, p->g, p->b, p->a);
+        count++;
+    }
+
+    return count;
+}
+
+/************************** Batch **************************/
+
+void batch_init(Batch *bt, const Batch_Ops *ops, void *data,
+                unsigned int vertices_size)
+{
+    memset(bt, 0, sizeof(Batch));
+    bt->ops = ops;
+    bt->data = data;
+    bt->vertices_size = vertices_size;
+    /* the first map of a dynamic buffer must discard */
+    bt->discard = 1;
+}
+
+void batch_begin(Batch *bt)
+{
+    /* appending goes on where the previous frame has stopped */
+    bt->draws = 0;
+    bt->wraps = 0;
+}
+
+/* unmap the ring and draw what has been appended since the last draw */
+void batch_flush(Batch *bt)
+{
+    unsigned int base;
+    unsigned int vertices;
+    unsigned int count;
+
+    if (bt->vertices)
+    {
+        bt->ops->unmap(bt->data);
+        bt->vertices = NULL;
+    }
+
+    base = bt->draw_base_vertex;
+    vertices = (bt->draw_type == PRIM_RECTANGLE) ? 4U : 3U;
+    count = (bt->vertex_pos - base) / vertices;
+    while (count > 0)
+    {
+        Index_Draw d;
+        unsigned int n;
+
+        n = index_draw_get(bt->draw_type, base, count, &d);
+        bt->ops->draw(bt->data, d.index_count, d.first_index, d.base_vertex);
+        bt->draws++;
+        base += vertices * n;
+        count -= n;
+    }
+
+    bt->draw_base_vertex = bt->vertex_pos;
+}
+
+/* the vertices of the next primitive of type, 3 or 4, NULL on failure */
+static Vertex *batch_reserve(Batch *bt, Prim_Type type, unsigned int *count)
+{
+    Vertex *v;
+
+    /* the pending draw type is the one of its first primitive */
+    if (bt->vertex_pos == bt->draw_base_vertex)
+        bt->draw_type = type;
+    else if ((bt->draw_type == PRIM_TRIANGLE) && (type == PRIM_RECTANGLE))
+    {
+        batch_flush(bt);
+        bt->draw_type = PRIM_RECTANGLE;
+    }
+    *count = (bt->draw_type == PRIM_RECTANGLE) ? 4U : 3U;
+
+    if (bt->vertices_size < 4U)
+        return NULL;
+
+    if (bt->vertex_pos + *count > bt->vertices_size)
+    {
+        /* wrap: draw what is pending, then restart at the beginning */
+        batch_flush(bt);
+        bt->vertex_pos = 0;
+        bt->draw_base_vertex = 0;
+        bt->discard = 1;
+        bt->wraps++;
+        /* a new draw, of the type of this primitive */
+        bt->draw_type = type;
+        *count = (type == PRIM_RECTANGLE) ? 4U : 3U;
+    }
+
+    if (!bt->vertices)
+    {
+        bt->vertices = (Vertex *)bt->ops->map(bt->data, bt->discard);
+        bt->discard = 0;
+        if (!bt->vertices)
+        {
+            batch_flush(bt);
+            return NULL;
+        }
+    }
+
+    v = bt->vertices + bt->vertex_pos;
+    bt->vertex_pos += *count;
+
+    return v;
+}
+
+static void batch_vertex_set(Vertex *v, int x, int y,
+                             unsigned char r,
+                             unsigned char g,
+                             unsigned char b,
+                             unsigned char a)
+{
+    v->x = (float)x;
+    v->y = (float)y;
+    v->r = r;
+    v->g = g;
+    v->b = b;
+    v->a = a;
+}
+
+int batch_triangle(Batch *bt,
+                   int x1, int y1,
+                   int x2, int y2,
+                   int x3, int y3,
+                   unsigned char r,
+                   unsigned char g,
+                   unsigned char b,
+                   unsigned char a)
+{
+    Vertex *v;
+    unsigned int count;
+
+    v = batch_reserve(bt, PRIM_TRIANGLE, &count);
+    if (!v)
+        return 0;
+
+    batch_vertex_set(v + 0, x1, y1, r, g, b, a);
+    batch_vertex_set(v + 1, x2, y2, r, g, b, a);
+    batch_vertex_set(v + 2, x3, y3, r, g, b, a);
+    /* in a quad, the second triangle 1 2 3 is degenerate */
+    if (count == 4U)
+        batch_vertex_set(v + 3, x3, y3, r, g, b, a);
+
+    return 1;
+}
+
+int batch_rectangle(Batch *bt,
+                    int x, int y,
+                    int w, int h,
+                    unsigned char r,
+                    unsigned char g,
+                    unsigned char b,
+                    unsigned char a)
+{
+    Vertex *v;
+    unsigned int count;
+
+    v = batch_reserve(bt, PRIM_RECTANGLE, &count);
+    if (!v)
+        return 0;
+
+    /* upper left, upper right, bottom right, bottom left */
+    batch_vertex_set(v + 0, x, y, r, g, b, a);
+    batch_vertex_set(v + 1, x + w, y, r, g, b, a);
+    batch_vertex_set(v + 2, x + w, y + h, r, g, b, a);
+    batch_vertex_set(v + 3, x, y + h, r, g, b, a);
+
+    return 1;
+}
+
+/*********************** Shader cache ***********************/
+
+/*
+ * cache file, all the values are little endian:
+ *
+ *   "D3DRSHC" '\0', version (u32), count (u32)
+ *   count entries: key (u64), offset (u32), size (u32), sorted by key
+ *   bytecodes, at 4 bytes aligned offsets
+ *
+ * The file is mapped once and the bytecodes are used in place. The
+ * shaders compiled meanwhile are kept in memory, the file is rewritten
+ * by shader_cache_close() if there are some.
+ */
+
+#define SHADER_CACHE_MAGIC "D3DRSHC"
+#define SHADER_CACHE_VERSION 1U
+#define SHADER_CACHE_HEADER 16U
+#define SHADER_CACHE_ENTRY 16U
+
+#ifdef HAVE_SHADER_BLOBS
+
+/* shaders compiled at build time, see the top of this file */
+# include "shader_main_vs.h"
+# include "shader_main_ps.h"
+# include "shader_main_rect_vs.h"
+# include "shader_main_vs16.h"
+
+typedef struct
+{
+    const char *entry;
+    const char *target;
+    const void *blob;
+    size_t size;
+} Shader_Embedded;
+
+static const Shader_Embedded shader_embedded[] =
+{
+    { "main_vs", "vs_5_0", shader_main_vs, sizeof(shader_main_vs) },
+    { "main_ps", "ps_5_0", shader_main_ps, sizeof(shader_main_ps) },
+    { "main_rect_vs", "vs_5_0", shader_main_rect_vs, sizeof(shader_main_rect_vs) },
+    { "main_vs16", "vs_5_0", shader_main_vs16, sizeof(shader_main_vs16) }
+};
+
+#endif
+
+/* FNV-1a, 64 bits */
+static unsigned long long shader_hash(const void *data, size_t size,
+                                      unsigned long long h)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (size--)
+    {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+unsigned long long shader_key(const void *src, size_t src_size,
+                              const char *entry, const char *target,
+                              unsigned int flags)
+{
+    unsigned char f[4];
+    unsigned long long h;
+
+    f[0] = (unsigned char)flags;
+    f[1] = (unsigned char)(flags >> 8);
+    f[2] = (unsigned char)(flags >> 16);
+    f[3] = (unsigned char)(flags >> 24);
+
+    /* the trailing nul separates the strings */
+    h = shader_hash(src, src_size, 0xcbf29ce484222325ULL);
+    h = shader_hash(entry, strlen(entry) + 1, h);
+    h = shader_hash(target, strlen(target) + 1, h);
+    h = shader_hash(f, sizeof(f), h);
+
+    return h;
+}
+
+static unsigned int shader_cache_u32(const unsigned char *p)
+{
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+           ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long shader_cache_u64(const unsigned char *p)
+{
+    return (unsigned long long)shader_cache_u32(p) |
+           ((unsigned long long)shader_cache_u32(p + 4) << 32);
+}
+
+static void shader_cache_put_u32(unsigned char *p, unsigned int v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void shader_cache_put_u64(unsigned char *p, unsigned long long v)
+{
+    shader_cache_put_u32(p, (unsigned int)v);
+    shader_cache_put_u32(p + 4, (unsigned int)(v >> 32));
+}
+
+static void shader_cache_unmap(Shader_Cache *c)
+{
+    if (!c->map)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(c->map);
+    CloseHandle(c->mapping);
+#else
+    munmap((void *)c->map, c->map_size);
+#endif
+    c->map = NULL;
+    c->map_size = 0;
+    c->count = 0;
+}
+
+static void shader_cache_map(Shader_Cache *c)
+{
+    unsigned int i;
+    unsigned long long prev;
+
+#ifdef _WIN32
+    HANDLE f;
+    LARGE_INTEGER size;
+
+    f = CreateFileA(c->file, GENERIC_READ, FILE_SHARE_READ, NULL,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (f == INVALID_HANDLE_VALUE)
+        return;
+
+    if (!GetFileSizeEx(f, &size) || (size.QuadPart < SHADER_CACHE_HEADER) ||
+        (size.QuadPart > 0xffffffffLL))
+    {
+        CloseHandle(f);
+        return;
+    }
+
+    c->mapping = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(f);
+    if (!c->mapping)
+        return;
+
+    c->map = (const unsigned char *)MapViewOfFile(c->mapping, FILE_MAP_READ,
+                                                  0, 0, 0);
+    if (!c->map)
+    {
+        CloseHandle(c->mapping);
+        return;
+    }
+    c->map_size = (size_t)size.QuadPart;
+#else
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(c->file, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    if ((fstat(fd, &st) < 0) || (st.st_size < SHADER_CACHE_HEADER) ||
+        (st.st_size > 0xffffffffLL))
+    {
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    c->map = (const unsigned char *)map;
+    c->map_size = st.st_size;
+#endif
+
+    /* a cache file of another version, or damaged, is ignored */
+    if (memcmp(c->map, SHADER_CACHE_MAGIC, 8) ||
+        (shader_cache_u32(c->map + 8) != SHADER_CACHE_VERSION))
+        goto unmap;
+
+    c->count = shader_cache_u32(c->map + 12);
+    if (c->count > (c->map_size - SHADER_CACHE_HEADER) / SHADER_CACHE_ENTRY)
+        goto unmap;
+
+    prev = 0;
+    for (i = 0; i < c->count; i++)
+    {
+        const unsigned char *e = c->map + SHADER_CACHE_HEADER + i * SHADER_CACHE_ENTRY;
+        unsigned long long key = shader_cache_u64(e);
+        unsigned int offset = shader_cache_u32(e + 8);
+        unsigned int size = shader_cache_u32(e + 12);
+
+        if (((i > 0) && (key <= prev)) ||
+            (offset > c->map_size) || (size > c->map_size - offset))
+            goto unmap;
+        prev = key;
+    }
+
+    return;
+
+  unmap:
+    shader_cache_unmap(c);
+}
+
+Shader_Cache *shader_cache_open(const char *file)
+{
+    Shader_Cache *c;
+
+    c = (Shader_Cache *)mem_calloc(1, sizeof(Shader_Cache));
+    if (!c)
+        return NULL;
+
+    c->file = (char *)mem_malloc(strlen(file) + 1);
+    if (!c->file)
+    {
+        free(c);
+        return NULL;
+    }
+    strcpy(c->file, file);
+
+    shader_cache_map(c);
+
+    return c;
+}
+
+const void *shader_cache_find(const Shader_Cache *c,
+                              unsigned long long key, size_t *size)
+{
+    unsigned int lo;
+    unsigned int hi;
+    unsigned int i;
+
+    /* file entries are sorted */
+    lo = 0;
+    hi = c->count;
+    while (lo < hi)
+    {
+        unsigned int mid = lo + (hi - lo) / 2;
+        const unsigned char *e = c->map + SHADER_CACHE_HEADER + mid * SHADER_CACHE_ENTRY;
+        unsigned long long k = shader_cache_u64(e);
+
+        if (k == key)
+        {
+            *size = shader_cache_u32(e + 12);
+            return c->map + shader_cache_u32(e + 8);
+        }
+        if (k < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (i = 0; i < c->added_count; i++)
+    {
+        if (c->added[i].key == key)
+        {
+            *size = c->added[i].size;
+            return c->added[i].blob;
+        }
+    }
+
+    return NULL;
+}
+
+/* blob must be allocated with mem_malloc(), the cache owns it */
+int shader_cache_add(Shader_Cache *c,
+                     unsigned long long key, void *blob, size_t size)
+{
+    Shader_Cache_Entry *e;
+
+    if (size > 0xffffffffU)
+        return 0;
+
+    if (c->added_count == c->added_size)
+    {
+        unsigned int s = c->added_size ? c->added_size * 2 : 8;
+
+        e = (Shader_Cache_Entry *)mem_realloc(c->added,
+                                              s * sizeof(Shader_Cache_Entry));
+        if (!e)
+            return 0;
+        c->added = e;
+        c->added_size = s;
+    }
+
+    e = c->added + c->added_count++;
+    e->key = key;
+    e->blob = blob;
+    e->size = size;
+
+    return 1;
+}
+
+static int shader_cache_entry_cmp(const void *a, const void *b)
+{
+    unsigned long long ka = ((const Shader_Cache_Entry *)a)->key;
+    unsigned long long kb = ((const Shader_Cache_Entry *)b)->key;
+
+    return (ka > kb) - (ka < kb);
+}
+
+/* writes the mapped and the added shaders in a temporary file */
+static int shader_cache_write(const Shader_Cache *c, const char *file)
+{
+    Shader_Cache_Entry *entries;
+    unsigned char buf[SHADER_CACHE_ENTRY];
+    static const unsigned char pad[4] = { 0, 0, 0, 0 };
+    unsigned long long offset;
+    unsigned int count;
+    unsigned int i;
+    FILE *f;
+    int ret = 0;
+
+    count = c->count + c->added_count;
+    entries = (Shader_Cache_Entry *)mem_malloc(count * sizeof(Shader_Cache_Entry));
+    if (!entries)
+        return 0;
+
+    for (i = 0; i < c->count; i++)
+    {
+        const unsigned char *e = c->map + SHADER_CACHE_HEADER + i * SHADER_CACHE_ENTRY;
+
+        entries[i].key = shader_cache_u64(e);
+        entries[i].blob = (void *)(c->map + shader_cache_u32(e + 8));
+        entries[i].size = shader_cache_u32(e + 12);
+    }
+    memcpy(entries + c->count, c->added,
+           c->added_count * sizeof(Shader_Cache_Entry));
+    qsort(entries, count, sizeof(Shader_Cache_Entry), shader_cache_entry_cmp);
+
+    f = fopen(file, "wb");
+    if (!f)
+        goto free_entries;
+
+    memcpy(buf, SHADER_CACHE_MAGIC, 8);
+    shader_cache_put_u32(buf + 8, SHADER_CACHE_VERSION);
+    shader_cache_put_u32(buf + 12, count);
+    if (fwrite(buf, SHADER_CACHE_HEADER, 1, f) != 1)
+        goto close_f;
+
+    offset = SHADER_CACHE_HEADER + (unsigned long long)count * SHADER_CACHE_ENTRY;
+    for (i = 0; i < count; i++)
+    {
+        shader_cache_put_u64(buf, entries[i].key);
+        shader_cache_put_u32(buf + 8, (unsigned int)offset);
+        shader_cache_put_u32(buf + 12, (unsigned int)entries[i].size);
+        if (fwrite(buf, SHADER_CACHE_ENTRY, 1, f) != 1)
+            goto close_f;
+        offset = (offset + entries[i].size + 3) & ~3ULL;
+        if (offset > 0xffffffffULL)
+            goto close_f;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if ((fwrite(entries[i].blob, 1, entries[i].size, f) != entries[i].size) ||
+            (fwrite(pad, 1, (4 - (entries[i].size & 3)) & 3, f) != ((4 - (entries[i].size & 3)) & 3)))
+            goto close_f;
+    }
+
+    ret = 1;
+
+  close_f:
+    if (fclose(f) != 0)
+        ret = 0;
+  free_entries:
+    free(entries);
+
+    return ret;
+}
+
+int shader_cache_close(Shader_Cache *c)
+{
+    char *tmp;
+    unsigned int i;
+    int ret = 1;
+
+    if (!c)
+        return 0;
+
+    if (c->added_count > 0)
+    {
+        ret = 0;
+        tmp = (char *)mem_malloc(strlen(c->file) + 5);
+        if (tmp)
+        {
+            strcpy(tmp, c->file);
+            strcat(tmp, ".tmp");
+            if (shader_cache_write(c, tmp))
+            {
+                /* the file must not be mapped to be replaced on Windows */
+                shader_cache_unmap(c);
+#ifdef _WIN32
+                ret = MoveFileExA(tmp, c->file, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+                ret = rename(tmp, c->file) == 0;
+#endif
+            }
+            if (!ret)
+                remove(tmp);
+            free(tmp);
+        }
+    }
+
+    shader_cache_unmap(c);
+    for (i = 0; i < c->added_count; i++)
+        free(c->added[i].blob);
+    free(c->added);
+    free(c->src_file);
+    free(c->src);
+    free(c->file);
+    free(c);
+
+    return ret;
+}
+
+/* the source is read once for all the shaders of a file */
+static int shader_source_read(Shader_Cache *c, const char *file)
+{
+    FILE *f;
+    char *src;
+    char *name;
+    long size;
+
+    if (c->src_file && !strcmp(c->src_file, file))
+        return 1;
+
+    f = fopen(file, "rb");
+    if (!f)
+        return 0;
+
+    if ((fseek(f, 0, SEEK_END) != 0) || ((size = ftell(f)) < 0) ||
+        (fseek(f, 0, SEEK_SET) != 0))
+        goto close_f;
+
+    src = (char *)mem_malloc(size + 1);
+    if (!src)
+        goto close_f;
+
+    name = (char *)mem_malloc(strlen(file) + 1);
+    if (!name)
+        goto free_src;
+
+    if (fread(src, 1, size, f) != (size_t)size)
+        goto free_name;
+    src[size] = '\0';
+    strcpy(name, file);
+
+    free(c->src_file);
+    free(c->src);
+    c->src_file = name;
+    c->src = src;
+    c->src_size = size;
+    fclose(f);
+
+    return 1;
+
+  free_name:
+    free(name);
+  free_src:
+    free(src);
+  close_f:
+    fclose(f);
+
+    return 0;
+}
+
+/*
+ * bytecode of a shader: embedded in the binary, in the cache, or
+ * compiled and added to the cache. It is valid until the cache is
+ * closed.
+ */
+const void *shader_get(Shader_Cache *c, const char *file,
+                       const char *entry, const char *target,
+                       unsigned int flags,
+                       Shader_Compile compile, void *data,
+                       size_t *size)
+{
+    unsigned long long key;
+    const void *bytecode;
+    void *blob;
+
+#ifdef HAVE_SHADER_BLOBS
+    unsigned int i;
+
+    for (i = 0; i < sizeof(shader_embedded) / sizeof(Shader_Embedded); i++)
+    {
+        if (!strcmp(shader_embedded[i].entry, entry) &&
+            !strcmp(shader_embedded[i].target, target))
+        {
+            *size = shader_embedded[i].size;
+            return shader_embedded[i].blob;
+        }
+    }
+#endif
+
+    if (!shader_source_read(c, file))
+    {
+        printf(" * can not read %s\n", file);
+        fflush(stdout);
+        return NULL;
+    }
+
+    key = shader_key(c->src, c->src_size, entry, target, flags);
+    bytecode = shader_cache_find(c, key, size);
+    if (bytecode)
+        return bytecode;
+
+    blob = compile(data, c->src, c->src_size, entry, target, flags, size);
+    if (!blob)
+        return NULL;
+    c->compiles++;
+
+    if (!shader_cache_add(c, key, blob, *size))
+    {
+        free(blob);
+        return NULL;
+    }
+
+    return blob;
+}
+
+/*************************** State ***************************/
+
+/* the state of the context is unknown, everything is issued */
+void state_cache_reset(State_Cache *sc)
+{
+    memset(sc->objects, 0, sizeof(sc->objects));
+    memset(sc->params, 0, sizeof(sc->params));
+    sc->valid = 0;
+}
+
+/* returns 1 if the bind call must be issued */
+int state_cache_set(State_Cache *sc, State_Slot slot,
+                    const void *object, unsigned long long param)
+{
+    if ((sc->valid & (1U << slot)) &&
+        (sc->objects[slot] == object) &&
+        (sc->params[slot] == param))
+    {
+        sc->elided++;
+        return 0;
+    }
+
+    sc->objects[slot] = object;
+    sc->params[slot] = param;
+    sc->valid |= 1U << slot;
+    sc->issued++;
+
+    return 1;
+}
+
+/* start of a frame: the counters of the previous one are kept */
+void state_cache_frame(State_Cache *sc)
+{
+    sc->last_issued = sc->issued;
+    sc->last_elided = sc->elided;
+    sc->issued = 0;
+    sc->elided = 0;
+}
+
+/*************************** Pacing ***************************/
+
+static unsigned long long pace_clock_default(void *data)
+{
+    (void)data;
+
+    return time_now();
+}
+
+void pace_init(Pace *pc, Pace_Mode mode, int hz,
+               Pace_Clock clock, void *clock_data)
+{
+    memset(pc, 0, sizeof(Pace));
+    pc->clock = clock ? clock : pace_clock_default;
+    pc->clock_data = clock_data;
+    pc->period = 1000000000ULL / (unsigned long long)(hz > 0 ? hz : 60);
+    pc->slack_min = 0x7fffffffffffffffLL;
+    pc->interval_min = 0xffffffffffffffffULL;
+    /* first frame */
+    pc->dirty = 1;
+    pace_mode_set(pc, mode);
+}
+
+void pace_mode_set(Pace *pc, Pace_Mode mode)
+{
+    pc->mode = mode;
+    pc->deadline = pc->clock(pc->clock_data);
+    pc->last = 0;
+}
+
+/* the window must be redrawn: needed for the on demand mode only */
+void pace_invalidate(Pace *pc)
+{
+    pc->dirty = 1;
+}
+
+/* time to wait before the next frame, or PACE_WAIT_EVENT */
+unsigned long long pace_wait(const Pace *pc)
+{
+    unsigned long long now;
+
+    switch (pc->mode)
+    {
+        case PACE_ON_DEMAND:
+            return pc->dirty ? 0 : PACE_WAIT_EVENT;
+        case PACE_FIXED:
+            now = pc->clock(pc->clock_data);
+            return (pc->deadline > now) ? pc->deadline - now : 0;
+        default:
+            return 0;
+    }
+}
+
+/* returns 1 if a frame must be rendered now */
+int pace_frame_begin(Pace *pc)
+{
+    unsigned long long now;
+
+    now = pc->clock(pc->clock_data);
+
+    if (pc->mode == PACE_ON_DEMAND)
+    {
+        if (!pc->dirty)
+            return 0;
+    }
+    else if (pc->mode == PACE_FIXED)
+    {
+        if (now < pc->deadline)
+            return 0;
+
+        /*
+         * late by more than a period: the missed frames are dropped,
+         * not rendered in a burst
+         */
+        pc->deadline += pc->period;
+        if (pc->deadline <= now)
+        {
+            pc->deadline = now + pc->period;
+            pc->missed++;
+        }
+    }
+
+    pc->dirty = 0;
+    pc->begin = now;
+    if (pc->last)
+    {
+        unsigned long long interval = now - pc->last;
+
+        if (interval < pc->interval_min)
+            pc->interval_min = interval;
+        if (interval > pc->interval_max)
+            pc->interval_max = interval;
+    }
+    pc->last = now;
+
+    return 1;
+}
+
+void pace_frame_end(Pace *pc)
+{
+    pc->frames++;
+
+    if (pc->mode == PACE_FIXED)
+    {
+        long long slack;
+
+        slack = (long long)(pc->deadline - pc->clock(pc->clock_data));
+        if (slack < pc->slack_min)
+            pc->slack_min = slack;
+        pc->slack_sum += slack;
+        TRACE("pace slack", slack, pc->missed);
+    }
+}
+
+/*************************** Queue ***************************/
+
+void cmd_queue_init(Cmd_Queue *q)
+{
+    memset(q, 0, sizeof(Cmd_Queue));
+}
+
+/* producer only, returns 0 if the ring is full */
+int cmd_queue_push(Cmd_Queue *q, const Cmd *c)
+{
+    unsigned int head;
+
+    head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    if (head - q->tail_cache == CMD_QUEUE_SIZE)
+    {
+        q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head - q->tail_cache == CMD_QUEUE_SIZE)
+            return 0;
+    }
+
+    q->cmds[head & (CMD_QUEUE_SIZE - 1)] = *c;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* consumer only, returns 0 if the ring is empty */
+int cmd_queue_pop(Cmd_Queue *q, Cmd *c)
+{
+    unsigned int tail;
+
+    tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    if (tail == q->head_cache)
+    {
+        q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail == q->head_cache)
+            return 0;
+    }
+
+    *c = q->cmds[tail & (CMD_QUEUE_SIZE - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/*************************** Chunks ***************************/
+
+/*
+ * a few chunks per thread, so that the threads done first take the
+ * remaining ones, but not less than min_size primitives per chunk.
+ * Returns the number of chunks, 0 for an empty scene.
+ */
+unsigned int chunks_split(Chunk *chunks, unsigned int max,
+                          unsigned int count, unsigned int threads,
+                          unsigned int min_size)
+{
+    unsigned int n;
+    unsigned int i;
+
+    if (count == 0)
+        return 0;
+
+    n = 4 * (threads > 0 ? threads : 1);
+    if (n > max)
+        n = max;
+    if ((min_size > 0) && (n > count / min_size))
+        n = count / min_size;
+    if (n < 1)
+        n = 1;
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned int first = (unsigned int)((unsigned long long)count * i / n);
+        unsigned int last = (unsigned int)((unsigned long long)count * (i + 1) / n);
+
+        chunks[i].first = first;
+        chunks[i].count = last - first;
+    }
+
+    return n;
+}
+
+/*************************** Resize ***************************/
+
+void resize_init(Resize *rs)
+{
+    memset(rs, 0, sizeof(Resize));
+    /* nothing applied yet */
+    rs->rot = -1;
+    rs->pending_rot = 0;
+}
+
+void resize_request(Resize *rs, int rot, UINT width, UINT height)
+{
+    rs->pending_width = width;
+    rs->pending_height = height;
+    rs->pending_rot = rot & 3;
+    rs->requests++;
+}
+
+/* a minimized window has a null size, its buffers are kept */
+unsigned int resize_pending(const Resize *rs)
+{
+    unsigned int changes = RESIZE_NONE;
+
+    if ((rs->pending_width > 0) && (rs->pending_height > 0) &&
+        ((rs->pending_width != rs->width) || (rs->pending_height != rs->height)))
+        changes |= RESIZE_BUFFERS;
+
+    if (rs->pending_rot != rs->rot)
+        changes |= RESIZE_ROTATION;
+
+    return changes;
+}
+
+/* changes successfully applied, the other ones are still pending */
+void resize_done(Resize *rs, unsigned int changes)
+{
+    if (changes & RESIZE_BUFFERS)
+    {
+        rs->width = rs->pending_width;
+        rs->height = rs->pending_height;
+        rs->reallocs++;
+    }
+
+    if (changes & RESIZE_ROTATION)
+    {
+        rs->rot = rs->pending_rot;
+        rs->rotations++;
+    }
+}
+
+/*************************** Tasks ***************************/
+
+#define TASK_THREADS_MAX 8
+
+typedef struct
+{
+    Task *tasks;
+    unsigned int count;
+    unsigned int remaining; /* tasks not done, failed nor skipped */
+    unsigned int running;
+    unsigned long long start;
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE cond;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} Task_Graph;
+
+typedef struct
+{
+    Task_Graph *graph;
+    int index;
+} Task_Worker;
+
+static void task_graph_lock(Task_Graph *g)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&g->lock);
+#else
+    pthread_mutex_lock(&g->lock);
+#endif
+}
+
+static void task_graph_unlock(Task_Graph *g)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&g->lock);
+#else
+    pthread_mutex_unlock(&g->lock);
+#endif
+}
+
+static void task_graph_wait(Task_Graph *g)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(&g->cond, &g->lock, INFINITE);
+#else
+    pthread_cond_wait(&g->cond, &g->lock);
+#endif
+}
+
+static void task_graph_wake(Task_Graph *g)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(&g->cond);
+#else
+    pthread_cond_broadcast(&g->cond);
+#endif
+}
+
+void task_set(Task *t, const char *name,
+              int (*func)(void *data), void *data,
+              unsigned int deps, int main_thread)
+{
+    memset(t, 0, sizeof(Task));
+    t->name = name;
+    t->func = func;
+    t->data = data;
+    t->deps = deps;
+    t->main_thread = !!main_thread;
+}
+
+/*
+ * with the lock held: a task that can run, or NULL. Tasks whose
+ * dependencies have failed are skipped on the way.
+ */
+static Task *task_graph_next(Task_Graph *g, int index)
+{
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < g->count; i++)
+    {
+        Task *t = g->tasks + i;
+        int ready = 1;
+
+        if (t->state != TASK_WAITING)
+            continue;
+
+        for (j = 0; j < g->count; j++)
+        {
+            Task_State s;
+
+            if (!(t->deps & (1U << j)))
+                continue;
+
+            s = g->tasks[j].state;
+            if ((s == TASK_FAILED) || (s == TASK_SKIPPED))
+            {
+                t->state = TASK_SKIPPED;
+                g->remaining--;
+                task_graph_wake(g);
+                break;
+            }
+            if (s != TASK_DONE)
+                ready = 0;
+        }
+
+        if ((t->state == TASK_WAITING) && ready &&
+            (!t->main_thread || (index == 0)))
+            return t;
+    }
+
+    return NULL;
+}
+
+static void task_graph_work(Task_Graph *g, int index)
+{
+    task_graph_lock(g);
+    while (g->remaining > 0)
+    {
+        Task *t;
+        int ret;
+
+        t = task_graph_next(g, index);
+        if (!t)
+        {
+            /* nothing can run anymore: dependency cycle */
+            if ((g->running == 0) && (g->remaining > 0) &&
+                !task_graph_next(g, 0))
+            {
+                unsigned int i;
+
+                for (i = 0; i < g->count; i++)
+                {
+                    if (g->tasks[i].state == TASK_WAITING)
+                        g->tasks[i].state = TASK_SKIPPED;
+                }
+                g->remaining = 0;
+                task_graph_wake(g);
+                break;
+            }
+            if (g->remaining > 0)
+                task_graph_wait(g);
+            continue;
+        }
+
+        t->state = TASK_RUNNING;
+        t->thread = index;
+        g->running++;
+        task_graph_unlock(g);
+
+        t->start = time_now() - g->start;
+        ret = t->func(t->data);
+        t->end = time_now() - g->start;
+
+        task_graph_lock(g);
+        t->state = ret ? TASK_DONE : TASK_FAILED;
+        g->running--;
+        g->remaining--;
+        task_graph_wake(g);
+    }
+    task_graph_unlock(g);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI task_graph_thread(LPVOID data)
+{
+    Task_Worker *w = (Task_Worker *)data;
+
+    TRACE_THREAD();
+    task_graph_work(w->graph, w->index);
+
+    return 0;
+}
+#else
+static void *task_graph_thread(void *data)
+{
+    Task_Worker *w = (Task_Worker *)data;
+
+    TRACE_THREAD();
+    task_graph_work(w->graph, w->index);
+
+    return NULL;
+}
+#endif
+
+/* returns 1 if all the tasks are done, 0 if one has failed */
+int task_graph_run(Task *tasks, unsigned int count, int threads)
+{
+    Task_Graph g;
+    Task_Worker workers[TASK_THREADS_MAX];
+#ifdef _WIN32
+    HANDLE handles[TASK_THREADS_MAX];
+#else
+    pthread_t handles[TASK_THREADS_MAX];
+#endif
+    unsigned int i;
+    int count_threads;
+    int n;
+
+    if (count > TASKS_MAX)
+        return 0;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > TASK_THREADS_MAX)
+        threads = TASK_THREADS_MAX;
+    if ((unsigned int)threads > count)
+        threads = count ? count : 1;
+
+    for (i = 0; i < count; i++)
+    {
+        tasks[i].state = TASK_WAITING;
+        tasks[i].thread = -1;
+        tasks[i].start = 0;
+        tasks[i].end = 0;
+    }
+
+    g.tasks = tasks;
+    g.count = count;
+    g.remaining = count;
+    g.running = 0;
+#ifdef _WIN32
+    InitializeCriticalSection(&g.lock);
+    InitializeConditionVariable(&g.cond);
+#else
+    pthread_mutex_init(&g.lock, NULL);
+    pthread_cond_init(&g.cond, NULL);
+#endif
+    g.start = time_now();
+
+    /* without thread, the calling thread runs everything */
+    count_threads = 1;
+    for (n = 1; n < threads; n++)
+    {
+        workers[n].graph = &g;
+        workers[n].index = n;
+#ifdef _WIN32
+        handles[n] = CreateThread(NULL, 0, task_graph_thread, workers + n, 0, NULL);
+        if (!handles[n])
+            break;
+#else
+        if (pthread_create(handles + n, NULL, task_graph_thread, workers + n) != 0)
+            break;
+#endif
+        count_threads++;
+    }
+
+    task_graph_work(&g, 0);
+
+    for (n = 1; n < count_threads; n++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(handles[n], INFINITE);
+        CloseHandle(handles[n]);
+#else
+        pthread_join(handles[n], NULL);
+#endif
+    }
+
+#ifdef _WIN32
+    DeleteCriticalSection(&g.lock);
+#else
+    pthread_cond_destroy(&g.cond);
+    pthread_mutex_destroy(&g.lock);
+#endif
+
+    for (i = 0; i < count; i++)
+    {
+        if (tasks[i].state != TASK_DONE)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* times of the tasks, the ones of the critical path are marked with '*' */
+void task_graph_print(const Task *tasks, unsigned int count)
+{
+    static const char *states[] = { "waiting", "running", "done", "failed", "skipped" };
+    unsigned int critical;
+    unsigned int last;
+    unsigned int i;
+
+    if (count == 0)
+        return;
+
+    /* critical path: from the last task, the dependency done last */
+    last = 0;
+    for (i = 1; i < count; i++)
+    {
+        if (tasks[i].end > tasks[last].end)
+            last = i;
+    }
+
+    critical = 0;
+    while (1)
+    {
+        unsigned int next = count;
+
+        critical |= 1U << last;
+        for (i = 0; i < count; i++)
+        {
+            if ((tasks[last].deps & (1U << i)) &&
+                ((next == count) || (tasks[i].end > tasks[next].end)))
+                next = i;
+        }
+        if (next == count)
+            break;
+        last = next;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        printf(" %c %-16s thread %d  start %8.3f ms  duration %8.3f ms  %s\n",
+               (critical & (1U << i)) ? '*' : ' ',
+               tasks[i].name, tasks[i].thread,
+               tasks[i].start / 1e6,
+               (tasks[i].end - tasks[i].start) / 1e6,
+               states[tasks[i].state]);
+    }
+    fflush(stdout);
+}
+
+#ifndef HAVE_SOFT
+
+/************************** D3D11 **************************/
+
+static void d3d_refresh_rate_get(D3d *d3d, UINT *num, UINT *den)
+{
+    DXGI_MODE_DESC *display_mode_list = NULL; /* 28 bytes */
+    IDXGIAdapter *dxgi_adapter;
+    IDXGIOutput *dxgi_output;
+    UINT nbr_modes;
+    UINT i;
+    HRESULT res;
+
+    *num = 0U;
+    *den = 1U;
+
+    if (!d3d->vsync)
+        return;
+
+    /* adapter of primary desktop : pass 0U */
+    res = IDXGIFactory_EnumAdapters(d3d->dxgi_factory, 0U, &dxgi_adapter);
+    if (FAILED(res))
+        return;
+
+    /* output of primary desktop : pass 0U */
+    res = IDXGIAdapter_EnumOutputs(dxgi_adapter, 0U, &dxgi_output);
+    if (FAILED(res))
+        goto release_dxgi_adapter;
+
+    /* number of mode that fit the format */
+     res = IDXGIOutput_GetDisplayModeList(dxgi_output,
+                                         DXGI_FORMAT_B8G8R8A8_UNORM,
+                                         DXGI_ENUM_MODES_INTERLACED,
+                                         &nbr_modes, NULL);
+    if (FAILED(res))
+        goto release_dxgi_output;
+
+    /* released with the scratch data of the first frame */
+    display_mode_list = (DXGI_MODE_DESC *)arena_alloc(&d3d->frame,
+                                                      nbr_modes * sizeof(DXGI_MODE_DESC));
+    if (!display_mode_list)
+        goto release_dxgi_output;
+
+    /* fill the mode list */
+    res = IDXGIOutput_GetDisplayModeList(dxgi_output,
+                                         DXGI_FORMAT_B8G8R8A8_UNORM,
+                                         DXGI_ENUM_MODES_INTERLACED,
+                                         &nbr_modes, display_mode_list);
+    if (FAILED(res))
+        goto release_dxgi_output;
+
+    for (i = 0; i < nbr_modes; i++)
+    {
+        if ((display_mode_list[i].Width == (UINT)GetSystemMetrics(SM_CXSCREEN)) &&
+            (display_mode_list[i].Height == (UINT)GetSystemMetrics(SM_CYSCREEN)))
+        {
+            *num = display_mode_list[i].RefreshRate.Numerator;
+            *den = display_mode_list[i].RefreshRate.Denominator;
+            break;
+        }
+    }
+
+#ifdef _DEBUG
+    {
+        DXGI_ADAPTER_DESC adapter_desc;
+
+        IDXGIAdapter_GetDesc(dxgi_adapter, &adapter_desc);
+        printf(" * video mem: %llu B, %llu MB\n",
+               adapter_desc.DedicatedVideoMemory,
+               adapter_desc.DedicatedVideoMemory / 1024 / 1024);
+        fflush(stdout);
+        wprintf(L" * description: %ls\n", adapter_desc.Description);
+        fflush(stdout);
+    }
+#endif
+
+  release_dxgi_output:
+    IDXGIOutput_Release(dxgi_output);
+  release_dxgi_adapter:
+    IDXGIFactory_Release(dxgi_adapter);
+}
+
+/*** immediate mode ***/
+
+static void *d3d_batch_map(void *data, int discard)
+{
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    D3d *d3d;
+    HRESULT res;
+
+    d3d = (D3d *)data;
+    res = ID3D11DeviceContext_Map(d3d->d3d_device_ctx,
+                                  (ID3D11Resource *)d3d->d3d_batch_vertex_buffer,
+                                  0U,
+                                  discard ?
+                                  D3D11_MAP_WRITE_DISCARD :
+                                  D3D11_MAP_WRITE_NO_OVERWRITE,
+                                  0, &mapped);
+    if (FAILED(res))
+    {
+        printf("Map() failed\n");
+        fflush(stdout);
+        return NULL;
+    }
+
+    return mapped.pData;
+}
+
+static void d3d_batch_unmap(void *data)
+{
+    D3d *d3d;
+
+    d3d = (D3d *)data;
+    ID3D11DeviceContext_Unmap(d3d->d3d_device_ctx,
+                              (ID3D11Resource *)d3d->d3d_batch_vertex_buffer,
+                              0U);
+}
+
+static void d3d_batch_draw(void *data,
+                           unsigned int index_count,
+                           unsigned int first_index,
+                           unsigned int base_vertex)
+{
+    D3d *d3d;
+
+    d3d = (D3d *)data;
+    ID3D11DeviceContext_DrawIndexed(d3d->d3d_device_ctx,
+                                    index_count,
+                                    first_index,
+                                    (INT)base_vertex);
+}
+
+static const Batch_Ops d3d_batch_ops =
+{
+    d3d_batch_map,
+    d3d_batch_unmap,
+    d3d_batch_draw
+};
+
+/*** shaders ***/
+
+/* Shader_Compile implementation, data is the name of the source file */
+static void *d3d_shader_compile(void *data,
+                                const char *src, size_t src_size,
+                                const char *entry, const char *target,
+                                unsigned int flags, size_t *size)
+{
+    ID3DBlob *blob;
+    ID3DBlob *err_blob;
+    void *bytecode;
+    HRESULT res;
+
+    blob = NULL;
+    err_blob = NULL;
+    res = D3DCompile(src, src_size,
+                     (const char *)data,
+                     NULL,
+                     D3D_COMPILE_STANDARD_FILE_INCLUDE,
+                     entry,
+                     target,
+                     flags,
+                     0U,
+                     &blob,
+                     &err_blob);
+    if (FAILED(res))
+    {
+        printf(" * %s error : %s\n", entry,
+               err_blob ? (char *)ID3D10Blob_GetBufferPointer(err_blob) : "");
+        fflush(stdout);
+        if (err_blob)
+            ID3D10Blob_Release(err_blob);
+        return NULL;
+    }
+
+    /* warnings */
+    if (err_blob)
+        ID3D10Blob_Release(err_blob);
+
+    *size = ID3D10Blob_GetBufferSize(blob);
+    bytecode = mem_malloc(*size);
+    if (bytecode)
+        memcpy(bytecode, ID3D10Blob_GetBufferPointer(blob), *size);
+    ID3D10Blob_Release(blob);
+
+    return bytecode;
+}
+
+/*** startup ***/
+
+/*
+ * d3d_init() is a task graph: shader bytecodes and display modes are
+ * obtained while the device and the swap chain are created. The device
+ * is single threaded, so the tasks that use it are chained.
+ */
+
+typedef enum
+{
+    D3D_TASK_FACTORY,
+    D3D_TASK_DEVICE,
+    D3D_TASK_MODES,
+    D3D_TASK_SHADERS,
+    D3D_TASK_SWAPCHAIN,
+    D3D_TASK_RESOURCES,
+    D3D_TASK_SHADER_OBJECTS,
+    D3D_TASK_LAST
+} D3d_Task;
+
+#define D3D_STARTUP_THREADS 3
+
+typedef struct
+{
+    D3d *d3d;
+    Window *win;
+    UINT num; /* refresh rate */
+    UINT den;
+    Shader_Cache *cache;
+    const void *vs_blob; /* bytecodes, valid until the cache is closed */
+    const void *ps_blob;
+    const void *rect_vs_blob;
+    const void *vs16_blob;
+    size_t vs_size;
+    size_t ps_size;
+    size_t rect_vs_size;
+    size_t vs16_size;
+} D3d_Startup;
+
+static int d3d_task_factory(void *data)
+{
+    D3d *d3d = ((D3d_Startup *)data)->d3d;
+    HRESULT res;
+    UINT flags;
+
+    /* create the DXGI factory */
+    flags = 0;
+#ifdef HAVE_WIN10
+# ifdef _DEBUG
+    flags = DXGI_CREATE_FACTORY_DEBUG;
+# endif
+    res = CreateDXGIFactory2(flags, &IID_IDXGIFactory2, (void **)&d3d->dxgi_factory);
+#else
+    (void)flags;
+    res = CreateDXGIFactory(&IID_IDXGIFactory, (void **)&d3d->dxgi_factory);
+#endif
+
+    return SUCCEEDED(res);
+}
+
+static int d3d_task_device(void *data)
+{
+    D3d *d3d = ((D3d_Startup *)data)->d3d;
+    D3D_FEATURE_LEVEL feature_level[4];
+    HRESULT res;
+    UINT flags;
+
+    /*
+     * software engine functions are called from one thread at a time:
+     * the main loop, or the render thread. Deferred contexts can not be
+     * created on a single threaded device.
+     */
+    flags = D3D11_CREATE_DEVICE_BGRA_SUPPORT;
+#ifndef HAVE_DEFERRED
+    flags |= D3D11_CREATE_DEVICE_SINGLETHREADED;
+#endif
+#ifdef HAVE_WIN10
+# ifdef _DEBUG
+    flags |= D3D11_CREATE_DEVICE_DEBUG;
+# endif
+#endif
+
+    feature_level[0] = D3D_FEATURE_LEVEL_11_1;
+    feature_level[1] = D3D_FEATURE_LEVEL_11_0;
+    feature_level[2] = D3D_FEATURE_LEVEL_10_1;
+    feature_level[3] = D3D_FEATURE_LEVEL_10_0;
+
+    /* create device and device context with hardware support */
+    res = D3D11CreateDevice(NULL,
+                            D3D_DRIVER_TYPE_HARDWARE,
+                            NULL,
+                            flags,
+                            feature_level,
+                            3U,
+                            D3D11_SDK_VERSION,
+                            &d3d->d3d_device,
+                            NULL,
+                            &d3d->d3d_device_ctx);
+    if (FAILED(res))
+        return 0;
+
+#ifdef HAVE_WIN10
+    /* optional: without it, the whole frame is always redrawn */
+    res = ID3D11DeviceContext_QueryInterface(d3d->d3d_device_ctx,
+                                             &IID_ID3D11DeviceContext1,
+                                             (void **)&d3d->d3d_device_ctx1);
+    if (FAILED(res))
+        d3d->d3d_device_ctx1 = NULL;
+#endif
+
+    return 1;
+}
+
+static int d3d_task_modes(void *data)
+{
+    D3d_Startup *st = (D3d_Startup *)data;
+
+    d3d_refresh_rate_get(st->d3d, &st->num, &st->den);
+
+    return 1;
+}
+
+/* bytecodes only, no device needed */
+static int d3d_task_shaders(void *data)
+{
+    D3d_Startup *st = (D3d_Startup *)data;
+    UINT flags;
+
+    st->cache = shader_cache_open("shader_3.cache");
+    if (!st->cache)
+        return 0;
+
+    flags = D3DCOMPILE_ENABLE_STRICTNESS;
+#ifdef _DEBUG
+    flags |= D3DCOMPILE_DEBUG;
+#endif
+
+    st->vs_blob = shader_get(st->cache, "shader_3.hlsl", "main_vs", "vs_5_0",
+                             flags, d3d_shader_compile, (void *)"shader_3.hlsl",
+                             &st->vs_size);
+    if (!st->vs_blob)
+        return 0;
+
+    st->ps_blob = shader_get(st->cache, "shader_3.hlsl", "main_ps", "ps_5_0",
+                             flags, d3d_shader_compile, (void *)"shader_3.hlsl",
+                             &st->ps_size);
+    if (!st->ps_blob)
+        return 0;
+
+    st->rect_vs_blob = shader_get(st->cache, "shader_3.hlsl", "main_rect_vs", "vs_5_0",
+                                  flags, d3d_shader_compile, (void *)"shader_3.hlsl",
+                                  &st->rect_vs_size);
+    if (!st->rect_vs_blob)
+        return 0;
+
+    st->vs16_blob = shader_get(st->cache, "shader_3.hlsl", "main_vs16", "vs_5_0",
+                               flags, d3d_shader_compile, (void *)"shader_3.hlsl",
+                               &st->vs16_size);
+
+    return st->vs16_blob != NULL;
+}
+
+/* run by the thread of the window */
+static int d3d_task_swapchain(void *data)
+{
+    D3d_Startup *st = (D3d_Startup *)data;
+    D3d *d3d = st->d3d;
+#ifdef HAVE_WIN10
+    DXGI_SWAP_CHAIN_DESC1 desc_sw;
+    DXGI_SWAP_CHAIN_FULLSCREEN_DESC desc_fs;
+#else
+    DXGI_SWAP_CHAIN_DESC desc_sw;
+#endif
+    RECT r;
+    HRESULT res;
+
+    if (!GetClientRect(st->win->win, &r))
+        return 0;
+
+    /*
+     * create the swap chain. It needs some settings...
+     * the size of the internal buffers
+     * the image format
+     * the number of back buffers (>= 2 for flip model, see SwapEffect field)
+     * vsync enabled: need refresh rate
+     *
+     * Settings are different in win 7 and win10
+     */
+
+#ifdef HAVE_WIN10
+    desc_sw.Width = r.right - r.left;
+    desc_sw.Height = r.bottom - r.top;
+    desc_sw.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc_sw.Stereo = FALSE;
+#else
+    desc_sw.BufferDesc.Width= r.right - r.left;
+    desc_sw.BufferDesc.Height = r.bottom - r.top;
+    desc_sw.BufferDesc.RefreshRate.Numerator = st->num;
+    desc_sw.BufferDesc.RefreshRate.Denominator = st->den;
+    desc_sw.BufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;;
+    desc_sw.BufferDesc.ScanlineOrdering = DXGI_MODE_SCANLINE_ORDER_UNSPECIFIED;
+    desc_sw.BufferDesc.Scaling = DXGI_MODE_SCALING_UNSPECIFIED;
+#endif
+    desc_sw.SampleDesc.Count = 1U;
+    desc_sw.SampleDesc.Quality = 0U;
+    desc_sw.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    desc_sw.BufferCount = 2U;
+#ifdef HAVE_WIN10
+    desc_sw.Scaling = DXGI_SCALING_NONE;
+#else
+    desc_sw.OutputWindow = st->win->win;
+    desc_sw.Windowed = TRUE;
+#endif
+    desc_sw.SwapEffect = DXGI_SWAP_EFFECT_FLIP_SEQUENTIAL;
+#ifdef HAVE_WIN10
+    desc_sw.AlphaMode = DXGI_ALPHA_MODE_UNSPECIFIED;
+#endif
+    desc_sw.Flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+
+#ifdef HAVE_WIN10
+    desc_fs.RefreshRate.Numerator = st->num;
+    desc_fs.RefreshRate.Denominator = st->den;
+    desc_fs.ScanlineOrdering = DXGI_MODE_SCANLINE_ORDER_UNSPECIFIED;
+    desc_fs.Scaling = DXGI_MODE_SCALING_UNSPECIFIED;
+    desc_fs.Windowed = TRUE;
+#endif
+
+#ifdef HAVE_WIN10
+    res = IDXGIFactory2_CreateSwapChainForHwnd(d3d->dxgi_factory,
+                                               (IUnknown *)d3d->d3d_device,
+                                               st->win->win,
+                                               &desc_sw,
+                                               &desc_fs,
+                                               NULL,
+                                               &d3d->dxgi_swapchain);
+#else
+    res = IDXGIFactory_CreateSwapChain(d3d->dxgi_factory,
+                                       (IUnknown *)d3d->d3d_device,
+                                       &desc_sw,
+                                       &d3d->dxgi_swapchain);
+#endif
+
+    return SUCCEEDED(res);
+}
+
+/* rasterizer state and buffers */
+static int d3d_task_resources(void *data)
+{
+    D3d *d3d = ((D3d_Startup *)data)->d3d;
+    /* unit quad: upper left, upper right, bottom right, bottom left */
+    const FLOAT quad[8] = { 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f };
+    USHORT *indices;
+    D3D11_BUFFER_DESC desc_buf;
+    D3D11_SUBRESOURCE_DATA sr_data;
+    D3D11_RASTERIZER_DESC desc_rs;
+    HRESULT res;
+
+    /* rasterizer */
+    desc_rs.FillMode = D3D11_FILL_SOLID;
+    desc_rs.CullMode = D3D11_CULL_NONE;
+    desc_rs.FrontCounterClockwise = FALSE;
+    desc_rs.DepthBias = 0;
+    desc_rs.DepthBiasClamp = 0.0f;
+    desc_rs.SlopeScaledDepthBias = 0.0f;
+    desc_rs.DepthClipEnable = TRUE;
+    desc_rs.ScissorEnable = FALSE;
+    desc_rs.MultisampleEnable = FALSE;
+    desc_rs.AntialiasedLineEnable = FALSE;
+
+    res = ID3D11Device_CreateRasterizerState(d3d->d3d_device,
+                                             &desc_rs,
+                                             &d3d->d3d_rasterizer_state);
+    if (FAILED(res))
+        return 0;
+
+    desc_rs.ScissorEnable = TRUE;
+    res = ID3D11Device_CreateRasterizerState(d3d->d3d_device,
+                                             &desc_rs,
+                                             &d3d->d3d_rasterizer_scissor_state);
+    if (FAILED(res))
+        return 0;
+
+    desc_buf.ByteWidth = sizeof(Const_Buffer);
+    desc_buf.Usage = D3D11_USAGE_DYNAMIC; /* because buffer is updated when the window has resized */
+    desc_buf.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    desc_buf.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    desc_buf.MiscFlags = 0;
+    desc_buf.StructureByteStride = 0;
+
+    res = ID3D11Device_CreateBuffer(d3d->d3d_device,
+                                    &desc_buf,
+                                    NULL,
+                                    &d3d->d3d_const_buffer);
+    if (FAILED(res))
+    {
+        printf(" * CreateBuffer() failed 0x%lx\n", res);
+        return 0;
+    }
+
+    /* immediate mode ring buffers, appended each frame */
+    desc_buf.ByteWidth = BATCH_VERTICES * sizeof(Vertex);
+    desc_buf.Usage = D3D11_USAGE_DYNAMIC;
+    desc_buf.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+    desc_buf.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    desc_buf.MiscFlags = 0;
+    desc_buf.StructureByteStride = 0;
+
+    res = ID3D11Device_CreateBuffer(d3d->d3d_device,
+                                    &desc_buf,
+                                    NULL,
+                                    &d3d->d3d_batch_vertex_buffer);
+    if (FAILED(res))
+    {
+        printf(" * CreateBuffer() failed 0x%lx\n", res);
+        return 0;
+    }
+
+    batch_init(&d3d->batch, &d3d_batch_ops, d3d, BATCH_VERTICES);
+
+    /* quad and triangle indices, generated once */
+    indices = (USHORT *)mem_malloc(INDEX_SHARED_COUNT * sizeof(USHORT));
+    if (!indices)
+        return 0;
+
+    index_shared_fill(indices);
+
+    desc_buf.ByteWidth = INDEX_SHARED_COUNT * sizeof(USHORT);
+    desc_buf.Usage = D3D11_USAGE_IMMUTABLE;
+    desc_buf.BindFlags = D3D11_BIND_INDEX_BUFFER;
+    desc_buf.CPUAccessFlags = 0;
+    desc_buf.MiscFlags = 0;
+    desc_buf.StructureByteStride = 0;
+
+    sr_data.pSysMem = indices;
+    sr_data.SysMemPitch = 0U;
+    sr_data.SysMemSlicePitch = 0U;
+
+    res = ID3D11Device_CreateBuffer(d3d->d3d_device,
+                                    &desc_buf,
+                                    &sr_data,
+                                    &d3d->d3d_shared_index_buffer);
+    free(indices);
+    if (FAILED(res))
+    {
+        printf(" * CreateBuffer() failed 0x%lx\n", res);
+        return 0;
+    }
+
+    /* unit quad, shared by all the rectangles */
+    desc_buf.ByteWidth = sizeof(quad);
+    desc_buf.Usage = D3D11_USAGE_IMMUTABLE;
+    desc_buf.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+    desc_buf.CPUAccessFlags = 0;
+    desc_buf.MiscFlags = 0;
+    desc_buf.StructureByteStride = 0;
+
+    sr_data.pSysMem = quad;
+    sr_data.SysMemPitch = 0U;
+    sr_data.SysMemSlicePitch = 0U;
+
+    res = ID3D11Device_CreateBuffer(d3d->d3d_device,
+                                    &desc_buf,
+                                    &sr_data,
+                                    &d3d->d3d_rect_vertex_buffer);
+    if (FAILED(res))
+    {
+        printf(" * CreateBuffer() failed 0x%lx\n", res);
+        return 0;
+    }
+
+#ifdef HAVE_DEFERRED
+    {
+        int i;
+
+        for (i = 0; i < D3D_RECORD_CHUNKS; i++)
+        {
+            res = ID3D11Device_CreateDeferredContext(d3d->d3d_device, 0,
+                                                     d3d->d3d_deferred_ctx + i);
+            if (FAILED(res))
+            {
+                printf(" * CreateDeferredContext() failed 0x%lx\n", res);
+                return 0;
+            }
+        }
+    }
+#endif
+
+    return 1;
+}
+
+static int d3d_task_shader_objects(void *data)
+{
+    D3d_Startup *st = (D3d_Startup *)data;
+    D3d *d3d = st->d3d;
+    D3D11_INPUT_ELEMENT_DESC desc_ie[] =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+        { "COLOR", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, 2 * sizeof(FLOAT), D3D11_INPUT_PER_VERTEX_DATA, 0 }
+    };
+    D3D11_INPUT_ELEMENT_DESC desc_ie_rect[] =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+        { "RECT", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 0, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+        { "COLOR", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 1, 4 * sizeof(FLOAT), D3D11_INPUT_PER_INSTANCE_DATA, 1 }
+    };
+    D3D11_INPUT_ELEMENT_DESC desc_ie16[] =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R16G16_SINT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+        { "COLOR", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, 2 * sizeof(SHORT), D3D11_INPUT_PER_VERTEX_DATA, 0 }
+    };
+    HRESULT res;
+
+    /* Vertex shader */
+    res = ID3D11Device_CreateVertexShader(d3d->d3d_device,
+                                          st->vs_blob,
+                                          st->vs_size,
+                                          NULL,
+                                          &d3d->d3d_vertex_shader);
+    if (FAILED(res))
+    {
+        printf(" * CreateVertexShader() failed\n");
+        return 0;
+    }
+
+    /* create the input layout */
+    res = ID3D11Device_CreateInputLayout(d3d->d3d_device,
+                                         desc_ie,
+                                         sizeof(desc_ie) / sizeof(D3D11_INPUT_ELEMENT_DESC),
+                                         st->vs_blob,
+                                         st->vs_size,
+                                         &d3d->d3d_input_layout);
+    if (FAILED(res))
+    {
+        printf(" * CreateInputLayout() failed\n");
+        return 0;
+    }
+
+    /* Pixel shader */
+    res = ID3D11Device_CreatePixelShader(d3d->d3d_device,
+                                         st->ps_blob,
+                                         st->ps_size,
+                                         NULL,
+                                         &d3d->d3d_pixel_shader);
+    if (FAILED(res))
+    {
+        printf(" * CreatePixelShader() failed\n");
+        return 0;
+    }
+
+    /* instanced rectangles vertex shader */
+    res = ID3D11Device_CreateVertexShader(d3d->d3d_device,
+                                          st->rect_vs_blob,
+                                          st->rect_vs_size,
+                                          NULL,
+                                          &d3d->d3d_rect_vertex_shader);
+    if (FAILED(res))
+    {
+        printf(" * CreateVertexShader() failed\n");
+        return 0;
+    }
+
+    res = ID3D11Device_CreateInputLayout(d3d->d3d_device,
+                                         desc_ie_rect,
+                                         sizeof(desc_ie_rect) / sizeof(D3D11_INPUT_ELEMENT_DESC),
+                                         st->rect_vs_blob,
+                                         st->rect_vs_size,
+                                         &d3d->d3d_rect_input_layout);
+    if (FAILED(res))
+    {
+        printf(" * CreateInputLayout() failed\n");
+        return 0;
+    }
+
+    /* compact vertices vertex shader */
+    res = ID3D11Device_CreateVertexShader(d3d->d3d_device,
+                                          st->vs16_blob,
+                                          st->vs16_size,
+                                          NULL,
+                                          &d3d->d3d_vertex16_shader);
+    if (FAILED(res))
+    {
+        printf(" * CreateVertexShader() failed\n");
+        return 0;
+    }
+
+    res = ID3D11Device_CreateInputLayout(d3d->d3d_device,
+                                         desc_ie16,
+                                         sizeof(desc_ie16) / sizeof(D3D11_INPUT_ELEMENT_DESC),
+                                         st->vs16_blob,
+                                         st->vs16_size,
+                                         &d3d->d3d_input16_layout);
+    if (FAILED(res))
+    {
+        printf(" * CreateInputLayout() failed\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+D3d *d3d_init(Window *win, int vsync)
+{
+    Task tasks[D3D_TASK_LAST];
+    D3d_Startup st;
+    D3d *d3d;
+    int ret;
+
+    d3d = (D3d *)mem_calloc(1, sizeof(D3d));
+    if (!d3d)
+        return NULL;
+
+    d3d->vsync = vsync;
+    win->d3d = d3d;
+    resize_init(&d3d->resize);
+    state_cache_reset(&d3d->state);
+    arena_init(&d3d->frame, 0);
+
+    d3d->scene = scene_new();
+    if (!d3d->scene)
+    {
+        free(d3d);
+        return NULL;
+    }
+    /* compact vertices, decoded by main_vs16 */
+    scene_vertex_format_set(d3d->scene, VERTEX_FORMAT_SINT16);
+
+    memset(&st, 0, sizeof(D3d_Startup));
+    st.d3d = d3d;
+    st.win = win;
+
+    task_set(tasks + D3D_TASK_FACTORY, "factory",
+             d3d_task_factory, &st, 0U, 0);
+    task_set(tasks + D3D_TASK_DEVICE, "device",
+             d3d_task_device, &st, 0U, 0);
+    task_set(tasks + D3D_TASK_MODES, "display modes",
+             d3d_task_modes, &st, 1U << D3D_TASK_FACTORY, 0);
+    task_set(tasks + D3D_TASK_SHADERS, "shader bytecodes",
+             d3d_task_shaders, &st, 0U, 0);
+    task_set(tasks + D3D_TASK_SWAPCHAIN, "swapchain",
+             d3d_task_swapchain, &st,
+             (1U << D3D_TASK_FACTORY) | (1U << D3D_TASK_DEVICE) | (1U << D3D_TASK_MODES), 1);
+    task_set(tasks + D3D_TASK_RESOURCES, "resources",
+             d3d_task_resources, &st, 1U << D3D_TASK_SWAPCHAIN, 0);
+    task_set(tasks + D3D_TASK_SHADER_OBJECTS, "shader objects",
+             d3d_task_shader_objects, &st,
+             (1U << D3D_TASK_RESOURCES) | (1U << D3D_TASK_SHADERS), 0);
+
+    ret = task_graph_run(tasks, D3D_TASK_LAST, D3D_STARTUP_THREADS);
+
+#ifdef _DEBUG
+    task_graph_print(tasks, D3D_TASK_LAST);
+#endif
+
+    /* bytecodes not used anymore, new ones are saved */
+    if (st.cache)
+        shader_cache_close(st.cache);
+
+    if (!ret)
+    {
+        printf(" * d3d_init() failed\n");
+        fflush(stdout);
+        win->d3d = NULL;
+        d3d_shutdown(d3d);
+        return NULL;
+    }
+
+#ifdef HAVE_DEFERRED
+    /* without it, the scene is drawn by the immediate context */
+    d3d->record_pool = d3d_record_pool_new(D3D_RECORD_THREADS);
+#endif
+
+    return d3d;
+}
+
+void d3d_shutdown(D3d *d3d)
+{
+#ifdef _DEBUG
+    ID3D11Debug *d3d_debug;
+    HRESULT res;
+#endif
+
+    if (!d3d)
+        return;
+
+    /* d3d_init() may have failed before creating everything */
+#ifdef _DEBUG
+    res = E_FAIL;
+    if (d3d->d3d_device)
+        res = ID3D11Debug_QueryInterface(d3d->d3d_device, &IID_ID3D11Debug,
+                                         (void **)&d3d_debug);
+#endif
+
+#ifdef HAVE_DEFERRED
+    {
+        int i;
+
+        d3d_record_pool_free(d3d->record_pool);
+        for (i = 0; i < D3D_RECORD_CHUNKS; i++)
+        {
+            if (d3d->d3d_command_list[i])
+                ID3D11CommandList_Release(d3d->d3d_command_list[i]);
+            if (d3d->d3d_deferred_ctx[i])
+                ID3D11DeviceContext_Release(d3d->d3d_deferred_ctx[i]);
+        }
+    }
+#endif
+
+    if (d3d->d3d_scene_index_buffer)
+        ID3D11Buffer_Release(d3d->d3d_scene_index_buffer);
+    if (d3d->d3d_scene_vertex_buffer)
+        ID3D11Buffer_Release(d3d->d3d_scene_vertex_buffer);
+    if (d3d->d3d_rect_instance_buffer)
+        ID3D11Buffer_Release(d3d->d3d_rect_instance_buffer);
+    if (d3d->d3d_rect_vertex_buffer)
+        ID3D11Buffer_Release(d3d->d3d_rect_vertex_buffer);
+    if (d3d->d3d_rect_input_layout)
+        ID3D11InputLayout_Release(d3d->d3d_rect_input_layout);
+    if (d3d->d3d_rect_vertex_shader)
+        ID3D11VertexShader_Release(d3d->d3d_rect_vertex_shader);
+    if (d3d->d3d_shared_index_buffer)
+        ID3D11Buffer_Release(d3d->d3d_shared_index_buffer);
+    if (d3d->d3d_batch_vertex_buffer)
+        ID3D11Buffer_Release(d3d->d3d_batch_vertex_buffer);
+    if (d3d->d3d_const_buffer)
+        ID3D11Buffer_Release(d3d->d3d_const_buffer);
+    if (d3d->d3d_pixel_shader)
+        ID3D11PixelShader_Release(d3d->d3d_pixel_shader);
+    if (d3d->d3d_input16_layout)
+        ID3D11InputLayout_Release(d3d->d3d_input16_layout);
+    if (d3d->d3d_vertex16_shader)
+        ID3D11VertexShader_Release(d3d->d3d_vertex16_shader);
+    if (d3d->d3d_input_layout)
+        ID3D11InputLayout_Release(d3d->d3d_input_layout);
+    if (d3d->d3d_vertex_shader)
+        ID3D11VertexShader_Release(d3d->d3d_vertex_shader);
+    if (d3d->d3d_rasterizer_scissor_state)
+        ID3D11RasterizerState_Release(d3d->d3d_rasterizer_scissor_state);
+    if (d3d->d3d_rasterizer_state)
+        ID3D11RasterizerState_Release(d3d->d3d_rasterizer_state);
+    if (d3d->d3d_render_target_view)
+        ID3D11RenderTargetView_Release(d3d->d3d_render_target_view);
+    if (d3d->dxgi_swapchain)
+    {
+#ifdef HAVE_WIN10
+        IDXGISwapChain1_SetFullscreenState(d3d->dxgi_swapchain, FALSE, NULL);
+        IDXGISwapChain1_Release(d3d->dxgi_swapchain);
+#else
+        IDXGISwapChain_SetFullscreenState(d3d->dxgi_swapchain, FALSE, NULL);
+        IDXGISwapChain_Release(d3d->dxgi_swapchain);
+#endif
+    }
+#ifdef HAVE_WIN10
+    if (d3d->d3d_device_ctx1)
+        ID3D11DeviceContext1_Release(d3d->d3d_device_ctx1);
+#endif
+    if (d3d->d3d_device_ctx)
+        ID3D11DeviceContext_Release(d3d->d3d_device_ctx);
+    if (d3d->d3d_device)
+        ID3D11Device_Release(d3d->d3d_device);
+#ifdef HAVE_WIN10
+    if (d3d->dxgi_factory)
+        IDXGIFactory2_Release(d3d->dxgi_factory);
+#else
+    if (d3d->dxgi_factory)
+        IDXGIFactory_Release(d3d->dxgi_factory);
+#endif
+    arena_free(&d3d->frame);
+    scene_free(d3d->scene);
+    free(d3d);
+
+#ifdef _DEBUG
+    if (SUCCEEDED(res))
+    {
+        ID3D11Debug_ReportLiveDeviceObjects(d3d_debug, D3D11_RLDO_DETAIL);
+        ID3D11Debug_Release(d3d_debug);
+    }
+#endif
+}
+
+/*** resize ***/
+
+/* rotation and viewport constants, updated only when one has changed */
+static int d3d_constants_update(D3d *d3d, int rot, UINT width, UINT height)
+{
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    Const_Buffer *cb;
+    HRESULT res;
+    int ret;
+
+    ret = 0;
+    PROF_BEGIN(RESIZE_MAP);
+
+    res = ID3D11DeviceContext_Map(d3d->d3d_device_ctx,
+                                  (ID3D11Resource *)d3d->d3d_const_buffer,
+                                  0U, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
+
+    if (FAILED(res))
+    {
+        printf("Map() failed\n");
+        fflush(stdout);
+        goto end_map;
+    }
+
+    TRACE("rotation", rot, 0);
+
+    cb = (Const_Buffer *)mapped.pData;
+    rotation_matrix_set(cb->rotation, rot);
+    cb->viewport[0] = (float)width;
+    cb->viewport[1] = (float)height;
+    cb->viewport[2] = 0.0f;
+    cb->viewport[3] = 0.0f;
+
+    ID3D11DeviceContext_Unmap(d3d->d3d_device_ctx,
+                              (ID3D11Resource *)d3d->d3d_const_buffer,
+                              0U);
+
+    ret = 1;
+
+  end_map:
+    PROF_END(RESIZE_MAP);
+
+    return ret;
+}
+
+/* swap chain buffers, reallocated only when the size has changed */
+static int d3d_buffers_resize(D3d *d3d, UINT width, UINT height)
+{
+    D3D11_RENDER_TARGET_VIEW_DESC desc_rtv;
+    ID3D11Texture2D *back_buffer;
+    HRESULT res;
+    int ret;
+
+    /* each stage has one exit, through its PROF_END() */
+    ret = 0;
+    PROF_BEGIN(RESIZE_BUFFERS);
+
+    /* unset the render target view in the output merger */
+    ID3D11DeviceContext_OMSetRenderTargets(d3d->d3d_device_ctx,
+                                           0U, NULL, NULL);
+
+    /* release the render target view */
+    if (d3d->d3d_render_target_view)
+        ID3D11RenderTargetView_Release(d3d->d3d_render_target_view);
+    d3d->d3d_render_target_view = NULL;
+
+    /* resize the internal nuffers of the swapt chain to the new size */
+#ifdef HAVE_WIN10
+    res = IDXGISwapChain1_ResizeBuffers(d3d->dxgi_swapchain,
+                                        0U, /* preserve buffer count */
+                                        width, height,
+                                        DXGI_FORMAT_UNKNOWN, /* preserve format */
+                                        0U);
+#else
+    res = IDXGISwapChain_ResizeBuffers(d3d->dxgi_swapchain,
+                                       0U, /* preserve buffer count */
+                                       width, height,
+                                       DXGI_FORMAT_UNKNOWN, /* preserve format */
+                                       0U);
+#endif
+    if ((res == DXGI_ERROR_DEVICE_REMOVED) ||
+        (res == DXGI_ERROR_DEVICE_RESET) ||
+        (res == DXGI_ERROR_DRIVER_INTERNAL_ERROR))
+    {
+        goto end_buffers;
+    }
+
+    if (FAILED(res))
+    {
+        printf("ResizeBuffers() failed\n");
+        fflush(stdout);
+        goto end_buffers;
+    }
+
+    ret = 1;
+
+  end_buffers:
+    PROF_END(RESIZE_BUFFERS);
+    if (!ret)
+        return 0;
+
+    ret = 0;
+    PROF_BEGIN(RESIZE_RTV);
+
+    /* get the internal buffer of the swap chain */
+#ifdef HAVE_WIN10
+    res = IDXGISwapChain1_GetBuffer(d3d->dxgi_swapchain, 0,
+                                    &IID_ID3D11Texture2D,
+                                    (void **)&back_buffer);
+#else
+    res = IDXGISwapChain_GetBuffer(d3d->dxgi_swapchain, 0,
+                                   &IID_ID3D11Texture2D,
+                                   (void **)&back_buffer);
+#endif
+    if (FAILED(res))
+    {
+        printf("swapchain GetBuffer() failed\n");
+        fflush(stdout);
+        goto end_rtv;
+    }
+
+    ZeroMemory(&desc_rtv, sizeof(D3D11_RENDER_TARGET_VIEW_DESC));
+    desc_rtv.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc_rtv.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+
+    /* create the new render target view from this internal buffer */
+    res = ID3D11Device_CreateRenderTargetView(d3d->d3d_device,
+                                              (ID3D11Resource *)back_buffer,
+                                              &desc_rtv,
+                                              &d3d->d3d_render_target_view);
+
+    ID3D11Texture2D_Release(back_buffer);
+    if (FAILED(res))
+    {
+        printf("CreateRenderTargetView() failed\n");
+        fflush(stdout);
+        d3d->d3d_render_target_view = NULL;
+        goto end_rtv;
+    }
+
+    /* update the pipeline with the new render target view */
+    ID3D11DeviceContext_OMSetRenderTargets(d3d->d3d_device_ctx,
+                                           1U, &d3d->d3d_render_target_view,
+                                           NULL);
+
+    /* set viewport, depends on size of the window */
+    d3d->viewport.TopLeftX = 0.0f;
+    d3d->viewport.TopLeftY = 0.0f;
+    d3d->viewport.Width = (float)width;
+    d3d->viewport.Height = (float)height;
+    d3d->viewport.MinDepth = 0.0f;
+    d3d->viewport.MaxDepth = 1.0f;
+
+    /* update the pipeline with the new viewport */
+    ID3D11DeviceContext_RSSetViewports(d3d->d3d_device_ctx,
+                                       1U, &d3d->viewport);
+
+    ret = 1;
+
+  end_rtv:
+    PROF_END(RESIZE_RTV);
+
+    return ret;
+}
+
+/* pending size and rotation, at the start of a frame */
+static void d3d_resize_apply(D3d *d3d)
+{
+    unsigned int changes;
+    unsigned int done;
+    int constants;
+
+    changes = resize_pending(&d3d->resize);
+    if (changes == RESIZE_NONE)
+        return;
+
+    /*
+     * rotation and size are both in the constants, the vertices are in
+     * pixels: that is all that changes for the geometry
+     */
+    done = RESIZE_NONE;
+    constants = d3d_constants_update(d3d, d3d->resize.pending_rot,
+                                     d3d->resize.pending_width,
+                                     d3d->resize.pending_height);
+    if (constants)
+        done |= changes & RESIZE_ROTATION;
+    if ((changes & RESIZE_BUFFERS) &&
+        d3d_buffers_resize(d3d,
+                           d3d->resize.pending_width,
+                           d3d->resize.pending_height) &&
+        constants)
+        done |= RESIZE_BUFFERS;
+
+    /* new buffers, or rotated content */
+    if (done != RESIZE_NONE)
+        damage_full(&d3d->scene->damage);
+
+    resize_done(&d3d->resize, done);
+}
+
+/* only recorded, applied by the next d3d_render() */
+void d3d_resize(D3d *d3d, int rot, UINT width, UINT height)
+{
+    TRACE("resize", width, height);
+    resize_request(&d3d->resize, rot, width, height);
+}
+
+/*** scene ***/
+
+static ID3D11Buffer *d3d_scene_buffer_new(D3d *d3d, UINT bind,
+                                          const void *data, UINT size)
+{
+    D3D11_BUFFER_DESC desc;
+    D3D11_SUBRESOURCE_DATA sr_data;
+    ID3D11Buffer *buffer;
+    HRESULT res;
+
+    /* updated with UpdateSubresource(), only on the modified ranges */
+    desc.ByteWidth = size;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = bind;
+    desc.CPUAccessFlags = 0U;
+    desc.MiscFlags = 0U;
+    desc.StructureByteStride = 0U;
+
+    sr_data.pSysMem = data;
+    sr_data.SysMemPitch = 0U;
+    sr_data.SysMemSlicePitch = 0U;
+
+    res = ID3D11Device_CreateBuffer(d3d->d3d_device,
+                                    &desc,
+                                    &sr_data,
+                                    &buffer);
+    if (FAILED(res))
+    {
+        printf(" * CreateBuffer() failed 0x%lx\n", res);
+        fflush(stdout);
+        return NULL;
+    }
+
+    return buffer;
+}
+
+static void d3d_buffer_update(D3d *d3d, ID3D11Buffer *buffer,
+                              const void *data, UINT start, UINT size)
+{
+    D3D11_BOX box;
+
+    box.left = start;
+    box.right = start + size;
+    box.top = 0U;
+    box.bottom = 1U;
+    box.front = 0U;
+    box.back = 1U;
+    ID3D11DeviceContext_UpdateSubresource(d3d->d3d_device_ctx,
+                                          (ID3D11Resource *)buffer,
+                                          0U, &box,
+                                          data,
+                                          0U, 0U);
+}
+
+/*
+ * upload the modified parts of the scene. The buffers are only
+ * recreated when the scene has grown beyond their capacity, or when
+ * the indices change of size. They are in 16 bits while the vertices
+ * fit, the scene has its own index buffer as its primitives are
+ * interleaved: with the shared one, each run of a type would be a draw.
+ */
+static int d3d_scene_upload(D3d *d3d)
+{
+    Scene *s;
+    DXGI_FORMAT format;
+    UINT index_size;
+    unsigned int i;
+    int ret;
+
+    s = d3d->scene;
+
+    {
+        PROF_BEGIN(GEOMETRY);
+        ret = scene_update(s);
+        PROF_END(GEOMETRY);
+    }
+
+    /* no memory for the ranges: the frame is skipped, the next one retries */
+    if (!ret)
+        return 0;
+
+    ret = 0;
+    PROF_BEGIN(UPLOAD);
+
+    if (s->vertices_count * s->vertex_size > d3d->scene_vertices_bytes)
+    {
+        ID3D11Buffer *buffer;
+
+        buffer = d3d_scene_buffer_new(d3d, D3D11_BIND_VERTEX_BUFFER,
+                                      s->vertices,
+                                      s->vertices_size * s->vertex_size);
+        if (!buffer)
+            goto end_upload;
+
+        if (d3d->d3d_scene_vertex_buffer)
+            ID3D11Buffer_Release(d3d->d3d_scene_vertex_buffer);
+        d3d->d3d_scene_vertex_buffer = buffer;
+        d3d->scene_vertices_bytes = s->vertices_size * s->vertex_size;
+        /* whole content already uploaded */
+        s->ranges_count = 0;
+    }
+
+    format = (s->vertices_count <= INDEX16_VERTICES_MAX) ?
+             DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+    index_size = (format == DXGI_FORMAT_R16_UINT) ?
+                 sizeof(USHORT) : sizeof(unsigned int);
+    if (format != d3d->scene_index_format)
+    {
+        /* all the indices again, in a new buffer */
+        d3d->scene_index_format = format;
+        d3d->scene_indices_size = 0;
+    }
+
+    if (s->indices_count > d3d->scene_indices_size)
+    {
+        ID3D11Buffer *buffer;
+        USHORT *indices16 = NULL;
+
+        if (format == DXGI_FORMAT_R16_UINT)
+        {
+            indices16 = (USHORT *)mem_malloc(s->indices_size * sizeof(USHORT));
+            if (!indices16)
+                goto end_upload;
+            index16_convert(s->indices, s->indices_count, indices16);
+        }
+
+        buffer = d3d_scene_buffer_new(d3d, D3D11_BIND_INDEX_BUFFER,
+                                      indices16 ? (const void *)indices16 :
+                                                  (const void *)s->indices,
+                                      s->indices_size * index_size);
+        free(indices16);
+        if (!buffer)
+            goto end_upload;
+
+        if (d3d->d3d_scene_index_buffer)
+            ID3D11Buffer_Release(d3d->d3d_scene_index_buffer);
+        d3d->d3d_scene_index_buffer = buffer;
+        d3d->scene_indices_size = s->indices_size;
+        s->indices_clean = s->indices_count;
+    }
+
+    for (i = 0; i < s->ranges_count; i++)
+    {
+        d3d_buffer_update(d3d, d3d->d3d_scene_vertex_buffer,
+                          (const BYTE *)s->vertices +
+                          s->ranges[i].first * s->vertex_size,
+                          s->ranges[i].first * s->vertex_size,
+                          s->ranges[i].count * s->vertex_size);
+    }
+
+    /* indices of the primitives added since the last upload */
+    if (s->indices_clean < s->indices_count)
+    {
+        unsigned int count = s->indices_count - s->indices_clean;
+        const void *data = s->indices + s->indices_clean;
+
+        if (format == DXGI_FORMAT_R16_UINT)
+        {
+            USHORT *indices16;
+
+            indices16 = (USHORT *)arena_alloc(&d3d->frame, count * sizeof(USHORT));
+            if (!indices16)
+                goto end_upload;
+            index16_convert(s->indices + s->indices_clean, count, indices16);
+            data = indices16;
+        }
+
+        d3d_buffer_update(d3d, d3d->d3d_scene_index_buffer,
+                          data,
+                          s->indices_clean * index_size,
+                          count * index_size);
+    }
+
+    scene_clean(s);
+    ret = 1;
+
+  end_upload:
+    PROF_END(UPLOAD);
+
+    return ret;
+}
+
+/*** state, redundant binds are dropped ***/
+
+static void d3d_topology_set(D3d *d3d, D3D11_PRIMITIVE_TOPOLOGY topology)
+{
+    if (state_cache_set(&d3d->state, STATE_TOPOLOGY, NULL, topology))
+        ID3D11DeviceContext_IASetPrimitiveTopology(d3d->d3d_device_ctx,
+                                                   topology);
+}
+
+static void d3d_input_layout_set(D3d *d3d, ID3D11InputLayout *layout)
+{
+    if (state_cache_set(&d3d->state, STATE_INPUT_LAYOUT, layout, 0))
+        ID3D11DeviceContext_IASetInputLayout(d3d->d3d_device_ctx,
+                                             layout);
+}
+
+/* slot 0 or 1, offset 0 */
+static void d3d_vertex_buffer_set(D3d *d3d, UINT slot,
+                                  ID3D11Buffer *buffer, UINT stride)
+{
+    const UINT offset = 0U;
+
+    if (state_cache_set(&d3d->state, STATE_VERTEX_BUFFER_0 + slot,
+                        buffer, stride))
+        ID3D11DeviceContext_IASetVertexBuffers(d3d->d3d_device_ctx,
+                                               slot,
+                                               1,
+                                               &buffer,
+                                               &stride,
+                                               &offset);
+}
+
+static void d3d_index_buffer_set(D3d *d3d,
+                                 ID3D11Buffer *buffer, DXGI_FORMAT format)
+{
+    if (state_cache_set(&d3d->state, STATE_INDEX_BUFFER, buffer, format))
+        ID3D11DeviceContext_IASetIndexBuffer(d3d->d3d_device_ctx,
+                                             buffer,
+                                             format,
+                                             0);
+}
+
+static void d3d_vs_set(D3d *d3d, ID3D11VertexShader *vs)
+{
+    if (state_cache_set(&d3d->state, STATE_VS, vs, 0))
+        ID3D11DeviceContext_VSSetShader(d3d->d3d_device_ctx,
+                                        vs,
+                                        NULL,
+                                        0);
+}
+
+static void d3d_vs_constant_buffer_set(D3d *d3d, ID3D11Buffer *buffer)
+{
+    if (state_cache_set(&d3d->state, STATE_VS_CONSTANT_BUFFER, buffer, 0))
+        ID3D11DeviceContext_VSSetConstantBuffers(d3d->d3d_device_ctx,
+                                                 0,
+                                                 1,
+                                                 &buffer);
+}
+
+static void d3d_rasterizer_set(D3d *d3d, ID3D11RasterizerState *rs)
+{
+    if (state_cache_set(&d3d->state, STATE_RASTERIZER, rs, 0))
+        ID3D11DeviceContext_RSSetState(d3d->d3d_device_ctx,
+                                       rs);
+}
+
+static void d3d_ps_set(D3d *d3d, ID3D11PixelShader *ps)
+{
+    if (state_cache_set(&d3d->state, STATE_PS, ps, 0))
+        ID3D11DeviceContext_PSSetShader(d3d->d3d_device_ctx,
+                                        ps,
+                                        NULL,
+                                        0);
+}
+
+/*** immediate mode rendering ***/
+
+/* input layout and vertex shader of the retained scene */
+static void d3d_scene_shaders_get(const D3d *d3d,
+                                  ID3D11InputLayout **layout,
+                                  ID3D11VertexShader **vs)
+{
+    if (d3d->scene->format == VERTEX_FORMAT_SINT16)
+    {
+        *layout = d3d->d3d_input16_layout;
+        *vs = d3d->d3d_vertex16_shader;
+    }
+    else
+    {
+        *layout = d3d->d3d_input_layout;
+        *vs = d3d->d3d_vertex_shader;
+    }
+}
+
+static void d3d_batch_bind(D3d *d3d)
+{
+    /* appended primitives are merged in one draw: list, not strip */
+    d3d_topology_set(d3d, D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    d3d_input_layout_set(d3d, d3d->d3d_input_layout);
+    d3d_vertex_buffer_set(d3d, 0, d3d->d3d_batch_vertex_buffer,
+                          sizeof(Vertex));
+    d3d_index_buffer_set(d3d, d3d->d3d_shared_index_buffer,
+                         DXGI_FORMAT_R16_UINT);
+    d3d_vs_set(d3d, d3d->d3d_vertex_shader);
+}
+
+static void d3d_rect_bind(D3d *d3d)
+{
+    d3d_topology_set(d3d, D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    d3d_input_layout_set(d3d, d3d->d3d_rect_input_layout);
+    d3d_vertex_buffer_set(d3d, 0, d3d->d3d_rect_vertex_buffer,
+                          2 * sizeof(FLOAT));
+    d3d_vertex_buffer_set(d3d, 1, d3d->d3d_rect_instance_buffer,
+                          sizeof(Rect_Instance));
+    d3d_index_buffer_set(d3d, d3d->d3d_shared_index_buffer,
+                         DXGI_FORMAT_R16_UINT);
+    d3d_vs_set(d3d, d3d->d3d_rect_vertex_shader);
+}
+
+/* write the instance records of all the rectangles of the scene */
+static int d3d_rect_instances_upload(D3d *d3d)
+{
+    D3D11_MAPPED_SUBRESOURCE mapped;
+    HRESULT res;
+
+    if (d3d->scene->rects_count > d3d->rect_instances_size)
+    {
+        D3D11_BUFFER_DESC desc;
+        ID3D11Buffer *buffer;
+        UINT size;
+
+        size = d3d->rect_instances_size ? d3d->rect_instances_size : 1024U;
+        while (size < d3d->scene->rects_count)
+            size *= 2U;
+
+        desc.ByteWidth = size * sizeof(Rect_Instance);
+        desc.Usage = D3D11_USAGE_DYNAMIC;
+        desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        desc.MiscFlags = 0U;
+        desc.StructureByteStride = 0U;
+
+        res = ID3D11Device_CreateBuffer(d3d->d3d_device,
+                                        &desc,
+                                        NULL,
+                                        &buffer);
+        if (FAILED(res))
+        {
+            printf(" * CreateBuffer() failed 0x%lx\n", res);
+            fflush(stdout);
+            return 0;
+        }
+
+        if (d3d->d3d_rect_instance_buffer)
+            ID3D11Buffer_Release(d3d->d3d_rect_instance_buffer);
+        d3d->d3d_rect_instance_buffer = buffer;
+        d3d->rect_instances_size = size;
+    }
+
+    if (d3d->scene->rects_count == 0)
+        return 1;
+
+    res = ID3D11DeviceContext_Map(d3d->d3d_device_ctx,
+                                  (ID3D11Resource *)d3d->d3d_rect_instance_buffer,
+                                  0U, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
+    if (FAILED(res))
+    {
+        printf("Map() failed\n");
+        fflush(stdout);
+        return 0;
+    }
+
+    scene_rect_instances_build(d3d->scene, (Rect_Instance *)mapped.pData);
+
+    ID3D11DeviceContext_Unmap(d3d->d3d_device_ctx,
+                              (ID3D11Resource *)d3d->d3d_rect_instance_buffer,
+                              0U);
+
+    return 1;
+}
+
+/*** retained mode rendering ***/
+
+static D3D11_PRIMITIVE_TOPOLOGY d3d_scene_topology(const Scene *s)
+{
+    return (s->topology == TOPOLOGY_STRIP) ?
+        D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP :
+        D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
+}
+
+/*
+ * the visible primitives of a chunk, the state is already set on ctx.
+ * The indices of consecutive primitives are consecutive, with the strip
+ * cuts: one draw per run of them, one for the whole chunk if all are
+ * visible.
+ */
+static void d3d_scene_draw(ID3D11DeviceContext *ctx, const Scene *s,
+                           const Chunk *c)
+{
+    unsigned int end;
+    unsigned int i;
+
+    end = c->first + c->count;
+    i = c->first;
+    while (i < end)
+    {
+        const Prim *first;
+        const Prim *last;
+
+        first = s->prims + s->visible[i];
+        for (i++; (i < end) && (s->visible[i] == s->visible[i - 1] + 1); i++)
+            ;
+        last = s->prims + s->visible[i - 1];
+        ID3D11DeviceContext_DrawIndexed(ctx,
+                                        last->first_index + last->index_count -
+                                        first->first_index,
+                                        first->first_index, 0);
+    }
+}
+
+#ifdef HAVE_WIN10
+
+/*
+ * damaged rects only: each one is cleared, then the primitives whose box
+ * intersects it are drawn with the scissor set to it. rects are in
+ * target pixels, boxes are compared in target pixels too.
+ */
+static void d3d_scene_draw_damaged(D3d *d3d, const D3D11_RECT *rects,
+                                   unsigned int count, const float m[2][4],
+                                   int w, int h)
+{
+    const FLOAT color[4] = { 0.10f, 0.18f, 0.24f, 1.0f };
+    const Scene *s = d3d->scene;
+    unsigned int i;
+    unsigned int k;
+
+    if (count == 0)
+        return;
+
+    ID3D11DeviceContext1_ClearView(d3d->d3d_device_ctx1,
+                                   (ID3D11View *)d3d->d3d_render_target_view,
+                                   color, rects, count);
+    d3d_rasterizer_set(d3d, d3d->d3d_rasterizer_scissor_state);
+
+    for (k = 0; k < count; k++)
+    {
+        Damage_Rect t;
+
+        t.x0 = rects[k].left;
+        t.y0 = rects[k].top;
+        t.x1 = rects[k].right;
+        t.y1 = rects[k].bottom;
+        ID3D11DeviceContext_RSSetScissorRects(d3d->d3d_device_ctx, 1,
+                                              rects + k);
+
+        for (i = 0; i < s->visible_count; i++)
+        {
+            const Prim *p = s->prims + s->visible[i];
+            Damage_Rect box;
+            Damage_Rect mapped;
+
+            scene_prim_box(p, &box);
+            if (!damage_rect_map(&box, m, w, h, &mapped) ||
+                !damage_rect_intersect(&mapped, &t))
+                continue;
+
+            ID3D11DeviceContext_DrawIndexed(d3d->d3d_device_ctx,
+                                            p->index_count,
+                                            p->first_index, 0);
+        }
+    }
+}
+
+#endif
+
+#ifdef HAVE_DEFERRED
+
+typedef struct
+{
+    D3d *d3d;
+    Chunk chunk;
+    int index; /* deferred context and command list */
+} D3d_Record;
+
+/* task: a deferred context starts without any state, all is set */
+static int d3d_record_chunk(void *data)
+{
+    D3d_Record *rec = (D3d_Record *)data;
+    D3d *d3d = rec->d3d;
+    ID3D11DeviceContext *ctx = d3d->d3d_deferred_ctx[rec->index];
+    ID3D11InputLayout *layout;
+    ID3D11VertexShader *vs;
+    const UINT stride = d3d->scene->vertex_size;
+    const UINT offset = 0U;
+    HRESULT res;
+
+    TRACE_BEGIN("record", rec->chunk.first, rec->chunk.count);
+
+    d3d_scene_shaders_get(d3d, &layout, &vs);
+    ID3D11DeviceContext_IASetPrimitiveTopology(ctx,
+                                               d3d_scene_topology(d3d->scene));
+    ID3D11DeviceContext_IASetInputLayout(ctx, layout);
+    ID3D11DeviceContext_IASetVertexBuffers(ctx, 0, 1,
+                                           &d3d->d3d_scene_vertex_buffer,
+                                           &stride, &offset);
+    ID3D11DeviceContext_IASetIndexBuffer(ctx, d3d->d3d_scene_index_buffer,
+                                         d3d->scene_index_format, 0);
+    ID3D11DeviceContext_VSSetShader(ctx, vs, NULL, 0);
+    ID3D11DeviceContext_VSSetConstantBuffers(ctx, 0, 1,
+                                             &d3d->d3d_const_buffer);
+    ID3D11DeviceContext_RSSetState(ctx, d3d->d3d_rasterizer_state);
+    ID3D11DeviceContext_RSSetViewports(ctx, 1, &d3d->viewport);
+    ID3D11DeviceContext_PSSetShader(ctx, d3d->d3d_pixel_shader, NULL, 0);
+    ID3D11DeviceContext_OMSetRenderTargets(ctx, 1,
+                                           &d3d->d3d_render_target_view,
+                                           NULL);
+
+    d3d_scene_draw(ctx, d3d->scene, &rec->chunk);
+
+    res = ID3D11DeviceContext_FinishCommandList(ctx, FALSE,
+                                                d3d->d3d_command_list + rec->index);
+
+    TRACE_END("record");
+
+    return SUCCEEDED(res);
+}
+
+/*
+ * recording workers, created by d3d_init() and kept for all the frames,
+ * so that a frame neither creates threads nor allocates their trace
+ * buffers. The chunks of a frame are taken in order by all the workers,
+ * the calling thread being the worker 0.
+ */
+
+typedef struct
+{
+    D3d_Record_Pool *pool;
+    int index;
+} D3d_Record_Worker;
+
+struct D3d_Record_Pool
+{
+    HANDLE threads[D3D_RECORD_THREADS];
+    D3d_Record_Worker workers[D3D_RECORD_THREADS];
+    int count; /* number of workers, the calling thread is the worker 0 */
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE start;
+    CONDITION_VARIABLE done;
+    unsigned int generation; /* incremented for each frame */
+    int running; /* threads still recording the current frame */
+    int quit;
+    /* current frame */
+    D3d_Record *recs;
+    LONG recs_count;
+    volatile LONG next; /* next chunk to record */
+    volatile LONG failed;
+};
+
+static void d3d_record_pool_work(D3d_Record_Pool *p)
+{
+    LONG i;
+
+    while ((i = InterlockedIncrement(&p->next) - 1) < p->recs_count)
+    {
+        if (!d3d_record_chunk(p->recs + i))
+            InterlockedExchange(&p->failed, 1);
+    }
+}
+
+static DWORD WINAPI d3d_record_pool_thread(LPVOID data)
+{
+    D3d_Record_Worker *w;
+    D3d_Record_Pool *p;
+    unsigned int generation;
+
+    w = (D3d_Record_Worker *)data;
+    p = w->pool;
+    /* trace buffer allocated once, at startup */
+    TRACE_THREAD();
+
+    generation = 0;
+    EnterCriticalSection(&p->lock);
+    while (1)
+    {
+        while (!p->quit && (p->generation == generation))
+            SleepConditionVariableCS(&p->start, &p->lock, INFINITE);
+        if (p->quit)
+            break;
+        generation = p->generation;
+        LeaveCriticalSection(&p->lock);
+
+        d3d_record_pool_work(p);
+
+        EnterCriticalSection(&p->lock);
+        if (--p->running == 0)
+            WakeConditionVariable(&p->done);
+    }
+    LeaveCriticalSection(&p->lock);
+
+    return 0;
+}
+
+static void d3d_record_pool_free(D3d_Record_Pool *p)
+{
+    int i;
+
+    if (!p)
+        return;
+
+    EnterCriticalSection(&p->lock);
+    p->quit = 1;
+    WakeAllConditionVariable(&p->start);
+    LeaveCriticalSection(&p->lock);
+
+    for (i = 1; i < p->count; i++)
+    {
+        WaitForSingleObject(p->threads[i], INFINITE);
+        CloseHandle(p->threads[i]);
+    }
+
+    DeleteCriticalSection(&p->lock);
+    free(p);
+}
+
+static D3d_Record_Pool *d3d_record_pool_new(int count)
+{
+    D3d_Record_Pool *p;
+    int i;
+
+    p = (D3d_Record_Pool *)mem_calloc(1, sizeof(D3d_Record_Pool));
+    if (!p)
+        return NULL;
+
+    InitializeCriticalSection(&p->lock);
+    InitializeConditionVariable(&p->start);
+    InitializeConditionVariable(&p->done);
+
+    p->count = 1;
+    for (i = 1; i < count; i++)
+    {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        p->threads[i] = CreateThread(NULL, 0, d3d_record_pool_thread,
+                                     p->workers + i, 0, NULL);
+        if (!p->threads[i])
+            break;
+        p->count++;
+    }
+
+    return p;
+}
+
+/* records the chunks, returns 1 if they all have been recorded */
+static int d3d_record_pool_run(D3d_Record_Pool *p,
+                               D3d_Record *recs, unsigned int count)
+{
+    p->recs = recs;
+    p->recs_count = (LONG)count;
+    p->next = 0;
+    p->failed = 0;
+
+    EnterCriticalSection(&p->lock);
+    p->running = p->count - 1;
+    p->generation++;
+    WakeAllConditionVariable(&p->start);
+    LeaveCriticalSection(&p->lock);
+
+    d3d_record_pool_work(p);
+
+    EnterCriticalSection(&p->lock);
+    while (p->running > 0)
+        SleepConditionVariableCS(&p->done, &p->lock, INFINITE);
+    LeaveCriticalSection(&p->lock);
+
+    return !p->failed;
+}
+
+/*
+ * chunks recorded in parallel, then executed in order. Returns 0 if the
+ * scene is too small, without workers, or if a recording has failed:
+ * nothing has been drawn then.
+ */
+static int d3d_render_recorded(D3d *d3d)
+{
+    D3d_Record recs[D3D_RECORD_CHUNKS];
+    Chunk chunks[D3D_RECORD_CHUNKS];
+    unsigned int count;
+    unsigned int i;
+    int ok;
+
+    if (!d3d->record_pool)
+        return 0;
+
+    count = chunks_split(chunks, D3D_RECORD_CHUNKS,
+                         d3d->scene->visible_count, d3d->record_pool->count,
+                         D3D_RECORD_MIN);
+    if (count < 2)
+        return 0;
+
+    for (i = 0; i < count; i++)
+    {
+        recs[i].d3d = d3d;
+        recs[i].chunk = chunks[i];
+        recs[i].index = i;
+    }
+
+    ok = d3d_record_pool_run(d3d->record_pool, recs, count);
+
+    /* replay in chunk order, the state of the immediate context is kept */
+    for (i = 0; i < count; i++)
+    {
+        if (!d3d->d3d_command_list[i])
+            continue;
+
+        if (ok)
+            ID3D11DeviceContext_ExecuteCommandList(d3d->d3d_device_ctx,
+                                                   d3d->d3d_command_list[i],
+                                                   TRUE);
+        ID3D11CommandList_Release(d3d->d3d_command_list[i]);
+        d3d->d3d_command_list[i] = NULL;
+    }
+
+    return ok;
+}
+
+#endif
+
+/*
+ * append the visible primitives to the ring buffers. In instanced mode,
+ * each run of consecutive rectangles is drawn with one DrawIndexedInstanced(), the
+ * scene order is kept.
+ */
+static void d3d_render_immediate(D3d *d3d)
+{
+    Batch *bt = &d3d->batch;
+    unsigned int instanced;
+    unsigned int run_first;
+    unsigned int run_count;
+    unsigned int i;
+
+    instanced = (d3d->mode == RENDER_INSTANCED);
+    if (instanced && !d3d_rect_instances_upload(d3d))
+        instanced = 0;
+
+    d3d_batch_bind(d3d);
+    batch_begin(bt);
+
+    run_first = 0;
+    run_count = 0;
+    for (i = 0; i < d3d->scene->visible_count; i++)
+    {
+        const Prim *p = d3d->scene->prims + d3d->scene->visible[i];
+
+        if (p->type == PRIM_TRIANGLE)
+        {
+            if (run_count)
+            {
+                ID3D11DeviceContext_DrawIndexedInstanced(d3d->d3d_device_ctx,
+                                                         6U, run_count,
+                                                         INDEX_QUADS_FIRST, 0,
+                                                         run_first);
+                run_first += run_count;
+                run_count = 0;
+                d3d_batch_bind(d3d);
+            }
+            batch_triangle(bt,
+                           p->p[0], p->p[1],
+                           p->p[2], p->p[3],
+                           p->p[4], p->p[5],
+                           p->r, p->g, p->b, p->a);
+        }
+        else if (instanced)
+        {
+            if (!run_count)
+            {
+                /* draw the pending triangles first */
+                batch_flush(bt);
+                d3d_rect_bind(d3d);
+            }
+            run_count++;
+        }
+        else
+            batch_rectangle(bt,
+                            p->p[0], p->p[1],
+                            p->p[2], p->p[3],
+                            p->r, p->g, p->b, p->a);
+    }
+
+    if (run_count)
+        ID3D11DeviceContext_DrawIndexedInstanced(d3d->d3d_device_ctx,
+                                                 6U, run_count,
+                                                 INDEX_QUADS_FIRST, 0,
+                                                 run_first);
+    else
+        batch_flush(bt);
+}
+
+void d3d_render(D3d *d3d)
+{
+#ifdef HAVE_WIN10
+    DXGI_PRESENT_PARAMETERS pp;
+    Damage_Region redraw;
+    Damage_Region present;
+    D3D11_RECT redraw_rects[DAMAGE_RECTS_MAX];
+    RECT present_rects[DAMAGE_RECTS_MAX];
+    unsigned int redraw_count = 0;
+    unsigned int present_count = 0;
+    unsigned int i;
+#endif
+    const FLOAT color[4] = { 0.10f, 0.18f, 0.24f, 1.0f };
+    float m[2][4];
+    HRESULT res;
+    int partial = 0; /* only the damaged rects are redrawn */
+    int w;
+    int h;
+
+    FCT;
+
+    PROF_BEGIN(FRAME);
+
+    d3d_frame_start(d3d);
+    d3d_resize_apply(d3d);
+    if (!d3d->d3d_render_target_view)
+        goto end_frame;
+
+    state_cache_frame(&d3d->state);
+    TRACE("state calls", d3d->state.last_issued, d3d->state.last_elided);
+
+    /* size of the buffers, set by the last resize, no query */
+    w = (int)d3d->viewport.Width;
+    h = (int)d3d->viewport.Height;
+
+    TRACE("swapchain size", w, h);
+
+    /* scene geometry: only what has changed is uploaded */
+    scene_size_set(d3d->scene, w, h);
+    if ((d3d->mode == RENDER_RETAINED) && !d3d_scene_upload(d3d))
+        goto end_frame;
+
+    /* only the primitives in the rotated viewport are submitted */
+    rotation_matrix_set(m, d3d->resize.rot);
+    scene_visible_update(d3d->scene, m);
+
+#ifdef HAVE_WIN10
+    /* damaged rects, in target pixels, in retained mode */
+    damage_frame(&d3d->scene->damage, &redraw, &present);
+    partial = (d3d->mode == RENDER_RETAINED) &&
+              d3d->d3d_device_ctx1 && !redraw.full;
+    if (partial)
+    {
+        for (i = 0; i < redraw.count; i++)
+        {
+            Damage_Rect t;
+
+            if (!damage_rect_map(redraw.rects + i, m, w, h, &t))
+                continue;
+            redraw_rects[redraw_count].left = t.x0;
+            redraw_rects[redraw_count].top = t.y0;
+            redraw_rects[redraw_count].right = t.x1;
+            redraw_rects[redraw_count].bottom = t.y1;
+            redraw_count++;
+        }
+        for (i = 0; !present.full && (i < present.count); i++)
+        {
+            Damage_Rect t;
+
+            if (!damage_rect_map(present.rects + i, m, w, h, &t))
+                continue;
+            present_rects[present_count].left = t.x0;
+            present_rects[present_count].top = t.y0;
+            present_rects[present_count].right = t.x1;
+            present_rects[present_count].bottom = t.y1;
+            present_count++;
+        }
+    }
+    TRACE("damage", partial ? redraw_count : w * h, present_count);
+#endif
+
+    /* clear render target, the damaged rects are cleared when drawn */
+    if (!partial)
+    {
+        PROF_BEGIN(CLEAR);
+        ID3D11DeviceContext_ClearRenderTargetView(d3d->d3d_device_ctx,
+                                                  d3d->d3d_render_target_view,
+                                                  color);
+        PROF_END(CLEAR);
+    }
+
+    PROF_BEGIN(STATE);
+
+    /* Input Assembler (IA) stage, and vertex shader stage */
+    {
+        ID3D11InputLayout *layout = d3d->d3d_input_layout;
+        ID3D11VertexShader *vs = d3d->d3d_vertex_shader;
+
+        if (d3d->mode == RENDER_RETAINED)
+            d3d_scene_shaders_get(d3d, &layout, &vs);
+        d3d_input_layout_set(d3d, layout);
+        d3d_vs_set(d3d, vs);
+    }
+    d3d_vs_constant_buffer_set(d3d, d3d->d3d_const_buffer);
+
+    /*
+     * Rasterizer Stage
+     *
+     * RSSetViewports() called in the resize() callback
+     */
+    d3d_rasterizer_set(d3d, d3d->d3d_rasterizer_state);
+    /* pixel shader stage */
+    d3d_ps_set(d3d, d3d->d3d_pixel_shader);
+
+    /*
+     * Output Merger stage
+     *
+     * OMSetRenderTargets() called in the resize() calback
+     */
+
+    PROF_END(STATE);
+
+    PROF_BEGIN(DRAW);
+
+    /* scene */
+    if (d3d->mode != RENDER_RETAINED)
+        d3d_render_immediate(d3d);
+#ifdef HAVE_DEFERRED
+    else if (!partial && d3d_render_recorded(d3d))
+        ;
+#endif
+    else if (d3d->scene->visible_count > 0)
+    {
+        /* Input Assembler (IA) stage */
+        d3d_topology_set(d3d, d3d_scene_topology(d3d->scene));
+        d3d_vertex_buffer_set(d3d, 0, d3d->d3d_scene_vertex_buffer,
+                              d3d->scene->vertex_size);
+        d3d_index_buffer_set(d3d, d3d->d3d_scene_index_buffer,
+                             d3d->scene_index_format);
+
+        /* draw */
+#ifdef HAVE_WIN10
+        if (partial)
+            d3d_scene_draw_damaged(d3d, redraw_rects, redraw_count, m, w, h);
+        else
+#endif
+        {
+            Chunk all;
+
+            all.first = 0;
+            all.count = d3d->scene->visible_count;
+            d3d_scene_draw(d3d->d3d_device_ctx, d3d->scene, &all);
+        }
+    }
+
+    PROF_END(DRAW);
+
+    PROF_BEGIN(PRESENT);
+
+    /*
+     * present frame, that is, flip the back buffer and the front buffer
+     * if no vsync, we present immediatly
+     */
+#ifdef HAVE_WIN10
+    /* no rect: the whole frame */
+    pp.DirtyRectsCount = present_count;
+    pp.pDirtyRects = present_count ? present_rects : NULL;
+    pp.pScrollRect = NULL;
+    pp.pScrollOffset = NULL;
+    res = IDXGISwapChain1_Present1(d3d->dxgi_swapchain,
+                                   d3d->vsync ? 1 : 0, 0, &pp);
+#else
+    res = IDXGISwapChain_Present(d3d->dxgi_swapchain,
+                                 d3d->vsync ? 1 : 0, 0);
+#endif
+
+    PROF_END(PRESENT);
+
+    if (res == DXGI_ERROR_DEVICE_RESET || res == DXGI_ERROR_DEVICE_REMOVED)
+    {
+        printf("device removed or lost, need to recreate everything\n");
+        fflush(stdout);
+    }
+    else if (res == DXGI_STATUS_OCCLUDED)
+    {
+        /* each frame while the window is not visible: no console output */
+        TRACE("occluded", 0, 0);
+    }
+
+  end_frame:
+    PROF_END(FRAME);
+}
+
+
+/*** render thread ***/
+
+/* sleep until a deadline, more precise than a timeout in ms */
+static HANDLE render_timer_new(void)
+{
+    HANDLE timer = NULL;
+
+#ifdef HAVE_WIN10
+    timer = CreateWaitableTimerExW(NULL, NULL,
+                                   CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                   TIMER_ALL_ACCESS);
+    if (!timer)
+#endif
+        timer = CreateWaitableTimer(NULL, TRUE, NULL);
+
+    return timer;
+}
+
+/* wait for the next frame (pace_wait()), or for event, or for a message */
+static void render_wait(HANDLE timer, HANDLE event,
+                        unsigned long long wait, int messages)
+{
+    HANDLE handles[2];
+    DWORD count = 0;
+    DWORD ms = INFINITE;
+
+    if (wait == 0)
+        return;
+
+    if (event)
+        handles[count++] = event;
+
+    if (wait != PACE_WAIT_EVENT)
+    {
+        if (timer)
+        {
+            LARGE_INTEGER due;
+
+            /* relative time, in 100 ns */
+            due.QuadPart = -(LONGLONG)(wait / 100ULL);
+            SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE);
+            handles[count++] = timer;
+        }
+        else
+            ms = (DWORD)(wait / 1000000ULL);
+    }
+
+    if (messages)
+        MsgWaitForMultipleObjectsEx(count, handles, ms,
+                                    QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    else
+        WaitForMultipleObjects(count, handles, FALSE, ms);
+}
+
+/*
+ * owns the device and the context once started: the window thread only
+ * posts commands, so a slow frame does not delay the input, and a
+ * burst of input does not delay the frames
+ */
+static DWORD WINAPI render_thread(LPVOID data)
+{
+    Render *r = (Render *)data;
+    Window *win = r->win;
+    int quit = 0;
+
+    while (!quit)
+    {
+        Cmd c;
+
+        render_wait(r->timer, r->event, pace_wait(win->pace), 0);
+
+        while (cmd_queue_pop(&r->queue, &c))
+        {
+            if (c.type == CMD_QUIT)
+                quit = 1;
+            else
+                cmd_execute(win, &c);
+        }
+
+        if (!quit && pace_frame_begin(win->pace))
+        {
+            d3d_render(win->d3d);
+            pace_frame_end(win->pace);
+        }
+    }
+
+    return 0;
+}
+
+static Render *render_new(Window *win)
+{
+    Render *r;
+
+    r = (Render *)mem_calloc(1, sizeof(Render));
+    if (!r)
+        return NULL;
+
+    cmd_queue_init(&r->queue);
+    r->win = win;
+
+    /* auto reset: a push while a frame is rendered is not lost */
+    r->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!r->event)
+        goto free_r;
+
+    r->timer = render_timer_new();
+
+    r->thread = CreateThread(NULL, 0, render_thread, r, 0, NULL);
+    if (!r->thread)
+        goto close_event;
+
+    return r;
+
+  close_event:
+    if (r->timer)
+        CloseHandle(r->timer);
+    CloseHandle(r->event);
+  free_r:
+    free(r);
+
+    return NULL;
+}
+
+static void render_del(Render *r)
+{
+    Cmd c;
+
+    memset(&c, 0, sizeof(Cmd));
+    c.type = CMD_QUIT;
+    while (!cmd_queue_push(&r->queue, &c))
+        SwitchToThread();
+    SetEvent(r->event);
+
+    /*
+     * DXGI may send messages to the window from the render thread,
+     * they are dispatched while waiting for it
+     */
+    while (MsgWaitForMultipleObjects(1, &r->thread, FALSE, INFINITE,
+                                     QS_ALLINPUT) == WAIT_OBJECT_0 + 1)
+    {
+        MSG msg;
+
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+            DispatchMessageW(&msg);
+    }
+
+    CloseHandle(r->thread);
+    if (r->timer)
+        CloseHandle(r->timer);
+    CloseHandle(r->event);
+    free(r);
+}
+
+/*
+ * d3d_rot [--render-thread]
+ */
+int main(int argc, char *argv[])
+{
+    Pace pace;
+    Cmd c;
+    Window *win;
+    D3d *d3d;
+    HANDLE timer;
+    int ret = 1;
+
+    simd_init();
+
+    /* remove scaling on HiDPI */
+#if _WIN32_WINNT >= 0x0A00
+    SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_SYSTEM_AWARE);
+#endif
+
+#ifdef _DEBUG
+    trace_open("d3d_rot_trace.json");
+#endif
+
+    win = window_new(100, 100, 800, 480);
+    if (!win)
+        goto close_trace;
+
+    d3d = d3d_init(win, 0);
+    if (!d3d)
+    {
+        printf(" * d3d_init() failed\n");
+        fflush(stdout);
+        goto del_window;
+    }
+
+    ret = 0;
+
+    /* 'P' switches to the fixed rate and present bound modes */
+    pace_init(&pace, PACE_ON_DEMAND, 60, NULL, NULL);
+    win->pace = &pace;
+
+    timer = render_timer_new();
+
+    SetWindowLongPtr(win->win, GWLP_USERDATA, (LONG_PTR)win);
+
+    /* from now on, the device is used by the render thread only */
+    if ((argc > 1) && !strcmp(argv[1], "--render-thread"))
+    {
+        win->render = render_new(win);
+        if (!win->render)
+        {
+            printf(" * render thread failed, rendering in the window thread\n");
+            fflush(stdout);
+        }
+    }
+
+    /* scene, created once */
+    memset(&c, 0, sizeof(Cmd));
+    c.type = CMD_TRIANGLE;
+    c.args[0] = 320; c.args[1] = 120;
+    c.args[2] = 480; c.args[3] = 360;
+    c.args[4] = 160; c.args[5] = 360;
+    c.args[6] = 255; c.args[7] = 255; c.args[8] = 0; c.args[9] = 255;
+    window_cmd(win, &c);
+    memset(&c, 0, sizeof(Cmd));
+    c.type = CMD_RECTANGLE;
+    c.args[0] = 520; c.args[1] = 120;
+    c.args[2] = 200; c.args[3] = 100;
+    c.args[4] = 0; c.args[5] = 0; c.args[6] = 255; c.args[7] = 255;
+    window_cmd(win, &c);
+
+    window_show(win);
+
+    /* mesage loop, blocking until an event or the next frame */
+    while(1)
+    {
+        MSG msg;
+
+        render_wait(timer, NULL,
+                    win->render ? PACE_WAIT_EVENT : pace_wait(&pace), 1);
+
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+        {
+            if (msg.message == WM_QUIT)
+                goto beach;
+            TranslateMessage(&msg);
+            DispatchMessageW(&msg);
+        }
+
+        if (!win->render && pace_frame_begin(&pace))
+        {
+            d3d_render(d3d);
+            pace_frame_end(&pace);
+        }
+
+#ifdef HAVE_PROF
+        prof_aggregate();
+#endif
+        trace_flush();
+    }
+
+  beach:
+    if (win->render)
+    {
+        render_del(win->render);
+        win->render = NULL;
+    }
+#ifdef _DEBUG
+    printf("pacing: %u frames, %u missed, interval min %llu us, max %llu us\n",
+           pace.frames, pace.missed,
+           pace.interval_min / 1000ULL, pace.interval_max / 1000ULL);
+    fflush(stdout);
+#endif
+#ifdef HAVE_PROF
+    prof_json_dump(stdout);
+#endif
+    if (timer)
+        CloseHandle(timer);
+    d3d_shutdown(d3d);
+  del_window:
+    window_del(win);
+  close_trace:
+    trace_close();
+
+    return ret;
+}
+
+#else
+
+/************************* Window *************************/
+
+Window *window_new(int x, int y, int w, int h)
+{
+    Window *win;
+
+    (void)x;
+    (void)y;
+
+    win = (Window *)mem_calloc(1, sizeof(Window));
+    if (!win)
+        return NULL;
+
+    win->width = w;
+    win->height = h;
+
+    return win;
+}
+
+void window_del(Window *win)
+{
+    free(win);
+}
+
+void window_show(Window *win)
+{
+    (void)win;
+}
+
+void window_fullscreen_set(Window *win, unsigned int on)
+{
+    /* no window, nothing to do */
+    win->fullscreen = !!on;
+}
+
+void window_rotation_set(Window *win, int rotation)
+{
+    int rdiff;
+
+    if (win->rotation == rotation)
+        return;
+
+    rdiff = win->rotation - rotation;
+    if (rdiff < 0) rdiff = -rdiff;
+
+    win->rotation = rotation;
+
+    /* what MoveWindow() does with a window */
+    if (rdiff != 2)
+    {
+        int tmp;
+
+        tmp = win->width;
+        win->width = win->height;
+        win->height = tmp;
+    }
+
+    d3d_resize(win->d3d, win->rotation, win->width, win->height);
+}
+
+/************************** Software **************************/
+
+/*
+ * software rasterizer, with the semantic of main_vs and main_ps:
+ * the 2x3 rotation is applied to the NDC positions, then the viewport
+ * transform. Vertices are snapped to 8 bits of sub-pixel precision,
+ * edge functions are evaluated in integers at the pixel centers with
+ * the top-left fill rule, so the output is deterministic.
+ */
+
+#define SOFT_SUBPIXEL_BITS 8
+#define SOFT_SUBPIXEL (1 << SOFT_SUBPIXEL_BITS)
+/* guard band, in pixels */
+#define SOFT_GUARD_BAND (1 << 20)
+
+typedef struct
+{
+    int x; /* fixed point, SOFT_SUBPIXEL_BITS of fraction */
+    int y;
+    BYTE r;
+    BYTE g;
+    BYTE b;
+    BYTE a;
+} Soft_Vertex;
+
+typedef struct
+{
+    int x0; /* inclusive */
+    int y0;
+    int x1; /* exclusive */
+    int y1;
+} Soft_Clip;
+
+static unsigned int soft_pixel(BYTE r, BYTE g, BYTE b, BYTE a)
+{
+    return ((unsigned int)a << 24) |
+           ((unsigned int)r << 16) |
+           ((unsigned int)g << 8) |
+           (unsigned int)b;
+}
+
+static int soft_snap(float v)
+{
+    v = v * (float)SOFT_SUBPIXEL;
+    if (v < -(float)SOFT_GUARD_BAND * SOFT_SUBPIXEL)
+        v = -(float)SOFT_GUARD_BAND * SOFT_SUBPIXEL;
+    if (v > (float)SOFT_GUARD_BAND * SOFT_SUBPIXEL)
+        v = (float)SOFT_GUARD_BAND * SOFT_SUBPIXEL;
+
+    return (int)floorf(v + 0.5f);
+}
+
+/* pixel positions of the vertices of a primitive, returns their number */
+static unsigned int soft_prim_positions(const Scene *s, const Prim *p,
+                                        int *x, int *y)
+{
+    unsigned int count;
+    unsigned int i;
+
+    count = scene_prim_vertex_count(p);
+    if (s->format == VERTEX_FORMAT_SINT16)
+    {
+        const Vertex16 *v = (const Vertex16 *)s->vertices + p->first_vertex;
+
+        for (i = 0; i < count; i++)
+        {
+            x[i] = v[i].x;
+            y[i] = v[i].y;
+        }
+    }
+    else
+    {
+        const Vertex *v = (const Vertex *)s->vertices + p->first_vertex;
+
+        for (i = 0; i < count; i++)
+        {
+            x[i] = (int)v[i].x;
+            y[i] = (int)v[i].y;
+        }
+    }
+
+    return count;
+}
+
+/* viewport of main_vs: the framebuffer, rotated back during the rotate pass */
+static void soft_viewport_get(const D3d *d3d, int *w, int *h)
+{
+    *w = (d3d->pass_rot & 1) ? d3d->height : d3d->width;
+    *h = (d3d->pass_rot & 1) ? d3d->width : d3d->height;
+}
+
+/*
+ * viewport transform of a vertex, x and y being the output of main_vs
+ * (main_vs16 for the compact vertices), computed by xform_batch().
+ * During the rotate pass, the snapped position is moved in the unrotated
+ * frame with integers, so that image_rotate() gives the same pixels as
+ * the rendering with the rotation.
+ */
+static void soft_vertex_set(const D3d *d3d, const Scene *s, unsigned int index,
+                            float x, float y, Soft_Vertex *sv)
+{
+    int w;
+    int h;
+    int px;
+    int py;
+
+    soft_viewport_get(d3d, &w, &h);
+    px = soft_snap((x + 1.0f) * 0.5f * (float)w);
+    py = soft_snap((1.0f - y) * 0.5f * (float)h);
+    switch (d3d->pass_rot)
+    {
+        case 1:
+            sv->x = py;
+            sv->y = w * SOFT_SUBPIXEL - px;
+            break;
+        case 2:
+            sv->x = w * SOFT_SUBPIXEL - px;
+            sv->y = h * SOFT_SUBPIXEL - py;
+            break;
+        case 3:
+            sv->x = h * SOFT_SUBPIXEL - py;
+            sv->y = px;
+            break;
+        default:
+            sv->x = px;
+            sv->y = py;
+            break;
+    }
+
+    if (s->format == VERTEX_FORMAT_SINT16)
+    {
+        const Vertex16 *v = (const Vertex16 *)s->vertices + index;
+
+        sv->r = v->r;
+        sv->g = v->g;
+        sv->b = v->b;
+        sv->a = v->a;
+    }
+    else
+    {
+        const Vertex *v = (const Vertex *)s->vertices + index;
+
+        sv->r = v->r;
+        sv->g = v->g;
+        sv->b = v->b;
+        sv->a = v->a;
+    }
+}
+
+/*
+ * 0 if pixels exactly on the edge a->b are drawn (top or left edge), -1
+ * otherwise. The edge is the one of the framebuffer rotated by rot, the
+ * rotation of the rotate pass.
+ */
+static int soft_edge_bias(const Soft_Vertex *a, const Soft_Vertex *b, int rot)
+{
+    int dx;
+    int dy;
+
+    switch (rot)
+    {
+        case 1:
+            dx = a->y - b->y;
+            dy = b->x - a->x;
+            break;
+        case 2:
+            dx = a->x - b->x;
+            dy = a->y - b->y;
+            break;
+        case 3:
+            dx = b->y - a->y;
+            dy = a->x - b->x;
+            break;
+        default:
+            dx = b->x - a->x;
+            dy = b->y - a->y;
+            break;
+    }
+
+    return ((dy < 0) || ((dy == 0) && (dx > 0))) ? 0 : -1;
+}
+
+static long long soft_edge(const Soft_Vertex *a, const Soft_Vertex *b,
+                           int px, int py)
+{
+    return (long long)(b->x - a->x) * (py - a->y) -
+           (long long)(b->y - a->y) * (px - a->x);
+}
+
+static BYTE soft_channel(float c0, float c1, float c2,
+                         float w0, float w1, float w2)
+{
+    float c;
+
+    c = c0 * w0 + c1 * w1 + c2 * w2 + 0.5f;
+    if (c <= 0.0f)
+        return 0;
+    if (c >= 255.0f)
+        return 255;
+
+    return (BYTE)c;
+}
+
+/* main_ps: interpolated color, written without blending */
+static void soft_triangle_draw(D3d *d3d,
+                               const Soft_Vertex *v0,
+                               const Soft_Vertex *v1,
+                               const Soft_Vertex *v2,
+                               const Soft_Clip *clip)
+{
+    const Soft_Vertex *tmp;
+    long long area;
+    long long row0, row1, row2;
+    long long dx0, dx1, dx2;
+    long long dy0, dy1, dy2;
+    float inv_area;
+    unsigned int pixel;
+    int bias0, bias1, bias2;
+    int flat;
+    int minx, miny, maxx, maxy;
+    int x, y;
+
+    area = soft_edge(v0, v1, v2->x, v2->y);
+    if (area == 0)
+        return;
+
+    /* same orientation for all the triangles */
+    if (area < 0)
+    {
+        tmp = v1;
+        v1 = v2;
+        v2 = tmp;
+        area = -area;
+    }
+
+    /* bounding box, in pixels, clipped */
+    minx = v0->x;
+    if (v1->x < minx) minx = v1->x;
+    if (v2->x < minx) minx = v2->x;
+    maxx = v0->x;
+    if (v1->x > maxx) maxx = v1->x;
+    if (v2->x > maxx) maxx = v2->x;
+    miny = v0->y;
+    if (v1->y < miny) miny = v1->y;
+    if (v2->y < miny) miny = v2->y;
+    maxy = v0->y;
+    if (v1->y > maxy) maxy = v1->y;
+    if (v2->y > maxy) maxy = v2->y;
+
+    minx = minx >> SOFT_SUBPIXEL_BITS;
+    miny = miny >> SOFT_SUBPIXEL_BITS;
+    maxx = (maxx >> SOFT_SUBPIXEL_BITS) + 1;
+    maxy = (maxy >> SOFT_SUBPIXEL_BITS) + 1;
+    if (minx < clip->x0) minx = clip->x0;
+    if (miny < clip->y0) miny = clip->y0;
+    if (maxx > clip->x1) maxx = clip->x1;
+    if (maxy > clip->y1) maxy = clip->y1;
+    if ((minx >= maxx) || (miny >= maxy))
+        return;
+
+    /* edge i is the one opposite to vertex i */
+    bias0 = soft_edge_bias(v1, v2, d3d->pass_rot);
+    bias1 = soft_edge_bias(v2, v0, d3d->pass_rot);
+    bias2 = soft_edge_bias(v0, v1, d3d->pass_rot);
+
+    x = (minx << SOFT_SUBPIXEL_BITS) + SOFT_SUBPIXEL / 2;
+    y = (miny << SOFT_SUBPIXEL_BITS) + SOFT_SUBPIXEL / 2;
+    row0 = soft_edge(v1, v2, x, y) + bias0;
+    row1 = soft_edge(v2, v0, x, y) + bias1;
+    row2 = soft_edge(v0, v1, x, y) + bias2;
+
+    dx0 = -(long long)(v2->y - v1->y) * SOFT_SUBPIXEL;
+    dx1 = -(long long)(v0->y - v2->y) * SOFT_SUBPIXEL;
+    dx2 = -(long long)(v1->y - v0->y) * SOFT_SUBPIXEL;
+    dy0 = (long long)(v2->x - v1->x) * SOFT_SUBPIXEL;
+    dy1 = (long long)(v0->x - v2->x) * SOFT_SUBPIXEL;
+    dy2 = (long long)(v1->x - v0->x) * SOFT_SUBPIXEL;
+
+    flat = (v0->r == v1->r) && (v0->r == v2->r) &&
+           (v0->g == v1->g) && (v0->g == v2->g) &&
+           (v0->b == v1->b) && (v0->b == v2->b) &&
+           (v0->a == v1->a) && (v0->a == v2->a);
+    pixel = soft_pixel(v0->r, v0->g, v0->b, v0->a);
+    inv_area = 1.0f / (float)area;
+
+    for (y = miny; y < maxy; y++)
+    {
+        unsigned int *dst;
+        long long e0 = row0;
+        long long e1 = row1;
+        long long e2 = row2;
+
+        dst = d3d->framebuffer + (size_t)y * d3d->width;
+        for (x = minx; x < maxx; x++)
+        {
+            if ((e0 | e1 | e2) >= 0)
+            {
+                if (!flat)
+                {
+                    float w0 = (float)(e0 - bias0) * inv_area;
+                    float w1 = (float)(e1 - bias1) * inv_area;
+                    float w2 = (float)(e2 - bias2) * inv_area;
+
+                    pixel = soft_pixel(soft_channel(v0->r, v1->r, v2->r, w0, w1, w2),
+                                       soft_channel(v0->g, v1->g, v2->g, w0, w1, w2),
+                                       soft_channel(v0->b, v1->b, v2->b, w0, w1, w2),
+                                       soft_channel(v0->a, v1->a, v2->a, w0, w1, w2));
+                }
+                dst[x] = pixel;
+            }
+            e0 += dx0;
+            e1 += dx1;
+            e2 += dx2;
+        }
+        row0 += dy0;
+        row1 += dy1;
+        row2 += dy2;
+    }
+}
+
+/* indexed triangles of a primitive, in the topology of the scene */
+static void soft_geometry_draw(D3d *d3d,
+                               const Scene *s,
+                               const Prim *p,
+                               const Soft_Clip *clip)
+{
+    Index_Iter it;
+    Soft_Vertex sv[4];
+    int x[4];
+    int y[4];
+    float nx[4];
+    float ny[4];
+    unsigned int tri[3];
+    unsigned int count;
+    unsigned int i;
+    int w;
+    int h;
+
+    /* each vertex once, a rectangle has 4 of them for 6 indices */
+    soft_viewport_get(d3d, &w, &h);
+    count = soft_prim_positions(s, p, x, y);
+    xform_batch(x, y, nx, ny, count, w, h, d3d->rotation);
+    for (i = 0; i < count; i++)
+        soft_vertex_set(d3d, s, p->first_vertex + i, nx[i], ny[i], sv + i);
+
+    index_iter_init(&it, s->topology,
+                    s->indices + p->first_index, p->index_count);
+    while (index_iter_next(&it, tri))
+        soft_triangle_draw(d3d,
+                           sv + (tri[0] - p->first_vertex),
+                           sv + (tri[1] - p->first_vertex),
+                           sv + (tri[2] - p->first_vertex),
+                           clip);
+}
+
+/*** thread pool ***/
+
+/*
+ * the items of a job are split in one range per worker. A worker takes
+ * items at the head of its range and, once it is empty, steals them at
+ * the tail of the ranges of the other workers. Head and tail are packed
+ * in one atomic word, so taking an item is a single compare and swap.
+ */
+
+#define SOFT_THREADS_MAX 64
+
+typedef struct
+{
+    _Atomic unsigned long long range; /* head in the low 32 bits, tail in the high ones */
+    char pad[64 - sizeof(unsigned long long)]; /* one cache line per worker */
+} Soft_Deque;
+
+typedef struct
+{
+    Soft_Pool *pool;
+    int index;
+} Soft_Worker;
+
+struct Soft_Pool
+{
+    pthread_t threads[SOFT_THREADS_MAX];
+    Soft_Worker workers[SOFT_THREADS_MAX];
+    Soft_Deque deques[SOFT_THREADS_MAX];
+    int count; /* number of workers, the calling thread is the worker 0 */
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation; /* incremented for each job */
+    int running; /* threads still working on the current job */
+    int quit;
+    /* current job */
+    void (*func)(void *data, unsigned int item);
+    void *data;
+};
+
+static int soft_deque_pop(Soft_Deque *d, unsigned int *item)
+{
+    unsigned long long r;
+    unsigned long long n;
+    unsigned int head;
+    unsigned int tail;
+
+    r = atomic_load(&d->range);
+    do
+    {
+        head = (unsigned int)r;
+        tail = (unsigned int)(r >> 32);
+        if (head >= tail)
+            return 0;
+        n = ((unsigned long long)tail << 32) | (head + 1);
+    } while (!atomic_compare_exchange_weak(&d->range, &r, n));
+
+    *item = head;
+
+    return 1;
+}
+
+static int soft_deque_steal(Soft_Deque *d, unsigned int *item)
+{
+    unsigned long long r;
+    unsigned long long n;
+    unsigned int head;
+    unsigned int tail;
+
+    r = atomic_load(&d->range);
+    do
+    {
+        head = (unsigned int)r;
+        tail = (unsigned int)(r >> 32);
+        if (head >= tail)
+            return 0;
+        n = ((unsigned long long)(tail - 1) << 32) | head;
+    } while (!atomic_compare_exchange_weak(&d->range, &r, n));
+
+    *item = tail - 1;
+
+    return 1;
+}
+
+/* own items first, then the ones of the other workers */
+static int soft_pool_take(Soft_Pool *p, int self, unsigned int *item)
+{
+    int i;
+
+    if (soft_deque_pop(p->deques + self, item))
+        return 1;
+
+    for (i = 1; i < p->count; i++)
+    {
+        if (soft_deque_steal(p->deques + (self + i) % p->count, item))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void soft_pool_work(Soft_Pool *p, int self)
+{
+    unsigned int item;
+
+    while (soft_pool_take(p, self, &item))
+        p->func(p->data, item);
+}
+
+static void *soft_pool_thread(void *data)
+{
+    Soft_Worker *w;
+    Soft_Pool *p;
+    unsigned int generation;
+
+    w = (Soft_Worker *)data;
+    p = w->pool;
+    /* a worker without tile in the first frames would allocate later */
+    TRACE_THREAD();
+
+    /*
+     * the pool is created at generation 0, the first job may have been
+     * started before this thread reaches this point
+     */
+    generation = 0;
+    pthread_mutex_lock(&p->lock);
+    while (1)
+    {
+        while (!p->quit && (p->generation == generation))
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->quit)
+            break;
+        generation = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        soft_pool_work(p, w->index);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->running == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void soft_pool_free(Soft_Pool *p)
+{
+    int i;
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 1; i < p->count; i++)
+        pthread_join(p->threads[i], NULL);
+
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->start);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+static Soft_Pool *soft_pool_new(int count)
+{
+    Soft_Pool *p;
+    int i;
+
+    p = (Soft_Pool *)mem_calloc(1, sizeof(Soft_Pool));
+    if (!p)
+        return NULL;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    p->count = 1;
+    for (i = 1; i < count; i++)
+    {
+        p->workers[i].pool = p;
+        p->workers[i].index = i;
+        if (pthread_create(p->threads + i, NULL,
+                           soft_pool_thread, p->workers + i) != 0)
+            break;
+        p->count++;
+    }
+
+    return p;
+}
+
+/* call func on items 0 to count - 1, returns when they are all done */
+static void soft_pool_run(Soft_Pool *p,
+                          void (*func)(void *data, unsigned int item),
+                          void *data,
+                          unsigned int count)
+{
+    unsigned int i;
+
+    p->func = func;
+    p->data = data;
+    for (i = 0; i < (unsigned int)p->count; i++)
+    {
+        unsigned long long head = (unsigned long long)count * i / p->count;
+        unsigned long long tail = (unsigned long long)count * (i + 1) / p->count;
+
+        atomic_store(&p->deques[i].range, (tail << 32) | head);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->running = p->count - 1;
+    p->generation++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    soft_pool_work(p, 0);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->running > 0)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*** tiled rendering ***/
+
+/*
+ * front-end: the triangles are transformed and binned in screen tiles,
+ * in scene order. Back-end: the tiles are rasterized in parallel, each
+ * one clipped to its tile. Tiles do not overlap and the edge functions
+ * are evaluated exactly at each pixel, so the framebuffer is the same
+ * as the one of the single threaded path.
+ */
+
+#define SOFT_TILE_SIZE 64
+
+struct Soft_Triangle
+{
+    Soft_Vertex v[3];
+    int minx; /* bounding box, in tiles, inclusive */
+    int miny;
+    int maxx;
+    int maxy;
+};
+
+/*
+ * front-end, recorded in parallel: each chunk of primitives writes its
+ * transformed triangles in its own range of the triangle array, large
+ * enough for all of them. The ranges are then compacted in chunk order.
+ */
+
+#define SOFT_CHUNK_MIN 64 /* primitives */
+
+/* transform, cull and compute the tile bounding boxes */
+static void soft_chunk_record(void *data, unsigned int item)
+{
+    D3d *d3d;
+    const Scene *s;
+    const Chunk *c;
+    int *x;
+    int *y;
+    float *nx;
+    float *ny;
+    unsigned int vertices;
+    unsigned int count;
+    unsigned int i;
+    int w;
+    int h;
+
+    d3d = (D3d *)data;
+    s = d3d->scene;
+    c = d3d->chunks + item;
+    soft_viewport_get(d3d, &w, &h);
+
+    /* the vertices of the chunk in one batch */
+    x = d3d->vertex_x + d3d->chunk_vertex_bases[item];
+    y = d3d->vertex_y + d3d->chunk_vertex_bases[item];
+    nx = d3d->vertex_nx + d3d->chunk_vertex_bases[item];
+    ny = d3d->vertex_ny + d3d->chunk_vertex_bases[item];
+    vertices = 0;
+    for (i = c->first; i < c->first + c->count; i++)
+        vertices += soft_prim_positions(s, s->prims + s->visible[i],
+                                        x + vertices, y + vertices);
+    xform_batch(x, y, nx, ny, vertices, w, h, d3d->rotation);
+
+    count = d3d->chunk_bases[item];
+    vertices = 0;
+    for (i = c->first; i < c->first + c->count; i++)
+    {
+        const Prim *p = s->prims + s->visible[i];
+        Index_Iter it;
+        unsigned int idx[3];
+
+        index_iter_init(&it, s->topology,
+                        s->indices + p->first_index, p->index_count);
+        while (index_iter_next(&it, idx))
+        {
+            Soft_Triangle *t = d3d->triangles + count;
+            int minx, miny, maxx, maxy;
+            int k;
+
+            for (k = 0; k < 3; k++)
+            {
+                unsigned int v = vertices + idx[k] - p->first_vertex;
+
+                soft_vertex_set(d3d, s, idx[k], nx[v], ny[v], t->v + k);
+            }
+
+            minx = maxx = t->v[0].x;
+            miny = maxy = t->v[0].y;
+            for (k = 1; k < 3; k++)
+            {
+                if (t->v[k].x < minx) minx = t->v[k].x;
+                if (t->v[k].x > maxx) maxx = t->v[k].x;
+                if (t->v[k].y < miny) miny = t->v[k].y;
+                if (t->v[k].y > maxy) maxy = t->v[k].y;
+            }
+            minx >>= SOFT_SUBPIXEL_BITS;
+            miny >>= SOFT_SUBPIXEL_BITS;
+            maxx >>= SOFT_SUBPIXEL_BITS;
+            maxy >>= SOFT_SUBPIXEL_BITS;
+            if ((maxx < 0) || (maxy < 0) ||
+                (minx >= d3d->width) || (miny >= d3d->height))
+                continue;
+
+            if (minx < 0) minx = 0;
+            if (miny < 0) miny = 0;
+            if (maxx >= d3d->width) maxx = d3d->width - 1;
+            if (maxy >= d3d->height) maxy = d3d->height - 1;
+            t->minx = minx / SOFT_TILE_SIZE;
+            t->miny = miny / SOFT_TILE_SIZE;
+            t->maxx = maxx / SOFT_TILE_SIZE;
+            t->maxy = maxy / SOFT_TILE_SIZE;
+            count++;
+        }
+        vertices += scene_prim_vertex_count(p);
+    }
+
+    d3d->chunk_counts[item] = count - d3d->chunk_bases[item];
+}
+
+/* returns the number of triangles, or -1 on failure */
+static int soft_record(D3d *d3d)
+{
+    const Scene *s;
+    unsigned int count;
+    unsigned int base;
+    unsigned int vertex_base;
+    unsigned int i;
+    unsigned int j;
+
+    s = d3d->scene;
+
+    /* 2 triangles per rectangle, 1 per triangle */
+    d3d->triangles = (Soft_Triangle *)arena_alloc(&d3d->frame,
+                                                  (s->prims_count + s->rects_count) *
+                                                  sizeof(Soft_Triangle));
+    if (!d3d->triangles)
+        return -1;
+
+    d3d->chunks_count = chunks_split(d3d->chunks, CHUNKS_MAX, s->visible_count,
+                                     d3d->pool ? d3d->pool->count : 1,
+                                     SOFT_CHUNK_MIN);
+
+    /* each chunk has room for all its triangles and vertices */
+    base = 0;
+    vertex_base = 0;
+    for (i = 0; i < d3d->chunks_count; i++)
+    {
+        const Chunk *c = d3d->chunks + i;
+
+        d3d->chunk_bases[i] = base;
+        d3d->chunk_vertex_bases[i] = vertex_base;
+        for (j = c->first; j < c->first + c->count; j++)
+        {
+            const Prim *p = s->prims + s->visible[j];
+
+            base += (p->type == PRIM_RECTANGLE) ? 2U : 1U;
+            vertex_base += scene_prim_vertex_count(p);
+        }
+    }
+
+    d3d->vertex_x = (int *)arena_alloc(&d3d->frame, vertex_base * sizeof(int));
+    d3d->vertex_y = (int *)arena_alloc(&d3d->frame, vertex_base * sizeof(int));
+    d3d->vertex_nx = (float *)arena_alloc(&d3d->frame, vertex_base * sizeof(float));
+    d3d->vertex_ny = (float *)arena_alloc(&d3d->frame, vertex_base * sizeof(float));
+    if (!d3d->vertex_x || !d3d->vertex_y || !d3d->vertex_nx || !d3d->vertex_ny)
+        return -1;
+
+    if (d3d->pool)
+        soft_pool_run(d3d->pool, soft_chunk_record, d3d, d3d->chunks_count);
+    else
+    {
+        for (i = 0; i < d3d->chunks_count; i++)
+            soft_chunk_record(d3d, i);
+    }
+
+    /* replay: culled triangles leave holes, removed in chunk order */
+    count = 0;
+    for (i = 0; i < d3d->chunks_count; i++)
+    {
+        if (d3d->chunk_bases[i] != count)
+            memmove(d3d->triangles + count,
+                    d3d->triangles + d3d->chunk_bases[i],
+                    d3d->chunk_counts[i] * sizeof(Soft_Triangle));
+        count += d3d->chunk_counts[i];
+    }
+
+    return (int)count;
+}
+
+static int soft_tiled_bin(D3d *d3d, unsigned int tiles_x, unsigned int tiles_y)
+{
+    unsigned int count;
+    unsigned int total;
+    unsigned int i;
+    int recorded;
+
+    d3d->bin_offsets = (unsigned int *)arena_alloc(&d3d->frame,
+                                                   (tiles_x * tiles_y + 1) *
+                                                   sizeof(unsigned int));
+    if (!d3d->bin_offsets)
+        return 0;
+
+    recorded = soft_record(d3d);
+    if (recorded < 0)
+        return 0;
+    count = (unsigned int)recorded;
+
+    /* binning: count, prefix sum, then fill in scene order */
+    memset(d3d->bin_offsets, 0, (tiles_x * tiles_y + 1) * sizeof(unsigned int));
+    for (i = 0; i < count; i++)
+    {
+        const Soft_Triangle *t = d3d->triangles + i;
+        int x, y;
+
+        for (y = t->miny; y <= t->maxy; y++)
+            for (x = t->minx; x <= t->maxx; x++)
+                d3d->bin_offsets[y * tiles_x + x + 1]++;
+    }
+
+    for (i = 1; i <= tiles_x * tiles_y; i++)
+        d3d->bin_offsets[i] += d3d->bin_offsets[i - 1];
+    total = d3d->bin_offsets[tiles_x * tiles_y];
+
+    d3d->bins = (unsigned int *)arena_alloc(&d3d->frame,
+                                            total * sizeof(unsigned int));
+    if (!d3d->bins)
+        return 0;
+
+    for (i = 0; i < count; i++)
+    {
+        const Soft_Triangle *t = d3d->triangles + i;
+        int x, y;
+
+        /* bin_offsets[tile] is used as the cursor of tile - 1 */
+        for (y = t->miny; y <= t->maxy; y++)
+            for (x = t->minx; x <= t->maxx; x++)
+                d3d->bins[d3d->bin_offsets[y * tiles_x + x]++] = i;
+    }
+
+    /* cursors are now the end of each tile, shift them back */
+    memmove(d3d->bin_offsets + 1, d3d->bin_offsets,
+            tiles_x * tiles_y * sizeof(unsigned int));
+    d3d->bin_offsets[0] = 0;
+
+    return 1;
+}
+
+static void soft_tile_render(void *data, unsigned int tile)
+{
+    D3d *d3d;
+    Soft_Clip clip;
+    unsigned int tiles_x;
+    unsigned int i;
+    int x;
+    int y;
+
+    TRACE_BEGIN("tile", tile, 0);
+
+    d3d = (D3d *)data;
+    tiles_x = (d3d->width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+
+    clip.x0 = (tile % tiles_x) * SOFT_TILE_SIZE;
+    clip.y0 = (tile / tiles_x) * SOFT_TILE_SIZE;
+    clip.x1 = clip.x0 + SOFT_TILE_SIZE;
+    clip.y1 = clip.y0 + SOFT_TILE_SIZE;
+    if (clip.x1 > d3d->width) clip.x1 = d3d->width;
+    if (clip.y1 > d3d->height) clip.y1 = d3d->height;
+
+    for (y = clip.y0; y < clip.y1; y++)
+    {
+        unsigned int *dst = d3d->framebuffer + (size_t)y * d3d->width;
+
+        for (x = clip.x0; x < clip.x1; x++)
+            dst[x] = d3d->clear_color;
+    }
+
+    for (i = d3d->bin_offsets[tile]; i < d3d->bin_offsets[tile + 1]; i++)
+    {
+        const Soft_Triangle *t = d3d->triangles + d3d->bins[i];
+
+        soft_triangle_draw(d3d, t->v + 0, t->v + 1, t->v + 2, &clip);
+    }
+
+    TRACE_END("tile");
+}
+
+static int soft_render_tiled(D3d *d3d)
+{
+    unsigned int tiles_x;
+    unsigned int tiles_y;
+
+    tiles_x = (d3d->width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+    tiles_y = (d3d->height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+
+    if (!soft_tiled_bin(d3d, tiles_x, tiles_y))
+        return 0;
+
+    soft_pool_run(d3d->pool, soft_tile_render, d3d, tiles_x * tiles_y);
+
+    return 1;
+}
+
+/* number of rendering threads, 1 for the single threaded path */
+int d3d_threads_set(D3d *d3d, int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    if (threads > SOFT_THREADS_MAX)
+        threads = SOFT_THREADS_MAX;
+
+    if ((d3d->pool && (d3d->pool->count == threads)) ||
+        (!d3d->pool && (threads == 1)))
+        return 1;
+
+    soft_pool_free(d3d->pool);
+    d3d->pool = NULL;
+    if (threads == 1)
+        return 1;
+
+    d3d->pool = soft_pool_new(threads);
+
+    return d3d->pool != NULL;
+}
+
+/* framebuffer, reallocated only when the size has changed */
+static int soft_buffers_resize(D3d *d3d, UINT width, UINT height)
+{
+    unsigned int *fb;
+    int ret;
+
+    ret = 0;
+    PROF_BEGIN(RESIZE_BUFFERS);
+
+    fb = (unsigned int *)mem_malloc((size_t)width * height * sizeof(unsigned int));
+    if (!fb)
+    {
+        printf("malloc() failed\n");
+        fflush(stdout);
+        goto end_buffers;
+    }
+
+    free(d3d->framebuffer);
+    d3d->framebuffer = fb;
+    d3d->width = width;
+    d3d->height = height;
+    ret = 1;
+
+  end_buffers:
+    PROF_END(RESIZE_BUFFERS);
+
+    return ret;
+}
+
+/* pending size and rotation, at the start of a frame */
+static void soft_resize_apply(D3d *d3d)
+{
+    unsigned int changes;
+    unsigned int done;
+
+    changes = resize_pending(&d3d->resize);
+    if (changes == RESIZE_NONE)
+        return;
+
+    done = RESIZE_NONE;
+    if (changes & RESIZE_ROTATION)
+    {
+        d3d->rot = d3d->resize.pending_rot;
+        rotation_matrix_set(d3d->rotation, d3d->rot);
+        done |= RESIZE_ROTATION;
+    }
+    if ((changes & RESIZE_BUFFERS) &&
+        soft_buffers_resize(d3d,
+                            d3d->resize.pending_width,
+                            d3d->resize.pending_height))
+        done |= RESIZE_BUFFERS;
+
+    /* new framebuffer, or rotated content */
+    if (done != RESIZE_NONE)
+        damage_full(&d3d->scene->damage);
+
+    resize_done(&d3d->resize, done);
+}
+
+D3d *d3d_init(Window *win, int vsync)
+{
+    D3d *d3d;
+
+    d3d = (D3d *)mem_calloc(1, sizeof(D3d));
+    if (!d3d)
+        return NULL;
+
+    d3d->vsync = vsync;
+    win->d3d = d3d;
+    arena_init(&d3d->frame, 0);
+
+    d3d->scene = scene_new();
+    if (!d3d->scene)
+        goto free_d3d;
+
+    resize_init(&d3d->resize);
+    d3d_resize(d3d, win->rotation, win->width, win->height);
+    soft_resize_apply(d3d);
+    if (!d3d->framebuffer)
+        goto free_scene;
+
+    return d3d;
+
+  free_scene:
+    scene_free(d3d->scene);
+  free_d3d:
+    free(d3d);
+
+    return NULL;
+}
+
+void d3d_shutdown(D3d *d3d)
+{
+    if (!d3d)
+        return;
+
+    soft_pool_free(d3d->pool);
+    free(d3d->unrotated);
+    arena_free(&d3d->frame);
+    free(d3d->framebuffer);
+    scene_free(d3d->scene);
+    free(d3d);
+}
+
+/* only recorded, applied by the next d3d_render() */
+void d3d_resize(D3d *d3d, int rot, UINT width, UINT height)
+{
+    TRACE("resize", width, height);
+    resize_request(&d3d->resize, rot, width, height);
+}
+
+/*
+ * damaged rects only, single threaded path: the framebuffer keeps the
+ * previous frame, each rect is cleared and the primitives whose box
+ * intersects it are drawn, clipped to it
+ */
+static void soft_render_damaged(D3d *d3d, const Damage_Region *redraw)
+{
+    const Scene *s = d3d->scene;
+    unsigned int i;
+    unsigned int k;
+
+    for (k = 0; k < redraw->count; k++)
+    {
+        Damage_Rect t;
+        Soft_Clip clip;
+        int y;
+
+        if (!damage_rect_map(redraw->rects + k, d3d->rotation,
+                             d3d->width, d3d->height, &t))
+            continue;
+
+        for (y = t.y0; y < t.y1; y++)
+        {
+            unsigned int *dst = d3d->framebuffer + (size_t)y * d3d->width;
+            int x;
+
+            for (x = t.x0; x < t.x1; x++)
+                dst[x] = d3d->clear_color;
+        }
+
+        clip.x0 = t.x0;
+        clip.y0 = t.y0;
+        clip.x1 = t.x1;
+        clip.y1 = t.y1;
+        for (i = 0; i < s->visible_count; i++)
+        {
+            const Prim *p = s->prims + s->visible[i];
+            Damage_Rect box;
+            Damage_Rect mapped;
+
+            scene_prim_box(p, &box);
+            if (!damage_rect_map(&box, d3d->rotation,
+                                 d3d->width, d3d->height, &mapped) ||
+                !damage_rect_intersect(&mapped, &t))
+                continue;
+
+            soft_geometry_draw(d3d, s, p, &clip);
+        }
+    }
+}
+
+static void soft_render(D3d *d3d)
+{
+    Damage_Region redraw;
+    Damage_Region present;
+    Soft_Clip clip;
+    Scene *s;
+    unsigned int color;
+    unsigned int *dst;
+    unsigned int *end;
+    unsigned int i;
+    int w;
+    int h;
+
+    FCT;
+
+    /* scene geometry, the vertices are read directly */
+    s = d3d->scene;
+
+    {
+        PROF_BEGIN(GEOMETRY);
+        soft_viewport_get(d3d, &w, &h);
+        scene_size_set(s, w, h);
+        if (scene_update(s))
+            scene_clean(s);
+        scene_visible_update(s, d3d->rotation);
+        PROF_END(GEOMETRY);
+    }
+
+    /* clear render target, { 0.10f, 0.18f, 0.24f, 1.0f } */
+    color = soft_pixel((BYTE)lrintf(0.10f * 255.0f),
+                       (BYTE)lrintf(0.18f * 255.0f),
+                       (BYTE)lrintf(0.24f * 255.0f),
+                       255);
+    d3d->clear_color = color;
+
+    /* the other paths redraw everything, the damage is only rolled */
+    damage_frame(&s->damage, &redraw, &present);
+    if (d3d->damage && !d3d->pool && !d3d->rotate_pass && !redraw.full)
+    {
+        PROF_BEGIN(DRAW);
+        soft_render_damaged(d3d, &redraw);
+        PROF_END(DRAW);
+        return;
+    }
+
+    /* tiles are cleared and rasterized in parallel */
+    if (d3d->pool)
+    {
+        int done;
+
+        PROF_BEGIN(DRAW);
+        done = soft_render_tiled(d3d);
+        PROF_END(DRAW);
+        if (done)
+            return;
+    }
+
+    {
+        PROF_BEGIN(CLEAR);
+        dst = d3d->framebuffer;
+        end = dst + (size_t)d3d->width * d3d->height;
+        while (dst < end)
+            *dst++ = color;
+        PROF_END(CLEAR);
+    }
+
+    PROF_BEGIN(DRAW);
+
+    clip.x0 = 0;
+    clip.y0 = 0;
+    clip.x1 = d3d->width;
+    clip.y1 = d3d->height;
+
+    /* scene */
+    for (i = 0; i < s->visible_count; i++)
+    {
+        const Prim *p = s->prims + s->visible[i];
+
+        soft_geometry_draw(d3d, s, p, &clip);
+    }
+
+    PROF_END(DRAW);
+}
+
+/*
+ * with the rotate pass, the scene is rendered in an intermediate
+ * framebuffer, unrotated, which is then rotated by quarter turns in the
+ * framebuffer with image_rotate(). The vertices keep the matrix and the
+ * viewport of d3d->rot, only their snapped positions are unrotated, so
+ * that the pixels are the ones of the rendering with the rotation.
+ */
+void d3d_render(D3d *d3d)
+{
+    unsigned int *fb;
+    int uw;
+    int uh;
+
+    PROF_BEGIN(FRAME);
+
+    d3d_frame_start(d3d);
+    soft_resize_apply(d3d);
+
+    if (!d3d->rotate_pass || (d3d->rot == 0))
+    {
+        soft_render(d3d);
+        goto end_frame;
+    }
+
+    /* size before rotation */
+    uw = (d3d->rot & 1) ? d3d->height : d3d->width;
+    uh = (d3d->rot & 1) ? d3d->width : d3d->height;
+    if ((size_t)uw * uh > d3d->unrotated_size)
+    {
+        unsigned int *tmp;
+
+        tmp = (unsigned int *)mem_realloc(d3d->unrotated,
+                                          (size_t)uw * uh * sizeof(unsigned int));
+        if (!tmp)
+        {
+            soft_render(d3d);
+            goto end_frame;
+        }
+        d3d->unrotated = tmp;
+        d3d->unrotated_size = (size_t)uw * uh;
+    }
+
+    fb = d3d->framebuffer;
+    d3d->framebuffer = d3d->unrotated;
+    d3d->width = uw;
+    d3d->height = uh;
+    d3d->pass_rot = d3d->rot;
+
+    soft_render(d3d);
+
+    d3d->framebuffer = fb;
+    d3d->width = (d3d->rot & 1) ? uh : uw;
+    d3d->height = (d3d->rot & 1) ? uw : uh;
+    d3d->pass_rot = 0;
+
+    {
+        PROF_BEGIN(ROTATE);
+        image_rotate(d3d->framebuffer, d3d->width,
+                     d3d->unrotated, uw,
+                     uw, uh, d3d->rot);
+        PROF_END(ROTATE);
+    }
+
+  end_frame:
+    PROF_END(FRAME);
+}
+
+void d3d_rotate_pass_set(D3d *d3d, int on)
+{
+    d3d->rotate_pass = !!on;
+}
+
+void d3d_damage_set(D3d *d3d, int on)
+{
+    d3d->damage = !!on;
+}
+
+/* binary PPM of the framebuffer */
+int d3d_framebuffer_save(const D3d *d3d, const char *file)
+{
+    FILE *f;
+    int i;
+
+    f = fopen(file, "wb");
+    if (!f)
+        return 0;
+
+    fprintf(f, "P6\n%d %d\n255\n", d3d->width, d3d->height);
+    for (i = 0; i < d3d->width * d3d->height; i++)
+    {
+        unsigned int p = d3d->framebuffer[i];
+
+        fputc((p >> 16) & 0xff, f);
+        fputc((p >> 8) & 0xff, f);
+        fputc(p & 0xff, f);
+    }
+    fclose(f);
+
+    return 1;
+}
+
+/************************** Bench **************************/
+
+/*
+ * d3d_rot --bench [options]: offscreen frame throughput. Options that
+ * take a list (comma separated) are swept, one result line for each
+ * combination.
+ *
+ *   --triangles N,...   number of triangles (1000)
+ *   --rectangles N,...  number of rectangles (1000)
+ *   --threads N,...     rendering threads (1)
+ *   --rotation R,...    rotation, 0 to 3, or all (0)
+ *   --size WxH          size of the target (1920x1080)
+ *   --prim-size S       maximum size of a primitive, in pixels (64)
+ *   --changes N         primitives modified each frame (0)
+ *   --frames N          measured frames (100)
+ *   --seed S            seed of the scene (1)
+ *   --rotate-pass       rotation done with image_rotate()
+ *   --min-fps F         exit with failure if a result is below F
+ *   --trace FILE        trace events of the frames, in FILE
+ *   --trace-events N    cost of N trace events, in ns per event
+ *   --shader-cache FILE shader cache in FILE, with a stub compiler
+ *   --tasks N           task graph executor, with N threads
+ *   --resize-replay     recorded burst of resizes, immediate or deferred
+ *   --state             state elision, against a mock device context
+ *   --pacing            frame pacing, with a simulated clock then a real one
+ *   --queue N           command queue, N messages between 2 threads
+ *   --record            parallel recording: chunks, replay order, timing
+ *   --damage            damaged rects only, against full redraws
+ *   --arena N           frame arena, N allocations per frame
+ *   --vertex16          compact vertices for the scene
+ *   --vertex            vertices: packing, pixels to NDC, rendering, resize
+ *   --index             shared 16 bits indices: pattern, draw splitting, batch
+ *   --topology          list / strip indices: coverage, index counts, timing
+ *   --cull              viewport culling: grid queries, frames, timing
+ *   --occlusion         occlusion by opaque rectangles: frames, overdraw timing
+ *   --scene             retained scene: dirty ranges, partial against full update
+ *   --prof              profiling: buckets, percentiles, aggregation (HAVE_PROF)
+ *   --batch             immediate mode batcher: wraps, discards, order, throughput
+ *   --instances         instanced rectangles: instance data, bytes against vertices
+ *   --tiles             tiled rendering: threads against 1 thread, all rotations
+ *   --xform             batch transform: SIMD variants against scalar, timing
+ *   --rotate-image      rotate pass: image_rotate, frames against the rotation, GB/s
+ */
+
+#define BENCH_WARMUP_FRAMES 10
+#define BENCH_LIST_MAX 16
+
+typedef struct
+{
+    int values[BENCH_LIST_MAX];
+    int count;
+} Bench_List;
+
+typedef struct
+{
+    Bench_List triangles;
+    Bench_List rectangles;
+    Bench_List threads;
+    Bench_List rotations;
+    int width;
+    int height;
+    int prim_size;
+    int changes;
+    int frames;
+    unsigned int seed;
+    double min_fps;
+    const char *trace;
+    int trace_events;
+    const char *shader_cache;
+    int tasks;
+    int queue;
+    int arena;
+    unsigned int resize_replay : 1;
+    unsigned int state : 1;
+    unsigned int pacing : 1;
+    unsigned int record : 1;
+    unsigned int damage : 1;
+    unsigned int vertex : 1;
+    unsigned int vertex16 : 1;
+    unsigned int index : 1;
+    unsigned int topology : 1;
+    unsigned int cull : 1;
+    unsigned int occlusion : 1;
+    unsigned int scene : 1;
+    unsigned int prof : 1;
+    unsigned int batch : 1;
+    unsigned int instances : 1;
+    unsigned int tiles : 1;
+    unsigned int xform : 1;
+    unsigned int rotate_image : 1;
+    unsigned int rotate_pass : 1;
+} Bench;
+
+/* xorshift, so that scenes are the same on all the systems */
+static unsigned int bench_rand(unsigned int *state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+static int bench_list_parse(Bench_List *l, const char *str)
+{
+    char *end;
+
+    l->count = 0;
+    while (*str && (l->count < BENCH_LIST_MAX))
+    {
+        l->values[l->count++] = (int)strtol(str, &end, 10);
+        if (end == str)
+            return 0;
+        str = (*end == ',') ? end + 1 : end;
+    }
+
+    return l->count > 0;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    unsigned long long ta = *(const unsigned long long *)a;
+    unsigned long long tb = *(const unsigned long long *)b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+static void bench_scene_fill(Scene *s, const Bench *b,
+                             int triangles, int rectangles)
+{
+    unsigned int state;
+    int i;
+
+    state = b->seed ? b->seed : 1U;
+    for (i = 0; i < triangles + rectangles; i++)
+    {
+        int x = bench_rand(&state) % b->width;
+        int y = bench_rand(&state) % b->height;
+        unsigned int c = bench_rand(&state);
+
+        /* triangles and rectangles are interleaved */
+        if ((i < 2 * triangles) && ((i & 1) || (i >= 2 * rectangles)))
+            scene_triangle_add(s,
+                               x, y,
+                               x + (int)(bench_rand(&state) % b->prim_size),
+                               y + (int)(bench_rand(&state) % b->prim_size),
+                               x - (int)(bench_rand(&state) % b->prim_size),
+                               y + (int)(bench_rand(&state) % b->prim_size),
+                               c, c >> 8, c >> 16, 255);
+        else
+            scene_rectangle_add(s,
+                                x, y,
+                                1 + bench_rand(&state) % b->prim_size,
+                                1 + bench_rand(&state) % b->prim_size,
+                                c, c >> 8, c >> 16, 255);
+    }
+}
+
+/* move some primitives, to measure the update path */
+static void bench_scene_change(Scene *s, const Bench *b, unsigned int *state)
+{
+    int i;
+
+    for (i = 0; (i < b->changes) && (s->prims_count > 0); i++)
+    {
+        int id = bench_rand(state) % s->prims_count;
+        Prim *p = s->prims + id;
+        int dx = (int)(bench_rand(state) % 5) - 2;
+        int dy = (int)(bench_rand(state) % 5) - 2;
+
+        if (p->type == PRIM_TRIANGLE)
+            scene_triangle_set(s, id,
+                               p->p[0] + dx, p->p[1] + dy,
+                               p->p[2] + dx, p->p[3] + dy,
+                               p->p[4] + dx, p->p[5] + dy,
+                               p->r, p->g, p->b, p->a);
+        else
+            scene_rectangle_set(s, id,
+                                p->p[0] + dx, p->p[1] + dy,
+                                p->p[2], p->p[3],
+                                p->r, p->g, p->b, p->a);
+    }
+}
+
+/* returns the number of frames per second */
+static double bench_run(const Bench *b,
+                        int triangles, int rectangles,
+                        int threads, int rotation)
+{
+    Window *win;
+    D3d *d3d;
+    unsigned long long *times;
+    unsigned long long start;
+    unsigned long long total;
+    unsigned long long allocs;
+    unsigned int state;
+    double fps;
+    int i;
+
+    times = (unsigned long long *)mem_malloc(b->frames * sizeof(unsigned long long));
+    if (!times)
+        return 0.0;
+
+    fps = 0.0;
+    win = window_new(0, 0, b->width, b->height);
+    if (!win)
+        goto free_times;
+
+    d3d = d3d_init(win, 0);
+    if (!d3d)
+        goto del_window;
+
+    d3d_threads_set(d3d, threads);
+    d3d_rotate_pass_set(d3d, b->rotate_pass);
+    if (b->vertex16)
+        scene_vertex_format_set(d3d->scene, VERTEX_FORMAT_SINT16);
+    bench_scene_fill(d3d->scene, b, triangles, rectangles);
+    window_rotation_set(win, rotation);
+
+    /*
+     * warm up: first upload and scratch buffers, then a few changed
+     * frames, so that the frame arena has grown to the moving tile bins
+     */
+    d3d_render(d3d);
+    state = b->seed + 1U;
+    for (i = 0; i < BENCH_WARMUP_FRAMES; i++)
+    {
+        bench_scene_change(d3d->scene, b, &state);
+        d3d_render(d3d);
+    }
+
+    total = 0;
+#ifdef HAVE_PROF
+    prof_reset();
+#endif
+    allocs = mem_allocs_get();
+    for (i = 0; i < b->frames; i++)
+    {
+        start = time_now();
+        bench_scene_change(d3d->scene, b, &state);
+        d3d_render(d3d);
+        times[i] = time_now() - start;
+        total += times[i];
+#ifdef HAVE_PROF
+        prof_aggregate();
+#endif
+        trace_flush();
+    }
+    allocs = mem_allocs_get() - allocs;
+
+    qsort(times, b->frames, sizeof(unsigned long long), bench_cmp);
+    fps = (double)b->frames * 1e9 / (double)total;
+
+    printf("triangles %d rectangles %d threads %d rotation %d : "
+           "%.1f fps, %.0f prims/s, p50 %.3f ms, p99 %.3f ms, "
+           "%.2f allocs/frame\n",
+           triangles, rectangles, threads, rotation,
+           fps, fps * (triangles + rectangles),
+           times[b->frames / 2] / 1e6,
+           times[(b->frames * 99) / 100] / 1e6,
+           (double)allocs / b->frames);
+    fflush(stdout);
+#ifdef HAVE_PROF
+    prof_json_dump(stdout);
+#endif
+
+    d3d_shutdown(d3d);
+  del_window:
+    window_del(win);
+  free_times:
+    free(times);
+
+    return fps;
+}
+
+/* rings are flushed, without file, when they are half full */
+static void bench_trace(int count)
+{
+    unsigned long long start;
+    unsigned long long total;
+    int i;
+
+    trace_flush();
+    total = 0;
+    i = 0;
+    while (i < count)
+    {
+        int n = TRACE_EVENTS / 2;
+
+        if (n > count - i)
+            n = count - i;
+        start = time_now();
+        for (; n > 0; n--, i++)
+            trace_event("bench", TRACE_TYPE_INSTANT, i, 0);
+        total += time_now() - start;
+        trace_flush();
+    }
+
+    printf("trace: %d events, %.1f ns/event\n",
+           count, (double)total / (double)count);
+    fflush(stdout);
+}
+
+/* stub compiler: the bytecode depends on all its parameters */
+static void *bench_shader_compile(void *data,
+                                  const char *src, size_t src_size,
+                                  const char *entry, const char *target,
+                                  unsigned int flags, size_t *size)
+{
+    unsigned char *blob;
+    unsigned long long key;
+    size_t i;
+
+    (void)data;
+    key = shader_key(src, src_size, entry, target, flags);
+    *size = 61 + strlen(entry);
+    blob = (unsigned char *)mem_malloc(*size);
+    if (!blob)
+        return NULL;
+
+    for (i = 0; i < *size; i++)
+        blob[i] = (unsigned char)(key >> ((i & 7) * 8)) ^ (unsigned char)i;
+
+    return blob;
+}
+
+/* one open/get/close round, checks the bytecodes and the compilations */
+static int bench_shader_round(const char *file, const char *src,
+                              unsigned int flags, unsigned int compiles)
+{
+    static const char *entries[4][2] =
+    {
+        { "main_vs", "vs_5_0" },
+        { "main_ps", "ps_5_0" },
+        { "main_rect_vs", "vs_5_0" },
+        { "main_vs16", "vs_5_0" }
+    };
+    Shader_Cache *c;
+    unsigned long long start;
+    unsigned long long t;
+    int ret = 1;
+    int i;
+
+    start = time_now();
+    c = shader_cache_open(file);
+    if (!c)
+        return 0;
+
+    for (i = 0; i < 4; i++)
+    {
+        const void *bytecode;
+        void *expected;
+        size_t size;
+        size_t expected_size;
+
+        bytecode = shader_get(c, src, entries[i][0], entries[i][1], flags,
+                              bench_shader_compile, NULL, &size);
+        expected = bench_shader_compile(NULL, c->src, c->src_size,
+                                        entries[i][0], entries[i][1], flags,
+                                        &expected_size);
+        if (!bytecode || !expected || (size != expected_size) ||
+            memcmp(bytecode, expected, size))
+            ret = 0;
+        free(expected);
+    }
+
+    if (c->compiles != compiles)
+        ret = 0;
+
+    printf("shader cache: %u compiles (%u expected), %u in file, ",
+           c->compiles, compiles, c->count);
+    if (!shader_cache_close(c))
+        ret = 0;
+    t = time_now() - start;
+    printf("%.1f us, %s\n", t / 1e3, ret ? "ok" : "FAILED");
+    fflush(stdout);
+
+    return ret;
+}
+
+static int bench_shaders(const char *file)
+{
+    char *src;
+    FILE *f;
+    int ret = 1;
+
+    src = (char *)mem_malloc(strlen(file) + 6);
+    if (!src)
+        return 1;
+    strcpy(src, file);
+    strcat(src, ".hlsl");
+
+    f = fopen(src, "wb");
+    if (!f)
+        goto free_src;
+    fprintf(f, "float4 main_ps() : SV_TARGET { return 1; }\n");
+    fclose(f);
+
+    remove(file);
+    /* empty cache, then cached, then new flags */
+    if (!bench_shader_round(file, src, 0U, 4) ||
+        !bench_shader_round(file, src, 0U, 0) ||
+        !bench_shader_round(file, src, 1U, 4) ||
+        !bench_shader_round(file, src, 1U, 0))
+        goto remove_src;
+
+    /* damaged cache file: ignored, then rewritten */
+    f = fopen(file, "r+b");
+    if (!f)
+        goto remove_src;
+    fputc('X', f);
+    fclose(f);
+    if (!bench_shader_round(file, src, 0U, 4) ||
+        !bench_shader_round(file, src, 0U, 0))
+        goto remove_src;
+
+    ret = 0;
+
+  remove_src:
+    remove(src);
+  free_src:
+    free(src);
+
+    return ret;
+}
+
+/* task of bench_tasks(): busy for data microseconds, 0 fails */
+static int bench_task(void *data)
+{
+    unsigned long long end;
+    int us = *(int *)data;
+
+    end = time_now() + (unsigned long long)us * 1000ULL;
+    while (time_now() < end)
+        ;
+
+    return us != 0;
+}
+
+static int bench_tasks(int threads)
+{
+    /* same shape as the startup of the D3D11 backend */
+    static int times[7] = { 2000, 8000, 3000, 12000, 4000, 2000, 1000 };
+    static int fail = 0;
+    Task tasks[8];
+    unsigned int i;
+    unsigned int j;
+    int ok = 1;
+
+    task_set(tasks + 0, "factory", bench_task, times + 0, 0U, 0);
+    task_set(tasks + 1, "device", bench_task, times + 1, 0U, 0);
+    task_set(tasks + 2, "display modes", bench_task, times + 2, 1U << 0, 0);
+    task_set(tasks + 3, "shader bytecodes", bench_task, times + 3, 0U, 0);
+    task_set(tasks + 4, "swapchain", bench_task, times + 4,
+             (1U << 0) | (1U << 1) | (1U << 2), 1);
+    task_set(tasks + 5, "resources", bench_task, times + 5, 1U << 4, 0);
+    task_set(tasks + 6, "shader objects", bench_task, times + 6,
+             (1U << 5) | (1U << 3), 0);
+
+    if (!task_graph_run(tasks, 7, threads))
+        ok = 0;
+    task_graph_print(tasks, 7);
+
+    for (i = 0; i < 7; i++)
+    {
+        for (j = 0; j < 7; j++)
+        {
+            if ((tasks[i].deps & (1U << j)) && (tasks[j].end > tasks[i].start))
+                ok = 0;
+        }
+    }
+    if (tasks[4].thread != 0)
+        ok = 0;
+
+    /* a failed task: the tasks depending on it are skipped */
+    task_set(tasks + 7, "failing", bench_task, &fail, 1U << 0, 0);
+    tasks[6].deps |= 1U << 7;
+    if (task_graph_run(tasks, 8, threads) ||
+        (tasks[7].state != TASK_FAILED) ||
+        (tasks[6].state != TASK_SKIPPED) ||
+        (tasks[5].state != TASK_DONE))
+        ok = 0;
+
+    /* dependency cycle: nothing runs */
+    tasks[0].deps = 1U << 6;
+    if (task_graph_run(tasks, 7, threads) ||
+        (tasks[0].state != TASK_SKIPPED))
+        ok = 0;
+
+    printf("tasks: %s\n", ok ? "ok" : "FAILED");
+    fflush(stdout);
+
+    return !ok;
+}
+
+/*
+ * interactive drag of the border of a window, then minimize and
+ * restore: time (ms), width and height of the WM_SIZE messages
+ */
+static const int bench_resize_events[][3] =
+{
+    { 4, 800, 480 }, { 7, 813, 487 }, { 12, 826, 494 }, { 14, 839, 502 },
+    { 16, 852, 509 }, { 22, 864, 516 }, { 24, 877, 523 }, { 28, 890, 531 },
+    { 34, 902, 538 }, { 36, 914, 545 }, { 42, 926, 551 }, { 45, 938, 558 },
+    { 47, 950, 565 }, { 49, 961, 571 }, { 54, 972, 577 }, { 59, 982, 583 },
+    { 61, 992, 589 }, { 64, 1002, 594 }, { 66, 1012, 600 }, { 72, 1021, 605 },
+    { 77, 1029, 610 }, { 79, 1038, 614 }, { 85, 1045, 619 }, { 87, 1053, 623 },
+    { 90, 1059, 627 }, { 96, 1066, 630 }, { 98, 1071, 634 }, { 104, 1077, 637 },
+    { 110, 1081, 639 }, { 115, 1086, 642 }, { 117, 1089, 644 }, { 120, 1092, 645 },
+    { 122, 1095, 647 }, { 128, 1097, 648 }, { 131, 1098, 649 }, { 135, 1099, 649 },
+    { 140, 1100, 650 }, { 143, 1099, 649 }, { 149, 1098, 649 }, { 151, 1097, 648 },
+    { 157, 1095, 647 }, { 161, 1092, 645 }, { 167, 1089, 644 }, { 170, 1086, 642 },
+    { 172, 1081, 639 }, { 178, 1077, 637 }, { 184, 1071, 634 }, { 187, 1066, 630 },
+    { 191, 1059, 627 }, { 193, 1053, 623 }, { 199, 1045, 619 }, { 201, 1038, 614 },
+    { 207, 1029, 610 }, { 209, 1021, 605 }, { 215, 1012, 600 }, { 218, 1002, 594 },
+    { 223, 992, 589 }, { 229, 982, 583 }, { 234, 972, 577 }, { 238, 961, 571 },
+    { 438, 0, 0 }, { 938, 961, 571 }, { 941, 961, 571 }, { 944, 961, 571 },
+    { 947, 961, 571 }, { 950, 961, 571 }, { 953, 961, 571 }
+};
+
+static int bench_resize_replay(void)
+{
+    Window *win;
+    D3d *d3d;
+    Resize immediate;
+    unsigned int count;
+    unsigned int frames;
+    unsigned int i;
+    int next_frame;
+    int ok;
+
+    win = window_new(0, 0, 800, 480);
+    if (!win)
+        return 1;
+
+    d3d = d3d_init(win, 0);
+    if (!d3d)
+    {
+        window_del(win);
+        return 1;
+    }
+
+    /* what resizing on each WM_SIZE does */
+    resize_init(&immediate);
+    resize_request(&immediate, 0, 800, 480);
+    resize_done(&immediate, resize_pending(&immediate));
+
+    count = sizeof(bench_resize_events) / sizeof(bench_resize_events[0]);
+    frames = 0;
+    next_frame = 16;
+    for (i = 0; i < count; i++)
+    {
+        const int *ev = bench_resize_events[i];
+
+        /* one frame every 16 ms */
+        for (; next_frame <= ev[0]; next_frame += 16, frames++)
+            d3d_render(d3d);
+
+        d3d_resize(d3d, 0, ev[1], ev[2]);
+        resize_request(&immediate, 0, ev[1], ev[2]);
+        resize_done(&immediate, resize_pending(&immediate));
+    }
+    d3d_render(d3d);
+    frames++;
+
+    ok = ((UINT)d3d->width == d3d->resize.pending_width) &&
+         ((UINT)d3d->height == d3d->resize.pending_height) &&
+         (d3d->resize.reallocs <= immediate.reallocs);
+
+    printf("resize: %u requests, %u frames, %u reallocations immediate, "
+           "%u deferred, %u rotation updates, %s\n",
+           count, frames, immediate.reallocs,
+           d3d->resize.reallocs, d3d->resize.rotations,
+           ok ? "ok" : "FAILED");
+    fflush(stdout);
+
+    d3d_shutdown(d3d);
+    window_del(win);
+
+    return !ok;
+}
+
+/*
+ * state elision: the binds of the immediate mode frames are replayed
+ * against a mock device context, which records what is bound. After
+ * each bind, the mock must have what a context without elision would
+ * have.
+ */
+
+typedef struct
+{
+    const void *objects[STATE_LAST];
+    unsigned long long params[STATE_LAST];
+    unsigned int calls;
+} Bench_State_Ctx;
+
+typedef struct
+{
+    State_Cache sc;
+    Bench_State_Ctx ctx;
+    unsigned int naive;
+    unsigned int errors;
+} Bench_State;
+
+static void bench_state_set(Bench_State *bs, State_Slot slot,
+                            const void *object, unsigned long long param)
+{
+    bs->naive++;
+    if (state_cache_set(&bs->sc, slot, object, param))
+    {
+        bs->ctx.objects[slot] = object;
+        bs->ctx.params[slot] = param;
+        bs->ctx.calls++;
+    }
+
+    if ((bs->ctx.objects[slot] != object) || (bs->ctx.params[slot] != param))
+        bs->errors++;
+}
+
+static int bench_state(void)
+{
+    /* stand-ins of the D3D objects, only the addresses matter */
+    static const char layout[2] = { 0, 0 };
+    static const char vb[3] = { 0, 0, 0 };
+    static const char ib[2] = { 0, 0 };
+    static const char vs[2] = { 0, 0 };
+    static const char cb = 0;
+    static const char rs = 0;
+    static const char ps = 0;
+    Bench_State bs;
+    unsigned int seed;
+    unsigned int issued;
+    unsigned int elided;
+    int frame;
+    int ok;
+
+    memset(&bs, 0, sizeof(Bench_State));
+    state_cache_reset(&bs.sc);
+
+    seed = 1U;
+    issued = 0;
+    elided = 0;
+    for (frame = 0; frame < 100; frame++)
+    {
+        int runs;
+        int i;
+
+        /* ClearState() or a device change: the context is unknown */
+        if (frame == 50)
+        {
+            state_cache_reset(&bs.sc);
+            memset(bs.ctx.objects, 0xff, sizeof(bs.ctx.objects));
+        }
+
+        state_cache_frame(&bs.sc);
+        issued += bs.sc.last_issued;
+        elided += bs.sc.last_elided;
+
+        /* what d3d_render() sets each frame */
+        bench_state_set(&bs, STATE_INPUT_LAYOUT, &layout[0], 0);
+        bench_state_set(&bs, STATE_VS, &vs[0], 0);
+        bench_state_set(&bs, STATE_VS_CONSTANT_BUFFER, &cb, 0);
+        bench_state_set(&bs, STATE_RASTERIZER, &rs, 0);
+        bench_state_set(&bs, STATE_PS, &ps, 0);
+
+        /* runs of triangles and rectangles, d3d_batch_bind() and d3d_rect_bind() */
+        runs = 1 + bench_rand(&seed) % 8;
+        for (i = 0; i < runs; i++)
+        {
+            bench_state_set(&bs, STATE_TOPOLOGY, NULL, 4);
+            if (bench_rand(&seed) & 1)
+            {
+                bench_state_set(&bs, STATE_INPUT_LAYOUT, &layout[0], 0);
+                bench_state_set(&bs, STATE_VERTEX_BUFFER_0, &vb[0], 20);
+                bench_state_set(&bs, STATE_INDEX_BUFFER, &ib[0], 42);
+                bench_state_set(&bs, STATE_VS, &vs[0], 0);
+            }
+            else
+            {
+                bench_state_set(&bs, STATE_INPUT_LAYOUT, &layout[1], 0);
+                bench_state_set(&bs, STATE_VERTEX_BUFFER_0, &vb[1], 8);
+                bench_state_set(&bs, STATE_VERTEX_BUFFER_1, &vb[2], 24);
+                bench_state_set(&bs, STATE_INDEX_BUFFER, &ib[1], 42);
+                bench_state_set(&bs, STATE_VS, &vs[1], 0);
+            }
+        }
+    }
+    state_cache_frame(&bs.sc);
+    issued += bs.sc.last_issued;
+    elided += bs.sc.last_elided;
+
+    ok = (bs.errors == 0) &&
+         (issued == bs.ctx.calls) &&
+         (issued + elided == bs.naive);
+
+    printf("state: %u calls without elision, %u issued, %u elided, %u errors, %s\n",
+           bs.naive, issued, elided, bs.errors, ok ? "ok" : "FAILED");
+    fflush(stdout);
+
+    return !ok;
+}
+
+/*
+ * frame pacing: the scheduler is first driven by a simulated clock,
+ * sleeps and frames only advance it. Frames cost 2 to 12 ms, with a
+ * 40 ms one every second, and sleeps last up to 1 ms too long.
+ */
+
+static unsigned long long bench_clock(void *data)
+{
+    return *(unsigned long long *)data;
+}
+
+static int bench_pacing(void)
+{
+    Pace pc;
+    unsigned long long now;
+    unsigned long long period;
+    unsigned long long wait;
+    unsigned long long start;
+    clock_t cpu;
+    unsigned int seed;
+    unsigned int frames;
+    int i;
+    int ok;
+    int ok_fixed;
+    int ok_demand;
+
+    seed = 1U;
+    now = 1000000000ULL;
+
+    /* fixed rate, 60 Hz during 10 s */
+    pace_init(&pc, PACE_FIXED, 60, bench_clock, &now);
+    period = pc.period;
+    start = now;
+    while (now - start < 10000000000ULL)
+    {
+        wait = pace_wait(&pc);
+        if (wait)
+            now += wait + bench_rand(&seed) % 1000000U;
+
+        if (pace_frame_begin(&pc))
+        {
+            if (pc.frames % 60 == 59)
+                now += 40000000ULL;
+            else
+                now += 2000000ULL + bench_rand(&seed) % 10000000U;
+            pace_frame_end(&pc);
+        }
+    }
+
+    /* no burst after the long frames, and at least 10 s worth of frames, minus the dropped ones */
+    ok_fixed = (pc.interval_min >= period - 1000000ULL) &&
+               (pc.frames + 2 * pc.missed + 1 >= 600);
+
+    printf("pacing fixed: %u frames, %u missed, interval %llu to %llu us "
+           "(period %llu us), slack min %lld us, mean %lld us, %s\n",
+           pc.frames, pc.missed,
+           pc.interval_min / 1000ULL, pc.interval_max / 1000ULL,
+           period / 1000ULL,
+           pc.slack_min / 1000LL, pc.slack_sum / (long long)pc.frames / 1000LL,
+           ok_fixed ? "ok" : "FAILED");
+
+    /* on demand: nothing without invalidation, bursts are coalesced */
+    pace_init(&pc, PACE_ON_DEMAND, 60, bench_clock, &now);
+    ok_demand = pace_frame_begin(&pc);
+    pace_frame_end(&pc);
+    ok_demand &= pace_wait(&pc) == PACE_WAIT_EVENT;
+    for (i = 0; i < 100; i++)
+    {
+        unsigned int n = 1 + bench_rand(&seed) % 4;
+
+        while (n--)
+            pace_invalidate(&pc);
+        ok_demand &= pace_wait(&pc) == 0;
+        if (pace_frame_begin(&pc))
+            pace_frame_end(&pc);
+        ok_demand &= !pace_frame_begin(&pc);
+        ok_demand &= pace_wait(&pc) == PACE_WAIT_EVENT;
+    }
+    ok_demand &= pc.frames == 101;
+
+    printf("pacing on demand: %u frames for 100 bursts of invalidations, %s\n",
+           pc.frames, ok_demand ? "ok" : "FAILED");
+
+    /* real clock: the CPU time must be small compared to the elapsed time */
+    pace_init(&pc, PACE_FIXED, 60, NULL, NULL);
+    cpu = clock();
+    start = time_now();
+    frames = 0;
+    while (frames < 60)
+    {
+        wait = pace_wait(&pc);
+        if (wait)
+            time_sleep(wait);
+        if (pace_frame_begin(&pc))
+        {
+            pace_frame_end(&pc);
+            frames++;
+        }
+    }
+    cpu = clock() - cpu;
+
+    printf("pacing real clock: %u frames in %llu ms, cpu %ld ms, "
+           "interval %llu to %llu us\n",
+           pc.frames, (time_now() - start) / 1000000ULL,
+           (long)(cpu * 1000 / CLOCKS_PER_SEC),
+           pc.interval_min / 1000ULL, pc.interval_max / 1000ULL);
+    fflush(stdout);
+
+    ok = ok_fixed && ok_demand;
+
+    return !ok;
+}
+
+/*
+ * command queue: filled and emptied by one thread, with the indices
+ * wrapping around, then a producer and a consumer thread exchange
+ * count messages, checked in order by the consumer
+ */
+
+typedef struct
+{
+    Cmd_Queue queue;
+    int count;
+    int errors;
+    unsigned long long full; /* push retries, the consumer is late */
+} Bench_Queue;
+
+static void *bench_queue_consumer(void *data)
+{
+    Bench_Queue *bq = (Bench_Queue *)data;
+    int i = 0;
+
+    while (i < bq->count)
+    {
+        Cmd c;
+
+        /* yield: the producer may share the core */
+        if (!cmd_queue_pop(&bq->queue, &c))
+        {
+            sched_yield();
+            continue;
+        }
+
+        if ((c.type != CMD_RESIZE) ||
+            (c.args[0] != i) || (c.args[9] != ~i))
+            bq->errors++;
+        i++;
+    }
+
+    return NULL;
+}
+
+static int bench_queue(int count)
+{
+    Bench_Queue *bq;
+    pthread_t thread;
+    unsigned long long t;
+    Cmd c;
+    int ok;
+    int i;
+    int j;
+
+    bq = (Bench_Queue *)mem_calloc(1, sizeof(Bench_Queue));
+    if (!bq)
+        return 1;
+
+    /* one thread, near the wrap around of the indices */
+    cmd_queue_init(&bq->queue);
+    bq->queue.head = 0xffffff80U;
+    bq->queue.tail = bq->queue.head;
+    bq->queue.tail_cache = bq->queue.head;
+    bq->queue.head_cache = bq->queue.head;
+    ok = !cmd_queue_pop(&bq->queue, &c);
+    for (j = 0; j < 3; j++)
+    {
+        memset(&c, 0, sizeof(Cmd));
+        for (i = 0; i < CMD_QUEUE_SIZE; i++)
+        {
+            c.args[0] = i;
+            ok &= cmd_queue_push(&bq->queue, &c);
+        }
+        ok &= !cmd_queue_push(&bq->queue, &c);
+        for (i = 0; i < CMD_QUEUE_SIZE; i++)
+            ok &= cmd_queue_pop(&bq->queue, &c) && (c.args[0] == i);
+        ok &= !cmd_queue_pop(&bq->queue, &c);
+    }
+
+    printf("queue: push until full, pop until empty, wrapping: %s\n",
+           ok ? "ok" : "FAILED");
+
+    /* 2 threads */
+    cmd_queue_init(&bq->queue);
+    bq->count = count;
+    t = time_now();
+    if (pthread_create(&thread, NULL, bench_queue_consumer, bq) != 0)
+    {
+        free(bq);
+        return 1;
+    }
+
+    memset(&c, 0, sizeof(Cmd));
+    c.type = CMD_RESIZE;
+    for (i = 0; i < count; i++)
+    {
+        c.args[0] = i;
+        c.args[9] = ~i;
+        while (!cmd_queue_push(&bq->queue, &c))
+        {
+            bq->full++;
+            sched_yield();
+        }
+    }
+
+    pthread_join(thread, NULL);
+    t = time_now() - t;
+
+    ok &= bq->errors == 0;
+
+    printf("queue: %d messages in %.1f ms, %.1f M messages/s, "
+           "%llu pushes on a full queue, %d errors, %s\n",
+           count, (double)t / 1000000.0,
+           (double)count * 1000.0 / (double)(t ? t : 1),
+           bq->full, bq->errors, ok ? "ok" : "FAILED");
+    fflush(stdout);
+
+    free(bq);
+
+    return !ok;
+}
+
+/*
+ * parallel recording: chunks_split() must cover the primitives with
+ * consecutive, non empty chunks. The scene recorded in parallel and
+ * replayed must give the framebuffer of the serial path, and the time
+ * of the recording is measured for each number of threads.
+ */
+static int bench_record(const Bench *b)
+{
+    static const int threads[] = { 1, 2, 3, 4, 8 };
+    Chunk chunks[CHUNKS_MAX];
+    Window *win;
+    D3d *d3d;
+    unsigned int *ref;
+    size_t size;
+    unsigned int state;
+    int ok_split;
+    int ok;
+    int i;
+    int t;
+
+    /* contract of chunks_split() */
+    ok_split = 1;
+    state = 1U;
+    for (i = 0; i < 10000; i++)
+    {
+        unsigned int count = bench_rand(&state) % 5000;
+        unsigned int th = 1 + bench_rand(&state) % 16;
+        unsigned int min = bench_rand(&state) % 100;
+        unsigned int n;
+        unsigned int next;
+        unsigned int c;
+
+        n = chunks_split(chunks, CHUNKS_MAX, count, th, min);
+        ok_split &= (n <= CHUNKS_MAX) && ((n == 0) == (count == 0));
+        next = 0;
+        for (c = 0; c < n; c++)
+        {
+            ok_split &= (chunks[c].first == next) && (chunks[c].count > 0);
+            ok_split &= (min == 0) || (n == 1) || (chunks[c].count >= min);
+            next += chunks[c].count;
+        }
+        ok_split &= next == count;
+    }
+
+    printf("record: chunks_split(), %s\n", ok_split ? "ok" : "FAILED");
+    fflush(stdout);
+
+    win = window_new(0, 0, b->width, b->height);
+    if (!win)
+        return 1;
+
+    d3d = d3d_init(win, 0);
+    if (!d3d)
+    {
+        window_del(win);
+        return 1;
+    }
+
+    bench_scene_fill(d3d->scene, b,
+                     b->triangles.values[0], b->rectangles.values[0]);
+
+    /* reference: single thread, drawn in scene order without recording */
+    d3d_render(d3d);
+    size = (size_t)d3d->width * d3d->height * sizeof(unsigned int);
+    ref = (unsigned int *)mem_malloc(size);
+    if (!ref)
+    {
+        d3d_shutdown(d3d);
+        window_del(win);
+        return 1;
+    }
+    memcpy(ref, d3d->framebuffer, size);
+
+    ok = ok_split;
+    for (t = 0; t < (int)(sizeof(threads) / sizeof(threads[0])); t++)
+    {
+        unsigned long long start;
+        unsigned long long total;
+        int same;
+
+        if (!d3d_threads_set(d3d, threads[t]))
+            break;
+
+        d3d_render(d3d);
+        same = !memcmp(ref, d3d->framebuffer, size);
+        ok &= same;
+
+        /* recording only, the front-end of the tiled path */
+        total = 0;
+        for (i = 0; i < b->frames; i++)
+        {
+            start = time_now();
+            soft_record(d3d);
+            total += time_now() - start;
+            arena_reset(&d3d->frame);
+        }
+
+        printf("record: threads %d, %u chunks, %.3f ms per recording, "
+               "replay %s\n",
+               threads[t], d3d->chunks_count,
+               (double)total / b->frames / 1e6,
+               same ? "identical" : "DIFFERENT");
+        fflush(stdout);
+    }
+
+    free(ref);
+    d3d_shutdown(d3d);
+    window_del(win);
+
+    return !ok;
+}
+
+/*
+ * damage: the framebuffer redrawn only in the damaged rects must be the
+ * one redrawn entirely, for each frame, with a rotation in the middle.
+ * The cost of the tracking is measured on random rects.
+ */
+static int bench_damage(const Bench *b)
+{
+    Window *win[2];
+    D3d *d3d[2];
+    Damage damage;
+    Damage_Region redraw;
+    Damage_Region present;
+    unsigned long long total[2];
+    unsigned long long start;
+    unsigned long long rects;
+    unsigned int state[2];
+    unsigned int rs;
+    size_t size;
+    Bench bc;
+    int frames_same;
+    int adds;
+    int ok;
+    int i;
+    int k;
+
+    /* a few primitives moved each frame */
+    bc = *b;
+    if (bc.changes < 10)
+        bc.changes = 10;
+
+    ok = 0;
+    memset(win, 0, sizeof(win));
+    memset(d3d, 0, sizeof(d3d));
+    for (k = 0; k < 2; k++)
+    {
+        win[k] = window_new(0, 0, b->width, b->height);
+        d3d[k] = win[k] ? d3d_init(win[k], 0) : NULL;
+        if (!d3d[k])
+        {
+            printf("damage: can not create the targets\n");
+            goto shutdown;
+        }
+        d3d_damage_set(d3d[k], k == 0);
+        bench_scene_fill(d3d[k]->scene, &bc,
+                         b->triangles.values[0], b->rectangles.values[0]);
+        d3d_render(d3d[k]);
+        state[k] = b->seed + 1U;
+        total[k] = 0;
+    }
+
+    frames_same = 0;
+    for (i = 0; i < b->frames; i++)
+    {
+        if (i == b->frames / 2)
+        {
+            window_rotation_set(win[0], 1);
+            window_rotation_set(win[1], 1);
+        }
+
+        for (k = 0; k < 2; k++)
+        {
+            start = time_now();
+            bench_scene_change(d3d[k]->scene, &bc, state + k);
+            d3d_render(d3d[k]);
+            total[k] += time_now() - start;
+        }
+
+        size = (size_t)d3d[0]->width * d3d[0]->height * sizeof(unsigned int);
+        frames_same += (d3d[0]->width == d3d[1]->width) &&
+                       (d3d[0]->height == d3d[1]->height) &&
+                       !memcmp(d3d[0]->framebuffer, d3d[1]->framebuffer, size);
+    }
+
+    ok = frames_same == b->frames;
+    printf("damage: %d changes/frame, %.3f ms damaged, %.3f ms full, "
+           "%d/%d frames identical, %.1f%% redrawn, %s\n",
+           bc.changes,
+           (double)total[0] / b->frames / 1e6,
+           (double)total[1] / b->frames / 1e6,
+           frames_same, b->frames,
+           100.0 * (double)d3d[0]->scene->damage.pixels /
+           ((double)d3d[0]->scene->damage.frames * b->width * b->height),
+           ok ? "ok" : "FAILED");
+    fflush(stdout);
+
+    /* tracking only: random rects, a few per frame */
+    damage_init(&damage);
+    damage_size_set(&damage, b->width, b->height);
+    rs = 1U;
+    adds = 0;
+    rects = 0;
+    start = time_now();
+    for (i = 0; i < 100000; i++)
+    {
+        int n = 1 + bench_rand(&rs) % 16;
+
+        for (k = 0; k < n; k++)
+        {
+            Damage_Rect r;
+
+            r.x0 = (int)(bench_rand(&rs) % b->width);
+            r.y0 = (int)(bench_rand(&rs) % b->height);
+            r.x1 = r.x0 + 1 + (int)(bench_rand(&rs) % b->prim_size);
+            r.y1 = r.y0 + 1 + (int)(bench_rand(&rs) % b->prim_size);
+            damage_add(&damage, &r);
+        }
+        adds += n;
+        damage_frame(&damage, &redraw, &present);
+        rects += redraw.count;
+    }
+    start = time_now() - start;
+
+    printf("damage: %.1f ns per rect added, %.2f rects per frame, "
+           "%.1f%% full frames, %.1f%% redrawn\n",
+           (double)start / adds,
+           (double)rects / damage.frames,
+           100.0 * damage.full_frames / damage.frames,
+           100.0 * (double)damage.pixels /
+           ((double)damage.frames * b->width * b->height));
+    fflush(stdout);
+
+  shutdown:
+    for (k = 0; k < 2; k++)
+    {
+        if (d3d[k])
+            d3d_shutdown(d3d[k]);
+        if (win[k])
+            window_del(win[k]);
+    }
+
+    return !ok;
+}
+
+/*
+ * frame arena: allocations are aligned and disjoint,
+ * a reset gives the same memory back, and once the largest frame has
+ * been seen, nothing is allocated on the heap anymore, by the arena nor
+ * by the rendering. Then both are timed against malloc() / free().
+ */
+static int bench_arena(const Bench *b)
+{
+    static const int threads[] = { 1, 4 };
+    Arena arena;
+    unsigned char **ptrs;
+    size_t *sizes;
+    unsigned long long allocs;
+    unsigned long long start;
+    unsigned long long t_arena;
+    unsigned long long t_malloc;
+    unsigned int state;
+    int frames;
+    int ok;
+    int n;
+    int i;
+    int j;
+    int f;
+
+    n = b->arena;
+    ptrs = (unsigned char **)mem_malloc(n * sizeof(unsigned char *));
+    sizes = (size_t *)mem_malloc(n * sizeof(size_t));
+    if (!ptrs || !sizes)
+    {
+        free(ptrs);
+        free(sizes);
+        return 1;
+    }
+
+    state = 1U;
+    for (i = 0; i < n; i++)
+        sizes[i] = 1 + bench_rand(&state) % 256;
+
+    /* aligned, disjoint, then the same memory after a reset */
+    ok = 1;
+    arena_init(&arena, 4096);
+    for (f = 0; f < 4; f++)
+    {
+        allocs = mem_allocs_get();
+        for (i = 0; i < n; i++)
+        {
+            unsigned char *p = (unsigned char *)arena_alloc(&arena, sizes[i]);
+
+            ok &= p && !((size_t)p & (ARENA_ALIGN - 1));
+            if (!p)
+                break;
+            ok &= (f < 2) || (p == ptrs[i]);
+            ptrs[i] = p;
+            memset(p, i & 0xff, sizes[i]);
+        }
+        for (j = 0; j < i; j++)
+        {
+            size_t k;
+
+            for (k = 0; k < sizes[j]; k++)
+                ok &= ptrs[j][k] == (unsigned char)(j & 0xff);
+        }
+        /* frame 0 fills the blocks, frame 1 the merged one */
+        ok &= (f < 1) || (mem_allocs_get() == allocs);
+        arena_reset(&arena);
+        ok &= (f < 1) || (arena.blocks && !arena.blocks->next);
+    }
+    ok &= arena.peak >= (size_t)n;
+
+    printf("arena: %d allocations per frame, peak %zu bytes, "
+           "aligned, disjoint, reused after a reset: %s\n",
+           n, arena.peak, ok ? "ok" : "FAILED");
+    fflush(stdout);
+
+    /* steady state of the rendering, single thread then tiled */
+    for (j = 0; j < (int)(sizeof(threads) / sizeof(threads[0])); j++)
+    {
+        Window *win;
+        D3d *d3d;
+        Bench bc;
+
+        win = window_new(0, 0, b->width, b->height);
+        d3d = win ? d3d_init(win, 0) : NULL;
+        if (!d3d)
+        {
+            window_del(win);
+            ok = 0;
+            break;
+        }
+
+        bc = *b;
+        if (bc.changes < 10)
+            bc.changes = 10;
+        d3d_threads_set(d3d, threads[j]);
+        bench_scene_fill(d3d->scene, &bc,
+                         b->triangles.values[0], b->rectangles.values[0]);
+        state = b->seed + 1U;
+        frames = 20;
+        for (f = 0; f < frames; f++)
+        {
+            bench_scene_change(d3d->scene, &bc, &state);
+            d3d_render(d3d);
+        }
+        /* the first frames allocate, not the last ones */
+        d3d->allocs.frames_allocating = 0;
+        for (f = 0; f < frames; f++)
+        {
+            bench_scene_change(d3d->scene, &bc, &state);
+            d3d_render(d3d);
+        }
+        ok &= d3d->allocs.frames_allocating == 0;
+
+        printf("arena: threads %d, %u of the last %d frames allocating, "
+               "frame arena peak %zu bytes: %s\n",
+               threads[j], d3d->allocs.frames_allocating, frames,
+               d3d->frame.peak,
+               (d3d->allocs.frames_allocating == 0) ? "ok" : "FAILED");
+        fflush(stdout);
+
+        d3d_shutdown(d3d);
+        window_del(win);
+    }
+
+    /* timing, against malloc() / free() */
+    frames = 100;
+    t_arena = 0;
+    t_malloc = 0;
+    for (f = 0; f < frames; f++)
+    {
+        start = time_now();
+        for (i = 0; i < n; i++)
+            ptrs[i] = (unsigned char *)arena_alloc(&arena, sizes[i]);
+        arena_reset(&arena);
+        t_arena += time_now() - start;
+
+        start = time_now();
+        for (i = 0; i < n; i++)
+            ptrs[i] = (unsigned char *)malloc(sizes[i]);
+        for (i = 0; i < n; i++)
+            free(ptrs[i]);
+        t_malloc += time_now() - start;
+    }
+
+    printf("arena: %.1f ns per allocation, malloc / free %.1f ns\n",
+           (double)t_arena / ((double)frames * n),
+           (double)t_malloc / ((double)frames * n));
+    fflush(stdout);
+
+    arena_free(&arena);
+    free(sizes);
+    free(ptrs);
+
+    return !ok;
+}
+
+/*
+ * vertices: packing and unpacking round trip over the whole 16 bits
+ * range, the conversion of the pixels to NDC of main_vs / main_vs16
+ * (vertex_ndc() and xform_batch()) gives the floats of XF() / YF(),
+ * the scene in both formats gives the same framebuffer for each
+ * rotation, and a size change regenerates no vertex.
+ * The regeneration of all the vertices is timed in both formats.
+ */
+static int bench_vertex(const Bench *b)
+{
+    static const int sizes[][2] =
+    {
+        { 1, 1 }, { 640, 480 }, { 1920, 1080 }, { 1080, 1920 }, { 3840, 2160 }, { 4095, 7 }
+    };
+    static const int threads[] = { 1, 4 };
+    Window *win;
+    Window *win2;
+    D3d *d3d;
+    D3d *d3d2;
+    unsigned int *ref;
+    unsigned int state;
+    size_t size;
+    int ok_pack;
+    int ok_decode;
+    int ok_xform;
+    int ok;
+    int i;
+    int j;
+
+    /* round trip, then out of range */
+    ok_pack = 1;
+    state = 1U;
+    for (i = -32768; i <= 32767; i++)
+    {
+        Vertex16 v;
+        unsigned int c = bench_rand(&state);
+        int y = (int)(bench_rand(&state) % 65536) - 32768;
+        int x2, y2;
+        unsigned char r, g, bl, a;
+
+        ok_pack &= vertex16_pack(&v, i, y, c, c >> 8, c >> 16, c >> 24);
+        vertex16_unpack(&v, &x2, &y2, &r, &g, &bl, &a);
+        ok_pack &= (x2 == i) && (y2 == y) &&
+                   (r == (unsigned char)c) && (g == (unsigned char)(c >> 8)) &&
+                   (bl == (unsigned char)(c >> 16)) && (a == (unsigned char)(c >> 24));
+    }
+    for (i = 0; i < 1000; i++)
+    {
+        Vertex16 v;
+        int x = 32768 + (int)(bench_rand(&state) % 100000);
+        int x2, y2;
+        unsigned char r, g, bl, a;
+
+        ok_pack &= !vertex16_pack(&v, x, -x, 0, 0, 0, 0);
+        vertex16_unpack(&v, &x2, &y2, &r, &g, &bl, &a);
+        ok_pack &= (x2 == 32767) && (y2 == -32768);
+    }
+
+    printf("vertex: %u bytes instead of %u, pack / unpack round trip: %s\n",
+           (unsigned int)sizeof(Vertex16), (unsigned int)sizeof(Vertex),
+           ok_pack ? "ok" : "FAILED");
+
+    /* main_vs and main_vs16, on the CPU: the floats of XF() / YF() */
+    ok_decode = 1;
+    for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+    {
+        int w = sizes[j][0];
+        int h = sizes[j][1];
+
+        for (i = -2 * w; i <= 3 * w; i++)
+        {
+            Vertex16 v;
+            Vertex d;
+            float x = XF(w, i);
+            float y = YF(h, i);
+            float nx;
+            float ny;
+
+            /* float pixels */
+            vertex_ndc((float)i, (float)i, w, h, &nx, &ny);
+            ok_decode &= !memcmp(&nx, &x, sizeof(float)) &&
+                         !memcmp(&ny, &y, sizeof(float));
+
+            /* 16 bits pixels */
+            vertex16_pack(&v, i, i, 1, 2, 3, 4);
+            vertex16_decode(&v, &d);
+            vertex_ndc(d.x, d.y, w, h, &nx, &ny);
+            ok_decode &= !memcmp(&nx, &x, sizeof(float)) &&
+                         !memcmp(&ny, &y, sizeof(float)) &&
+                         (d.r == 1) && (d.g == 2) && (d.b == 3) && (d.a == 4);
+        }
+    }
+
+    printf("vertex: pixels to NDC equal to XF() / YF(): %s\n",
+           ok_decode ? "ok" : "FAILED");
+
+    /* batch transform, with the rotation of main_vs */
+    ok_xform = 1;
+    for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+    {
+        int w = sizes[j][0];
+        int h = sizes[j][1];
+        int rot;
+
+        for (rot = 0; rot < 4; rot++)
+        {
+            float m[2][4];
+
+            rotation_matrix_set(m, rot);
+            for (i = -2 * w; i <= 3 * w; i += 64)
+            {
+                int xs[64];
+                int ys[64];
+                float ox[64];
+                float oy[64];
+                unsigned int n;
+                unsigned int k;
+
+                n = (unsigned int)(3 * w - i + 1);
+                if (n > 64U) n = 64U;
+                for (k = 0; k < n; k++)
+                {
+                    xs[k] = i + (int)k;
+                    ys[k] = 2 * w - i - (int)k;
+                }
+
+                xform_batch(xs, ys, ox, oy, n, w, h, m);
+                for (k = 0; k < n; k++)
+                {
+                    float nx;
+                    float ny;
+                    float x;
+                    float y;
+
+                    vertex_ndc((float)xs[k], (float)ys[k], w, h, &nx, &ny);
+                    x = m[0][0] * nx + m[0][1] * ny + m[0][2];
+                    y = m[1][0] * nx + m[1][1] * ny + m[1][2];
+                    ok_xform &= !memcmp(ox + k, &x, sizeof(float)) &&
+                                !memcmp(oy + k, &y, sizeof(float));
+                }
+            }
+        }
+    }
+
+    printf("vertex: batch transform equal to main_vs: %s\n",
+           ok_xform ? "ok" : "FAILED");
+    fflush(stdout);
+
+    ok = ok_pack && ok_decode && ok_xform;
+
+    /* same frames in both formats */
+    win = window_new(0, 0, b->width, b->height);
+    d3d = win ? d3d_init(win, 0) : NULL;
+    if (!d3d)
+    {
+        window_del(win);
+        return 1;
+    }
+
+    size = (size_t)b->width * b->height * sizeof(unsigned int);
+    ref = (unsigned int *)mem_malloc(size);
+    if (!ref)
+    {
+        d3d_shutdown(d3d);
+        window_del(win);
+        return 1;
+    }
+
+    bench_scene_fill(d3d->scene, b,
+                     b->triangles.values[0], b->rectangles.values[0]);
+    for (j = 0; j < (int)(sizeof(threads) / sizeof(threads[0])); j++)
+    {
+        d3d_threads_set(d3d, threads[j]);
+        for (i = 0; i < 4; i++)
+        {
+            int same;
+
+            window_rotation_set(win, i);
+            scene_vertex_format_set(d3d->scene, VERTEX_FORMAT_FLOAT);
+            d3d_render(d3d);
+            size = (size_t)d3d->width * d3d->height * sizeof(unsigned int);
+            memcpy(ref, d3d->framebuffer, size);
+            scene_vertex_format_set(d3d->scene, VERTEX_FORMAT_SINT16);
+            d3d_render(d3d);
+            same = !memcmp(ref, d3d->framebuffer, size);
+            ok &= same;
+
+            printf("vertex: threads %d rotation %d, same frame in both formats: %s\n",
+                   threads[j], i, same ? "ok" : "FAILED");
+        }
+    }
+    fflush(stdout);
+
+    /*
+     * size change: nothing to regenerate, and the frame is the one of
+     * a scene created at the new size
+     */
+    window_rotation_set(win, 0);
+    win2 = window_new(0, 0, b->width / 2 + 1, b->height / 2 + 1);
+    d3d2 = win2 ? d3d_init(win2, 0) : NULL;
+    if (d3d2)
+    {
+        bench_scene_fill(d3d2->scene, b,
+                         b->triangles.values[0], b->rectangles.values[0]);
+        for (i = 0; i < VERTEX_FORMAT_LAST; i++)
+        {
+            Scene *s = d3d->scene;
+            int clean;
+            int same;
+
+            scene_vertex_format_set(s, (Vertex_Format)i);
+            scene_vertex_format_set(d3d2->scene, (Vertex_Format)i);
+            d3d_resize(d3d, 0, b->width, b->height);
+            d3d_render(d3d);
+            d3d_render(d3d2);
+
+            d3d_resize(d3d, 0, win2->width, win2->height);
+            scene_size_set(s, win2->width, win2->height);
+            clean = !s->dirty_all && (s->dirty_count == 0);
+            d3d_render(d3d);
+            size = (size_t)d3d2->width * d3d2->height * sizeof(unsigned int);
+            same = (d3d->width == d3d2->width) &&
+                   (d3d->height == d3d2->height) &&
+                   !memcmp(d3d->framebuffer, d3d2->framebuffer, size);
+            ok &= clean && same;
+
+            printf("vertex: %s, size change: no vertex regenerated: %s, "
+                   "same frame as a new scene: %s\n",
+                   (i == VERTEX_FORMAT_FLOAT) ? "float" : "sint16",
+                   clean ? "ok" : "FAILED", same ? "ok" : "FAILED");
+        }
+        d3d_resize(d3d, 0, b->width, b->height);
+        d3d_render(d3d);
+    }
+    else
+        ok = 0;
+    d3d_shutdown(d3d2);
+    window_del(win2);
+    fflush(stdout);
+
+    /* regeneration of all the vertices, as after a format change */
+    for (i = 0; i < VERTEX_FORMAT_LAST; i++)
+    {
+        Scene *s = d3d->scene;
+        unsigned long long start;
+        unsigned long long total;
+
+        scene_vertex_format_set(s, (Vertex_Format)i);
+        total = 0;
+        for (j = 0; j < b->frames; j++)
+        {
+            s->dirty_all = 1;
+            start = time_now();
+            scene_update(s);
+            total += time_now() - start;
+            scene_clean(s);
+        }
+
+        printf("vertex: %s, %u bytes per vertex, %u KB for the scene, "
+               "%.2f ns per vertex regenerated\n",
+               (i == VERTEX_FORMAT_FLOAT) ? "float" : "sint16",
+               s->vertex_size, s->vertices_count * s->vertex_size / 1024,
+               (double)total / ((double)b->frames * s->vertices_count));
+    }
+    fflush(stdout);
+
+    free(ref);
+    d3d_shutdown(d3d);
+    window_del(win);
+
+    return !ok;
 }
 
-void window_del(Window *win)
+/* Batch_Ops on the CPU: the draws are expanded to a list of positions */
+typedef struct
 {
-    if (!win)
-        return;
+    Vertex *ring;
+    const USHORT *indices; /* shared */
+    int *positions; /* x y of the vertices of the drawn triangles */
+    unsigned int count; /* in vertices */
+    unsigned int size;
+    unsigned int draws;
+    unsigned int draws_too_large;
+    unsigned int maps;
+    unsigned int discards;
+    unsigned int drawn_end; /* end of the vertices drawn since the last discard */
+    unsigned int overwrites; /* draws before drawn_end, without discard */
+} Bench_Batch;
+
+static void *bench_batch_map(void *data, int discard)
+{
+    Bench_Batch *bb = (Bench_Batch *)data;
 
-    DestroyWindow(win->win);
-    UnregisterClass("D2D", win->instance);
-    FreeLibrary(win->instance);
-    free(win);
+    bb->maps++;
+    if (discard)
+    {
+        bb->discards++;
+        bb->drawn_end = 0;
+    }
+
+    return bb->ring;
 }
 
-void window_show(Window *win)
+static void bench_batch_unmap(void *data)
 {
-    ShowWindow(win->win, SW_SHOWNORMAL);
+    (void)data;
 }
 
-void window_fullscreen_set(Window *win, unsigned int on)
+static void bench_batch_draw(void *data,
+                             unsigned int index_count,
+                             unsigned int first_index,
+                             unsigned int base_vertex)
 {
-    HWND prev;
-    DWORD style;
-    DWORD exstyle;
-    UINT flags;
-    int x;
-    int y;
-    int w;
-    int h;
+    Bench_Batch *bb = (Bench_Batch *)data;
+    unsigned int i;
 
-    on =  !!on;
-    if ((win->fullscreen && on) ||
-        (!win->fullscreen && !on))
+    bb->draws++;
+    if ((index_count > 6U * INDEX_QUADS_MAX) ||
+        (first_index + index_count > INDEX_SHARED_COUNT))
+    {
+        bb->draws_too_large++;
         return;
+    }
 
-    if (on)
+    /* no-overwrite: appended vertices follow the drawn ones */
+    if (base_vertex < bb->drawn_end)
+        bb->overwrites++;
+    bb->drawn_end = base_vertex +
+                    ((first_index == INDEX_QUADS_FIRST) ? 4U * (index_count / 6U) :
+                                                          index_count);
+
+    for (i = 0; i < index_count; i += 3)
     {
-        MONITORINFO mi;
-        HMONITOR monitor;
+        const Vertex *v0 = bb->ring + base_vertex + bb->indices[first_index + i + 0];
+        const Vertex *v1 = bb->ring + base_vertex + bb->indices[first_index + i + 1];
+        const Vertex *v2 = bb->ring + base_vertex + bb->indices[first_index + i + 2];
 
-        if (!GetWindowRect(win->win, &win->rect))
+        /* degenerate triangles are not drawn */
+        if ((v1->x - v0->x) * (v2->y - v0->y) == (v1->y - v0->y) * (v2->x - v0->x))
+            continue;
+
+        if ((bb->count + 3 <= bb->size) && bb->positions)
         {
-            printf("GetWindowRect() failed\n");
-            return;
+            int *p = bb->positions + 2 * bb->count;
+
+            p[0] = (int)v0->x;
+            p[1] = (int)v0->y;
+            p[2] = (int)v1->x;
+            p[3] = (int)v1->y;
+            p[4] = (int)v2->x;
+            p[5] = (int)v2->y;
         }
+        bb->count += 3;
+    }
+}
 
-        monitor = MonitorFromWindow(win->win, MONITOR_DEFAULTTONEAREST);
-        mi.cbSize = sizeof(MONITORINFO);
-        if (!GetMonitorInfo(monitor, &mi))
-            return;
+static const Batch_Ops bench_batch_ops =
+{
+    bench_batch_map,
+    bench_batch_unmap,
+    bench_batch_draw
+};
 
-        style = WS_VISIBLE | WS_POPUP;
-        exstyle = WS_EX_TOPMOST;
-        prev = HWND_TOPMOST;
-        x = 0;
-        y = 0;
-        w = mi.rcMonitor.right - mi.rcMonitor.left;
-        h = mi.rcMonitor.bottom - mi.rcMonitor.top;
-        flags = SWP_NOCOPYBITS | SWP_SHOWWINDOW;
+/*
+ * shared 16 bits indices: the generated pattern, the splitting of the
+ * draws at the 16 bits limit, which gives the same triangles as one
+ * index per vertex in 32 bits, and the batcher, which draws the
+ * appended triangles in order with the shared indices only. The bytes
+ * of indices are compared with the previous per-primitive 32 bits ones.
+ */
+static int bench_index(const Bench *b)
+{
+    static const unsigned int counts[] =
+    {
+        0, 1, 2, INDEX_TRIANGLES_MAX - 1, INDEX_TRIANGLES_MAX,
+        INDEX_TRIANGLES_MAX + 1, INDEX_QUADS_MAX - 1, INDEX_QUADS_MAX,
+        INDEX_QUADS_MAX + 1, 3 * INDEX_QUADS_MAX + 5, 100000
+    };
+    static const unsigned int quad[6] = { 0, 1, 3, 1, 2, 3 };
+    USHORT *indices;
+    Bench_Batch bb;
+    Batch bt;
+    int *expected;
+    unsigned int expected_count;
+    unsigned int state;
+    unsigned int triangles;
+    unsigned int rectangles;
+    unsigned int i;
+    unsigned int j;
+    int ok_pattern;
+    int ok_split;
+    int ok_batch;
+    int ok_compact;
+
+    indices = (USHORT *)mem_malloc(INDEX_SHARED_COUNT * sizeof(USHORT));
+    if (!indices)
+        return 1;
+
+    /* pattern */
+    index_shared_fill(indices);
+    ok_pattern = 1;
+    for (i = 0; i < INDEX_QUADS_MAX; i++)
+    {
+        for (j = 0; j < 6; j++)
+            ok_pattern &= indices[INDEX_QUADS_FIRST + 6 * i + j] == 4 * i + quad[j];
     }
-    else
+    for (i = 0; i < 3 * INDEX_TRIANGLES_MAX; i++)
+        ok_pattern &= indices[INDEX_TRIANGLES_FIRST + i] == i;
+    for (i = 0; i < INDEX_SHARED_COUNT; i++)
+        ok_pattern &= indices[i] < INDEX16_VERTICES_MAX;
+
+    printf("index: %u shared indices, %u KB, pattern: %s\n",
+           INDEX_SHARED_COUNT, INDEX_SHARED_COUNT * 2 / 1024,
+           ok_pattern ? "ok" : "FAILED");
+
+    /* scene indices in 16 bits: the strip cut is the one of R16_UINT */
     {
+        static const unsigned int in[6] = { 0, 1, 3, INDEX_CUT, 0xfffd, 0xfffe };
+        static const USHORT out_expected[6] = { 0, 1, 3, 0xffff, 0xfffd, 0xfffe };
+        USHORT out[6];
+        int ok_convert;
 
-        style = WS_OVERLAPPEDWINDOW | WS_SIZEBOX;
-        exstyle = 0U;
-        prev = HWND_NOTOPMOST;
-        x = win->rect.left;
-        y = win->rect.top;
-        w = win->rect.right - win->rect.left;
-        h = win->rect.bottom - win->rect.top;
-        flags = SWP_NOCOPYBITS | SWP_SHOWWINDOW;
+        index16_convert(in, 6, out);
+        ok_convert = !memcmp(out, out_expected, sizeof(out));
+        ok_pattern &= ok_convert;
+
+        printf("index: scene indices to 16 bits, cut 0x%x: %s\n",
+               out[3], ok_convert ? "ok" : "FAILED");
     }
 
-    SetLastError(0);
-    if (!SetWindowLongPtr(win->win, GWL_STYLE, style) &&
-        (GetLastError() != 0))
+    /* splitting: same vertices as first_vertex + pattern, in 32 bits */
+    ok_split = 1;
+    for (i = 0; i < 2 * (sizeof(counts) / sizeof(counts[0])); i++)
     {
-        printf("SetWindowLongPtr() failed\n");
-        return;
+        Prim_Type type = (i & 1) ? PRIM_RECTANGLE : PRIM_TRIANGLE;
+        unsigned int vertices = (type == PRIM_RECTANGLE) ? 4U : 3U;
+        unsigned int count = counts[i / 2];
+        unsigned int base = 1000U;
+        unsigned int prim = 0;
+        unsigned int draws = 0;
+
+        while (prim < count)
+        {
+            Index_Draw d;
+            unsigned int n;
+            unsigned int k;
+
+            n = index_draw_get(type, base + prim * vertices, count - prim, &d);
+            ok_split &= (n > 0) && (d.index_count == n * (vertices == 4U ? 6U : 3U)) &&
+                        (d.first_index + d.index_count <= INDEX_SHARED_COUNT);
+            if (!ok_split)
+                break;
+
+            for (k = 0; k < d.index_count; k++)
+            {
+                unsigned int p = prim + k / (vertices == 4U ? 6U : 3U);
+                unsigned int e = (vertices == 4U) ? quad[k % 6] : k % 3;
+
+                ok_split &= d.base_vertex + indices[d.first_index + k] ==
+                            base + p * vertices + e;
+            }
+            prim += n;
+            draws++;
+        }
+
+        ok_split &= draws == (count + ((vertices == 4U) ? INDEX_QUADS_MAX : INDEX_TRIANGLES_MAX) - 1) /
+                             ((vertices == 4U) ? INDEX_QUADS_MAX : INDEX_TRIANGLES_MAX);
     }
-    SetLastError(0);
-    if (!SetWindowLongPtr(win->win, GWL_EXSTYLE, exstyle) &&
-        (GetLastError() != 0))
+
+    printf("index: draws split at %u quads / %u triangles, same vertices as 32 bits indices: %s\n",
+           INDEX_QUADS_MAX, INDEX_TRIANGLES_MAX, ok_split ? "ok" : "FAILED");
+
+    /* batcher, several ring wraps, against the appended triangles */
+    triangles = (unsigned int)b->triangles.values[0] * 20U;
+    rectangles = (unsigned int)b->rectangles.values[0] * 20U;
+    memset(&bb, 0, sizeof(Bench_Batch));
+    bb.indices = indices;
+    bb.size = 3U * (triangles + 2U * rectangles);
+    bb.ring = (Vertex *)mem_malloc(BATCH_VERTICES * sizeof(Vertex));
+    bb.positions = (int *)mem_malloc(2U * bb.size * sizeof(int));
+    expected = (int *)mem_malloc(2U * bb.size * sizeof(int));
+    if (!bb.ring || !bb.positions || !expected)
     {
-        printf("SetWindowLongPtr() failed\n");
-        return;
+        free(expected);
+        free(bb.positions);
+        free(bb.ring);
+        free(indices);
+        return 1;
     }
-    if (!SetWindowPos(win->win, prev, x, y, w, h, flags))
+
+    batch_init(&bt, &bench_batch_ops, &bb, BATCH_VERTICES);
+    batch_begin(&bt);
+    expected_count = 0;
+    state = b->seed ? b->seed : 1U;
+    for (i = 0; i < triangles + rectangles; i++)
     {
-        printf("SetWindowPos() failed\n");
-        return;
+        int x = (int)(bench_rand(&state) % 4096);
+        int y = (int)(bench_rand(&state) % 4096);
+        int w = 1 + (int)(bench_rand(&state) % 64);
+        int h = 1 + (int)(bench_rand(&state) % 64);
+        int *e = expected + 2 * expected_count;
+
+        if ((i & 1) && (i / 2 < triangles))
+        {
+            batch_triangle(&bt, x, y, x + w, y + h, x - w, y + h, 1, 2, 3, 4);
+            e[0] = x;
+            e[1] = y;
+            e[2] = x + w;
+            e[3] = y + h;
+            e[4] = x - w;
+            e[5] = y + h;
+            expected_count += 3;
+        }
+        else
+        {
+            /* upper left triangle, then bottom right one */
+            batch_rectangle(&bt, x, y, w, h, 1, 2, 3, 4);
+            e[0] = x;
+            e[1] = y;
+            e[2] = x + w;
+            e[3] = y;
+            e[4] = x;
+            e[5] = y + h;
+            e[6] = x + w;
+            e[7] = y;
+            e[8] = x + w;
+            e[9] = y + h;
+            e[10] = x;
+            e[11] = y + h;
+            expected_count += 6;
+        }
+    }
+    batch_flush(&bt);
+
+    ok_batch = (bb.count == expected_count) && !bb.draws_too_large &&
+               !memcmp(bb.positions, expected, 2U * expected_count * sizeof(int));
+
+    printf("index: batch, %u primitives, %u wraps, %u draws, triangles drawn in order: %s\n",
+           triangles + rectangles, bt.wraps, bb.draws, ok_batch ? "ok" : "FAILED");
+
+    /* a run of triangles, then of rectangles: 3 vertices per triangle, 2 draws */
+    batch_init(&bt, &bench_batch_ops, &bb, BATCH_VERTICES);
+    batch_begin(&bt);
+    bb.count = 0;
+    bb.draws = 0;
+    for (i = 0; i < 2000; i++)
+    {
+        if (i < 1000)
+            batch_triangle(&bt, 0, 0, 10, 0, 0, 10, 1, 2, 3, 4);
+        else
+            batch_rectangle(&bt, 0, 0, 10, 10, 1, 2, 3, 4);
+    }
+    batch_flush(&bt);
+    ok_compact = (bt.vertex_pos == 3U * 1000U + 4U * 1000U) &&
+                 (bb.draws == 2) && (bb.count == 3U * 1000U + 6U * 1000U);
+    ok_batch &= ok_compact;
+
+    printf("index: batch, 1000 triangles then 1000 rectangles, %u vertices, %u draws: %s\n",
+           bt.vertex_pos, bb.draws, ok_compact ? "ok" : "FAILED");
+
+    /* bytes per frame, for the primitives of the bench */
+    triangles = (unsigned int)b->triangles.values[0];
+    rectangles = (unsigned int)b->rectangles.values[0];
+    printf("index: %u triangles %u rectangles, batch: %u KB vertices + %u KB indices written "
+           "before, %u KB (%u KB with triangles in quad draws) + 0 now; "
+           "indices read: %u KB in 32 bits, %u KB in 16 bits\n",
+           triangles, rectangles,
+           (unsigned int)((3U * triangles + 4U * rectangles) * sizeof(Vertex) / 1024),
+           (3U * triangles + 6U * rectangles) * 4U / 1024,
+           (unsigned int)((3U * triangles + 4U * rectangles) * sizeof(Vertex) / 1024),
+           (unsigned int)((4U * triangles + 4U * rectangles) * sizeof(Vertex) / 1024),
+           (3U * triangles + 6U * rectangles) * 4U / 1024,
+           (3U * triangles + 6U * rectangles) * 2U / 1024);
+    fflush(stdout);
+
+    free(expected);
+    free(bb.positions);
+    free(bb.ring);
+    free(indices);
+
+    return !(ok_pattern && ok_split && ok_batch);
+}
+
+/* the triangles of indices, vertices sorted, so that windings compare equal */
+static unsigned int bench_triangles_get(Topology topology,
+                                        const unsigned int *indices,
+                                        unsigned int count,
+                                        unsigned int *out)
+{
+    Index_Iter it;
+    unsigned int tri[3];
+    unsigned int n;
+
+    n = 0;
+    index_iter_init(&it, topology, indices, count);
+    while (index_iter_next(&it, tri))
+    {
+        unsigned int t;
+
+        if (tri[0] > tri[1]) { t = tri[0]; tri[0] = tri[1]; tri[1] = t; }
+        if (tri[1] > tri[2]) { t = tri[1]; tri[1] = tri[2]; tri[2] = t; }
+        if (tri[0] > tri[1]) { t = tri[0]; tri[0] = tri[1]; tri[1] = t; }
+        out[n++] = tri[0];
+        out[n++] = tri[1];
+        out[n++] = tri[2];
+    }
+
+    return n;
+}
+
+/*
+ * topologies: random meshes of quads and triangles converted to strips
+ * draw exactly the triangles of the list, in the same order, and the
+ * converter picks the smaller one. The scene gives the same frames in
+ * both, for each rotation. The index counts and the frame times are
+ * compared for several proportions of rectangles.
+ */
+static int bench_topology(const Bench *b)
+{
+    static const int rotations[] = { 0, 1, 2, 3 };
+    static const int threads[] = { 1, 4 };
+    static const int percents[] = { 0, 25, 50, 75, 100 };
+    static const unsigned int quad[6] = { 0, 1, 3, 1, 2, 3 };
+    unsigned int *list;
+    unsigned int *out;
+    unsigned int *tris_list;
+    unsigned int *tris_out;
+    unsigned int size;
+    unsigned int state;
+    unsigned int *ref;
+    Window *win;
+    D3d *d3d;
+    int ok_convert;
+    int ok_scene;
+    int i;
+    int j;
+
+    /* random meshes: quads, triangles, shared vertices */
+    size = 6U * 4096U;
+    list = (unsigned int *)mem_malloc(size * sizeof(unsigned int));
+    out = (unsigned int *)mem_malloc(size * sizeof(unsigned int) * 4 / 3);
+    tris_list = (unsigned int *)mem_malloc(size * sizeof(unsigned int));
+    tris_out = (unsigned int *)mem_malloc(size * sizeof(unsigned int));
+    if (!list || !out || !tris_list || !tris_out)
+    {
+        free(tris_out);
+        free(tris_list);
+        free(out);
+        free(list);
+        return 1;
+    }
+
+    ok_convert = 1;
+    state = b->seed ? b->seed : 1U;
+    for (i = 0; i < 200; i++)
+    {
+        unsigned int quads_percent = (unsigned int)(i % 5) * 25U;
+        unsigned int count = 0;
+        unsigned int quads = 0;
+        unsigned int triangles = 0;
+        unsigned int out_count;
+        unsigned int n1;
+        unsigned int n2;
+        Topology topology;
+
+        while (count + 6U <= size)
+        {
+            unsigned int base = bench_rand(&state) % 60000U;
+            unsigned int k;
+
+            if ((bench_rand(&state) % 100U) < quads_percent)
+            {
+                for (k = 0; k < 6; k++)
+                    list[count++] = base + quad[k];
+                quads++;
+            }
+            else
+            {
+                /* any 3 vertices, sometimes shared with the previous ones */
+                for (k = 0; k < 3; k++)
+                {
+                    unsigned int v = bench_rand(&state) % 60000U;
+
+                    if ((count >= 3) && (bench_rand(&state) & 1))
+                        v = list[count - 3];
+                    list[count++] = v;
+                }
+                triangles++;
+            }
+            if ((bench_rand(&state) % 64U) == 0)
+                break;
+        }
+
+        topology = index_topology_convert(list, count, out, &out_count);
+        n1 = bench_triangles_get(TOPOLOGY_LIST, list, count, tris_list);
+        n2 = bench_triangles_get(topology, out, out_count, tris_out);
+        ok_convert &= (n1 == n2) &&
+                      !memcmp(tris_list, tris_out, n1 * sizeof(unsigned int));
+
+        /* fewer indices, and the strips of 2 triangles are the quads */
+        n2 = index_strip_convert(list, count, out);
+        ok_convert &= out_count == ((n2 < count) ? n2 : count);
+        if (count > 0)
+            ok_convert &= n2 <= 5U * quads + 4U * triangles - 1U;
+        n2 = bench_triangles_get(TOPOLOGY_STRIP, out, n2, tris_out);
+        ok_convert &= (n1 == n2) &&
+                      !memcmp(tris_list, tris_out, n1 * sizeof(unsigned int));
+    }
+
+    printf("topology: list to strips, same triangles in the same order, fewer indices: %s\n",
+           ok_convert ? "ok" : "FAILED");
+    fflush(stdout);
+
+    free(tris_out);
+    free(tris_list);
+    free(out);
+    free(list);
+
+    /* scene: same frames, list or strips */
+    win = window_new(0, 0, b->width, b->height);
+    d3d = win ? d3d_init(win, 0) : NULL;
+    ref = (unsigned int *)mem_malloc((size_t)b->width * b->height *
+                                     sizeof(unsigned int) * 2);
+    if (!d3d || !ref)
+    {
+        free(ref);
+        d3d_shutdown(d3d);
+        window_del(win);
+        return 1;
+    }
+
+    bench_scene_fill(d3d->scene, b,
+                     b->triangles.values[0], b->rectangles.values[0]);
+    ok_scene = 1;
+    for (j = 0; j < (int)(sizeof(threads) / sizeof(threads[0])); j++)
+    {
+        d3d_threads_set(d3d, threads[j]);
+        for (i = 0; i < (int)(sizeof(rotations) / sizeof(rotations[0])); i++)
+        {
+            size_t bytes;
+            int same;
+
+            window_rotation_set(win, rotations[i]);
+            scene_topology_set(d3d->scene, TOPOLOGY_LIST);
+            d3d_render(d3d);
+            bytes = (size_t)d3d->width * d3d->height * sizeof(unsigned int);
+            memcpy(ref, d3d->framebuffer, bytes);
+            same = scene_topology_set(d3d->scene, TOPOLOGY_STRIP);
+            d3d_render(d3d);
+            same &= !memcmp(ref, d3d->framebuffer, bytes);
+            ok_scene &= same;
+
+            printf("topology: threads %d rotation %d, same frame with lists and strips: %s\n",
+                   threads[j], rotations[i], same ? "ok" : "FAILED");
+        }
+    }
+    fflush(stdout);
+    window_rotation_set(win, 0);
+    d3d_threads_set(d3d, 1);
+    d3d_shutdown(d3d);
+    window_del(win);
+    free(ref);
+
+    /* index counts and frame times */
+    for (i = 0; i < (int)(sizeof(percents) / sizeof(percents[0])); i++)
+    {
+        static const char *names[] = { "list", "strip", "auto" };
+        int prims = b->triangles.values[0] + b->rectangles.values[0];
+        int rects = prims * percents[i] / 100;
+        double ms[3];
+        unsigned int counts[3];
+        Topology chosen = TOPOLOGY_LIST;
+        int t;
+
+        win = window_new(0, 0, b->width, b->height);
+        d3d = win ? d3d_init(win, 0) : NULL;
+        if (!d3d)
+        {
+            window_del(win);
+            return 1;
+        }
+        bench_scene_fill(d3d->scene, b, prims - rects, rects);
+
+        /* automatic first, from the list of a new scene */
+        for (t = TOPOLOGY_AUTO; t >= TOPOLOGY_LIST; t--)
+        {
+            unsigned long long start;
+            int f;
+
+            scene_topology_set(d3d->scene, (Topology)t);
+            d3d_render(d3d);
+            start = time_now();
+            for (f = 0; f < b->frames; f++)
+                d3d_render(d3d);
+            ms[t] = (double)(time_now() - start) / (1e6 * b->frames);
+            counts[t] = d3d->scene->indices_count;
+            if (t == TOPOLOGY_AUTO)
+                chosen = d3d->scene->topology;
+        }
+
+        printf("topology: %d triangles %d rectangles, indices: %u list, %u strip, "
+               "auto %s; %.3f ms %s, %.3f ms %s\n",
+               prims - rects, rects, counts[TOPOLOGY_LIST], counts[TOPOLOGY_STRIP],
+               names[chosen], ms[TOPOLOGY_LIST], names[TOPOLOGY_LIST],
+               ms[TOPOLOGY_STRIP], names[TOPOLOGY_STRIP]);
+        fflush(stdout);
+
+        d3d_shutdown(d3d);
+        window_del(win);
+    }
+
+    return !(ok_convert && ok_scene);
+}
+
+/* linear scan, the reference of grid_query() */
+static unsigned int bench_grid_scan(const Damage_Rect *boxes, unsigned int count,
+                                    const Damage_Rect *r, unsigned int *ids)
+{
+    unsigned int n;
+    unsigned int i;
+
+    n = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (damage_rect_intersect(boxes + i, r))
+            ids[n++] = i;
+    }
+
+    return n;
+}
+
+static void bench_grid_box(Damage_Rect *r, unsigned int *state,
+                           int w, int h, int prim_size)
+{
+    int size = prim_size;
+
+    /* some large ones, over more than GRID_CELLS_MAX cells */
+    if ((bench_rand(state) % 100U) == 0)
+        size = 1024;
+    r->x0 = (int)(bench_rand(state) % (unsigned int)w) - w / 8;
+    r->y0 = (int)(bench_rand(state) % (unsigned int)h) - h / 8;
+    r->x1 = r->x0 + 1 + (int)(bench_rand(state) % (unsigned int)size);
+    r->y1 = r->y0 + 1 + (int)(bench_rand(state) % (unsigned int)size);
+}
+
+/*
+ * viewport culling: grid queries return the same ids as a linear scan,
+ * in the same order, after random insertions and moves. Over a canvas 3
+ * times larger than the target, the frames are the same with and
+ * without culling for each rotation. Insertion, move and query times
+ * are measured for 10k, 100k and 1M boxes over 8x8 targets.
+ */
+static int bench_cull(const Bench *b)
+{
+    static const int rotations[] = { 0, 1, 2, 3 };
+    static const int threads[] = { 1, 4 };
+    static const unsigned int counts[] = { 10000, 100000, 1000000 };
+    Damage_Rect *boxes;
+    unsigned int *ids;
+    unsigned int *ref;
+    unsigned int *frame;
+    unsigned int state;
+    Bench canvas;
+    Window *win;
+    D3d *d3d;
+    Grid g;
+    int ok_grid;
+    int ok_scene;
+    int i;
+    int j;
+
+    /* grid against a linear scan */
+    boxes = (Damage_Rect *)mem_malloc(counts[2] * sizeof(Damage_Rect));
+    ids = (unsigned int *)mem_malloc(counts[2] * sizeof(unsigned int) * 2);
+    if (!boxes || !ids)
+    {
+        free(ids);
+        free(boxes);
+        return 1;
+    }
+
+    ok_grid = 1;
+    state = b->seed ? b->seed : 1U;
+    grid_init(&g);
+    for (i = 0; i < 20000; i++)
+    {
+        unsigned int id = (unsigned int)i;
+
+        /* a move for one insertion out of two */
+        if ((i & 1) && (i > 0))
+            id = bench_rand(&state) % (unsigned int)i;
+        bench_grid_box(boxes + id, &state, 4 * b->width, 4 * b->height,
+                       b->prim_size);
+        ok_grid &= grid_set(&g, id, boxes + id);
+        if (i % 1000 == 999)
+        {
+            Damage_Rect r;
+            unsigned int n1;
+            unsigned int n2;
+
+            bench_grid_box(&r, &state, 4 * b->width, 4 * b->height, 2048);
+            n1 = grid_query(&g, &r, ids);
+            n2 = bench_grid_scan(boxes, g.ids_count, &r, ids + counts[2]);
+            ok_grid &= (n1 == n2) &&
+                       !memcmp(ids, ids + counts[2], n1 * sizeof(unsigned int));
+        }
+    }
+    grid_free(&g);
+
+    printf("cull: grid, insertions and moves, queries as a linear scan: %s\n",
+           ok_grid ? "ok" : "FAILED");
+    fflush(stdout);
+
+    /* scene: same frames, culled or not */
+    canvas = *b;
+    canvas.width = 3 * b->width;
+    canvas.height = 3 * b->height;
+    win = window_new(0, 0, b->width, b->height);
+    d3d = win ? d3d_init(win, 0) : NULL;
+    ref = (unsigned int *)mem_malloc((size_t)b->width * b->height *
+                                     sizeof(unsigned int) * 2);
+    if (!d3d || !ref)
+    {
+        free(ref);
+        d3d_shutdown(d3d);
+        window_del(win);
+        free(ids);
+        free(boxes);
+        return 1;
+    }
+
+    bench_scene_fill(d3d->scene, &canvas,
+                     b->triangles.values[0], b->rectangles.values[0]);
+    frame = ref + (size_t)b->width * b->height;
+    ok_scene = 1;
+    for (j = 0; j < (int)(sizeof(threads) / sizeof(threads[0])); j++)
+    {
+        d3d_threads_set(d3d, threads[j]);
+        for (i = 0; i < (int)(sizeof(rotations) / sizeof(rotations[0])); i++)
+        {
+            double ms[2];
+            size_t bytes;
+            int c;
+            int same;
+
+            window_rotation_set(win, rotations[i]);
+            for (c = 1; c >= 0; c--)
+            {
+                unsigned long long start;
+                int f;
+
+                scene_cull_set(d3d->scene, c);
+                d3d_render(d3d);
+                start = time_now();
+                for (f = 0; f < b->frames; f++)
+                    d3d_render(d3d);
+                ms[c] = (double)(time_now() - start) / (1e6 * b->frames);
+                bytes = (size_t)d3d->width * d3d->height * sizeof(unsigned int);
+                memcpy(c ? ref : frame, d3d->framebuffer, bytes);
+                if (c)
+                    printf("cull: threads %d rotation %d, %u of %u visible",
+                           threads[j], rotations[i],
+                           d3d->scene->visible_count, d3d->scene->prims_count);
+            }
+            same = !memcmp(ref, frame, bytes);
+            ok_scene &= same;
+
+            printf(", %.3f ms culled, %.3f ms all, same frame: %s\n",
+                   ms[1], ms[0], same ? "ok" : "FAILED");
+        }
+    }
+    fflush(stdout);
+    window_rotation_set(win, 0);
+    d3d_threads_set(d3d, 1);
+    d3d_shutdown(d3d);
+    window_del(win);
+    free(ref);
+
+    /* timings, the query is a target in the middle of 8x8 targets */
+    for (j = 0; j < (int)(sizeof(counts) / sizeof(counts[0])); j++)
+    {
+        unsigned long long start;
+        double insert_ns;
+        double move_ns;
+        double query_us;
+        double scan_us;
+        Damage_Rect r;
+        unsigned int n;
+        unsigned int k;
+        int q;
+
+        state = b->seed ? b->seed : 1U;
+        for (k = 0; k < counts[j]; k++)
+            bench_grid_box(boxes + k, &state, 8 * b->width, 8 * b->height,
+                           b->prim_size);
+
+        grid_init(&g);
+        start = time_now();
+        for (k = 0; k < counts[j]; k++)
+            grid_set(&g, k, boxes + k);
+        insert_ns = (double)(time_now() - start) / counts[j];
+
+        /* small moves, as bench_scene_change() */
+        start = time_now();
+        for (k = 0; k < counts[j]; k++)
+        {
+            Damage_Rect *box = boxes + bench_rand(&state) % counts[j];
+            int dx = (int)(bench_rand(&state) % 5) - 2;
+            int dy = (int)(bench_rand(&state) % 5) - 2;
+
+            box->x0 += dx;
+            box->x1 += dx;
+            box->y0 += dy;
+            box->y1 += dy;
+            grid_set(&g, (unsigned int)(box - boxes), box);
+        }
+        move_ns = (double)(time_now() - start) / counts[j];
+
+        r.x0 = (int)(3.5 * b->width);
+        r.y0 = (int)(3.5 * b->height);
+        r.x1 = r.x0 + b->width;
+        r.y1 = r.y0 + b->height;
+        n = 0;
+        start = time_now();
+        for (q = 0; q < b->frames; q++)
+            n = grid_query(&g, &r, ids);
+        query_us = (double)(time_now() - start) / (1e3 * b->frames);
+        start = time_now();
+        for (q = 0; q < 10; q++)
+            bench_grid_scan(boxes, counts[j], &r, ids + counts[2]);
+        scan_us = (double)(time_now() - start) / (1e3 * 10);
+
+        printf("cull: %u boxes, %u visible, insertion %.1f ns, move %.1f ns, "
+               "query %.1f us, linear scan %.1f us\n",
+               counts[j], n, insert_ns, move_ns, query_us, scan_us);
+        fflush(stdout);
+        grid_free(&g);
     }
 
-    win->fullscreen = on;
+    free(ids);
+    free(boxes);
+
+    return !(ok_grid && ok_scene);
 }
 
-void window_rotation_set(Window *win, int rotation)
+/*
+ * layers of opaque rectangles over the target, overlapping by 16 pixels
+ * so that their edges are inside the next ones, each with a triangle
+ * and a translucent rectangle over it. The last layer covers all the
+ * previous ones.
+ */
+static void bench_overdraw_fill(Scene *s, const Bench *b, int layers)
 {
-    int rdiff;
-
-    if (win->rotation == rotation)
-        return;
+    unsigned int state;
+    int l;
 
-    rdiff = win->rotation - rotation;
-    if (rdiff < 0) rdiff = -rdiff;
-
-    if (rdiff != 2)
+    state = b->seed ? b->seed : 1U;
+    for (l = 0; l < layers; l++)
     {
-        RECT r;
-        RECT r2;
+        int ox = -(int)(bench_rand(&state) % 128U);
+        int oy = -(int)(bench_rand(&state) % 128U);
         int x;
         int y;
 
-        win->rotation = rotation;
-
-        if (!GetWindowRect(win->win, &r))
+        for (y = oy; y < b->height; y += 128)
         {
-            printf("GetClient failed\n");
-            return;
+            for (x = ox; x < b->width; x += 128)
+            {
+                unsigned int c = bench_rand(&state);
+                int tx = x + (int)(bench_rand(&state) % 96U);
+                int ty = y + (int)(bench_rand(&state) % 96U);
+
+                scene_rectangle_add(s, x, y, 144, 144,
+                                    c, c >> 8, c >> 16, 255);
+                scene_triangle_add(s, tx, ty, tx + 32, ty + 8, tx + 8, ty + 32,
+                                   c >> 16, c, c >> 8, 255);
+                scene_rectangle_add(s, ty - y + x, tx - x + y, 24, 24,
+                                    c >> 8, c >> 16, c, 128);
+            }
         }
+    }
+}
 
-        x = r.left;
-        y = r.top;
+/*
+ * occlusion: the frames are the same with and without it, for random
+ * scenes and overdraw scenes, each rotation, 1 and 4 threads, and the
+ * pass drops the same primitives each time. Frame and pass times are
+ * measured for several overdraw levels.
+ */
+static int bench_occlusion(const Bench *b)
+{
+    static const int rotations[] = { 0, 1, 2, 3 };
+    static const int threads[] = { 1, 4 };
+    static const int layers[] = { 1, 2, 4, 8, 16 };
+    unsigned int *ref;
+    unsigned int *frame;
+    int ok;
+    int n;
+    int i;
+    int j;
+
+    ref = (unsigned int *)mem_malloc((size_t)b->width * b->height *
+                                     sizeof(unsigned int) * 2);
+    if (!ref)
+        return 1;
+    frame = ref + (size_t)b->width * b->height;
 
-        if (!GetClientRect(win->win, &r))
+    ok = 1;
+    for (n = 0; n < 2; n++)
+    {
+        Window *win;
+        D3d *d3d;
+
+        win = window_new(0, 0, b->width, b->height);
+        d3d = win ? d3d_init(win, 0) : NULL;
+        if (!d3d)
         {
-            printf("GetClient failed\n");
-            return;
+            window_del(win);
+            free(ref);
+            return 1;
         }
 
-        printf(" * win rot : %ld %ld\n", r.bottom - r.top, r.right - r.left);
+        /* random scene, or 4 layers */
+        if (n == 0)
+            bench_scene_fill(d3d->scene, b,
+                             b->triangles.values[0], b->rectangles.values[0]);
+        else
+            bench_overdraw_fill(d3d->scene, b, 4);
+
+        for (j = 0; j < (int)(sizeof(threads) / sizeof(threads[0])); j++)
+        {
+            d3d_threads_set(d3d, threads[j]);
+            for (i = 0; i < (int)(sizeof(rotations) / sizeof(rotations[0])); i++)
+            {
+                unsigned int dropped;
+                size_t bytes;
+                int same;
+
+                window_rotation_set(win, rotations[i]);
+                scene_occlusion_set(d3d->scene, 1);
+                d3d_render(d3d);
+                dropped = d3d->scene->occluded_count;
+                bytes = (size_t)d3d->width * d3d->height * sizeof(unsigned int);
+                memcpy(ref, d3d->framebuffer, bytes);
+
+                /* the pass again, from a new query */
+                scene_occlusion_set(d3d->scene, 1);
+                d3d_render(d3d);
+                same = d3d->scene->occluded_count == dropped;
+
+                scene_occlusion_set(d3d->scene, 0);
+                d3d_render(d3d);
+                memcpy(frame, d3d->framebuffer, bytes);
+                same &= !memcmp(ref, frame, bytes);
+                ok &= same;
+
+                printf("occlusion: %s scene, threads %d rotation %d, %u of %u dropped, "
+                       "same frame: %s\n",
+                       n ? "overdraw" : "random", threads[j], rotations[i],
+                       dropped, d3d->scene->prims_count, same ? "ok" : "FAILED");
+            }
+        }
         fflush(stdout);
 
-        r2.left = 0;
-        r2.top = 0;
-        r2.right = r.bottom - r.top;
-        r2.bottom = r.right - r.left;
-        if (!AdjustWindowRectEx(&r2,
-                                WS_OVERLAPPEDWINDOW | WS_SIZEBOX,
-                                FALSE,
-                                0U))
+        window_rotation_set(win, 0);
+        d3d_threads_set(d3d, 1);
+        d3d_shutdown(d3d);
+        window_del(win);
+    }
+    free(ref);
+
+    /* timings */
+    for (i = 0; i < (int)(sizeof(layers) / sizeof(layers[0])); i++)
+    {
+        Window *win;
+        D3d *d3d;
+        double ms[2];
+        double pass_us;
+        unsigned int dropped;
+        unsigned long long start;
+        int f;
+        int o;
+
+        win = window_new(0, 0, b->width, b->height);
+        d3d = win ? d3d_init(win, 0) : NULL;
+        if (!d3d)
         {
-            printf("AdjustWindowRectEx failed\n");
-            return;
+            window_del(win);
+            return 1;
         }
+        bench_overdraw_fill(d3d->scene, b, layers[i]);
 
-        printf(" * win rot 2 : %ld %ld\n", r2.bottom - r2.top, r2.right - r2.left);
-        fflush(stdout);
+        for (o = 0; o < 2; o++)
+        {
+            scene_occlusion_set(d3d->scene, o);
+            d3d_render(d3d);
+            start = time_now();
+            for (f = 0; f < b->frames; f++)
+                d3d_render(d3d);
+            ms[o] = (double)(time_now() - start) / (1e6 * b->frames);
+        }
 
-        if (!MoveWindow(win->win,
-                        x, y,
-                        r2.right - r2.left, r2.bottom - r2.top,
-                        TRUE))
+        /* the pass alone, the query result is dropped each time */
+        dropped = d3d->scene->occluded_count;
+        start = time_now();
+        for (f = 0; f < b->frames; f++)
         {
-            printf("MoveWindow() failed\n");
-            return;
+            scene_occlusion_set(d3d->scene, 1);
+            scene_visible_update(d3d->scene, d3d->rotation);
         }
+        pass_us = (double)(time_now() - start) / (1e3 * b->frames);
+
+        printf("occlusion: %d layers, %u primitives, %u dropped, "
+               "%.3f ms, %.3f ms without, query and pass %.1f us\n",
+               layers[i], d3d->scene->prims_count, dropped,
+               ms[1], ms[0], pass_us);
+        fflush(stdout);
+
+        d3d_shutdown(d3d);
+        window_del(win);
     }
+
+    return !ok;
 }
 
+/* vertices of a scene, to check which ones are regenerated */
+static int bench_scene_ranges_check(const Scene *s, const unsigned char *before,
+                                    const unsigned int *ids, unsigned int count)
+{
+    unsigned int i;
+    int ok;
 
+    ok = 1;
+    for (i = 0; i < s->prims_count; i++)
+    {
+        const Prim *p = s->prims + i;
+        size_t offset = (size_t)p->first_vertex * s->vertex_size;
+        size_t bytes = (size_t)scene_prim_vertex_count(p) * s->vertex_size;
+        unsigned int k;
+        int dirty = 0;
+
+        for (k = 0; k < count; k++)
+            dirty |= ids[k] == i;
+        if (!dirty)
+            ok &= !memcmp((const unsigned char *)s->vertices + offset,
+                          before + offset, bytes);
+    }
 
-/************************** D3D11 **************************/
+    return ok;
+}
 
-static void d3d_refresh_rate_get(D3d *d3d, UINT *num, UINT *den)
+/*
+ * retained scene: after scene_*_set(), only the vertices of the modified
+ * primitives are regenerated, in one range per run of adjacent ones,
+ * and the ranges are empty once cleaned. The bytes uploaded and the
+ * update time are compared with a full regeneration.
+ */
+static int bench_scene(const Bench *b)
 {
-    DXGI_MODE_DESC *display_mode_list = NULL; /* 28 bytes */
-    IDXGIAdapter *dxgi_adapter;
-    IDXGIOutput *dxgi_output;
-    UINT nbr_modes;
-    UINT i;
-    HRESULT res;
-
-    *num = 0U;
-    *den = 1U;
+    static const int changes[] = { 1, 10, 100, 1000 };
+    unsigned char *before;
+    unsigned int ids[3];
+    Scene *s;
+    size_t bytes;
+    int ok_ranges;
+    int ok_full;
+    int i;
+
+    s = scene_new();
+    if (!s)
+        return 1;
+    bench_scene_fill(s, b, b->triangles.values[0], b->rectangles.values[0]);
+    scene_update(s);
+    scene_clean(s);
 
-    if (!d3d->vsync)
-        return;
+    bytes = (size_t)s->vertices_count * s->vertex_size;
+    before = (unsigned char *)mem_malloc(bytes);
+    if (!before || (s->prims_count < 100))
+    {
+        free(before);
+        scene_free(s);
+        return 1;
+    }
 
-    /* adapter of primary desktop : pass 0U */
-    res = IDXGIFactory_EnumAdapters(d3d->dxgi_factory, 0U, &dxgi_adapter);
-    if (FAILED(res))
-        return;
+    ok_ranges = 1;
 
-    /* output of primary desktop : pass 0U */
-    res = IDXGIAdapter_EnumOutputs(dxgi_adapter, 0U, &dxgi_output);
-    if (FAILED(res))
-        goto release_dxgi_adapter;
+    /* one triangle, then one rectangle */
+    for (i = 0; i < 2; i++)
+    {
+        const Prim *p;
+        unsigned int id;
+
+        for (id = 50; s->prims[id].type != (i ? PRIM_RECTANGLE : PRIM_TRIANGLE); id++)
+            ;
+        p = s->prims + id;
+        memcpy(before, s->vertices, bytes);
+        if (i)
+            scene_rectangle_set(s, (int)id, p->p[0] + 3, p->p[1], p->p[2], p->p[3],
+                                p->r, p->g, p->b, p->a);
+        else
+            scene_triangle_set(s, (int)id, p->p[0] + 3, p->p[1], p->p[2], p->p[3],
+                               p->p[4], p->p[5], p->r, p->g, p->b, p->a);
+        scene_update(s);
+        ids[0] = id;
+        ok_ranges &= (s->ranges_count == 1) &&
+                     (s->ranges[0].first == p->first_vertex) &&
+                     (s->ranges[0].count == (i ? 4U : 3U)) &&
+                     bench_scene_ranges_check(s, before, ids, 1);
+        scene_clean(s);
+        ok_ranges &= (s->ranges_count == 0) && (s->dirty_count == 0) &&
+                     !s->prims[id].dirty;
+    }
 
-    /* number of mode that fit the format */
-     res = IDXGIOutput_GetDisplayModeList(dxgi_output,
-                                         DXGI_FORMAT_B8G8R8A8_UNORM,
-                                         DXGI_ENUM_MODES_INTERLACED,
-                                         &nbr_modes, NULL);
-    if (FAILED(res))
-        goto release_dxgi_output;
+    /* 2 adjacent primitives, set in reverse order, and a distant one */
+    memcpy(before, s->vertices, bytes);
+    ids[0] = 21;
+    ids[1] = 20;
+    ids[2] = 80;
+    for (i = 0; i < 3; i++)
+    {
+        const Prim *p = s->prims + ids[i];
+
+        if (p->type == PRIM_TRIANGLE)
+            scene_triangle_set(s, (int)ids[i], p->p[0], p->p[1] + 1, p->p[2], p->p[3],
+                               p->p[4], p->p[5], p->r, p->g, p->b, p->a);
+        else
+            scene_rectangle_set(s, (int)ids[i], p->p[0], p->p[1] + 1, p->p[2], p->p[3],
+                                p->r, p->g, p->b, p->a);
+    }
+    scene_update(s);
+    ok_ranges &= (s->ranges_count == 2) &&
+                 (s->ranges[0].first == s->prims[20].first_vertex) &&
+                 (s->ranges[0].count == scene_prim_vertex_count(s->prims + 20) +
+                                        scene_prim_vertex_count(s->prims + 21)) &&
+                 (s->ranges[1].first == s->prims[80].first_vertex) &&
+                 (s->ranges[1].count == scene_prim_vertex_count(s->prims + 80)) &&
+                 bench_scene_ranges_check(s, before, ids, 3);
+    scene_clean(s);
+
+    printf("scene: ranges of the modified primitives only, merged, cleaned: %s\n",
+           ok_ranges ? "ok" : "FAILED");
+
+    /* the first primitives, up to 1 in SCENE_DIRTY_FULL, then one more */
+    ok_full = 1;
+    for (i = 0; i < 2; i++)
+    {
+        unsigned int count = s->prims_count / SCENE_DIRTY_FULL + (unsigned int)i;
+        unsigned int id;
+
+        for (id = 0; id < count; id++)
+            scene_prim_dirty(s, id);
+        scene_update(s);
+        ok_full &= !s->dirty_all == !i;
+        ok_full &= (s->ranges_count == 1) && (s->ranges[0].first == 0) &&
+                   ((s->ranges[0].count == s->vertices_count) == !!i);
+        scene_clean(s);
+    }
 
-    printf("display mode list : %d\n", nbr_modes);
+    printf("scene: full update above 1 modified primitive in %u: %s\n",
+           SCENE_DIRTY_FULL, ok_full ? "ok" : "FAILED");
     fflush(stdout);
-    display_mode_list = (DXGI_MODE_DESC *)malloc(nbr_modes * sizeof(DXGI_MODE_DESC));
-    if (!display_mode_list)
-        goto release_dxgi_output;
-
-    /* fill the mode list */
-    res = IDXGIOutput_GetDisplayModeList(dxgi_output,
-                                         DXGI_FORMAT_B8G8R8A8_UNORM,
-                                         DXGI_ENUM_MODES_INTERLACED,
-                                         &nbr_modes, display_mode_list);
-    if (FAILED(res))
-        goto free_mode_list;
+    free(before);
 
-    for (i = 0; i < nbr_modes; i++)
+    /* partial against full updates */
+    for (i = 0; i < (int)(sizeof(changes) / sizeof(changes[0])); i++)
     {
-        if ((display_mode_list[i].Width == (UINT)GetSystemMetrics(SM_CXSCREEN)) &&
-            (display_mode_list[i].Height == (UINT)GetSystemMetrics(SM_CYSCREEN)))
+        Bench bc = *b;
+        unsigned long long start;
+        unsigned long long partial_bytes;
+        double partial_us;
+        double full_us;
+        unsigned int state;
+        unsigned int k;
+        int f;
+
+        bc.changes = changes[i];
+        state = 1U;
+        partial_bytes = 0;
+        start = time_now();
+        for (f = 0; f < b->frames; f++)
         {
-            *num = display_mode_list[i].RefreshRate.Numerator;
-            *den = display_mode_list[i].RefreshRate.Denominator;
-            break;
+            bench_scene_change(s, &bc, &state);
+            scene_update(s);
+            for (k = 0; k < s->ranges_count; k++)
+                partial_bytes += (unsigned long long)s->ranges[k].count * s->vertex_size;
+            scene_clean(s);
         }
-    }
+        partial_us = (double)(time_now() - start) / (1e3 * b->frames);
 
-#ifdef _DEBUG
-    {
-        DXGI_ADAPTER_DESC adapter_desc;
+        start = time_now();
+        for (f = 0; f < b->frames; f++)
+        {
+            bench_scene_change(s, &bc, &state);
+            s->dirty_all = 1;
+            scene_update(s);
+            scene_clean(s);
+        }
+        full_us = (double)(time_now() - start) / (1e3 * b->frames);
 
-        IDXGIAdapter_GetDesc(dxgi_adapter, &adapter_desc);
-        printf(" * video mem: %llu B, %llu MB\n",
-               adapter_desc.DedicatedVideoMemory,
-               adapter_desc.DedicatedVideoMemory / 1024 / 1024);
-        fflush(stdout);
-        wprintf(L" * description: %ls\n", adapter_desc.Description);
-        fflush(stdout);
+        printf("scene: %u primitives, %d changes/frame, %llu bytes %.1f us, "
+               "full %u bytes %.1f us\n",
+               s->prims_count, changes[i], partial_bytes / b->frames, partial_us,
+               s->vertices_count * s->vertex_size, full_us);
     }
-#endif
+    fflush(stdout);
 
-  free_mode_list:
-    free(display_mode_list);
-  release_dxgi_output:
-    IDXGIOutput_Release(dxgi_output);
-  release_dxgi_adapter:
-    IDXGIFactory_Release(dxgi_adapter);
+    scene_free(s);
+
+    return !(ok_ranges && ok_full);
 }
 
-D3d *d3d_init(Window *win, int vsync)
+/*
+ * profiling: the buckets bound their values within 1/16, and
+ * prof_percentile() gives the bucket of the sample of rank ceil(p n),
+ * exact below 16 ns. The aggregation counts the samples overwritten in
+ * a full ring, and aggregating in several times changes nothing.
+ */
+static int bench_prof(void)
 {
-    D3D11_INPUT_ELEMENT_DESC desc_ie[] =
+#ifdef HAVE_PROF
+    static const double ps[] = { 0.01, 0.25, 0.50, 0.90, 0.99, 1.0 };
+    Prof_Histo once;
+    unsigned long long start;
+    unsigned long long v;
+    double sample_ns;
+    int ok_buckets;
+    int ok_small;
+    int ok_large;
+    int ok_ring;
+    int i;
+
+    /* buckets: v is in b, and not in b - 1 */
+    ok_buckets = 1;
+    for (v = 0; v < (1ULL << 40); v = v + 1 + v / 7)
     {
-        { "POSITION", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 0, D3D11_INPUT_PER_VERTEX_DATA, 0 },
-        { "COLOR", 0, DXGI_FORMAT_R8G8B8A8_UNORM, 0, 2 * sizeof(FLOAT), D3D11_INPUT_PER_VERTEX_DATA, 0 }
-    };
-#ifdef HAVE_WIN10
-    DXGI_SWAP_CHAIN_DESC1 desc_sw;
-    DXGI_SWAP_CHAIN_FULLSCREEN_DESC desc_fs;
-#else
-    DXGI_SWAP_CHAIN_DESC desc_sw;
-#endif
-    D3D11_BUFFER_DESC desc_buf;
-    D3D11_RASTERIZER_DESC desc_rs;
-    D3d *d3d;
-    RECT r;
-    HRESULT res;
-    UINT flags;
-    UINT num;
-    UINT den;
-    D3D_FEATURE_LEVEL feature_level[4];
-    ID3DBlob *vs_blob; /* vertex shader blob ptr */
-    ID3DBlob *ps_blob; /* pixel shader blob ptr */
-    ID3DBlob *err_blob; /* error blob ptr */
-
-    d3d = (D3d *)calloc(1, sizeof(D3d));
-    if (!d3d)
-        return NULL;
-
-    d3d->vsync = vsync;
-    win->d3d = d3d;
-
-    /* create the DXGI factory */
-    flags = 0;
-#ifdef HAVE_WIN10
-# ifdef _DEBUG
-    flags = DXGI_CREATE_FACTORY_DEBUG;
-# endif
-    res = CreateDXGIFactory2(flags, &IID_IDXGIFactory2, (void **)&d3d->dxgi_factory);
-#else
-    res = CreateDXGIFactory(&IID_IDXGIFactory, (void **)&d3d->dxgi_factory);
-#endif
-    if (FAILED(res))
-        goto free_d3d;
-
-    /* software engine functions are called from the main loop */
-    flags = D3D11_CREATE_DEVICE_SINGLETHREADED |
-            D3D11_CREATE_DEVICE_BGRA_SUPPORT;
-#ifdef HAVE_WIN10
-# ifdef _DEBUG
-    flags |= D3D11_CREATE_DEVICE_DEBUG;
-# endif
-#endif
-
-    feature_level[0] = D3D_FEATURE_LEVEL_11_1;
-    feature_level[1] = D3D_FEATURE_LEVEL_11_0;
-    feature_level[2] = D3D_FEATURE_LEVEL_10_1;
-    feature_level[3] = D3D_FEATURE_LEVEL_10_0;
-
-    /* create device and device context with hardware support */
-    res = D3D11CreateDevice(NULL,
-                            D3D_DRIVER_TYPE_HARDWARE,
-                            NULL,
-                            flags,
-                            feature_level,
-                            3U,
-                            D3D11_SDK_VERSION,
-                            &d3d->d3d_device,
-                            NULL,
-                            &d3d->d3d_device_ctx);
-    if (FAILED(res))
-        goto release_dxgi_factory2;
-
-    if (!GetClientRect(win->win, &r))
-        goto release_d3d_device;
-
-    /*
-     * create the swap chain. It needs some settings...
-     * the size of the internal buffers
-     * the image format
-     * the number of back buffers (>= 2 for flip model, see SwapEffect field)
-     * vsync enabled: need refresh rate
-     *
-     * Settings are different in win 7 and win10
-     */
-
-    d3d_refresh_rate_get(d3d, &num, &den);
+        unsigned int b = prof_bucket(v);
 
-#ifdef HAVE_WIN10
-    desc_sw.Width = r.right - r.left;
-    desc_sw.Height = r.bottom - r.top;
-    desc_sw.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    desc_sw.Stereo = FALSE;
-#else
-    desc_sw.BufferDesc.Width= r.right - r.left;
-    desc_sw.BufferDesc.Height = r.bottom - r.top;
-    desc_sw.BufferDesc.RefreshRate.Numerator = num;
-    desc_sw.BufferDesc.RefreshRate.Denominator = den;
-    desc_sw.BufferDesc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;;
-    desc_sw.BufferDesc.ScanlineOrdering = DXGI_MODE_SCANLINE_ORDER_UNSPECIFIED;
-    desc_sw.BufferDesc.Scaling = DXGI_MODE_SCALING_UNSPECIFIED;
-#endif
-    desc_sw.SampleDesc.Count = 1U;
-    desc_sw.SampleDesc.Quality = 0U;
-    desc_sw.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-    desc_sw.BufferCount = 2U;
-#ifdef HAVE_WIN10
-    desc_sw.Scaling = DXGI_SCALING_NONE;
-#else
-    desc_sw.OutputWindow = win->win;
-    desc_sw.Windowed = TRUE;
-#endif
-    desc_sw.SwapEffect = DXGI_SWAP_EFFECT_FLIP_SEQUENTIAL;
-#ifdef HAVE_WIN10
-    desc_sw.AlphaMode = DXGI_ALPHA_MODE_UNSPECIFIED;
-#endif
-    desc_sw.Flags = DXGI_SWAP_CHAIN_FLAG_ALLOW_MODE_SWITCH;
+        ok_buckets &= (prof_bucket_value(b) >= v) &&
+                      ((b == 0) || (prof_bucket_value(b - 1) < v)) &&
+                      (prof_bucket_value(b) - v <= v / PROF_SUB_COUNT);
+    }
 
-#ifdef HAVE_WIN10
-    desc_fs.RefreshRate.Numerator = num;
-    desc_fs.RefreshRate.Denominator = den;
-    desc_fs.ScanlineOrdering = DXGI_MODE_SCANLINE_ORDER_UNSPECIFIED;
-    desc_fs.Scaling = DXGI_MODE_SCALING_UNSPECIFIED;
-    desc_fs.Windowed = TRUE;
-#endif
+    /* 0 to 15 ns, once each: exact */
+    prof_reset();
+    for (i = 0; i < PROF_SUB_COUNT; i++)
+        prof_sample(PROF_RESIZE_RTV, (unsigned long long)i);
+    prof_aggregate();
+    ok_small = prof_histos[PROF_RESIZE_RTV].count == PROF_SUB_COUNT;
+    for (i = 1; i <= PROF_SUB_COUNT; i++)
+        ok_small &= prof_percentile(PROF_RESIZE_RTV,
+                                    (double)i / PROF_SUB_COUNT) ==
+                    (unsigned long long)(i - 1);
+
+    /* 1 us to 1 ms, aggregated in 4 times, then in one */
+    prof_reset();
+    for (i = 1; i <= 1000; i++)
+    {
+        prof_sample(PROF_RESIZE_RTV, (unsigned long long)i * 1000);
+        if ((i % 250) == 0)
+            prof_aggregate();
+    }
+    once = prof_histos[PROF_RESIZE_RTV];
+    ok_large = (once.count == 1000) && (once.lost == 0) &&
+               (once.sum == 500500000ULL) && (once.max == 1000000ULL);
+    for (i = 0; i < (int)(sizeof(ps) / sizeof(ps[0])); i++)
+    {
+        unsigned long long exact;
+        unsigned long long got;
+
+        exact = (unsigned long long)ceil(ps[i] * 1000) * 1000;
+        got = prof_percentile(PROF_RESIZE_RTV, ps[i]);
+        ok_large &= (got >= exact) && (got - exact <= exact / PROF_SUB_COUNT);
+        printf("prof: p%g of 1 us to 1 ms: %llu ns, exact %llu ns\n",
+               ps[i] * 100, got, exact);
+    }
+    prof_reset();
+    for (i = 1; i <= 1000; i++)
+        prof_sample(PROF_RESIZE_RTV, (unsigned long long)i * 1000);
+    prof_aggregate();
+    ok_large &= !memcmp(&once, prof_histos + PROF_RESIZE_RTV, sizeof(Prof_Histo));
+
+    /* ring overflow: the oldest samples are lost, and counted */
+    prof_reset();
+    for (i = 0; i < PROF_RING_SIZE + 100; i++)
+        prof_sample(PROF_RESIZE_RTV, 10);
+    prof_aggregate();
+    ok_ring = (prof_histos[PROF_RESIZE_RTV].count == PROF_RING_SIZE) &&
+              (prof_histos[PROF_RESIZE_RTV].lost == 100) &&
+              (prof_percentile(PROF_RESIZE_RTV, 0.5) == 10);
+
+    /* cost of a sample, aggregation included */
+    prof_reset();
+    start = time_now();
+    for (i = 0; i < 1000000; i++)
+    {
+        prof_sample(PROF_RESIZE_RTV, (unsigned long long)i);
+        if ((i & (PROF_RING_SIZE - 1)) == PROF_RING_SIZE - 1)
+            prof_aggregate();
+    }
+    sample_ns = (double)(time_now() - start) / 1e6;
+    prof_reset();
+
+    printf("prof: buckets %s, exact below %d ns %s, "
+           "percentiles within 1/%d %s, ring overflow %s\n",
+           ok_buckets ? "ok" : "FAILED",
+           PROF_SUB_COUNT, ok_small ? "ok" : "FAILED",
+           PROF_SUB_COUNT, ok_large ? "ok" : "FAILED",
+           ok_ring ? "ok" : "FAILED");
+    printf("prof: %.1f ns per sample, aggregation included\n", sample_ns);
+    fflush(stdout);
 
-#ifdef HAVE_WIN10
-    res = IDXGIFactory2_CreateSwapChainForHwnd(d3d->dxgi_factory,
-                                               (IUnknown *)d3d->d3d_device,
-                                               win->win,
-                                               &desc_sw,
-                                               &desc_fs,
-                                               NULL,
-                                               &d3d->dxgi_swapchain);
+    return !(ok_buckets && ok_small && ok_large && ok_ring);
 #else
-    res = IDXGIFactory_CreateSwapChain(d3d->dxgi_factory,
-                                       (IUnknown *)d3d->d3d_device,
-                                       &desc_sw,
-                                       &d3d->dxgi_swapchain);
+    printf("prof: built without HAVE_PROF, skipped\n");
+    fflush(stdout);
+
+    return 0;
 #endif
-    if (FAILED(res))
-        goto release_d3d_device;
+}
 
-    /* rasterizer */
-    desc_rs.FillMode = D3D11_FILL_SOLID;
-    desc_rs.CullMode = D3D11_CULL_NONE;
-    desc_rs.FrontCounterClockwise = FALSE;
-    desc_rs.DepthBias = 0;
-    desc_rs.DepthBiasClamp = 0.0f;
-    desc_rs.SlopeScaledDepthBias = 0.0f;
-    desc_rs.DepthClipEnable = TRUE;
-    desc_rs.ScissorEnable = FALSE;
-    desc_rs.MultisampleEnable = FALSE;
-    desc_rs.AntialiasedLineEnable = FALSE;
+/* Batch_Ops for the timing: the draws are only counted */
+static void bench_batch_draw_count(void *data,
+                                   unsigned int index_count,
+                                   unsigned int first_index,
+                                   unsigned int base_vertex)
+{
+    (void)index_count;
+    (void)first_index;
+    (void)base_vertex;
 
-    res = ID3D11Device_CreateRasterizerState(d3d->d3d_device,
-                                             &desc_rs,
-                                             &d3d->d3d_rasterizer_state);
-    if (FAILED(res))
-        goto release_dxgi_swapchain;
+    ((Bench_Batch *)data)->draws++;
+}
 
-    /* Vertex shader */
-    flags = D3DCOMPILE_ENABLE_STRICTNESS;
-#ifdef _DEBUG
-    flags |= D3DCOMPILE_DEBUG;
-#endif
-    vs_blob = NULL;
-    res = D3DCompileFromFile(L"shader_3.hlsl",
-                             NULL,
-                             D3D_COMPILE_STANDARD_FILE_INCLUDE,
-                             "main_vs",
-                             "vs_5_0",
-                             flags,
-                             0U,
-                             &vs_blob,
-                             &err_blob );
+static const Batch_Ops bench_batch_count_ops =
+{
+    bench_batch_map,
+    bench_batch_unmap,
+    bench_batch_draw_count
+};
 
-    if (FAILED(res))
+/* appends count primitives, kind 0: triangles, 1: rectangles, 2: mixed */
+static void bench_batch_append(Batch *bt, int kind, unsigned int count,
+                               unsigned int *state,
+                               int *expected, unsigned int *expected_count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
     {
-        printf(" * vs error : %s\n", (char *)ID3D10Blob_GetBufferPointer(err_blob));
-        goto release_d3D_rasterizer;
-    }
+        int x = (int)(bench_rand(state) % 4096);
+        int y = (int)(bench_rand(state) % 4096);
+        int w = 1 + (int)(bench_rand(state) % 64);
+        int h = 1 + (int)(bench_rand(state) % 64);
+        int rect;
+
+        rect = (kind == 2) ? (int)(bench_rand(state) & 1) : kind;
+        if (!rect)
+            batch_triangle(bt, x, y, x + w, y + h, x - w, y + h, 1, 2, 3, 4);
+        else
+            batch_rectangle(bt, x, y, w, h, 1, 2, 3, 4);
+
+        if (expected)
+        {
+            int *e = expected + 2 * *expected_count;
 
-    res = ID3D11Device_CreateVertexShader(d3d->d3d_device,
-                                          ID3D10Blob_GetBufferPointer(vs_blob),
-                                          ID3D10Blob_GetBufferSize(vs_blob),
-                                          NULL,
-                                          &d3d->d3d_vertex_shader);
+            e[0] = x;
+            e[1] = y;
+            if (!rect)
+            {
+                e[2] = x + w;
+                e[3] = y + h;
+                e[4] = x - w;
+                e[5] = y + h;
+                *expected_count += 3;
+            }
+            else
+            {
+                /* upper left triangle, then bottom right one */
+                e[2] = x + w;
+                e[3] = y;
+                e[4] = x;
+                e[5] = y + h;
+                e[6] = x + w;
+                e[7] = y;
+                e[8] = x + w;
+                e[9] = y + h;
+                e[10] = x;
+                e[11] = y + h;
+                *expected_count += 6;
+            }
+        }
+    }
+}
 
-    if (FAILED(res))
+/*
+ * immediate mode batcher, in a ring of 64 vertices so that it wraps
+ * often: a full ring draws what is pending then restarts with a
+ * discard, the other maps are no-overwrite and never append before
+ * the vertices drawn since the last discard, and the triangles are
+ * drawn in order. Then the primitives per second appended in the ring
+ * of the backend, with draws that are only counted.
+ */
+static int bench_batch(const Bench *b)
+{
+    static const char *kinds[3] = { "triangles", "rectangles", "mixed" };
+    static const unsigned int per_ring[2] = { 64U / 3U, 64U / 4U };
+    Bench_Batch bb;
+    Batch bt;
+    USHORT *indices;
+    int *expected;
+    unsigned int expected_count;
+    unsigned int count;
+    unsigned int state;
+    int ok_map;
+    int ok;
+    int k;
+
+    count = 1000U;
+    indices = (USHORT *)mem_malloc(INDEX_SHARED_COUNT * sizeof(USHORT));
+    expected = (int *)mem_malloc(12U * count * sizeof(int));
+    memset(&bb, 0, sizeof(Bench_Batch));
+    bb.size = 6U * count;
+    bb.ring = (Vertex *)mem_malloc(BATCH_VERTICES * sizeof(Vertex));
+    bb.positions = (int *)mem_malloc(2U * bb.size * sizeof(int));
+    if (!indices || !expected || !bb.ring || !bb.positions)
     {
-        printf(" * vs error : %s\n", (char *)ID3D10Blob_GetBufferPointer(err_blob));
-        ID3D10Blob_Release(vs_blob);
-        goto release_d3D_rasterizer;
+        free(bb.positions);
+        free(bb.ring);
+        free(expected);
+        free(indices);
+        return 1;
     }
+    index_shared_fill(indices);
+    bb.indices = indices;
 
-    /* create the input layout */
-    res = ID3D11Device_CreateInputLayout(d3d->d3d_device,
-                                         desc_ie,
-                                         sizeof(desc_ie) / sizeof(D3D11_INPUT_ELEMENT_DESC),
-                                         ID3D10Blob_GetBufferPointer(vs_blob),
-                                         ID3D10Blob_GetBufferSize(vs_blob),
-                                         &d3d->d3d_input_layout);
-    ID3D10Blob_Release(vs_blob);
-    if (FAILED(res))
+    ok = 1;
+    for (k = 0; k < 3; k++)
     {
-        printf(" * CreateInputLayout() failed\n");
-        goto release_vertex_shader;
+        unsigned int wraps;
+        unsigned int draws;
+        unsigned int maps;
+        unsigned int discards;
+        int ok_order;
+        int ok_wraps;
+        int ok_frame;
+
+        bb.count = 0;
+        bb.draws = 0;
+        bb.maps = 0;
+        bb.discards = 0;
+        bb.drawn_end = 0;
+        bb.overwrites = 0;
+        expected_count = 0;
+        state = b->seed ? b->seed : 1U;
+
+        batch_init(&bt, &bench_batch_ops, &bb, 64U);
+        batch_begin(&bt);
+        bench_batch_append(&bt, k, count, &state, expected, &expected_count);
+        batch_flush(&bt);
+
+        ok_order = (bb.count == expected_count) && !bb.draws_too_large &&
+                   !memcmp(bb.positions, expected, 2U * expected_count * sizeof(int));
+
+        /* the first map discards, then one discard per wrap */
+        ok_wraps = (bb.discards == bt.wraps + 1) && (bb.overwrites == 0);
+        if (k < 2)
+        {
+            /* each full ring is drawn before the wrap */
+            ok_wraps &= (bt.wraps == (count - 1) / per_ring[k]) &&
+                        (bb.draws == bt.wraps + 1) &&
+                        (bb.maps == bb.discards);
+        }
+        wraps = bt.wraps;
+        draws = bb.draws;
+        maps = bb.maps;
+        discards = bb.discards;
+
+        /* next frame: appended after the previous one, no discard */
+        batch_begin(&bt);
+        bb.count = 0;
+        expected_count = 0;
+        if (bt.vertex_pos + 4U <= bt.vertices_size)
+        {
+            bench_batch_append(&bt, 1, 1, &state, expected, &expected_count);
+            batch_flush(&bt);
+            ok_frame = (bb.discards == discards) && (bt.wraps == 0) &&
+                       (bb.overwrites == 0) && (bb.count == expected_count) &&
+                       !memcmp(bb.positions, expected, 2U * expected_count * sizeof(int));
+        }
+        else
+        {
+            bench_batch_append(&bt, 1, 1, &state, expected, &expected_count);
+            batch_flush(&bt);
+            ok_frame = (bb.discards == discards + 1) && (bt.wraps == 1);
+        }
+        ok &= ok_order && ok_wraps && ok_frame;
+
+        printf("batch: %u %s in 64 vertices, %u wraps, %u draws, %u maps, "
+               "%u discards, in order: %s, wraps: %s, next frame: %s\n",
+               count, kinds[k], wraps, draws, maps, discards,
+               ok_order ? "ok" : "FAILED",
+               ok_wraps ? "ok" : "FAILED",
+               ok_frame ? "ok" : "FAILED");
     }
 
-    /* Pixel shader */
-    ps_blob = NULL;
-    res = D3DCompileFromFile(L"shader_3.hlsl",
-                             NULL,
-                             D3D_COMPILE_STANDARD_FILE_INCLUDE,
-                             "main_ps",
-                             "ps_5_0",
-                             flags,
-                             0U,
-                             &ps_blob,
-                             &err_blob );
+    /* 2 triangles then a rectangle: the flush of the triangles unmaps */
+    bb.count = 0;
+    bb.draws = 0;
+    bb.maps = 0;
+    bb.discards = 0;
+    bb.drawn_end = 0;
+    bb.overwrites = 0;
+    batch_init(&bt, &bench_batch_ops, &bb, 64U);
+    batch_begin(&bt);
+    batch_triangle(&bt, 0, 0, 10, 0, 0, 10, 1, 2, 3, 4);
+    batch_triangle(&bt, 0, 0, 10, 0, 0, 10, 1, 2, 3, 4);
+    batch_rectangle(&bt, 0, 0, 10, 10, 1, 2, 3, 4);
+    batch_flush(&bt);
+    ok_map = (bb.maps == 2) && (bb.discards == 1) && (bb.draws == 2) &&
+             (bb.overwrites == 0) && (bt.vertex_pos == 10);
+    ok &= ok_map;
+    printf("batch: 2 triangles then a rectangle, %u maps, %u discard, "
+           "%u draws, %u vertices: %s\n",
+           bb.maps, bb.discards, bb.draws, bt.vertex_pos, ok_map ? "ok" : "FAILED");
+    fflush(stdout);
 
-    if (FAILED(res))
+    /* throughput, ring of the backend */
+    for (k = 0; k < 3; k++)
     {
-        printf(" * ps blob error : %s\n", (char *)ID3D10Blob_GetBufferPointer(err_blob));
-        goto release_input_layout;
+        unsigned long long start;
+        unsigned long long vertices;
+        unsigned int n;
+        double ns;
+        int f;
+
+        n = 100000U;
+        bb.draws = 0;
+        bb.discards = 0;
+        vertices = 0;
+        state = b->seed ? b->seed : 1U;
+        batch_init(&bt, &bench_batch_count_ops, &bb, BATCH_VERTICES);
+        start = time_now();
+        for (f = 0; f < 10; f++)
+        {
+            unsigned int pos = bt.vertex_pos;
+
+            batch_begin(&bt);
+            bench_batch_append(&bt, k, n, &state, NULL, NULL);
+            batch_flush(&bt);
+            vertices += bt.vertex_pos + (unsigned long long)bt.wraps * bt.vertices_size - pos;
+        }
+        ns = (double)(time_now() - start);
+
+        printf("batch: %s, %.1f M primitives/s, %.1f vertices per primitive, "
+               "%.0f MB/s of vertices, %u draws, %u discards\n",
+               kinds[k], 10.0 * n * 1e3 / ns,
+               (double)vertices / (10.0 * n),
+               (double)vertices * sizeof(Vertex) * 1e3 / ns,
+               bb.draws, bb.discards);
     }
+    fflush(stdout);
 
-    res = ID3D11Device_CreatePixelShader(d3d->d3d_device,
-                                         ID3D10Blob_GetBufferPointer(ps_blob),
-                                         ID3D10Blob_GetBufferSize(ps_blob),
-                                         NULL,
-                                         &d3d->d3d_pixel_shader);
-    ID3D10Blob_Release(ps_blob);
-    if (FAILED(res))
+    free(bb.positions);
+    free(bb.ring);
+    free(expected);
+    free(indices);
+
+    return !ok;
+}
+
+/*
+ * instanced rectangles: sizeof(Rect_Instance) is the 20 bytes of the
+ * input layout, rect_instance_set() stores what it is given, and the
+ * instances of scene_rect_instances_build(), expanded with the unit
+ * quad as main_rect_vs does, are the 4 vertices of each visible
+ * rectangle of the scene, in scene order. Then the bytes and the time
+ * per frame of 100000 rectangles, against the vertex path.
+ */
+static int bench_instances(const Bench *b)
+{
+    /* unit quad of d3d_task_resources() */
+    static const float quad[8] = { 0.0f, 0.0f, 1.0f, 0.0f, 1.0f, 1.0f, 0.0f, 1.0f };
+    Rect_Instance *ri;
+    Rect_Instance one;
+    Scene *s;
+    float m[2][4];
+    unsigned long long start;
+    double build_us;
+    double update_us;
+    unsigned int count;
+    unsigned int rects;
+    unsigned int n;
+    int ok_set;
+    int ok_build;
+    int pass;
+    int f;
+
+    rect_instance_set(&one, -3, 7, 11, 13, 1, 2, 3, 4);
+    ok_set = (sizeof(Rect_Instance) == 20) &&
+             (one.x == -3.0f) && (one.y == 7.0f) &&
+             (one.w == 11.0f) && (one.h == 13.0f) &&
+             (one.r == 1) && (one.g == 2) && (one.b == 3) && (one.a == 4);
+
+    s = scene_new();
+    if (!s)
+        return 1;
+    bench_scene_fill(s, b, b->triangles.values[0], b->rectangles.values[0]);
+    scene_update(s);
+    ri = (Rect_Instance *)mem_malloc((s->rects_count + 1) * sizeof(Rect_Instance));
+    if (!ri)
     {
-        printf(" * CreatePixelShader() failed\n");
-        goto release_input_layout;
+        scene_free(s);
+        return 1;
     }
 
-    desc_buf.ByteWidth = sizeof(Const_Buffer);
-    desc_buf.Usage = D3D11_USAGE_DYNAMIC; /* because buffer is updated when the window has resized */
-    desc_buf.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    desc_buf.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    desc_buf.MiscFlags = 0;
-    desc_buf.StructureByteStride = 0;
+    /* whole scene visible, then culled by a quarter of the target */
+    ok_build = 1;
+    rotation_matrix_set(m, 0);
+    scene_occlusion_set(s, 0);
+    for (pass = 0; pass < 2; pass++)
+    {
+        unsigned int last;
+        unsigned int k;
+        unsigned int i;
+
+        scene_cull_set(s, pass);
+        scene_size_set(s, pass ? b->width / 2 : b->width,
+                       pass ? b->height / 2 : b->height);
+        scene_visible_update(s, m);
+        count = scene_rect_instances_build(s, ri);
+
+        rects = 0;
+        last = 0;
+        k = 0;
+        for (i = 0; i < s->visible_count; i++)
+        {
+            const Prim *p = s->prims + s->visible[i];
+            const Vertex *v;
+            int c;
+
+            ok_build &= (i == 0) || (s->visible[i] > last);
+            last = s->visible[i];
+            if (p->type != PRIM_RECTANGLE)
+                continue;
+            rects++;
+            if (k >= count)
+            {
+                ok_build = 0;
+                break;
+            }
 
-    res = ID3D11Device_CreateBuffer(d3d->d3d_device,
-                                    &desc_buf,
-                                    NULL,
-                                    &d3d->d3d_const_buffer);
-    if (FAILED(res))
+            v = (const Vertex *)s->vertices + p->first_vertex;
+            for (c = 0; c < 4; c++)
+            {
+                ok_build &= (ri[k].x + quad[2 * c] * ri[k].w == v[c].x) &&
+                            (ri[k].y + quad[2 * c + 1] * ri[k].h == v[c].y) &&
+                            (ri[k].r == v[c].r) && (ri[k].g == v[c].g) &&
+                            (ri[k].b == v[c].b) && (ri[k].a == v[c].a);
+            }
+            k++;
+        }
+        ok_build &= (count == rects) && (pass || (count == s->rects_count));
+
+        printf("instances: %s, %u of %u rectangles, same quads as the vertices: %s\n",
+               pass ? "culled" : "all visible", count, s->rects_count,
+               ok_build ? "ok" : "FAILED");
+    }
+    printf("instances: %u bytes per instance, rect_instance_set(): %s\n",
+           (unsigned int)sizeof(Rect_Instance), ok_set ? "ok" : "FAILED");
+    fflush(stdout);
+    free(ri);
+    scene_free(s);
+
+    /* 100000 rectangles, all rewritten each frame */
+    n = 100000U;
+    s = scene_new();
+    if (!s)
+        return 1;
+    for (count = 0; count < n; count++)
+        scene_rectangle_add(s, (int)(count % 1000U), (int)(count / 1000U), 8, 8,
+                            count, count >> 8, count >> 16, 255);
+    scene_update(s);
+    scene_occlusion_set(s, 0);
+    scene_size_set(s, 1000, 100);
+    scene_visible_update(s, m);
+    ri = (Rect_Instance *)mem_malloc(n * sizeof(Rect_Instance));
+    if (!ri)
     {
-        printf(" * CreateBuffer() failed 0x%lx\n", res);
-        goto release_pixel_shader;
+        scene_free(s);
+        return 1;
     }
 
-    return d3d;
+    start = time_now();
+    for (f = 0; f < b->frames; f++)
+        count = scene_rect_instances_build(s, ri);
+    build_us = (double)(time_now() - start) / (1e3 * b->frames);
 
-  release_pixel_shader:
-    ID3D11PixelShader_Release(d3d->d3d_pixel_shader);
-  release_input_layout:
-    ID3D11InputLayout_Release(d3d->d3d_input_layout);
-  release_vertex_shader:
-    ID3D11VertexShader_Release(d3d->d3d_vertex_shader);
-  release_d3D_rasterizer:
-    ID3D11RasterizerState_Release(d3d->d3d_rasterizer_state);
-  release_dxgi_swapchain:
-#ifdef HAVE_WIN10
-    IDXGISwapChain1_SetFullscreenState(d3d->dxgi_swapchain, FALSE, NULL);
-    IDXGISwapChain1_Release(d3d->dxgi_swapchain);
-#else
-    IDXGISwapChain_SetFullscreenState(d3d->dxgi_swapchain, FALSE, NULL);
-    IDXGISwapChain_Release(d3d->dxgi_swapchain);
-#endif
-  release_d3d_device:
-    ID3D11DeviceContext_Release(d3d->d3d_device_ctx);
-    ID3D11Device_Release(d3d->d3d_device);
-  release_dxgi_factory2:
-#ifdef HAVE_WIN10
-    IDXGIFactory2_Release(d3d->dxgi_factory);
-#else
-    IDXGIFactory_Release(d3d->dxgi_factory);
-#endif
-  free_d3d:
-    free(d3d);
+    start = time_now();
+    for (f = 0; f < b->frames; f++)
+    {
+        s->dirty_all = 1;
+        scene_update(s);
+        scene_clean(s);
+    }
+    update_us = (double)(time_now() - start) / (1e3 * b->frames);
+
+    printf("instances: %u rectangles, instanced %u KB (%u bytes each) + %u bytes "
+           "once, %.1f us; vertices %u KB (%u bytes each), 16 bits vertices %u KB, "
+           "%.1f us, + %u KB of indices once\n",
+           count,
+           (unsigned int)(n * sizeof(Rect_Instance) / 1024),
+           (unsigned int)sizeof(Rect_Instance),
+           (unsigned int)(sizeof(quad) + 6 * sizeof(USHORT)),
+           build_us,
+           (unsigned int)(n * 4 * sizeof(Vertex) / 1024),
+           (unsigned int)(4 * sizeof(Vertex)),
+           (unsigned int)(n * 4 * sizeof(Vertex16) / 1024),
+           update_us,
+           (unsigned int)(n * 6 * ((4 * n <= INDEX16_VERTICES_MAX) ? 2 : 4) / 1024));
+    fflush(stdout);
 
-    return NULL;
+    free(ri);
+    scene_free(s);
+
+    return !(ok_set && ok_build);
 }
 
-void d3d_shutdown(D3d *d3d)
+/*
+ * tiled rendering: the framebuffer of each thread count must be the
+ * single thread one, pixel for pixel, for each rotation, on target
+ * sizes that are not multiples of SOFT_TILE_SIZE, for a first full
+ * frame then frames with moved primitives (damaged rects only).
+ */
+static int bench_tiles(const Bench *b)
 {
-#ifdef _DEBUG
-    ID3D11Debug *d3d_debug;
-    HRESULT res;
-#endif
-
-    if (!d3d)
-        return;
+    static const int threads[] = { 2, 3, 4, 8 };
+    int sizes[3][2];
+    int ok;
+    int z;
+
+    sizes[0][0] = b->width;
+    sizes[0][1] = b->height;
+    sizes[1][0] = 317;
+    sizes[1][1] = 203;
+    sizes[2][0] = 63;
+    sizes[2][1] = 65;
+
+    ok = 1;
+    for (z = 0; z < 3; z++)
+    {
+        Bench bc;
+        int rot;
 
-#ifdef _DEBUG
-    res = ID3D11Debug_QueryInterface(d3d->d3d_device, &IID_ID3D11Debug,
-                                     (void **)&d3d_debug);
-#endif
+        bc = *b;
+        bc.width = sizes[z][0];
+        bc.height = sizes[z][1];
+        if (bc.changes < 10)
+            bc.changes = 10;
 
-    ID3D11Buffer_Release(d3d->d3d_const_buffer);
-    ID3D11PixelShader_Release(d3d->d3d_pixel_shader);
-    ID3D11InputLayout_Release(d3d->d3d_input_layout);
-    ID3D11VertexShader_Release(d3d->d3d_vertex_shader);
-    ID3D11RasterizerState_Release(d3d->d3d_rasterizer_state);
-    ID3D11RenderTargetView_Release(d3d->d3d_render_target_view);
-#ifdef HAVE_WIN10
-    IDXGISwapChain1_SetFullscreenState(d3d->dxgi_swapchain, FALSE, NULL);
-    IDXGISwapChain1_Release(d3d->dxgi_swapchain);
-#else
-    IDXGISwapChain_SetFullscreenState(d3d->dxgi_swapchain, FALSE, NULL);
-    IDXGISwapChain_Release(d3d->dxgi_swapchain);
-#endif
-    ID3D11DeviceContext_Release(d3d->d3d_device_ctx);
-    ID3D11Device_Release(d3d->d3d_device);
-#ifdef HAVE_WIN10
-    IDXGIFactory2_Release(d3d->dxgi_factory);
-#else
-    IDXGIFactory_Release(d3d->dxgi_factory);
-#endif
-    free(d3d);
+        for (rot = 0; rot < 4; rot++)
+        {
+            unsigned long long diff[sizeof(threads) / sizeof(threads[0])];
+            int same = 1;
+            int j;
 
-#ifdef _DEBUG
-    if (SUCCEEDED(res))
-    {
-        ID3D11Debug_ReportLiveDeviceObjects(d3d_debug, D3D11_RLDO_DETAIL);
-        ID3D11Debug_Release(d3d_debug);
+            for (j = 0; j < (int)(sizeof(threads) / sizeof(threads[0])); j++)
+            {
+                Window *win[2];
+                D3d *d3d[2];
+                unsigned int state[2];
+                int f;
+                int k;
+
+                diff[j] = 0;
+                memset(d3d, 0, sizeof(d3d));
+                for (k = 0; k < 2; k++)
+                {
+                    win[k] = window_new(0, 0, bc.width, bc.height);
+                    d3d[k] = win[k] ? d3d_init(win[k], 0) : NULL;
+                    if (!d3d[k] || !d3d_threads_set(d3d[k], k ? threads[j] : 1))
+                        break;
+                    bench_scene_fill(d3d[k]->scene, &bc,
+                                     b->triangles.values[0],
+                                     b->rectangles.values[0]);
+                    window_rotation_set(win[k], rot);
+                    state[k] = b->seed + 1U;
+                }
+                if (k < 2)
+                {
+                    printf("tiles: can not create the targets\n");
+                    for (; k >= 0; k--)
+                    {
+                        d3d_shutdown(d3d[k]);
+                        window_del(win[k]);
+                    }
+                    return 1;
+                }
+
+                for (f = 0; f < 4; f++)
+                {
+                    unsigned int p;
+
+                    for (k = 0; k < 2; k++)
+                    {
+                        if (f > 0)
+                            bench_scene_change(d3d[k]->scene, &bc, state + k);
+                        d3d_render(d3d[k]);
+                    }
+
+                    if ((d3d[0]->width != d3d[1]->width) ||
+                        (d3d[0]->height != d3d[1]->height))
+                    {
+                        diff[j] += (unsigned long long)d3d[0]->width * d3d[0]->height;
+                        continue;
+                    }
+                    for (p = 0; p < (unsigned int)(d3d[0]->width * d3d[0]->height); p++)
+                        diff[j] += d3d[0]->framebuffer[p] != d3d[1]->framebuffer[p];
+                }
+                same &= diff[j] == 0;
+
+                for (k = 0; k < 2; k++)
+                {
+                    d3d_shutdown(d3d[k]);
+                    window_del(win[k]);
+                }
+            }
+            ok &= same;
+
+            printf("tiles: %dx%d rotation %d, pixels different from 1 thread "
+                   "over 4 frames with threads 2 3 4 8: %llu %llu %llu %llu, %s\n",
+                   bc.width, bc.height, rot,
+                   diff[0], diff[1], diff[2], diff[3],
+                   same ? "ok" : "FAILED");
+            fflush(stdout);
+        }
     }
-#endif
+
+    return !ok;
 }
 
-void d3d_resize(D3d *d3d, int rot, UINT width, UINT height)
+/* distance in ulps of 2 floats, both of them being finite */
+static unsigned int bench_ulps(float a, float b)
 {
-    D3D11_RENDER_TARGET_VIEW_DESC desc_rtv;
-    D3D11_MAPPED_SUBRESOURCE mapped;
-    ID3D11Texture2D *back_buffer;
-    HRESULT res;
-
-    FCT;
+    int ia;
+    int ib;
+    long long d;
+
+    memcpy(&ia, &a, sizeof(int));
+    memcpy(&ib, &b, sizeof(int));
+    /* sign and magnitude to two's complement, -0 and +0 are both 0 */
+    if (ia < 0) ia = (int)(0x80000000U - (unsigned int)ia);
+    if (ib < 0) ib = (int)(0x80000000U - (unsigned int)ib);
+    d = (long long)ia - ib;
+
+    return (unsigned int)((d < 0) ? -d : d);
+}
 
-    res = ID3D11DeviceContext_Map(d3d->d3d_device_ctx,
-                                  (ID3D11Resource *)d3d->d3d_const_buffer,
-                                  0U, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
+#define BENCH_XFORM_COUNT 4096
 
-    if (FAILED(res))
+/*
+ * each SIMD variant of xform_batch() against the scalar one: all the
+ * lengths up to 67 for the tails, random positions in the 16 bits
+ * range, without matrix and with the 4 rotations
+ */
+static int bench_xform(const Bench *b)
+{
+    static const int sizes[][2] =
     {
-        printf("Map() failed\n");
-        fflush(stdout);
-        return;
+        { 1, 1 }, { 317, 203 }, { 1920, 1080 }, { 1080, 1920 }, { 4095, 7 }
+    };
+    Xform_Func funcs[XFORM_VARIANTS_MAX];
+    const char *names[XFORM_VARIANTS_MAX];
+    int *xs;
+    int *ys;
+    float *ox;
+    float *oy;
+    float *rx;
+    float *ry;
+    unsigned int count;
+    unsigned int state;
+    unsigned int v;
+    unsigned int i;
+    int ok;
+
+    count = xform_variants_get(funcs, names);
+    xs = (int *)mem_malloc(BENCH_XFORM_COUNT * sizeof(int));
+    ys = (int *)mem_malloc(BENCH_XFORM_COUNT * sizeof(int));
+    ox = (float *)mem_malloc(BENCH_XFORM_COUNT * sizeof(float));
+    oy = (float *)mem_malloc(BENCH_XFORM_COUNT * sizeof(float));
+    rx = (float *)mem_malloc(BENCH_XFORM_COUNT * sizeof(float));
+    ry = (float *)mem_malloc(BENCH_XFORM_COUNT * sizeof(float));
+    if (!xs || !ys || !ox || !oy || !rx || !ry)
+    {
+        free(xs);
+        free(ys);
+        free(ox);
+        free(oy);
+        free(rx);
+        free(ry);
+        return 1;
     }
 
-    printf(" * d3d_resize: %d\n", rot);
-    fflush(stdout);
+    state = b->seed;
+    for (i = 0; i < BENCH_XFORM_COUNT; i++)
+    {
+        xs[i] = (int)(bench_rand(&state) % 65536) - 32768;
+        ys[i] = (int)(bench_rand(&state) % 65536) - 32768;
+    }
 
-    switch (rot)
+    ok = 1;
+    for (v = 0; v < count; v++)
     {
-        case 0:
-            ((Const_Buffer *)mapped.pData)->rotation[0][0] = 1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][1] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][2] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][0] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][1] = 1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][2] = 0.0f;
-            break;
-        case 1:
-            ((Const_Buffer *)mapped.pData)->rotation[0][0] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][1] = -1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][2] = 2.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][0] = 1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][1] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][2] = 0.0f;
-            break;
-        case 2:
-            ((Const_Buffer *)mapped.pData)->rotation[0][0] = -1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][1] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][2] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][0] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][1] = -1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][2] = 0.0f;
-            break;
-        case 3:
-            ((Const_Buffer *)mapped.pData)->rotation[0][0] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][1] = 1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[0][2] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][0] = -1.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][1] = 0.0f;
-            ((Const_Buffer *)mapped.pData)->rotation[1][2] = 2.0f;
-            break;
+        unsigned int ulps = 0;
+        unsigned long long start;
+        unsigned long long total;
+        float m[2][4];
+        int j;
+        int rot;
+
+        for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+        {
+            int w = sizes[j][0];
+            int h = sizes[j][1];
+
+            /* rot 4 is without matrix */
+            for (rot = 0; rot <= 4; rot++)
+            {
+                const float (*mp)[4] = (rot < 4) ? (const float (*)[4])m : NULL;
+                unsigned int n;
+
+                if (rot < 4)
+                    rotation_matrix_set(m, rot);
+
+                /* unaligned starts and all the tails */
+                for (n = 0; n <= 67; n++)
+                {
+                    xform_batch_c(xs + n, ys + n, rx, ry, n, w, h, mp);
+                    funcs[v](xs + n, ys + n, ox, oy, n, w, h, mp);
+                    for (i = 0; i < n; i++)
+                    {
+                        unsigned int ux = bench_ulps(ox[i], rx[i]);
+                        unsigned int uy = bench_ulps(oy[i], ry[i]);
+
+                        if (ux > ulps) ulps = ux;
+                        if (uy > ulps) ulps = uy;
+                    }
+                }
+
+                xform_batch_c(xs, ys, rx, ry, BENCH_XFORM_COUNT, w, h, mp);
+                funcs[v](xs, ys, ox, oy, BENCH_XFORM_COUNT, w, h, mp);
+                for (i = 0; i < BENCH_XFORM_COUNT; i++)
+                {
+                    unsigned int ux = bench_ulps(ox[i], rx[i]);
+                    unsigned int uy = bench_ulps(oy[i], ry[i]);
+
+                    if (ux > ulps) ulps = ux;
+                    if (uy > ulps) ulps = uy;
+                }
+            }
+        }
+
+        /* throughput, with the rotation of main_vs */
+        rotation_matrix_set(m, 1);
+        total = 0;
+        for (i = 0; i < (unsigned int)b->frames; i++)
+        {
+            start = time_now();
+            funcs[v](xs, ys, ox, oy, BENCH_XFORM_COUNT,
+                     b->width, b->height, (const float (*)[4])m);
+            total += time_now() - start;
+        }
+
+        ok &= ulps <= 1U;
+        printf("xform: %-4s max %u ulp against c %s, %.3f ns per vertex%s\n",
+               names[v], ulps, (ulps <= 1U) ? "ok" : "FAILED",
+               (double)total / ((double)b->frames * BENCH_XFORM_COUNT),
+               (funcs[v] == xform_batch_func) ? ", used" : "");
     }
+    fflush(stdout);
 
-    ID3D11DeviceContext_Unmap(d3d->d3d_device_ctx,
-                              (ID3D11Resource *)d3d->d3d_const_buffer,
-                              0U);
+    free(xs);
+    free(ys);
+    free(ox);
+    free(oy);
+    free(rx);
+    free(ry);
 
-    /* unset the render target view in the output merger */
-    ID3D11DeviceContext_OMSetRenderTargets(d3d->d3d_device_ctx,
-                                           0U, NULL, NULL);
+    return !ok;
+}
 
-    /* release the render target view */
-    if (d3d->d3d_render_target_view)
-        ID3D11RenderTargetView_Release(d3d->d3d_render_target_view);
+/* image_rotate() as it is defined, one pixel at a time */
+static void bench_rotate_naive(unsigned int *dst, int dst_stride,
+                               const unsigned int *src, int src_stride,
+                               int w, int h, int rot)
+{
+    int x;
+    int y;
 
-    /* resize the internal nuffers of the swapt chain to the new size */
-#ifdef HAVE_WIN10
-    res = IDXGISwapChain1_ResizeBuffers(d3d->dxgi_swapchain,
-                                        0U, /* preserve buffer count */
-                                        width, height,
-                                        DXGI_FORMAT_UNKNOWN, /* preserve format */
-                                        0U);
-#else
-    res = IDXGISwapChain_ResizeBuffers(d3d->dxgi_swapchain,
-                                       0U, /* preserve buffer count */
-                                       width, height,
-                                       DXGI_FORMAT_UNKNOWN, /* preserve format */
-                                       0U);
-#endif
-    if ((res == DXGI_ERROR_DEVICE_REMOVED) ||
-        (res == DXGI_ERROR_DEVICE_RESET) ||
-        (res == DXGI_ERROR_DRIVER_INTERNAL_ERROR))
+    for (y = 0; y < h; y++)
     {
-        return;
+        for (x = 0; x < w; x++)
+        {
+            int dx = x;
+            int dy = y;
+
+            if (rot == 1)
+            {
+                dx = h - 1 - y;
+                dy = x;
+            }
+            else if (rot == 2)
+            {
+                dx = w - 1 - x;
+                dy = h - 1 - y;
+            }
+            else if (rot == 3)
+            {
+                dx = y;
+                dy = w - 1 - x;
+            }
+            dst[(size_t)dy * dst_stride + dx] = src[(size_t)y * src_stride + x];
+        }
     }
+}
 
-    if (FAILED(res))
+/*
+ * rotate pass: image_rotate() against the naive loop, with strides
+ * larger than the images, then the frames of the pass against the ones
+ * rendered with the rotation, for odd sizes, and the rotation speed
+ */
+static int bench_rotate_image(const Bench *b)
+{
+    static const int images[][2] =
     {
-        printf("ResizeBuffers() failed\n");
-        fflush(stdout);
-        return;
+        { 1, 1 }, { 3, 5 }, { 4, 4 }, { 63, 65 }, { 64, 64 }, { 130, 7 }, { 317, 203 }
+    };
+    static const int frames[][2] = { { 321, 203 }, { 317, 200 }, { 63, 65 } };
+    static const int threads[] = { 1, 4 };
+    unsigned int *src;
+    unsigned int *dst;
+    unsigned int *ref;
+    unsigned int state;
+    size_t size;
+    int ok_image;
+    int ok;
+    int rot;
+    int i;
+
+    /* room for the largest image and the speed test, with the strides */
+    size = (size_t)(b->width + 8) * (b->height + 8);
+    if (size < (size_t)(317 + 8) * (317 + 8))
+        size = (size_t)(317 + 8) * (317 + 8);
+    src = (unsigned int *)mem_malloc(size * sizeof(unsigned int));
+    dst = (unsigned int *)mem_malloc(size * sizeof(unsigned int));
+    ref = (unsigned int *)mem_malloc(size * sizeof(unsigned int));
+    if (!src || !dst || !ref)
+    {
+        free(src);
+        free(dst);
+        free(ref);
+        return 1;
+    }
+
+    state = b->seed;
+    for (i = 0; i < (int)size; i++)
+        src[i] = bench_rand(&state);
+
+    /* the padding of the destination rows must be left untouched */
+    ok_image = 1;
+    for (i = 0; i < (int)(sizeof(images) / sizeof(images[0])); i++)
+    {
+        int w = images[i][0];
+        int h = images[i][1];
+
+        for (rot = 0; rot < 4; rot++)
+        {
+            int src_stride = w + 3;
+            int dst_stride = ((rot & 1) ? h : w) + 5;
+            size_t bytes = (size_t)dst_stride * ((rot & 1) ? w : h) * sizeof(unsigned int);
+
+            memset(dst, 0x5a, bytes);
+            memset(ref, 0x5a, bytes);
+            image_rotate(dst, dst_stride, src, src_stride, w, h, rot);
+            bench_rotate_naive(ref, dst_stride, src, src_stride, w, h, rot);
+            ok_image &= !memcmp(dst, ref, bytes);
+        }
     }
 
-    /* get the internal buffer of the swap chain */
-#ifdef HAVE_WIN10
-    res = IDXGISwapChain1_GetBuffer(d3d->dxgi_swapchain, 0,
-                                    &IID_ID3D11Texture2D,
-                                    (void **)&back_buffer);
-#else
-    res = IDXGISwapChain_GetBuffer(d3d->dxgi_swapchain, 0,
-                                   &IID_ID3D11Texture2D,
-                                   (void **)&back_buffer);
-#endif
-    if (FAILED(res))
+    printf("rotate: image_rotate equal to the naive loop, %u sizes, "
+           "4 rotations: %s\n",
+           (unsigned int)(sizeof(images) / sizeof(images[0])),
+           ok_image ? "ok" : "FAILED");
+    fflush(stdout);
+    ok = ok_image;
+
+    /* pass against rotation, with 1 thread and with tiles */
+    for (i = 0; i < (int)(sizeof(frames) / sizeof(frames[0])); i++)
     {
-        printf("swapchain GetBuffer() failed\n");
-        fflush(stdout);
-        return;
-    }
+        Bench bc;
 
-    ZeroMemory(&desc_rtv, sizeof(D3D11_RENDER_TARGET_VIEW_DESC));
-    desc_rtv.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
-    desc_rtv.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+        bc = *b;
+        bc.width = frames[i][0];
+        bc.height = frames[i][1];
+        if (bc.changes < 10)
+            bc.changes = 10;
 
-    /* create the new render target view from this internal buffer */
-    res = ID3D11Device_CreateRenderTargetView(d3d->d3d_device,
-                                              (ID3D11Resource *)back_buffer,
-                                              &desc_rtv,
-                                              &d3d->d3d_render_target_view);
+        for (rot = 1; rot < 4; rot++)
+        {
+            unsigned long long diff[sizeof(threads) / sizeof(threads[0])];
+            int same = 1;
+            int j;
 
-    ID3D11Texture2D_Release(back_buffer);
+            for (j = 0; j < (int)(sizeof(threads) / sizeof(threads[0])); j++)
+            {
+                Window *win[2];
+                D3d *d3d[2];
+                unsigned int states[2];
+                int f;
+                int k;
+
+                diff[j] = 0;
+                memset(d3d, 0, sizeof(d3d));
+                for (k = 0; k < 2; k++)
+                {
+                    win[k] = window_new(0, 0, bc.width, bc.height);
+                    d3d[k] = win[k] ? d3d_init(win[k], 0) : NULL;
+                    if (!d3d[k] || !d3d_threads_set(d3d[k], threads[j]))
+                        break;
+                    d3d_rotate_pass_set(d3d[k], k);
+                    bench_scene_fill(d3d[k]->scene, &bc,
+                                     b->triangles.values[0],
+                                     b->rectangles.values[0]);
+                    window_rotation_set(win[k], rot);
+                    states[k] = b->seed + 1U;
+                }
+                if (k < 2)
+                {
+                    printf("rotate: can not create the targets\n");
+                    for (; k >= 0; k--)
+                    {
+                        d3d_shutdown(d3d[k]);
+                        window_del(win[k]);
+                    }
+                    free(src);
+                    free(dst);
+                    free(ref);
+                    return 1;
+                }
+
+                for (f = 0; f < 4; f++)
+                {
+                    unsigned int p;
+
+                    for (k = 0; k < 2; k++)
+                    {
+                        if (f > 0)
+                            bench_scene_change(d3d[k]->scene, &bc, states + k);
+                        d3d_render(d3d[k]);
+                    }
+
+                    if ((d3d[0]->width != d3d[1]->width) ||
+                        (d3d[0]->height != d3d[1]->height))
+                    {
+                        diff[j] += (unsigned long long)d3d[0]->width * d3d[0]->height;
+                        continue;
+                    }
+                    for (p = 0; p < (unsigned int)(d3d[0]->width * d3d[0]->height); p++)
+                        diff[j] += d3d[0]->framebuffer[p] != d3d[1]->framebuffer[p];
+                }
+                same &= diff[j] == 0;
+
+                for (k = 0; k < 2; k++)
+                {
+                    d3d_shutdown(d3d[k]);
+                    window_del(win[k]);
+                }
+            }
+            ok &= same;
+
+            printf("rotate: %dx%d rotation %d, pixels of the pass different "
+                   "from the rotation over 4 frames, threads 1 and 4: %llu %llu, %s\n",
+                   bc.width, bc.height, rot, diff[0], diff[1],
+                   same ? "ok" : "FAILED");
+            fflush(stdout);
+        }
+    }
 
-    /* update the pipeline with the new render target view */
-    ID3D11DeviceContext_OMSetRenderTargets(d3d->d3d_device_ctx,
-                                           1U, &d3d->d3d_render_target_view,
-                                           NULL);
+    /* speed against the naive loop, each pixel read once and written once */
+    for (rot = 1; rot < 4; rot++)
+    {
+        unsigned long long start;
+        unsigned long long total;
+        unsigned long long naive;
+        double bytes;
+        int dst_stride = (rot & 1) ? b->height : b->width;
+
+        total = 0;
+        naive = 0;
+        for (i = 0; i < b->frames; i++)
+        {
+            start = time_now();
+            image_rotate(dst, dst_stride, src, b->width,
+                         b->width, b->height, rot);
+            total += time_now() - start;
+
+            start = time_now();
+            bench_rotate_naive(ref, dst_stride, src, b->width,
+                               b->width, b->height, rot);
+            naive += time_now() - start;
+        }
+        bytes = 2.0 * b->width * b->height * sizeof(unsigned int) * b->frames;
+
+        printf("rotate: %dx%d rotation %d, %.3f ms per image, %.2f GB/s, "
+               "naive loop %.3f ms %.2f GB/s, %.2f times faster\n",
+               b->width, b->height, rot,
+               (double)total / b->frames / 1e6,
+               (total > 0) ? bytes / (double)total : 0.0,
+               (double)naive / b->frames / 1e6,
+               (naive > 0) ? bytes / (double)naive : 0.0,
+               (total > 0) ? (double)naive / (double)total : 0.0);
+    }
+    fflush(stdout);
 
-    /* set viewport, depends on size of the window */
-    d3d->viewport.TopLeftX = 0.0f;
-    d3d->viewport.TopLeftY = 0.0f;
-    d3d->viewport.Width = (float)width;
-    d3d->viewport.Height = (float)height;
-    d3d->viewport.MinDepth = 0.0f;
-    d3d->viewport.MaxDepth = 1.0f;
+    free(src);
+    free(dst);
+    free(ref);
 
-    /* update the pipeline with the new viewport */
-    ID3D11DeviceContext_RSSetViewports(d3d->d3d_device_ctx,
-                                       1U, &d3d->viewport);
+    return !ok;
 }
 
-/*** triangle ***/
-
-typedef struct
+static int bench_main(int argc, char *argv[])
 {
-    ID3D11Buffer* vertex_buffer;
-    ID3D11Buffer* index_buffer; /* not useful for a single triangle */
-    UINT stride;
-    UINT offset;
-    UINT count;
-    UINT index_count;
-} Triangle;
+    Bench b;
+    int ret;
+    int i;
+    int a, c, t, r;
+
+    memset(&b, 0, sizeof(Bench));
+    b.triangles.values[0] = 1000;
+    b.triangles.count = 1;
+    b.rectangles.values[0] = 1000;
+    b.rectangles.count = 1;
+    b.threads.values[0] = 1;
+    b.threads.count = 1;
+    b.rotations.values[0] = 0;
+    b.rotations.count = 1;
+    b.width = 1920;
+    b.height = 1080;
+    b.prim_size = 64;
+    b.frames = 100;
+    b.seed = 1U;
+
+    for (i = 2; i < argc; i++)
+    {
+        const char *opt = argv[i];
+        const char *val = (i + 1 < argc) ? argv[i + 1] : NULL;
+        int ok = 1;
 
-Triangle *triangle_new(D3d *d3d,
-                       int w, int h,
-                       int x1, int y1,
-                       int x2, int y2,
-                       int x3, int y3,
-                       unsigned char r,
-                       unsigned char g,
-                       unsigned char b,
-                       unsigned char a)
-{
-    Vertex vertices[3];
-    unsigned int indices[3];
-    D3D11_BUFFER_DESC desc;
-    D3D11_SUBRESOURCE_DATA sr_data;
-    Triangle *t;
-    HRESULT res;
+        if (!strcmp(opt, "--rotate-pass"))
+        {
+            b.rotate_pass = 1;
+            continue;
+        }
 
-    t = (Triangle *)malloc(sizeof(Triangle));
-    if (!t)
-        return NULL;
+        if (!strcmp(opt, "--resize-replay"))
+        {
+            b.resize_replay = 1;
+            continue;
+        }
 
-    vertices[0].x = XF(w, x1);
-    vertices[0].y = YF(h, y1);
-    vertices[0].r = r;
-    vertices[0].g = g;
-    vertices[0].b = b;
-    vertices[0].a = a;
-    vertices[1].x = XF(w, x2);
-    vertices[1].y = YF(h, y2);
-    vertices[1].r = r;
-    vertices[1].g = g;
-    vertices[1].b = b;
-    vertices[1].a = a;
-    vertices[2].x = XF(w, x3);
-    vertices[2].y = YF(h, y3);
-    vertices[2].r = r;
-    vertices[2].g = g;
-    vertices[2].b = b;
-    vertices[2].a = a;
-
-    indices[0] = 0;
-    indices[1] = 1;
-    indices[2] = 2;
-
-    t->stride = sizeof(Vertex);
-    t->offset = 0U;
-    t->index_count = 3U;
-
-    desc.ByteWidth = sizeof(vertices);
-    desc.Usage = D3D11_USAGE_DYNAMIC;
-    desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    desc.MiscFlags = 0U;
-    desc.StructureByteStride = 0U;
+        if (!strcmp(opt, "--state"))
+        {
+            b.state = 1;
+            continue;
+        }
 
-    sr_data.pSysMem = vertices;
-    sr_data.SysMemPitch = 0U;
-    sr_data.SysMemSlicePitch = 0U;
+        if (!strcmp(opt, "--pacing"))
+        {
+            b.pacing = 1;
+            continue;
+        }
 
-    res =ID3D11Device_CreateBuffer(d3d->d3d_device,
-                                   &desc,
-                                   &sr_data,
-                                   &t->vertex_buffer);
-    if (FAILED(res))
-    {
-        free(t);
-        return NULL;
-    }
+        if (!strcmp(opt, "--record"))
+        {
+            b.record = 1;
+            continue;
+        }
 
-    desc.ByteWidth = sizeof(indices);
-    desc.Usage = D3D11_USAGE_DYNAMIC;
-    desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    desc.MiscFlags = 0U;
-    desc.StructureByteStride = 0U;
+        if (!strcmp(opt, "--damage"))
+        {
+            b.damage = 1;
+            continue;
+        }
 
-    sr_data.pSysMem = indices;
-    sr_data.SysMemPitch = 0U;
-    sr_data.SysMemSlicePitch = 0U;
+        if (!strcmp(opt, "--vertex"))
+        {
+            b.vertex = 1;
+            continue;
+        }
 
-    res =ID3D11Device_CreateBuffer(d3d->d3d_device,
-                                   &desc,
-                                   &sr_data,
-                                   &t->index_buffer);
-    if (FAILED(res))
-    {
-        ID3D11Buffer_Release(t->vertex_buffer);
-        free(t);
-        return NULL;
-    }
+        if (!strcmp(opt, "--vertex16"))
+        {
+            b.vertex16 = 1;
+            continue;
+        }
 
-    return t;
-}
+        if (!strcmp(opt, "--index"))
+        {
+            b.index = 1;
+            continue;
+        }
 
-void triangle_free(Triangle *t)
-{
-    if (!t)
-        return ;
+        if (!strcmp(opt, "--topology"))
+        {
+            b.topology = 1;
+            continue;
+        }
 
-    ID3D11Buffer_Release(t->index_buffer);
-    ID3D11Buffer_Release(t->vertex_buffer);
-    free(t);
-}
+        if (!strcmp(opt, "--cull"))
+        {
+            b.cull = 1;
+            continue;
+        }
 
-/*** rectangle ***/
+        if (!strcmp(opt, "--occlusion"))
+        {
+            b.occlusion = 1;
+            continue;
+        }
 
-typedef struct
-{
-    ID3D11Buffer* vertex_buffer;
-    ID3D11Buffer* index_buffer;
-    UINT stride;
-    UINT offset;
-    UINT count;
-    UINT index_count;
-} Rect;
+        if (!strcmp(opt, "--scene"))
+        {
+            b.scene = 1;
+            continue;
+        }
 
-Rect *rectangle_new(D3d *d3d,
-                    int w, int h,
-                    int x, int y,
-                    int rw, int rh, /* width and height of the rectangle */
-                    unsigned char r,
-                    unsigned char g,
-                    unsigned char b,
-                    unsigned char a)
-{
-    Vertex vertices[4];
-    unsigned int indices[6];
-    D3D11_BUFFER_DESC desc;
-    D3D11_SUBRESOURCE_DATA sr_data;
-    Rect *rc;
-    HRESULT res;
+        if (!strcmp(opt, "--prof"))
+        {
+            b.prof = 1;
+            continue;
+        }
 
-    rc = (Rect *)malloc(sizeof(Rect));
-    if (!rc)
-        return NULL;
+        if (!strcmp(opt, "--batch"))
+        {
+            b.batch = 1;
+            continue;
+        }
 
-    /* vertex upper left */
-    vertices[0].x = XF(w, x);
-    vertices[0].y = YF(h, y);
-    vertices[0].r = r;
-    vertices[0].g = g;
-    vertices[0].b = b;
-    vertices[0].a = a;
-    /* vertex upper right*/
-    vertices[1].x = XF(w, x + rw);
-    vertices[1].y = YF(h, y);
-    vertices[1].r = r;
-    vertices[1].g = g;
-    vertices[1].b = b;
-    vertices[1].a = a;
-    /* vertex bottom right*/
-    vertices[2].x = XF(w, x + rw);
-    vertices[2].y = YF(h, y + rh);
-    vertices[2].r = r;
-    vertices[2].g = g;
-    vertices[2].b = b;
-    vertices[2].a = a;
-    /* vertex bottom left*/
-    vertices[3].x = XF(w, x);
-    vertices[3].y = YF(h, y + rh);
-    vertices[3].r = r;
-    vertices[3].g = g;
-    vertices[3].b = b;
-    vertices[3].a = a;
-
-    /* triangle upper left */
-    indices[0] = 0;
-    indices[1] = 1;
-    indices[2] = 3;
-    /* triangle bottom right */
-    indices[3] = 1;
-    indices[4] = 2;
-    indices[5] = 3;
-
-    rc->stride = sizeof(Vertex);
-    rc->offset = 0U;
-    rc->index_count = 6U;
-
-    desc.ByteWidth = sizeof(vertices);
-    desc.Usage = D3D11_USAGE_DYNAMIC;
-    desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    desc.MiscFlags = 0U;
-    desc.StructureByteStride = 0U;
+        if (!strcmp(opt, "--instances"))
+        {
+            b.instances = 1;
+            continue;
+        }
 
-    sr_data.pSysMem = vertices;
-    sr_data.SysMemPitch = 0U;
-    sr_data.SysMemSlicePitch = 0U;
+        if (!strcmp(opt, "--tiles"))
+        {
+            b.tiles = 1;
+            continue;
+        }
 
-    res =ID3D11Device_CreateBuffer(d3d->d3d_device,
-                                   &desc,
-                                   &sr_data,
-                                   &rc->vertex_buffer);
-    if (FAILED(res))
-    {
-        free(rc);
-        return NULL;
-    }
+        if (!strcmp(opt, "--xform"))
+        {
+            b.xform = 1;
+            continue;
+        }
 
-    desc.ByteWidth = sizeof(indices);
-    desc.Usage = D3D11_USAGE_DYNAMIC;
-    desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    desc.MiscFlags = 0U;
-    desc.StructureByteStride = 0U;
+        if (!strcmp(opt, "--rotate-image"))
+        {
+            b.rotate_image = 1;
+            continue;
+        }
 
-    sr_data.pSysMem = indices;
-    sr_data.SysMemPitch = 0U;
-    sr_data.SysMemSlicePitch = 0U;
+        if (!val)
+            ok = 0;
+        else if (!strcmp(opt, "--triangles"))
+            ok = bench_list_parse(&b.triangles, val);
+        else if (!strcmp(opt, "--rectangles"))
+            ok = bench_list_parse(&b.rectangles, val);
+        else if (!strcmp(opt, "--threads"))
+            ok = bench_list_parse(&b.threads, val);
+        else if (!strcmp(opt, "--rotation") && !strcmp(val, "all"))
+            ok = bench_list_parse(&b.rotations, "0,1,2,3");
+        else if (!strcmp(opt, "--rotation"))
+            ok = bench_list_parse(&b.rotations, val);
+        else if (!strcmp(opt, "--size"))
+            ok = sscanf(val, "%dx%d", &b.width, &b.height) == 2;
+        else if (!strcmp(opt, "--prim-size"))
+            b.prim_size = atoi(val);
+        else if (!strcmp(opt, "--changes"))
+            b.changes = atoi(val);
+        else if (!strcmp(opt, "--frames"))
+            b.frames = atoi(val);
+        else if (!strcmp(opt, "--seed"))
+            b.seed = (unsigned int)strtoul(val, NULL, 10);
+        else if (!strcmp(opt, "--min-fps"))
+            b.min_fps = atof(val);
+        else if (!strcmp(opt, "--trace"))
+            b.trace = val;
+        else if (!strcmp(opt, "--trace-events"))
+            b.trace_events = atoi(val);
+        else if (!strcmp(opt, "--shader-cache"))
+            b.shader_cache = val;
+        else if (!strcmp(opt, "--tasks"))
+            b.tasks = atoi(val);
+        else if (!strcmp(opt, "--queue"))
+            b.queue = atoi(val);
+        else if (!strcmp(opt, "--arena"))
+            b.arena = atoi(val);
+        else
+            ok = 0;
+
+        if (!ok)
+        {
+            printf("bad option %s\n", opt);
+            return 1;
+        }
+        i++;
+    }
 
-    res =ID3D11Device_CreateBuffer(d3d->d3d_device,
-                                   &desc,
-                                   &sr_data,
-                                   &rc->index_buffer);
-    if (FAILED(res))
+    if ((b.width < 1) || (b.height < 1) || (b.prim_size < 1) || (b.frames < 1))
     {
-        ID3D11Buffer_Release(rc->vertex_buffer);
-        free(rc);
-        return NULL;
+        printf("bad size, primitive size or number of frames\n");
+        return 1;
     }
 
-    return rc;
-}
+    if (b.trace_events > 0)
+    {
+        bench_trace(b.trace_events);
+        return 0;
+    }
 
-void rectangle_free(Rect *r)
-{
-    if (!r)
-        return ;
+    if (b.shader_cache)
+        return bench_shaders(b.shader_cache);
 
-    ID3D11Buffer_Release(r->index_buffer);
-    ID3D11Buffer_Release(r->vertex_buffer);
-    free(r);
-}
+    if (b.tasks > 0)
+        return bench_tasks(b.tasks);
 
-void d3d_render(D3d *d3d)
-{
-#ifdef HAVE_WIN10
-    DXGI_PRESENT_PARAMETERS pp;
-    DXGI_SWAP_CHAIN_DESC1 desc;
-#else
-    DXGI_SWAP_CHAIN_DESC desc;
-#endif
-    const FLOAT color[4] = { 0.10f, 0.18f, 0.24f, 1.0f };
-    HRESULT res;
-    int w;
-    int h;
+    if (b.resize_replay)
+        return bench_resize_replay();
 
-    FCT;
+    if (b.state)
+        return bench_state();
 
-#ifdef HAVE_WIN10
-    res = IDXGISwapChain1_GetDesc1(d3d->dxgi_swapchain, &desc);
-    if (FAILED(res))
-        return;
+    if (b.pacing)
+        return bench_pacing();
 
-    w = desc.Width;
-    h = desc.Height;
-#else
-    res = IDXGISwapChain_GetDesc(d3d->dxgi_swapchain, &desc);
-    if (FAILED(res))
-        return;
+    if (b.queue > 0)
+        return bench_queue(b.queue);
 
-    w = desc.BufferDesc.Width;
-    h = desc.BufferDesc.Height;
-#endif
+    if (b.record)
+        return bench_record(&b);
 
-    printf(" * swapchain size : %d %d\n", w, h);
-    fflush(stdout);
+    if (b.damage)
+        return bench_damage(&b);
 
-    /* clear render target */
-    ID3D11DeviceContext_ClearRenderTargetView(d3d->d3d_device_ctx,
-                                              d3d->d3d_render_target_view,
-                                              color);
-    /* Input Assembler (IA) stage */
-    ID3D11DeviceContext_IASetPrimitiveTopology(d3d->d3d_device_ctx,
-                                               D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
-    ID3D11DeviceContext_IASetInputLayout(d3d->d3d_device_ctx,
-                                         d3d->d3d_input_layout);
-
-    /* vertex shader stage */
-    ID3D11DeviceContext_VSSetShader(d3d->d3d_device_ctx,
-                                    d3d->d3d_vertex_shader,
-                                    NULL,
-                                    0);
-    ID3D11DeviceContext_VSSetConstantBuffers(d3d->d3d_device_ctx,
-                                             0,
-                                             1,
-                                             &d3d->d3d_const_buffer);
+    if (b.arena > 0)
+        return bench_arena(&b);
 
-    /*
-     * Rasterizer Stage
-     *
-     * RSSetViewports() called in the resize() callback
-     */
-    ID3D11DeviceContext_RSSetState(d3d->d3d_device_ctx,
-                                   d3d->d3d_rasterizer_state);
-    /* pixel shader stage */
-    ID3D11DeviceContext_PSSetShader(d3d->d3d_device_ctx,
-                                    d3d->d3d_pixel_shader,
-                                    NULL,
-                                    0);
+    if (b.vertex)
+        return bench_vertex(&b);
 
-    /*
-     * Output Merger stage
-     *
-     * OMSetRenderTargets() called in the resize() calback
-     */
+    if (b.index)
+        return bench_index(&b);
 
-    /* scene */
-    Triangle *t;
-    Rect *r;
-
-    t = triangle_new(d3d,
-                     w, h,
-                     320, 120,
-                     480, 360,
-                     160, 360,
-                     255, 255, 0, 255);
-
-    r = rectangle_new(d3d,
-                      w, h,
-                      520, 120,
-                      200, 100,
-                      0, 0, 255, 255);
-
-    /* Input Assembler (IA) stage */
-    ID3D11DeviceContext_IASetVertexBuffers(d3d->d3d_device_ctx,
-                                           0,
-                                           1,
-                                           &t->vertex_buffer,
-                                           &t->stride,
-                                           &t->offset);
-    ID3D11DeviceContext_IASetIndexBuffer(d3d->d3d_device_ctx,
-                                         t->index_buffer,
-                                         DXGI_FORMAT_R32_UINT,
-                                         0);
-    /* draw */
-    ID3D11DeviceContext_DrawIndexed(d3d->d3d_device_ctx,
-                                    t->index_count,
-                                    0, 0);
-
-    /* Input Assembler (IA) stage */
-    ID3D11DeviceContext_IASetVertexBuffers(d3d->d3d_device_ctx,
-                                           0,
-                                           1,
-                                           &r->vertex_buffer,
-                                           &r->stride,
-                                           &r->offset);
-    ID3D11DeviceContext_IASetIndexBuffer(d3d->d3d_device_ctx,
-                                         r->index_buffer,
-                                         DXGI_FORMAT_R32_UINT,
-                                         0);
-    /* draw */
-    ID3D11DeviceContext_DrawIndexed(d3d->d3d_device_ctx,
-                                    r->index_count,
-                                    0, 0);
+    if (b.topology)
+        return bench_topology(&b);
 
-    rectangle_free(r);
-    triangle_free(t);
+    if (b.cull)
+        return bench_cull(&b);
 
-    /*
-     * present frame, that is, flip the back buffer and the front buffer
-     * if no vsync, we present immediatly
-     */
-#ifdef HAVE_WIN10
-    pp.DirtyRectsCount = 0;
-    pp.pDirtyRects = NULL;
-    pp.pScrollRect = NULL;
-    pp.pScrollOffset = NULL;
-    res = IDXGISwapChain1_Present1(d3d->dxgi_swapchain,
-                                   d3d->vsync ? 1 : 0, 0, &pp);
-#else
-    res = IDXGISwapChain_Present(d3d->dxgi_swapchain,
-                                 d3d->vsync ? 1 : 0, 0);
-#endif
-    if (res == DXGI_ERROR_DEVICE_RESET || res == DXGI_ERROR_DEVICE_REMOVED)
-    {
-        printf("device removed or lost, need to recreate everything\n");
-        fflush(stdout);
-    }
-    else if (res == DXGI_STATUS_OCCLUDED)
+    if (b.occlusion)
+        return bench_occlusion(&b);
+
+    if (b.scene)
+        return bench_scene(&b);
+
+    if (b.prof)
+        return bench_prof();
+
+    if (b.batch)
+        return bench_batch(&b);
+
+    if (b.instances)
+        return bench_instances(&b);
+
+    if (b.tiles)
+        return bench_tiles(&b);
+
+    if (b.xform)
+        return bench_xform(&b);
+
+    if (b.rotate_image)
+        return bench_rotate_image(&b);
+
+    if (b.trace && !trace_open(b.trace))
     {
-        printf("window is not visible, so vsync won't work. Let's sleep a bit to reduce CPU usage\n");
-        fflush(stdout);
+        printf("can not open %s\n", b.trace);
+        return 1;
     }
-}
 
+    ret = 0;
+    for (a = 0; a < b.triangles.count; a++)
+        for (c = 0; c < b.rectangles.count; c++)
+            for (t = 0; t < b.threads.count; t++)
+                for (r = 0; r < b.rotations.count; r++)
+                {
+                    double fps;
+
+                    fps = bench_run(&b,
+                                    b.triangles.values[a],
+                                    b.rectangles.values[c],
+                                    b.threads.values[t],
+                                    b.rotations.values[r] & 3);
+                    if (fps < b.min_fps)
+                        ret = 1;
+                }
+
+    trace_close();
+
+    return ret;
+}
 
-int main()
+int main(int argc, char *argv[])
 {
     Window *win;
     D3d *d3d;
     int ret = 1;
 
-    /* remove scaling on HiDPI */
-#if _WIN32_WINNT >= 0x0A00
-    SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_SYSTEM_AWARE);
-#endif
+    simd_init();
+
+    if ((argc > 1) && !strcmp(argv[1], "--bench"))
+        return bench_main(argc, argv);
+
+    /* d3d_rot [image.ppm [trace.json]] */
+    if ((argc > 2) && !trace_open(argv[2]))
+    {
+        printf(" * can not open %s\n", argv[2]);
+        fflush(stdout);
+    }
 
     win = window_new(100, 100, 800, 480);
     if (!win)
-        return ret;
+        goto close_trace;
 
     d3d = d3d_init(win, 0);
     if (!d3d)
@@ -1446,36 +13416,34 @@ int main()
         goto del_window;
     }
 
-    ret = 0;
-
-    SetWindowLongPtr(win->win, GWLP_USERDATA, (LONG_PTR)win);
+    /* scene, created once */
+    scene_triangle_add(d3d->scene,
+                       320, 120,
+                       480, 360,
+                       160, 360,
+                       255, 255, 0, 255);
+    scene_rectangle_add(d3d->scene,
+                        520, 120,
+                        200, 100,
+                        0, 0, 255, 255);
 
-    window_show(win);
+    d3d_render(d3d);
 
-    /* mesage loop */
-    while(1)
+    ret = 0;
+    if ((argc > 1) && !d3d_framebuffer_save(d3d, argv[1]))
     {
-        MSG msg;
-        BOOL ret;
-
-        ret = PeekMessage(&msg, NULL, 0, 0, PM_REMOVE);
-        if (ret)
-        {
-            do
-            {
-                if (msg.message == WM_QUIT)
-                  goto beach;
-                TranslateMessage(&msg);
-                DispatchMessageW(&msg);
-            } while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE));
-        }
+        printf(" * can not save %s\n", argv[1]);
+        fflush(stdout);
+        ret = 1;
     }
 
-  beach:
     d3d_shutdown(d3d);
   del_window:
     window_del(win);
+  close_trace:
+    trace_close();
 
     return ret;
 }
 
+#endif
@@ -1,11 +1,25 @@
 cbuffer cv_viewport : register(b0)
 {
     row_major float2x3 rotation_matrix;
+    float2 viewport_size; /* in pixels */
 }
 
 struct vs_input
 {
-    float2 position : POSITION;
+    float2 position : POSITION; /* in pixels */
+    float4 color : COLOR;
+};
+
+struct vs16_input
+{
+    int2 position : POSITION; /* in pixels */
+    float4 color : COLOR;
+};
+
+struct vs_rect_input
+{
+    float2 corner : POSITION; /* unit quad */
+    float4 rect : RECT; /* upper left corner and size, in pixels */
     float4 color : COLOR;
 };
 
@@ -15,11 +29,48 @@ struct ps_input
     float4 color : COLOR;
 };
 
+/* pixels to NDC, same computation as XF() and YF() */
+float2 pixels_to_ndc(int2 p)
+{
+    int2 size = (int2)viewport_size;
+
+    return float2((float)(2 * p.x - size.x) / viewport_size.x,
+                  (float)(size.y - 2 * p.y) / viewport_size.y);
+}
+
+/* same as vertex_ndc(), exact for integer pixels */
+float2 pixels_to_ndc(float2 p)
+{
+    return float2((2.0f * p.x - viewport_size.x) / viewport_size.x,
+                  (viewport_size.y - 2.0f * p.y) / viewport_size.y);
+}
+
 ps_input main_vs(vs_input input )
 {
     ps_input output;
-    float2 p = input.position;
-    p = mul(rotation_matrix, float3(input.position, 1.0f));
+    float2 p;
+    p = mul(rotation_matrix, float3(pixels_to_ndc(input.position), 1.0f));
+    output.position = float4(p, 0.0f, 1.0f);
+    output.color = input.color;
+    return output;
+}
+
+ps_input main_vs16(vs16_input input)
+{
+    ps_input output;
+    float2 p;
+    p = mul(rotation_matrix, float3(pixels_to_ndc(input.position), 1.0f));
+    output.position = float4(p, 0.0f, 1.0f);
+    output.color = input.color;
+    return output;
+}
+
+ps_input main_rect_vs(vs_rect_input input)
+{
+    ps_input output;
+    float2 p;
+    p = input.rect.xy + input.corner * input.rect.zw;
+    p = mul(rotation_matrix, float3(pixels_to_ndc(p), 1.0f));
     output.position = float4(p, 0.0f, 1.0f);
     output.color = input.color;
     return output;